@@ -0,0 +1,65 @@
+/*
+    GemPCTwin_emulator.c: emulate a GemPC Twin serial reader on a pty
+    Copyright (C) 2009   Ludovic Rousseau
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc., 51
+	Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * $Id$
+ */
+
+/*
+ * Usage: GemPCTwin_emulator [options]
+ *
+ * The name of the pseudo terminal is printed on stdout. Use it as
+ * DEVICENAME in /etc/reader.conf for the libccidtwin driver to
+ * benchmark pcscd and the driver without a reader.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "twin_emulator.h"
+
+int main(int argc, char *argv[])
+{
+	twin_emulator emu;
+	int opt;
+
+	if (EmulatorOpen(&emu) < 0)
+		return 1;
+
+	while ((opt = getopt(argc, argv, EMULATOR_OPTIONS)) != -1)
+	{
+		if (EmulatorSetOption(&emu, opt, optarg) < 0)
+		{
+			(void)fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+			EmulatorUsage();
+			EmulatorClose(&emu);
+			return 1;
+		}
+	}
+
+	printf("%s\n", emu.slave_name);
+	(void)fflush(stdout);
+
+	(void)EmulatorRun(&emu);
+
+	EmulatorClose(&emu);
+
+	return 0;
+}
+
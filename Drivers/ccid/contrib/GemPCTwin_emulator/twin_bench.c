@@ -0,0 +1,283 @@
+/*
+    twin_bench.c: benchmark the serial driver with the GemPC Twin emulator
+    Copyright (C) 2009   Ludovic Rousseau
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc., 51
+	Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * $Id$
+ */
+
+/*
+ * Usage: twin_bench [-n apdus] [-L le] [-C lc] [emulator options]
+ *
+ * Send APDUs to the emulated reader through the driver IFDH API and
+ * print the throughput and the latency distribution. A failed APDU
+ * is counted as an error and the card is reset.
+ *
+ * To benchmark pcscd as well use GemPCTwin_emulator and a client
+ * program like testpcsc instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <pcsclite.h>
+#include <ifdhandler.h>
+#include <reader.h>
+
+#include "twin_emulator.h"
+#include "ccid_stats.h"
+
+#define LUN 0
+
+static int compare(const void *a, const void *b);
+static int reset_card(DWORD protocol);
+static void print_stats(void);
+static void usage(const char *name);
+
+int main(int argc, char *argv[])
+{
+	twin_emulator emu;
+	pid_t pid;
+	char device[sizeof(emu.slave_name) + 20];
+	UCHAR cmd[5 + 255 + 1];
+	DWORD cmd_length;
+	UCHAR res[258];
+	DWORD res_length;
+	DWORD protocol;
+	SCARD_IO_HEADER pci;
+	RESPONSECODE rv;
+	struct timeval start, before, after;
+	long *latencies, total;
+	int opt, i, ret = 1, errors = 0;
+	int loops = 1000, le = 8, lc = 0;
+
+	if (EmulatorOpen(&emu) < 0)
+		return 1;
+
+	while ((opt = getopt(argc, argv, EMULATOR_OPTIONS "n:L:C:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'n':
+				loops = atoi(optarg);
+				break;
+
+			case 'L':
+				le = atoi(optarg);
+				break;
+
+			case 'C':
+				lc = atoi(optarg);
+				break;
+
+			default:
+				if (EmulatorSetOption(&emu, opt, optarg) < 0)
+				{
+					usage(argv[0]);
+					EmulatorClose(&emu);
+					return 1;
+				}
+		}
+	}
+
+	if ((loops < 1) || (le < 0) || (le > 256) || (lc < 0) || (lc > 255)
+		|| ((0 == le) && (0 == lc)))
+	{
+		usage(argv[0]);
+		EmulatorClose(&emu);
+		return 1;
+	}
+
+	latencies = malloc(loops * sizeof(*latencies));
+	if (NULL == latencies)
+	{
+		EmulatorClose(&emu);
+		return 1;
+	}
+
+	/* T=1 card if TD1 indicates T=1 */
+	protocol = SCARD_PROTOCOL_T0;
+	if ((emu.atr[1] & 0x80) && (1 == (emu.atr[2] & 0x0F)))
+		protocol = SCARD_PROTOCOL_T1;
+
+	pid = fork();
+	if (pid < 0)
+	{
+		perror("fork");
+		free(latencies);
+		EmulatorClose(&emu);
+		return 1;
+	}
+
+	if (0 == pid)
+	{
+		/* reader side */
+		(void)EmulatorRun(&emu);
+		_exit(0);
+	}
+
+	(void)snprintf(device, sizeof(device), "%s:GemPCTwin", emu.slave_name);
+
+	rv = IFDHCreateChannelByName(LUN, device);
+	if (rv != IFD_SUCCESS)
+	{
+		printf("IFDHCreateChannelByName failed\n");
+		goto end;
+	}
+
+	if (reset_card(protocol) < 0)
+		goto end;
+
+	/* GET CHALLENGE for a case 2 APDU, PUT DATA otherwise */
+	memset(cmd, 0, sizeof(cmd));
+	if (lc)
+	{
+		cmd[1] = 0xDA;
+		cmd[4] = lc;
+		cmd_length = 5 + lc;
+		if (le)
+			cmd[cmd_length++] = le & 0xFF;
+	}
+	else
+	{
+		cmd[1] = 0x84;
+		cmd[4] = le & 0xFF;
+		cmd_length = 5;
+	}
+
+	pci.Protocol = protocol - 1;
+	pci.Length = 0;
+
+	(void)gettimeofday(&start, NULL);
+	for (i=0; i<loops; i++)
+	{
+		res_length = sizeof(res);
+
+		(void)gettimeofday(&before, NULL);
+		rv = IFDHTransmitToICC(LUN, pci, cmd, cmd_length, res, &res_length,
+			NULL);
+		(void)gettimeofday(&after, NULL);
+
+		latencies[i] = (after.tv_sec - before.tv_sec) * 1000000
+			+ (after.tv_usec - before.tv_usec);
+
+		if (rv != IFD_SUCCESS)
+		{
+			errors++;
+			if (reset_card(protocol) < 0)
+				goto end;
+		}
+	}
+	(void)gettimeofday(&after, NULL);
+
+	total = (after.tv_sec - start.tv_sec) * 1000000
+		+ (after.tv_usec - start.tv_usec);
+
+	qsort(latencies, loops, sizeof(*latencies), compare);
+
+	printf("APDU: %d, errors: %d, time: %ld ms, %.1f APDU/s\n",
+		loops, errors, total / 1000, loops * 1000000.0 / total);
+	printf("latency (us): min %ld, median %ld, 90%% %ld, 99%% %ld, max %ld\n",
+		latencies[0], latencies[loops / 2], latencies[loops * 9 / 10],
+		latencies[loops * 99 / 100], latencies[loops - 1]);
+
+	print_stats();
+
+	(void)IFDHCloseChannel(LUN);
+	ret = 0;
+
+end:
+	(void)kill(pid, SIGTERM);
+	(void)waitpid(pid, NULL, 0);
+	free(latencies);
+	EmulatorClose(&emu);
+
+	return ret;
+}
+
+static int compare(const void *a, const void *b)
+{
+	long la = *(const long *)a;
+	long lb = *(const long *)b;
+
+	return (la > lb) - (la < lb);
+}
+
+static int reset_card(DWORD protocol)
+{
+	UCHAR atr[MAX_ATR_SIZE];
+	DWORD atr_length = sizeof(atr);
+
+	if (IFDHPowerICC(LUN, IFD_RESET, atr, &atr_length) != IFD_SUCCESS)
+	{
+		printf("IFDHPowerICC failed\n");
+		return -1;
+	}
+
+	if (IFDHSetProtocolParameters(LUN, protocol, 0, 0, 0, 0) != IFD_SUCCESS)
+	{
+		printf("IFDHSetProtocolParameters failed\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void print_stats(void)
+{
+	ccid_transfer_stats stats;
+	DWORD length;
+	int i;
+
+	if ((IFDHControl(LUN, IOCTL_SMARTCARD_VENDOR_TRANSFER_STATS, NULL, 0,
+		(PUCHAR)&stats, sizeof(stats), &length) != IFD_SUCCESS)
+		|| (length != sizeof(stats)))
+		return;
+
+	printf("driver: %u writes (%u bytes), %u reads (%u bytes), "
+		"%u errors, %u timeouts, %u retries\n",
+		stats.write_transfers, stats.write_bytes, stats.read_transfers,
+		stats.read_bytes, stats.write_errors + stats.read_errors,
+		stats.write_timeouts + stats.read_timeouts, stats.read_retries);
+
+	printf("read time (us):");
+	for (i=0; i<CCID_TRANSFER_STATS_BUCKETS; i++)
+		if (stats.read_time[i])
+		{
+			if (i < CCID_TRANSFER_STATS_BUCKETS-1)
+				printf(" <%d: %u", 64 << i, stats.read_time[i]);
+			else
+				printf(" more: %u", stats.read_time[i]);
+		}
+	printf("\n");
+}
+
+static void usage(const char *name)
+{
+	(void)fprintf(stderr, "Usage: %s [options]\n", name);
+	(void)fprintf(stderr,
+		"  -n apdus\tnumber of APDUs to send (default 1000)\n"
+		"  -L le\t\tLe of the APDU, 1 to 256 (default 8), 0 for no Le\n"
+		"  -C lc\t\tLc of the APDU, 0 to 255 (default 0)\n");
+	EmulatorUsage();
+}
+
@@ -0,0 +1,883 @@
+/*
+    twin_emulator.c: GemPC Twin serial reader emulator
+    Copyright (C) 2009   Ludovic Rousseau
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * $Id$
+ */
+
+/*
+ * The emulator is the reader side of a pseudo terminal. The driver
+ * (libccidtwin) opens the slave side as if it was a serial port.
+ *
+ * Frames use the GemPC Twin serial protocol (see ccid_serial.c):
+ * SYNC (0x03), CTRL (ACK 0x06), CCID message, LRC
+ *
+ * The reader echoes each command frame before sending the answer.
+ *
+ * The virtual card speaks T=0 or T=1 (TPDU level, like the real
+ * reader) and answers:
+ * - the APDU listed in a script file (see EmulatorUsage())
+ * - a case 2 or case 4 APDU with Le bytes 00 01 02 ... and 90 00
+ * - any other APDU with 90 00
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+
+#include "twin_emulator.h"
+
+#define SYNC 0x03
+#define CTRL_ACK 0x06
+#define CTRL_NAK 0x15
+
+/* CCID header size */
+#define CCID_HEADER_SIZE 10
+
+/* 271 = max size for short APDU + CCID header */
+#define EMULATOR_MAXBUF (271 +2 +1)
+
+/* PC_to_RDR messages */
+#define PC_to_RDR_SetParameters		0x61
+#define PC_to_RDR_IccPowerOn		0x62
+#define PC_to_RDR_IccPowerOff		0x63
+#define PC_to_RDR_GetSlotStatus		0x65
+#define PC_to_RDR_Escape			0x6B
+#define PC_to_RDR_XfrBlock			0x6F
+
+/* RDR_to_PC messages */
+#define RDR_to_PC_DataBlock			0x80
+#define RDR_to_PC_SlotStatus		0x81
+#define RDR_to_PC_Parameters		0x82
+#define RDR_to_PC_Escape			0x83
+
+/* bStatus */
+#define ICC_PRESENT_ACTIVE		0x00
+#define ICC_PRESENT_INACTIVE	0x01
+#define ICC_ABSENT				0x02
+#define COMMAND_FAILED			0x40
+
+/* bError */
+#define CMD_NOT_SUPPORTED		0x00
+#define ICC_MUTE				0xFE
+
+#define FIRMWARE "GemPC Twin emulator"
+
+/* T=1 PCB */
+#define T1_I_BLOCK		0x00
+#define T1_R_BLOCK		0x80
+#define T1_S_BLOCK		0xC0
+#define T1_MORE_BLOCKS	0x20
+#define T1_S_RESPONSE	0x20
+#define T1_S_RESYNC		0x00
+#define T1_S_IFS		0x01
+#define T1_S_ABORT		0x02
+#define T1_EDC_ERROR	0x01
+
+/* default ATR: T=0 card without interface bytes */
+static const unsigned char default_atr[] = { 0x3B, 0x00 };
+
+/* ATR used with "-a T1": T=1 only, IFSC = 32, BWI = 4, CWI = 5 */
+static const unsigned char t1_atr[] = { 0x3B, 0x80, 0x81, 0x31, 0x20, 0x45,
+	0x55 };
+
+static int read_frame(int fd, unsigned char *frame, int *frame_length);
+static int send_frame(int fd, unsigned char *msg, int length);
+static int process(twin_emulator *emu, const unsigned char *cmd,
+	unsigned char *res);
+static int xfr_block(twin_emulator *emu, const unsigned char *tpdu,
+	int length, unsigned char *res);
+static int xfr_block_t1(twin_emulator *emu, const unsigned char *block,
+	int length, unsigned char *res);
+static int t1_send_block(twin_emulator *emu, unsigned char pcb,
+	const unsigned char *data, int length, unsigned char *res);
+static int card_answer(twin_emulator *emu, const unsigned char *apdu,
+	int length, unsigned char *res);
+static void card_delay(twin_emulator *emu);
+static int parse_hex(const char *hex, unsigned char *buffer, int size);
+static int load_script(twin_emulator *emu, const char *filename);
+
+
+/*****************************************************************************
+ *
+ *					EmulatorOpen
+ *
+ ****************************************************************************/
+int EmulatorOpen(twin_emulator *emu)
+{
+	struct termios t;
+	char *name;
+
+	emu->fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (emu->fd < 0)
+	{
+		perror("posix_openpt");
+		return -1;
+	}
+
+	if ((grantpt(emu->fd) < 0) || (unlockpt(emu->fd) < 0)
+		|| (NULL == (name = ptsname(emu->fd))))
+	{
+		perror("pty");
+		(void)close(emu->fd);
+		return -1;
+	}
+
+	(void)snprintf(emu->slave_name, sizeof(emu->slave_name), "%s", name);
+
+	emu->slave = open(emu->slave_name, O_RDWR | O_NOCTTY);
+	if (emu->slave < 0)
+	{
+		perror(emu->slave_name);
+		(void)close(emu->fd);
+		return -1;
+	}
+
+	/* raw mode until the driver configures the port itself */
+	if (0 == tcgetattr(emu->slave, &t))
+	{
+		t.c_iflag = 0;
+		t.c_oflag = 0;
+		t.c_lflag = 0;
+		t.c_cflag = CS8 | CREAD | CLOCAL;
+		(void)tcsetattr(emu->slave, TCSANOW, &t);
+	}
+
+	emu->echo = 1;
+	emu->card_present = 1;
+	emu->card_powered = 0;
+	memcpy(emu->atr, default_atr, sizeof(default_atr));
+	emu->atr_length = sizeof(default_atr);
+	emu->protocol = 0;
+	emu->script = NULL;
+	emu->script_size = 0;
+	emu->latency = 0;
+	emu->time_requests = 0;
+	emu->nak_every = 0;
+	emu->mute_every = 0;
+	emu->corrupt_every = 0;
+	emu->nb_frames = 0;
+	emu->nb_xfr = 0;
+	emu->nb_t1_blocks = 0;
+	emu->t0_pending_length = 0;
+	emu->t1_last_block_length = 0;
+
+	return 0;
+} /* EmulatorOpen */
+
+
+/*****************************************************************************
+ *
+ *					EmulatorSetOption: one of EMULATOR_OPTIONS
+ *
+ ****************************************************************************/
+int EmulatorSetOption(twin_emulator *emu, int opt, const char *arg)
+{
+	int length;
+
+	switch (opt)
+	{
+		case 'a':
+			if (0 == strcmp(arg, "T1"))
+			{
+				memcpy(emu->atr, t1_atr, sizeof(t1_atr));
+				emu->atr_length = sizeof(t1_atr);
+				break;
+			}
+			length = parse_hex(arg, emu->atr, sizeof(emu->atr));
+			if (length < 2)
+			{
+				(void)fprintf(stderr, "Invalid ATR: %s\n", arg);
+				return -1;
+			}
+			emu->atr_length = length;
+			break;
+
+		case 's':
+			return load_script(emu, arg);
+
+		case 'l':
+			emu->latency = strtoul(arg, NULL, 0);
+			break;
+
+		case 'r':
+			emu->time_requests = atoi(arg);
+			break;
+
+		case 'N':
+			emu->nak_every = atoi(arg);
+			break;
+
+		case 'm':
+			emu->mute_every = atoi(arg);
+			break;
+
+		case 'c':
+			emu->corrupt_every = atoi(arg);
+			break;
+
+		default:
+			return -1;
+	}
+
+	return 0;
+} /* EmulatorSetOption */
+
+
+/*****************************************************************************
+ *
+ *					EmulatorUsage
+ *
+ ****************************************************************************/
+void EmulatorUsage(void)
+{
+	(void)fprintf(stderr,
+		"  -a atr\tATR of the virtual card in hex, or T1 for a T=1 card\n"
+		"  -s file\tscript of the card answers, one \"command : response\"\n"
+		"\t\tin hex per line. A command matches any APDU starting with it\n"
+		"  -l usec\tcard processing time for each APDU\n"
+		"  -r n\t\tsend n time request bytes during the processing time\n"
+		"  -N n\t\tanswer every nth command frame with a NAK\n"
+		"  -m n\t\tevery nth PC_to_RDR_XfrBlock fails with ICC_MUTE\n"
+		"  -c n\t\tevery nth T=1 block from the card has a wrong LRC\n");
+} /* EmulatorUsage */
+
+
+/*****************************************************************************
+ *
+ *					EmulatorRun: serve the driver until an I/O error
+ *
+ ****************************************************************************/
+int EmulatorRun(twin_emulator *emu)
+{
+	unsigned char frame[EMULATOR_MAXBUF];
+	unsigned char res[EMULATOR_MAXBUF];
+	int frame_length, res_length;
+
+	for (;;)
+	{
+		if (read_frame(emu->fd, frame, &frame_length) < 0)
+			return -1;
+
+		/* the reader got a bad frame: no echo and no answer */
+		emu->nb_frames++;
+		if (emu->nak_every && (0 == emu->nb_frames % emu->nak_every))
+		{
+			unsigned char nak[] = { SYNC, CTRL_NAK, SYNC ^ CTRL_NAK };
+
+			if (write(emu->fd, nak, sizeof(nak)) != sizeof(nak))
+				return -1;
+			continue;
+		}
+
+		/* the reader echoes the complete command frame */
+		if (emu->echo && (write(emu->fd, frame, frame_length) != frame_length))
+			return -1;
+
+		res_length = process(emu, frame+2, res);
+		if (send_frame(emu->fd, res, res_length) < 0)
+			return -1;
+	}
+} /* EmulatorRun */
+
+
+/*****************************************************************************
+ *
+ *					EmulatorClose
+ *
+ ****************************************************************************/
+void EmulatorClose(twin_emulator *emu)
+{
+	free(emu->script);
+	emu->script = NULL;
+	emu->script_size = 0;
+
+	(void)close(emu->slave);
+	(void)close(emu->fd);
+} /* EmulatorClose */
+
+
+/*****************************************************************************
+ *
+ *					read_bytes: read exactly length bytes
+ *
+ ****************************************************************************/
+static int read_bytes(int fd, unsigned char *buffer, int length)
+{
+	int rv;
+
+	while (length > 0)
+	{
+		rv = read(fd, buffer, length);
+		if (rv < 0)
+		{
+			if (EINTR == errno)
+				continue;
+			return -1;
+		}
+		if (0 == rv)
+			return -1;
+
+		buffer += rv;
+		length -= rv;
+	}
+
+	return 0;
+} /* read_bytes */
+
+
+/*****************************************************************************
+ *
+ *					read_frame: read a complete command frame
+ *
+ ****************************************************************************/
+static int read_frame(int fd, unsigned char *frame, int *frame_length)
+{
+	unsigned int length;
+
+again:
+	/* SYNC */
+	if (read_bytes(fd, frame, 1) < 0)
+		return -1;
+	if (frame[0] != SYNC)
+		goto again;
+
+	/* CTRL + CCID header */
+	if (read_bytes(fd, frame+1, 1+CCID_HEADER_SIZE) < 0)
+		return -1;
+	if (frame[1] != CTRL_ACK)
+		goto again;
+
+	/* dwLength */
+	length = frame[3] + (frame[4] << 8) + (frame[5] << 16) + (frame[6] << 24);
+	if (length > EMULATOR_MAXBUF - (2+CCID_HEADER_SIZE+1))
+		return -1;
+
+	/* CCID data + LRC */
+	if (read_bytes(fd, frame+2+CCID_HEADER_SIZE, length+1) < 0)
+		return -1;
+
+	*frame_length = 2 + CCID_HEADER_SIZE + length + 1;
+
+	return 0;
+} /* read_frame */
+
+
+/*****************************************************************************
+ *
+ *					send_frame: send a CCID message in a serial frame
+ *
+ ****************************************************************************/
+static int send_frame(int fd, unsigned char *msg, int length)
+{
+	unsigned char frame[EMULATOR_MAXBUF];
+	unsigned char lrc;
+	int i;
+
+	frame[0] = SYNC;
+	frame[1] = CTRL_ACK;
+	memcpy(frame+2, msg, length);
+
+	lrc = 0;
+	for (i=0; i<length+2; i++)
+		lrc ^= frame[i];
+	frame[length+2] = lrc;
+
+	if (write(fd, frame, length+3) != length+3)
+		return -1;
+
+	return 0;
+} /* send_frame */
+
+
+/*****************************************************************************
+ *
+ *					process: build the answer to a CCID command
+ *
+ ****************************************************************************/
+static int process(twin_emulator *emu, const unsigned char *cmd,
+	unsigned char *res)
+{
+	unsigned int length = cmd[1] + (cmd[2] << 8) + (cmd[3] << 16)
+		+ (cmd[4] << 24);
+	const unsigned char *data = cmd + CCID_HEADER_SIZE;
+	int res_length = 0;
+
+	/* common header */
+	memset(res, 0, CCID_HEADER_SIZE);
+	res[5] = cmd[5];	/* bSlot */
+	res[6] = cmd[6];	/* bSeq */
+
+	if (! emu->card_present)
+		res[7] = ICC_ABSENT;
+	else
+		res[7] = emu->card_powered ? ICC_PRESENT_ACTIVE : ICC_PRESENT_INACTIVE;
+
+	switch (cmd[0])
+	{
+		case PC_to_RDR_GetSlotStatus:
+			res[0] = RDR_to_PC_SlotStatus;
+			break;
+
+		case PC_to_RDR_IccPowerOn:
+			res[0] = RDR_to_PC_DataBlock;
+			if (! emu->card_present)
+			{
+				res[7] |= COMMAND_FAILED;
+				res[8] = ICC_MUTE;
+				break;
+			}
+			emu->card_powered = 1;
+			emu->protocol = 0;
+			emu->t0_pending_length = 0;
+			res[7] = ICC_PRESENT_ACTIVE;
+			memcpy(res + CCID_HEADER_SIZE, emu->atr, emu->atr_length);
+			res_length = emu->atr_length;
+			break;
+
+		case PC_to_RDR_IccPowerOff:
+			res[0] = RDR_to_PC_SlotStatus;
+			emu->card_powered = 0;
+			if (emu->card_present)
+				res[7] = ICC_PRESENT_INACTIVE;
+			break;
+
+		case PC_to_RDR_SetParameters:
+			res[0] = RDR_to_PC_Parameters;
+			res[9] = cmd[7];	/* bProtocolNum */
+			emu->protocol = cmd[7];
+			if (1 == emu->protocol)
+			{
+				/* IFSD is 32 until an S(IFS request) */
+				emu->t1_ns = 0;
+				emu->t1_nr = 0;
+				emu->t1_ifsd = 32;
+				emu->t1_apdu_length = 0;
+				emu->t1_response_length = 0;
+				emu->t1_response_offset = 0;
+				emu->t1_last_block_length = 0;
+			}
+			memcpy(res + CCID_HEADER_SIZE, data, length);
+			res_length = length;
+			break;
+
+		case PC_to_RDR_Escape:
+			res[0] = RDR_to_PC_Escape;
+			/* get firmware version */
+			if ((1 == length) && (0x02 == data[0]))
+			{
+				memcpy(res + CCID_HEADER_SIZE, FIRMWARE, sizeof(FIRMWARE)-1);
+				res_length = sizeof(FIRMWARE)-1;
+			}
+			break;
+
+		case PC_to_RDR_XfrBlock:
+			res[0] = RDR_to_PC_DataBlock;
+			emu->nb_xfr++;
+			if ((! emu->card_powered)
+				|| (emu->mute_every && (0 == emu->nb_xfr % emu->mute_every)))
+			{
+				res[7] |= COMMAND_FAILED;
+				res[8] = ICC_MUTE;
+				break;
+			}
+			card_delay(emu);
+			if (1 == emu->protocol)
+				res_length = xfr_block_t1(emu, data, length,
+					res + CCID_HEADER_SIZE);
+			else
+				res_length = xfr_block(emu, data, length,
+					res + CCID_HEADER_SIZE);
+			break;
+
+		default:
+			res[0] = RDR_to_PC_SlotStatus;
+			res[7] |= COMMAND_FAILED;
+			res[8] = CMD_NOT_SUPPORTED;
+	}
+
+	/* dwLength */
+	res[1] = res_length & 0xFF;
+	res[2] = (res_length >> 8) & 0xFF;
+	res[3] = (res_length >> 16) & 0xFF;
+	res[4] = (res_length >> 24) & 0xFF;
+
+	return CCID_HEADER_SIZE + res_length;
+} /* process */
+
+
+/*****************************************************************************
+ *
+ *					xfr_block: T=0 TPDU exchange with the virtual card
+ *
+ ****************************************************************************/
+static int xfr_block(twin_emulator *emu, const unsigned char *tpdu,
+	int length, unsigned char *res)
+{
+	unsigned char answer[EMULATOR_MAX_RESPONSE_SIZE];
+	int answer_length;
+
+	/* PPS request: the card accepts it by echoing it */
+	if ((length > 0) && (0xFF == tpdu[0]))
+	{
+		memcpy(res, tpdu, length);
+		return length;
+	}
+
+	/* GET RESPONSE after a 61 XX */
+	if ((5 == length) && (0xC0 == tpdu[1]) && emu->t0_pending_length)
+	{
+		memcpy(res, emu->t0_pending, emu->t0_pending_length);
+		answer_length = emu->t0_pending_length;
+		emu->t0_pending_length = 0;
+		return answer_length;
+	}
+
+	answer_length = card_answer(emu, tpdu, length, answer);
+
+	/* a T=0 card can't send data after ISO IN data (case 3 and 4 TPDU) */
+	if ((length > 5) && (answer_length > 2))
+	{
+		memcpy(emu->t0_pending, answer, answer_length);
+		emu->t0_pending_length = answer_length;
+		res[0] = 0x61;
+		res[1] = (answer_length - 2) & 0xFF;
+		return 2;
+	}
+
+	memcpy(res, answer, answer_length);
+	return answer_length;
+} /* xfr_block */
+
+
+/*****************************************************************************
+ *
+ *					xfr_block_t1: T=1 block exchange with the virtual card
+ *
+ ****************************************************************************/
+static int xfr_block_t1(twin_emulator *emu, const unsigned char *block,
+	int length, unsigned char *res)
+{
+	unsigned char pcb, lrc;
+	int i, chunk;
+
+	/* PPS request: the card accepts it by echoing it */
+	if ((length > 0) && (0xFF == block[0]))
+	{
+		memcpy(res, block, length);
+		return length;
+	}
+
+	lrc = 0;
+	for (i=0; i<length; i++)
+		lrc ^= block[i];
+
+	if ((length < 4) || (block[2] != length - 4) || lrc)
+		/* R-block with EDC error */
+		return t1_send_block(emu, T1_R_BLOCK | (emu->t1_nr << 4)
+			| T1_EDC_ERROR, NULL, 0, res);
+
+	pcb = block[1];
+
+	/* I-block */
+	if (0 == (pcb & 0x80))
+	{
+		/* the reader did not get our last block and sends its own again */
+		if (((pcb >> 6) & 1) != emu->t1_nr)
+			goto resend;
+
+		emu->t1_nr ^= 1;
+		if (emu->t1_apdu_length + block[2] > (int)sizeof(emu->t1_apdu))
+			emu->t1_apdu_length = 0;
+		memcpy(emu->t1_apdu + emu->t1_apdu_length, block+3, block[2]);
+		emu->t1_apdu_length += block[2];
+
+		/* chaining: ask for the next block */
+		if (pcb & T1_MORE_BLOCKS)
+			return t1_send_block(emu, T1_R_BLOCK | (emu->t1_nr << 4), NULL,
+				0, res);
+
+		emu->t1_response_length = card_answer(emu, emu->t1_apdu,
+			emu->t1_apdu_length, emu->t1_response);
+		emu->t1_response_offset = 0;
+		emu->t1_apdu_length = 0;
+
+		goto send_next;
+	}
+
+	/* R-block */
+	if (T1_R_BLOCK == (pcb & 0xC0))
+	{
+		/* acknowledge of our chained block: send the next one */
+		if ((((pcb >> 4) & 1) == emu->t1_ns)
+			&& (emu->t1_response_offset < emu->t1_response_length)
+			&& (0 == (pcb & 0x0F)))
+			goto send_next;
+
+		goto resend;
+	}
+
+	/* S-block */
+	switch (pcb & 0x0F)
+	{
+		case T1_S_IFS:
+			if (block[2] != 1)
+				goto resend;
+			emu->t1_ifsd = block[3];
+			break;
+
+		case T1_S_RESYNC:
+			emu->t1_ns = 0;
+			emu->t1_nr = 0;
+			emu->t1_apdu_length = 0;
+			emu->t1_response_length = 0;
+			emu->t1_response_offset = 0;
+			break;
+
+		case T1_S_ABORT:
+			emu->t1_apdu_length = 0;
+			emu->t1_response_length = 0;
+			emu->t1_response_offset = 0;
+			break;
+	}
+	return t1_send_block(emu, pcb | T1_S_RESPONSE, block+3, block[2], res);
+
+send_next:
+	chunk = emu->t1_response_length - emu->t1_response_offset;
+	pcb = T1_I_BLOCK | (emu->t1_ns << 6);
+	if (chunk > emu->t1_ifsd)
+	{
+		chunk = emu->t1_ifsd;
+		pcb |= T1_MORE_BLOCKS;
+	}
+	emu->t1_ns ^= 1;
+	i = t1_send_block(emu, pcb,
+		emu->t1_response + emu->t1_response_offset, chunk, res);
+	emu->t1_response_offset += chunk;
+	return i;
+
+resend:
+	memcpy(res, emu->t1_last_block, emu->t1_last_block_length);
+	return emu->t1_last_block_length;
+} /* xfr_block_t1 */
+
+
+/*****************************************************************************
+ *
+ *					t1_send_block: build a T=1 block from the card
+ *
+ ****************************************************************************/
+static int t1_send_block(twin_emulator *emu, unsigned char pcb,
+	const unsigned char *data, int length, unsigned char *res)
+{
+	unsigned char lrc;
+	int i;
+
+	res[0] = 0;	/* NAD */
+	res[1] = pcb;
+	res[2] = length;
+	memcpy(res+3, data, length);
+
+	lrc = 0;
+	for (i=0; i<length+3; i++)
+		lrc ^= res[i];
+	res[length+3] = lrc;
+
+	/* keep a good copy for a retransmission */
+	memcpy(emu->t1_last_block, res, length+4);
+	emu->t1_last_block_length = length+4;
+
+	emu->nb_t1_blocks++;
+	if (emu->corrupt_every && (0 == emu->nb_t1_blocks % emu->corrupt_every))
+		res[length+3] ^= 0xFF;
+
+	return length+4;
+} /* t1_send_block */
+
+
+/*****************************************************************************
+ *
+ *					card_answer: response APDU of the virtual card
+ *
+ ****************************************************************************/
+static int card_answer(twin_emulator *emu, const unsigned char *apdu,
+	int length, unsigned char *res)
+{
+	int i, le;
+
+	for (i=0; i<emu->script_size; i++)
+	{
+		twin_script_entry *entry = &emu->script[i];
+
+		if ((length >= entry->command_length)
+			&& (0 == memcmp(apdu, entry->command, entry->command_length)))
+		{
+			memcpy(res, entry->response, entry->response_length);
+			return entry->response_length;
+		}
+	}
+
+	/* Le is present in case 2 (CLA INS P1 P2 Le) and
+	 * case 4 (CLA INS P1 P2 Lc data Le) */
+	le = -1;
+	if (5 == length)
+		le = apdu[4];
+	else
+		if ((length > 5) && (length == 5 + apdu[4] + 1))
+			le = apdu[length-1];
+
+	if (le < 0)
+	{
+		res[0] = 0x90;
+		res[1] = 0x00;
+		return 2;
+	}
+
+	if (0 == le)
+		le = 256;
+	for (i=0; i<le; i++)
+		res[i] = i;
+	res[le] = 0x90;
+	res[le+1] = 0x00;
+
+	return le+2;
+} /* card_answer */
+
+
+/*****************************************************************************
+ *
+ *					card_delay: card processing time
+ *
+ ****************************************************************************/
+static void card_delay(twin_emulator *emu)
+{
+	unsigned char time_request = 0x80;
+	int i;
+
+	for (i=0; i<emu->time_requests; i++)
+	{
+		if (emu->latency)
+			(void)usleep(emu->latency / (emu->time_requests + 1));
+		(void)write(emu->fd, &time_request, 1);
+	}
+
+	if (emu->latency)
+		(void)usleep(emu->latency / (emu->time_requests + 1));
+} /* card_delay */
+
+
+/*****************************************************************************
+ *
+ *					parse_hex: "3B 00" or "3B00" to binary
+ *
+ ****************************************************************************/
+static int parse_hex(const char *hex, unsigned char *buffer, int size)
+{
+	int length = 0;
+	unsigned int value;
+
+	while (*hex)
+	{
+		if (isspace((unsigned char)*hex))
+		{
+			hex++;
+			continue;
+		}
+
+		if ((length >= size) || (1 != sscanf(hex, "%2x", &value))
+			|| ! isxdigit((unsigned char)hex[1]))
+			return -1;
+
+		buffer[length++] = value;
+		hex += 2;
+	}
+
+	return length;
+} /* parse_hex */
+
+
+/*****************************************************************************
+ *
+ *					load_script: read the "command : response" lines
+ *
+ ****************************************************************************/
+static int load_script(twin_emulator *emu, const char *filename)
+{
+	FILE *file;
+	char line[1024];
+	char *sep;
+	int line_number = 0;
+	twin_script_entry *entry, *script;
+
+	file = fopen(filename, "r");
+	if (NULL == file)
+	{
+		perror(filename);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), file))
+	{
+		line_number++;
+
+		/* skip comments and empty lines */
+		sep = line + strspn(line, " \t\r\n");
+		if (('#' == *sep) || ('\0' == *sep))
+			continue;
+
+		script = realloc(emu->script,
+			(emu->script_size + 1) * sizeof(*emu->script));
+		if (NULL == script)
+		{
+			(void)fclose(file);
+			return -1;
+		}
+		emu->script = script;
+		entry = &emu->script[emu->script_size];
+
+		sep = strchr(line, ':');
+		if (sep)
+			*sep = '\0';
+		if ((NULL == sep)
+			|| ((entry->command_length = parse_hex(line, entry->command,
+				sizeof(entry->command))) < 1)
+			|| ((entry->response_length = parse_hex(sep+1, entry->response,
+				sizeof(entry->response))) < 2))
+		{
+			(void)fprintf(stderr, "%s:%d: syntax error\n", filename,
+				line_number);
+			(void)fclose(file);
+			return -1;
+		}
+
+		emu->script_size++;
+	}
+
+	(void)fclose(file);
+
+	return 0;
+} /* load_script */
+
@@ -0,0 +1,148 @@
+/*
+    twin_emulator.h: GemPC Twin serial reader emulator
+    Copyright (C) 2009   Ludovic Rousseau
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * $Id$
+ */
+
+#ifndef __TWIN_EMULATOR_H__
+#define __TWIN_EMULATOR_H__
+
+/* maximum ATR size */
+#define EMULATOR_MAX_ATR_SIZE 33
+
+/* short APDU: CLA INS P1 P2 Lc 255 bytes Le */
+#define EMULATOR_MAX_APDU_SIZE (5 + 255 + 1)
+
+/* short response: 256 bytes + SW1 SW2 */
+#define EMULATOR_MAX_RESPONSE_SIZE (256 + 2)
+
+/* maximum T=1 block: NAD PCB LEN 254 bytes LRC */
+#define EMULATOR_MAX_T1_BLOCK (3 + 254 + 1)
+
+/*
+ * one line of a card script
+ * the response is sent when the received APDU starts with command
+ */
+typedef struct
+{
+	unsigned char command[EMULATOR_MAX_APDU_SIZE];
+	int command_length;
+	unsigned char response[EMULATOR_MAX_RESPONSE_SIZE];
+	int response_length;
+} twin_script_entry;
+
+typedef struct
+{
+	/*
+	 * pseudo terminal master side (the reader side)
+	 */
+	int fd;
+
+	/*
+	 * pseudo terminal slave side
+	 * kept open so the master does not get EIO between two driver opens
+	 */
+	int slave;
+
+	/*
+	 * name of the slave side, to be used as DEVICENAME by the driver
+	 */
+	char slave_name[64];
+
+	/*
+	 * does the reader echo the commands?
+	 */
+	int echo;
+
+	/*
+	 * virtual card
+	 */
+	int card_present;
+	int card_powered;
+	unsigned char atr[EMULATOR_MAX_ATR_SIZE];
+	int atr_length;
+
+	/*
+	 * protocol selected by PC_to_RDR_SetParameters (0: T=0, 1: T=1)
+	 */
+	int protocol;
+
+	/*
+	 * scripted answers, tried in order before the built-in ones
+	 */
+	twin_script_entry *script;
+	int script_size;
+
+	/*
+	 * card processing time in microseconds, and number of time
+	 * request bytes sent by the reader while waiting
+	 */
+	unsigned int latency;
+	int time_requests;
+
+	/*
+	 * error injection, 0 to disable
+	 * nak_every: answer every nth command frame with a NAK
+	 * mute_every: every nth PC_to_RDR_XfrBlock fails with ICC_MUTE
+	 * corrupt_every: every nth T=1 block has a wrong LRC
+	 */
+	int nak_every;
+	int mute_every;
+	int corrupt_every;
+	int nb_frames;
+	int nb_xfr;
+	int nb_t1_blocks;
+
+	/*
+	 * T=0 answer waiting for a GET RESPONSE
+	 */
+	unsigned char t0_pending[EMULATOR_MAX_RESPONSE_SIZE];
+	int t0_pending_length;
+
+	/*
+	 * T=1 card state
+	 */
+	int t1_ns;	/* N(S) of the next I-block sent by the card */
+	int t1_nr;	/* N(S) expected in the next I-block from the reader */
+	int t1_ifsd;
+	unsigned char t1_apdu[EMULATOR_MAX_APDU_SIZE];
+	int t1_apdu_length;
+	unsigned char t1_response[EMULATOR_MAX_RESPONSE_SIZE];
+	int t1_response_length;
+	int t1_response_offset;
+	unsigned char t1_last_block[EMULATOR_MAX_T1_BLOCK];
+	int t1_last_block_length;
+} twin_emulator;
+
+/* getopt() options understood by EmulatorSetOption() */
+#define EMULATOR_OPTIONS "a:s:l:r:N:m:c:"
+
+int EmulatorOpen(twin_emulator *emu);
+
+int EmulatorSetOption(twin_emulator *emu, int opt, const char *arg);
+
+void EmulatorUsage(void);
+
+int EmulatorRun(twin_emulator *emu);
+
+void EmulatorClose(twin_emulator *emu);
+
+#endif
+
@@ -0,0 +1,66 @@
+/*
+    twin_log.c: driver log functions for the emulator programs
+    Copyright (C) 2009   Ludovic Rousseau
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc., 51
+	Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * $Id$
+ */
+
+/*
+ * The driver log functions are provided by pcscd. The programs linked
+ * with the driver provide them instead. The logs are printed on stderr
+ * only if TWIN_EMULATOR_DEBUG is set.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+void log_msg(const int priority, const char *fmt, ...);
+void log_xxd(const int priority, const char *msg, const unsigned char *buffer,
+	const int size);
+
+void log_msg(const int priority, const char *fmt, ...)
+{
+	va_list argptr;
+
+	(void)priority;
+	if (NULL == getenv("TWIN_EMULATOR_DEBUG"))
+		return;
+
+	va_start(argptr, fmt);
+	(void)vfprintf(stderr, fmt, argptr);
+	va_end(argptr);
+	(void)fprintf(stderr, "\n");
+}
+
+void log_xxd(const int priority, const char *msg, const unsigned char *buffer,
+	const int size)
+{
+	int i;
+
+	(void)priority;
+	if (NULL == getenv("TWIN_EMULATOR_DEBUG"))
+		return;
+
+	(void)fprintf(stderr, "%s", msg);
+	for (i=0; i<size; i++)
+		(void)fprintf(stderr, "%02X ", buffer[i]);
+	(void)fprintf(stderr, "\n");
+}
+
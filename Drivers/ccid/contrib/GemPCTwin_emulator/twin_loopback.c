@@ -0,0 +1,355 @@
+/*
+    twin_loopback.c: test the serial driver against the GemPC Twin emulator
+    Copyright (C) 2009   Ludovic Rousseau
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc., 51
+	Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * $Id$
+ */
+
+/*
+ * The emulator runs in a child process on the master side of a pty and
+ * the driver IFDH API is used on the slave side. No hardware is needed.
+ *
+ * Set TWIN_EMULATOR_DEBUG to get the driver logs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <pcsclite.h>
+#include <ifdhandler.h>
+#include <reader.h>
+
+#include "twin_emulator.h"
+#include "ccid_stats.h"
+
+#define LUN 0
+
+/* number of APDU exchanged */
+#define LOOPS 500
+
+/* number of readers used at the same time by run_many_readers() */
+#define MANY_READERS 40
+#define MANY_LOOPS 50
+
+#define CHECK(test, text) \
+if (!(test)) \
+{ \
+	printf("%s failed\n", text); \
+	goto end; \
+}
+
+/* emulator options of each test */
+static const char *tests[][2] =
+{
+	/* T=0 card and time requests from the reader */
+	{ "r", "2" },
+	/* T=1 card with command and answer chaining and EDC errors */
+	{ "a", "T1" },
+	/* T=0 card muting for every 5th command */
+	{ "m", "5" }
+};
+
+/* one of the readers used by run_many_readers() */
+typedef struct
+{
+	twin_emulator emu;
+	pid_t pid;
+	DWORD Lun;
+	int ret;
+} reader_thread;
+
+static int run_test(const char *opt, const char *arg);
+static int run_many_readers(void);
+static void *reader_thread_main(void *arg);
+
+int main(void)
+{
+	unsigned int i;
+
+	for (i=0; i<sizeof(tests)/sizeof(tests[0]); i++)
+		if (run_test(tests[i][0], tests[i][1]))
+			return 1;
+
+	if (run_many_readers())
+		return 1;
+
+	return 0;
+}
+
+static int run_test(const char *opt, const char *arg)
+{
+	twin_emulator emu;
+	pid_t pid;
+	char device[sizeof(emu.slave_name) + 20];
+	UCHAR atr[MAX_ATR_SIZE];
+	DWORD atr_length = sizeof(atr);
+	UCHAR cmd[5 + 255 + 1];
+	DWORD cmd_length;
+	UCHAR res[258];
+	DWORD res_length;
+	DWORD protocol;
+	SCARD_IO_HEADER pci;
+	RESPONSECODE rv;
+	ccid_transfer_stats stats;
+	DWORD stats_length;
+	unsigned int reads;
+	int i, j, le, lc, ret = 1;
+
+	if (EmulatorOpen(&emu) < 0)
+		return 1;
+
+	if (EmulatorSetOption(&emu, opt[0], arg) < 0)
+	{
+		EmulatorClose(&emu);
+		return 1;
+	}
+
+	/* T=1 card if TD1 indicates T=1 */
+	protocol = SCARD_PROTOCOL_T0;
+	if ((emu.atr[1] & 0x80) && (1 == (emu.atr[2] & 0x0F)))
+		protocol = SCARD_PROTOCOL_T1;
+	/* and a wrong LRC every 7th T=1 block to test the error recovery */
+	if (SCARD_PROTOCOL_T1 == protocol)
+		emu.corrupt_every = 7;
+
+	pid = fork();
+	if (pid < 0)
+	{
+		perror("fork");
+		EmulatorClose(&emu);
+		return 1;
+	}
+
+	if (0 == pid)
+	{
+		/* reader side */
+		(void)EmulatorRun(&emu);
+		_exit(0);
+	}
+
+	printf("test -%s %s: ", opt, arg);
+
+	(void)snprintf(device, sizeof(device), "%s:GemPCTwin", emu.slave_name);
+
+	rv = IFDHCreateChannelByName(LUN, device);
+	CHECK(IFD_SUCCESS == rv, "IFDHCreateChannelByName");
+
+	rv = IFDHICCPresence(LUN);
+	CHECK(IFD_ICC_PRESENT == rv, "IFDHICCPresence");
+
+	rv = IFDHPowerICC(LUN, IFD_POWER_UP, atr, &atr_length);
+	CHECK(IFD_SUCCESS == rv, "IFDHPowerICC");
+	CHECK((atr_length == (DWORD)emu.atr_length)
+		&& (0 == memcmp(atr, emu.atr, atr_length)), "ATR");
+
+	rv = IFDHSetProtocolParameters(LUN, protocol, 0, 0, 0, 0);
+	CHECK(IFD_SUCCESS == rv, "IFDHSetProtocolParameters");
+
+	pci.Protocol = protocol - 1;
+	pci.Length = 0;
+
+	/* all the answer sizes, so that the frames wrap around the driver
+	 * ring buffer at every possible offset */
+	for (i=0; i<LOOPS; i++)
+	{
+		le = i % 256 + 1;
+
+		/* GET CHALLENGE, or a case 4 APDU with up to 255 bytes for T=1 */
+		memset(cmd, 0, sizeof(cmd));
+		cmd[1] = 0x84;
+		cmd_length = 5;
+		if ((SCARD_PROTOCOL_T1 == protocol) && (i & 1))
+		{
+			lc = (i * 7) % 255 + 1;
+			cmd[1] = 0xCA;
+			cmd[4] = lc;
+			cmd_length = 5 + lc + 1;
+		}
+		cmd[cmd_length-1] = le & 0xFF;
+		res_length = sizeof(res);
+
+		rv = IFDHTransmitToICC(LUN, pci, cmd, cmd_length, res, &res_length,
+			NULL);
+
+		/* the emulator mutes for every 5th PC_to_RDR_XfrBlock */
+		if (emu.mute_every && (0 == (i+1) % emu.mute_every))
+		{
+			CHECK(IFD_COMMUNICATION_ERROR == rv, "mute card");
+			continue;
+		}
+
+		CHECK(IFD_SUCCESS == rv, "IFDHTransmitToICC");
+		CHECK(res_length == (DWORD)le+2, "answer length");
+
+		for (j=0; j<le; j++)
+			CHECK(res[j] == (j & 0xFF), "answer data");
+		CHECK((0x90 == res[le]) && (0x00 == res[le+1]), "status word");
+	}
+
+	rv = IFDHControl(LUN, IOCTL_SMARTCARD_VENDOR_TRANSFER_STATS, NULL, 0,
+		(PUCHAR)&stats, sizeof(stats), &stats_length);
+	CHECK((IFD_SUCCESS == rv) && (sizeof(stats) == stats_length)
+		&& (CCID_TRANSFER_STATS_VERSION == stats.version),
+		"transfer statistics");
+
+	/* one read per write and every read in the histogram */
+	reads = 0;
+	for (j=0; j<CCID_TRANSFER_STATS_BUCKETS; j++)
+		reads += stats.read_time[j];
+	CHECK((stats.write_transfers >= LOOPS)
+		&& (stats.read_transfers == stats.write_transfers)
+		&& (reads == stats.read_transfers)
+		&& (0 == stats.read_errors + stats.read_timeouts + stats.write_errors),
+		"transfer counters");
+
+	rv = IFDHPowerICC(LUN, IFD_POWER_DOWN, atr, &atr_length);
+	CHECK(IFD_SUCCESS == rv, "IFDHPowerICC");
+
+	rv = IFDHCloseChannel(LUN);
+	CHECK(IFD_SUCCESS == rv, "IFDHCloseChannel");
+
+	printf("%d APDU exchanged\n", LOOPS);
+	ret = 0;
+
+end:
+	(void)kill(pid, SIGTERM);
+	(void)waitpid(pid, NULL, 0);
+	EmulatorClose(&emu);
+
+	return ret;
+}
+
+/*
+ * more readers than the 16 supported by the previous versions of the
+ * driver, each one used by its own thread like pcscd does
+ */
+static int run_many_readers(void)
+{
+	reader_thread readers[MANY_READERS];
+	pthread_t threads[MANY_READERS];
+	int i, started = 0, ret = 1;
+
+	printf("test %d readers: ", MANY_READERS);
+
+	/* fork all the emulators before creating any thread */
+	for (i=0; i<MANY_READERS; i++)
+	{
+		if (EmulatorOpen(&readers[i].emu) < 0)
+			goto end;
+
+		readers[i].pid = fork();
+		if (readers[i].pid < 0)
+		{
+			perror("fork");
+			EmulatorClose(&readers[i].emu);
+			goto end;
+		}
+
+		if (0 == readers[i].pid)
+		{
+			(void)EmulatorRun(&readers[i].emu);
+			_exit(0);
+		}
+
+		/* Lun as used by pcscd */
+		readers[i].Lun = i << 16;
+		started++;
+	}
+
+	for (i=0; i<MANY_READERS; i++)
+		if (pthread_create(&threads[i], NULL, reader_thread_main, &readers[i]))
+		{
+			printf("pthread_create failed\n");
+			exit(1);
+		}
+
+	ret = 0;
+	for (i=0; i<MANY_READERS; i++)
+	{
+		(void)pthread_join(threads[i], NULL);
+		if (readers[i].ret)
+			ret = 1;
+	}
+
+	if (0 == ret)
+		printf("%d APDU exchanged\n", MANY_READERS * MANY_LOOPS);
+
+end:
+	for (i=0; i<started; i++)
+	{
+		(void)kill(readers[i].pid, SIGTERM);
+		(void)waitpid(readers[i].pid, NULL, 0);
+		EmulatorClose(&readers[i].emu);
+	}
+
+	return ret;
+}
+
+static void *reader_thread_main(void *arg)
+{
+	reader_thread *reader = arg;
+	char device[sizeof(reader->emu.slave_name) + 20];
+	UCHAR atr[MAX_ATR_SIZE];
+	DWORD atr_length = sizeof(atr);
+	UCHAR cmd[] = { 0x00, 0x84, 0x00, 0x00, 0x08 };
+	UCHAR res[258];
+	DWORD res_length;
+	SCARD_IO_HEADER pci;
+	RESPONSECODE rv;
+	int i;
+
+	reader->ret = 1;
+
+	(void)snprintf(device, sizeof(device), "%s:GemPCTwin",
+		reader->emu.slave_name);
+
+	rv = IFDHCreateChannelByName(reader->Lun, device);
+	CHECK(IFD_SUCCESS == rv, "IFDHCreateChannelByName");
+
+	rv = IFDHPowerICC(reader->Lun, IFD_POWER_UP, atr, &atr_length);
+	CHECK(IFD_SUCCESS == rv, "IFDHPowerICC");
+
+	rv = IFDHSetProtocolParameters(reader->Lun, SCARD_PROTOCOL_T0, 0, 0, 0,
+		0);
+	CHECK(IFD_SUCCESS == rv, "IFDHSetProtocolParameters");
+
+	pci.Protocol = 0;
+	pci.Length = 0;
+
+	for (i=0; i<MANY_LOOPS; i++)
+	{
+		res_length = sizeof(res);
+		rv = IFDHTransmitToICC(reader->Lun, pci, cmd, sizeof(cmd), res,
+			&res_length, NULL);
+		CHECK((IFD_SUCCESS == rv) && (10 == res_length)
+			&& (0x90 == res[8]), "IFDHTransmitToICC");
+	}
+
+	rv = IFDHCloseChannel(reader->Lun);
+	CHECK(IFD_SUCCESS == rv, "IFDHCloseChannel");
+
+	reader->ret = 0;
+
+end:
+	return NULL;
+}
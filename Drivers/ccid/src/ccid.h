@@ -91,6 +91,35 @@ typedef struct
 	 */
 	unsigned int readTimeout;
 
+	/*
+	 * Adaptive read timeout (DRIVER_OPTION_ADAPTIVE_TIMEOUT)
+	 * readTimeoutMs: timeout of the next read in milliseconds, 0 to use
+	 * readTimeout instead
+	 * responseTime: smoothed card response time in ms (scaled by 8)
+	 * responseTimeDev: mean deviation of the response time (scaled by 4)
+	 * responseSamples: number of responses used in the estimation
+	 */
+	unsigned int readTimeoutMs;
+	unsigned int responseTime;
+	unsigned int responseTimeDev;
+	unsigned int responseSamples;
+
+	/*
+	 * TRUE during a CmdXfrBlock() if the adaptive timeout is enabled
+	 */
+	int adaptiveExchange;
+
+	/*
+	 * bBWI of the last PC_to_RDR_XfrBlock sent
+	 */
+	unsigned char bBWI;
+
+	/*
+	 * TRUE if an adaptive timeout expired and the late answer has still
+	 * to be discarded
+	 */
+	int lateAnswer;
+
 	/*
 	 * Card protocol
 	 */
@@ -123,6 +152,16 @@ typedef struct
 	int bVoltageSupport;
 } _ccid_descriptor;
 
+/* timeout of the next read in ms */
+#define READ_TIMEOUT_MS(ccid) ((ccid)->readTimeoutMs ? (ccid)->readTimeoutMs \
+	: (ccid)->readTimeout * 1000)
+
+/* lower limit of the adaptive timeout in ms */
+#define ADAPTIVE_TIMEOUT_MIN 1000
+
+/* number of responses needed before using the adaptive timeout */
+#define ADAPTIVE_TIMEOUT_SAMPLES 8
+
 /* Features from dwFeatures */
 #define CCID_CLASS_AUTO_CONF_ATR	0x00000002
 #define CCID_CLASS_AUTO_VOLTAGE		0x00000008
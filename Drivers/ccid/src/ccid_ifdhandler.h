@@ -24,6 +24,8 @@
 #ifndef _ccid_ifd_handler_h_
 #define _ccid_ifd_handler_h_
 
+#include "ccid_stats.h"
+
 #define IOCTL_SMARTCARD_VENDOR_IFD_EXCHANGE	SCARD_CTL_CODE(1)
 
 #define CLASS2_IOCTL_MAGIC 0x330000
@@ -43,21 +45,27 @@
 #define DRIVER_OPTION_GEMPC_TWIN_KEY_APDU 2
 #define DRIVER_OPTION_USE_BOGUS_FIRMWARE 4
 #define DRIVER_OPTION_RESET_ON_CLOSE 8
+#define DRIVER_OPTION_ADAPTIVE_TIMEOUT 64
 
 extern int DriverOptions;
 
 /*
- * Maximum number of CCID readers supported simultaneously
+ * Maximum number of CCID readers (slots) supported simultaneously
+ *
+ * The state of a reader is allocated only when the reader is used so a
+ * large value costs only an array of pointers per module.
  *
  * The maximum number of readers is also limited in pcsc-lite (16 by default)
  * see the definition of PCSCLITE_MAX_READERS_CONTEXTS in src/PCSC/pcsclite.h
  */
-#define CCID_DRIVER_MAX_READERS 16
+#define CCID_DRIVER_MAX_READERS 256
 
 /*
  * CCID driver specific functions
  */
 CcidDesc *get_ccid_slot(unsigned int reader_index);
 
+ccid_transfer_stats *get_transfer_stats(unsigned int reader_index);
+
 #endif
 
@@ -33,8 +33,10 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <ifdhandler.h>
 
+#include "misc.h"
 #include "defs.h"
 #include "ccid_ifdhandler.h"
 #include "config.h"
@@ -51,6 +53,11 @@
 #define CARD_ABSENT 0x02
 #define CARD_PRESENT 0x03
 
+/* bMessageType of the PC_to_RDR messages: 0x61 to 0x72. The RDR_to_PC
+ * messages are 0x80 to 0x84 */
+#define IS_PC_TO_RDR(type) (((type) >= 0x61) && ((type) < 0x80))
+#define BSEQ_OFFSET 6
+
 /*
  * normal command:
  * 1 : SYNC
@@ -96,6 +103,32 @@
  */
 #define GEMPCTWIN_MAXBUF (271 +2 +1) * 2
 
+/* size of the receive ring buffer
+ * must be a power of 2 and at least GEMPCTWIN_MAXBUF */
+#define GEMPCTWIN_RINGSIZE 1024
+#define GEMPCTWIN_RINGMASK (GEMPCTWIN_RINGSIZE -1)
+
+/* default serial port speed */
+#define GEMPCTWIN_DEFAULT_SPEED 115200
+
+typedef struct
+{
+	/*
+	 * serial communication ring buffer
+	 */
+	unsigned char buffer[GEMPCTWIN_RINGSIZE];
+
+	/*
+	 * next byte to parse (free running counter)
+	 */
+	unsigned int head;
+
+	/*
+	 * next byte to store (free running counter)
+	 */
+	unsigned int tail;
+} _serialRing;
+
 typedef struct
 {
 	/*
@@ -120,19 +153,16 @@ typedef struct
 	int echo;
 
 	/*
-	 * serial communication buffer
-	 */
-	unsigned char buffer[GEMPCTWIN_MAXBUF];
-
-	/*
-	 * next available byte
+	 * receive ring buffer shared by all the slots of the device
 	 */
-	int buffer_offset;
+	_serialRing real_ring;
+	_serialRing *ring;
 
 	/*
-	 * number of available bytes
+	 * transfer statistics shared by all the slots of the device
 	 */
-	int buffer_offset_last;
+	ccid_transfer_stats real_stats;
+	ccid_transfer_stats *stats;
 
 	/*
 	 * CCID infos common to USB and serial
@@ -153,15 +183,29 @@ unsigned int SerialExtendedDataRates[] = { ISO_DATA_RATES, 500000, 0 };
 /* data rates supported by the secondary slots on the GemCore Pos Pro & SIM Pro */
 unsigned int SerialCustomDataRates[] = { GEMPLUS_CUSTOM_DATA_RATES, 0 };
 
-/* no need to initialize to 0 since it is static */
-static _serialDevice serialDevice[CCID_DRIVER_MAX_READERS];
+/* allocated the first time a reader_index is used and kept for the next
+ * reader using the same index since the other slots of a multi-slot
+ * reader point to the shared fields of the first slot */
+static _serialDevice **serialDevice = NULL;
+static int serialDeviceSize = 0;
 
 /* unexported functions */
-static int ReadChunk(unsigned int reader_index, unsigned char *buffer,
-	int buffer_length, int min_length);
+static status_t ReadFrame(unsigned int reader_index, unsigned int *length,
+	unsigned char *buffer);
+
+static int ReadChunk(unsigned int reader_index, unsigned int min_length);
 
-static int get_bytes(unsigned int reader_index, /*@out@*/ unsigned char *buffer,
-	int length);
+static int write_all(unsigned int reader_index, struct iovec *iov,
+	int iovcnt);
+
+static speed_t get_speed(unsigned int speed);
+
+/* number of bytes available in the ring buffer */
+#define RING_AVAILABLE(ring) ((ring)->tail - (ring)->head)
+
+/* byte at offset from the next byte to parse */
+#define RING_PEEK(ring, offset) \
+	((ring)->buffer[((ring)->head + (offset)) & GEMPCTWIN_RINGMASK])
 
 
 /*****************************************************************************
@@ -174,7 +218,10 @@ status_t WriteSerial(unsigned int reader_index, unsigned int length,
 {
 	unsigned int i;
 	unsigned char lrc;
-	unsigned char low_level_buffer[GEMPCTWIN_MAXBUF];
+	unsigned char header[2];
+	struct iovec iov[3];
+	ccid_transfer_stats *stats = serialDevice[reader_index]->stats;
+	struct timeval start;
 
 	char debug_header[] = "-> 123456 ";
 
@@ -189,26 +236,30 @@ status_t WriteSerial(unsigned int reader_index, unsigned int length,
 	}
 
 	/* header */
-	low_level_buffer[0] = 0x03;	/* SYNC */
-	low_level_buffer[1] = 0x06;	/* ACK */
-
-	/* CCID command */
-	memcpy(low_level_buffer+2, buffer, length);
+	header[0] = SYNC;
+	header[1] = CTRL_ACK;
 
 	/* checksum */
-	lrc = 0;
-	for(i=0; i<length+2; i++)
-		lrc ^= low_level_buffer[i];
-	low_level_buffer[length+2] = lrc;
-
-	DEBUG_XXD(debug_header, low_level_buffer, length+3);
-
-	if (write(serialDevice[reader_index].fd, low_level_buffer,
-		length+3) != length+3)
-	{
-		DEBUG_CRITICAL2("write error: %s", strerror(errno));
+	lrc = SYNC ^ CTRL_ACK;
+	for(i=0; i<length; i++)
+		lrc ^= buffer[i];
+
+	DEBUG_XXD(debug_header, buffer, length);
+
+	/* the frame is sent as is, without copying the CCID command */
+	iov[0].iov_base = header;
+	iov[0].iov_len = sizeof(header);
+	iov[1].iov_base = buffer;
+	iov[1].iov_len = length;
+	iov[2].iov_base = &lrc;
+	iov[2].iov_len = 1;
+
+	(void)gettimeofday(&start, NULL);
+	stats->write_transfers++;
+	if (write_all(reader_index, iov, 3) < 0)
 		return STATUS_UNSUCCESSFUL;
-	}
+	StatsAddTime(stats->write_time, &start);
+	stats->write_bytes += length;
 
 	return STATUS_SUCCESS;
 } /* WriteSerial */
@@ -222,239 +273,403 @@ status_t WriteSerial(unsigned int reader_index, unsigned int length,
 status_t ReadSerial(unsigned int reader_index,
 	unsigned int *length, unsigned char *buffer)
 {
-	unsigned char c;
-	int rv;
-	int echo;
-	int to_read;
-	int i;
-
-	/* we get the echo first */
-	echo = serialDevice[reader_index].echo;
-
-start:
-	DEBUG_COMM("start");
-	if ((rv = get_bytes(reader_index, &c, 1)) != STATUS_SUCCESS)
-		return rv;
-
-	if (c == RDR_to_PC_NotifySlotChange)
-		goto slot_change;
+	ccid_transfer_stats *stats = serialDevice[reader_index]->stats;
+	_ccid_descriptor *ccid_descriptor = &serialDevice[reader_index]->ccid;
+	unsigned int timeouts = stats->read_timeouts;
+	unsigned int buffer_length = *length;
+	struct timeval start;
+	status_t ret;
 
-	if (c == SYNC)
-		goto sync;
+read_again:
+	(void)gettimeofday(&start, NULL);
+	*length = buffer_length;
+	ret = ReadFrame(reader_index, length, buffer);
+	StatsAddTime(stats->read_time, &start);
 
-	if (c >= 0x80)
+	/* the answer to a command for which the adaptive timeout expired may
+	 * arrive now. It is not the answer to the last command sent */
+	if ((STATUS_SUCCESS == ret) && ccid_descriptor->lateAnswer
+		&& (*length > BSEQ_OFFSET) && !IS_PC_TO_RDR(buffer[0]))
 	{
-		DEBUG_COMM2("time request: 0x%02X", c);
-		goto start;
+		if (buffer[BSEQ_OFFSET] != (unsigned char)(*ccid_descriptor->pbSeq -1))
+		{
+			DEBUG_INFO2("Late answer discarded (bSeq: %d)",
+				buffer[BSEQ_OFFSET]);
+			stats->read_transfers++;
+			stats->read_retries++;
+			goto read_again;
+		}
+		ccid_descriptor->lateAnswer = FALSE;
 	}
 
-	DEBUG_CRITICAL2("Got 0x%02X", c);
-	return STATUS_COMM_ERROR;
-
-slot_change:
-	DEBUG_COMM("slot change");
-	if ((rv = get_bytes(reader_index, &c, 1)) != STATUS_SUCCESS)
-		return rv;
-
-	if (c == CARD_ABSENT)
-	{
-		DEBUG_COMM("Card removed");
-	}
+	stats->read_transfers++;
+	if (STATUS_SUCCESS == ret)
+		stats->read_bytes += *length;
 	else
-		if (c == CARD_PRESENT)
-		{
-			DEBUG_COMM("Card inserted");
-		}
+		if (STATUS_COMM_NAK == ret)
+			stats->read_retries++;
 		else
-		{
-			DEBUG_COMM2("Unknown card movement: %d", c);
-		}
-	goto start;
+			/* the timeouts are already counted by ReadChunk() */
+			if (timeouts == stats->read_timeouts)
+				stats->read_errors++;
 
-sync:
-	DEBUG_COMM("sync");
-	if ((rv = get_bytes(reader_index, &c, 1)) != STATUS_SUCCESS)
-		return rv;
+	return ret;
+} /* ReadSerial */
 
-	if (c == CTRL_ACK)
-		goto ack;
 
-	if (c == CTRL_NAK)
-		goto nak;
+/*****************************************************************************
+ *
+ *				ReadFrame: parse the next CCID frame
+ *
+ *****************************************************************************/
+static status_t ReadFrame(unsigned int reader_index,
+	unsigned int *length, unsigned char *buffer)
+{
+	_serialRing *ring = serialDevice[reader_index]->ring;
+	unsigned char c;
+	unsigned int to_read, frame_size, i;
 
-	DEBUG_CRITICAL2("Got 0x%02X instead of ACK/NAK", c);
-	return STATUS_COMM_ERROR;
+	/* parse the frames already received and read more data only when
+	 * the frame is not yet complete */
+	for (;;)
+	{
+		if (ReadChunk(reader_index, 1) < 0)
+			return STATUS_COMM_ERROR;
 
-nak:
-	DEBUG_COMM("nak");
-	if ((rv = get_bytes(reader_index, &c, 1)) != STATUS_SUCCESS)
-		return rv;
+		c = RING_PEEK(ring, 0);
 
-	if (c != (SYNC ^ CTRL_NAK))
-	{
-		DEBUG_CRITICAL2("Wrong LRC: 0x%02X", c);
-		return STATUS_COMM_ERROR;
-	}
-	else
-	{
-		DEBUG_COMM("NAK requested");
-		return STATUS_COMM_NAK;
-	}
+		if (c == RDR_to_PC_NotifySlotChange)
+		{
+			if (ReadChunk(reader_index, 2) < 0)
+				return STATUS_COMM_ERROR;
 
-ack:
-	DEBUG_COMM("ack");
-	/* normal CCID frame */
-	if ((rv = get_bytes(reader_index, buffer, 5)) != STATUS_SUCCESS)
-		return rv;
+			c = RING_PEEK(ring, 1);
+			ring->head += 2;
 
-	/* total frame size */
-	to_read = 10+dw2i(buffer, 1);
+			if (c == CARD_ABSENT)
+			{
+				DEBUG_COMM("Card removed");
+			}
+			else
+				if (c == CARD_PRESENT)
+				{
+					DEBUG_COMM("Card inserted");
+				}
+				else
+				{
+					DEBUG_COMM2("Unknown card movement: %d", c);
+				}
+			continue;
+		}
 
-	DEBUG_COMM2("frame size: %d", to_read);
-	if ((rv = get_bytes(reader_index, buffer+5, to_read-5)) != STATUS_SUCCESS)
-		return rv;
+		if (c >= 0x80)
+		{
+			DEBUG_COMM2("time request: 0x%02X", c);
+			ring->head++;
 
-	DEBUG_XXD("frame: ", buffer, to_read);
+			/* the card needs more time: use the normal timeout */
+			serialDevice[reader_index]->ccid.readTimeoutMs = 0;
+			continue;
+		}
 
-	/* lrc */
-	DEBUG_COMM("lrc");
-	if ((rv = get_bytes(reader_index, &c, 1)) != STATUS_SUCCESS)
-		return rv;
+		if (c != SYNC)
+		{
+			DEBUG_CRITICAL2("Got 0x%02X", c);
+			ring->head++;
+			return STATUS_COMM_ERROR;
+		}
 
-	DEBUG_COMM2("lrc: 0x%02X", c);
-	for (i=0; i<to_read; i++)
-		c ^= buffer[i];
+		if (ReadChunk(reader_index, 2) < 0)
+			return STATUS_COMM_ERROR;
 
-	if (c != (SYNC ^ CTRL_ACK))
-		DEBUG_CRITICAL2("Wrong LRC: 0x%02X", c);
+		c = RING_PEEK(ring, 1);
 
-	if (echo)
-	{
-		echo = FALSE;
-		goto start;
-	}
+		if (c == CTRL_NAK)
+		{
+			if (ReadChunk(reader_index, 3) < 0)
+				return STATUS_COMM_ERROR;
 
-	/* length of data read */
-	*length = to_read;
+			c = RING_PEEK(ring, 2);
+			ring->head += 3;
 
-	return STATUS_SUCCESS;
-} /* ReadSerial */
+			if (c != (SYNC ^ CTRL_NAK))
+			{
+				DEBUG_CRITICAL2("Wrong LRC: 0x%02X", c);
+				return STATUS_COMM_ERROR;
+			}
 
+			DEBUG_COMM("NAK requested");
+			return STATUS_COMM_NAK;
+		}
 
-/*****************************************************************************
- *
- *				get_bytes: get n bytes
- *
- *****************************************************************************/
-int get_bytes(unsigned int reader_index, unsigned char *buffer, int length)
-{
-	int offset = serialDevice[reader_index].buffer_offset;
-	int offset_last = serialDevice[reader_index].buffer_offset_last;
+		if (c != CTRL_ACK)
+		{
+			DEBUG_CRITICAL2("Got 0x%02X instead of ACK/NAK", c);
+			ring->head += 2;
+			return STATUS_COMM_ERROR;
+		}
 
-	DEBUG_COMM3("available: %d, needed: %d", offset_last-offset,
-		length);
-	/* enough data are available */
-	if (offset + length <= offset_last)
-	{
-		DEBUG_COMM("data available");
-		memcpy(buffer, serialDevice[reader_index].buffer + offset, length);
-		serialDevice[reader_index].buffer_offset += length;
-	}
-	else
-	{
-		int present, rv;
+		/* normal CCID frame: SYNC + ACK + CCID header up to dwLength */
+		if (ReadChunk(reader_index, 2+5) < 0)
+			return STATUS_COMM_ERROR;
 
-		/* copy available data */
-		present = offset_last - offset;
+		to_read = 10 + (RING_PEEK(ring, 2+1)
+			| (RING_PEEK(ring, 2+2) << 8)
+			| (RING_PEEK(ring, 2+3) << 16)
+			| (RING_PEEK(ring, 2+4) << 24));
 
-		if (present > 0)
+		if ((to_read > *length) || (to_read > GEMPCTWIN_MAXBUF-3))
 		{
-			DEBUG_COMM2("some data available: %d", present);
-			memcpy(buffer, serialDevice[reader_index].buffer + offset,
-				present);
+			DEBUG_CRITICAL3("frame too long: %d for max %d", to_read,
+				min(*length, GEMPCTWIN_MAXBUF-3));
+			/* resynchronise on the next received frame */
+			ring->head = ring->tail;
+			return STATUS_COMM_ERROR;
 		}
 
-		/* get fresh data */
-		DEBUG_COMM2("get more data: %d", length - present);
-		rv = ReadChunk(reader_index, serialDevice[reader_index].buffer,
-			sizeof(serialDevice[reader_index].buffer), length - present);
-		if (rv < 0)
+		/* SYNC + ACK + CCID frame + LRC */
+		frame_size = 2 + to_read + 1;
+		DEBUG_COMM2("frame size: %d", to_read);
+		if (ReadChunk(reader_index, frame_size) < 0)
 			return STATUS_COMM_ERROR;
 
-		/* fill the buffer */
-		memcpy(buffer + present, serialDevice[reader_index].buffer,
-			length - present);
-		serialDevice[reader_index].buffer_offset = length - present;
-		serialDevice[reader_index].buffer_offset_last = rv;
-		DEBUG_COMM3("offset: %d, last_offset: %d",
-			serialDevice[reader_index].buffer_offset,
-			serialDevice[reader_index].buffer_offset_last);
-	}
+		/* lrc */
+		c = RING_PEEK(ring, frame_size-1);
+		for (i=0; i<to_read; i++)
+		{
+			buffer[i] = RING_PEEK(ring, 2+i);
+			c ^= buffer[i];
+		}
+		ring->head += frame_size;
 
-	return STATUS_SUCCESS;
-} /* get_bytes */
+		DEBUG_XXD("frame: ", buffer, to_read);
+
+		if (c != (SYNC ^ CTRL_ACK))
+			DEBUG_CRITICAL2("Wrong LRC: 0x%02X", c);
+
+		/* the echo is recognized by its content, not by its position:
+		 * after an expired timeout a late answer may come before it */
+		if (serialDevice[reader_index]->echo && (to_read > BSEQ_OFFSET)
+			&& IS_PC_TO_RDR(buffer[0]))
+		{
+			if (buffer[BSEQ_OFFSET]
+				!= (unsigned char)(*serialDevice[reader_index]->ccid.pbSeq -1))
+				DEBUG_INFO2("Old echo discarded (bSeq: %d)",
+					buffer[BSEQ_OFFSET]);
+			continue;
+		}
+
+		/* length of data read */
+		*length = to_read;
+
+		return STATUS_SUCCESS;
+	}
+} /* ReadFrame */
 
 
 /*****************************************************************************
  *
- *				ReadChunk: read a minimum number of bytes
+ *				ReadChunk: make sure at least min_length bytes are
+ *				available in the ring buffer
  *
  *****************************************************************************/
-static int ReadChunk(unsigned int reader_index, unsigned char *buffer,
-	int buffer_length, int min_length)
+static int ReadChunk(unsigned int reader_index, unsigned int min_length)
 {
-	int fd = serialDevice[reader_index].fd;
+	_serialRing *ring = serialDevice[reader_index]->ring;
+	int fd = serialDevice[reader_index]->fd;
 # ifndef S_SPLINT_S
 	fd_set fdset;
 # endif
 	struct timeval t;
-	int i, rv = 0;
-	int already_read;
+	struct iovec iov[2];
+	unsigned int start, room, timeout;
+	int i, rv;
 	char debug_header[] = "<- 123456 ";
 
 	(void)snprintf(debug_header, sizeof(debug_header), "<- %06X ",
 		reader_index);
 
-	already_read = 0;
-	while (already_read < min_length)
+	while (RING_AVAILABLE(ring) < min_length)
 	{
 		/* use select() to, eventually, timeout */
 		FD_ZERO(&fdset);
 		FD_SET(fd, &fdset);
-		t.tv_sec = serialDevice[reader_index].ccid.readTimeout;
-		t.tv_usec = 0;
+		timeout = READ_TIMEOUT_MS(&serialDevice[reader_index]->ccid);
+		t.tv_sec = timeout / 1000;
+		t.tv_usec = (timeout % 1000) * 1000;
 
 		i = select(fd+1, &fdset, NULL, NULL, &t);
 		if (i == -1)
 		{
+			if (EINTR == errno)
+				continue;
+
 			DEBUG_CRITICAL2("select: %s", strerror(errno));
 			return -1;
 		}
 		else
 			if (i == 0)
 			{
-				DEBUG_COMM2("Timeout! (%d sec)", serialDevice[reader_index].ccid.readTimeout);
+				DEBUG_COMM2("Timeout! (%d ms)", timeout);
+				serialDevice[reader_index]->stats->read_timeouts++;
 				return -1;
 			}
 
-		rv = read(fd, buffer + already_read, buffer_length - already_read);
+		/* read everything available, up to the free room in the ring
+		 * buffer, in one call. The free room may wrap around the end of
+		 * the buffer. */
+		start = ring->tail & GEMPCTWIN_RINGMASK;
+		room = GEMPCTWIN_RINGSIZE - RING_AVAILABLE(ring);
+		iov[0].iov_base = ring->buffer + start;
+		iov[0].iov_len = min(room, GEMPCTWIN_RINGSIZE - start);
+		iov[1].iov_base = ring->buffer;
+		iov[1].iov_len = room - iov[0].iov_len;
+
+		rv = readv(fd, iov, iov[1].iov_len ? 2 : 1);
 		if (rv < 0)
 		{
+			if ((EAGAIN == errno) || (EINTR == errno))
+				continue;
+
 			DEBUG_COMM2("read error: %s", strerror(errno));
 			return -1;
 		}
 
-		DEBUG_XXD(debug_header, buffer + already_read, rv);
+		if (0 == rv)
+		{
+			DEBUG_COMM("end of file");
+			return -1;
+		}
+
+		if ((unsigned int)rv <= iov[0].iov_len)
+		{
+			DEBUG_XXD(debug_header, iov[0].iov_base, rv);
+		}
+		else
+		{
+			DEBUG_XXD(debug_header, iov[0].iov_base, iov[0].iov_len);
+			DEBUG_XXD(debug_header, iov[1].iov_base, rv - iov[0].iov_len);
+		}
 
-		already_read += rv;
-		DEBUG_COMM3("read: %d, to read: %d", already_read,
+		ring->tail += rv;
+		DEBUG_COMM3("available: %d, needed: %d", RING_AVAILABLE(ring),
 			min_length);
 	}
 
-	return already_read;
+	return RING_AVAILABLE(ring);
 } /* ReadChunk */
 
 
+/*****************************************************************************
+ *
+ *				write_all: write a complete frame on the
+ *				non-blocking serial port
+ *
+ *****************************************************************************/
+static int write_all(unsigned int reader_index, struct iovec *iov,
+	int iovcnt)
+{
+	int fd = serialDevice[reader_index]->fd;
+# ifndef S_SPLINT_S
+	fd_set fdset;
+# endif
+	struct timeval t;
+	ssize_t rv;
+	int i;
+
+	while (iovcnt > 0)
+	{
+		rv = writev(fd, iov, iovcnt);
+		if (rv < 0)
+		{
+			if (EINTR == errno)
+				continue;
+
+			if (EAGAIN != errno)
+			{
+				DEBUG_CRITICAL2("write error: %s", strerror(errno));
+				serialDevice[reader_index]->stats->write_errors++;
+				return -1;
+			}
+
+			/* output queue is full. Wait until it drains */
+			FD_ZERO(&fdset);
+			FD_SET(fd, &fdset);
+			t.tv_sec = serialDevice[reader_index]->ccid.readTimeout;
+			t.tv_usec = 0;
+
+			i = select(fd+1, NULL, &fdset, NULL, &t);
+			if ((i == -1) && (EINTR != errno))
+			{
+				DEBUG_CRITICAL2("select: %s", strerror(errno));
+				serialDevice[reader_index]->stats->write_errors++;
+				return -1;
+			}
+			if (i == 0)
+			{
+				DEBUG_CRITICAL2("Write timeout! (%d sec)",
+					serialDevice[reader_index]->ccid.readTimeout);
+				serialDevice[reader_index]->stats->write_timeouts++;
+				return -1;
+			}
+			continue;
+		}
+
+		/* skip what has been written */
+		while ((iovcnt > 0) && ((size_t)rv >= iov->iov_len))
+		{
+			rv -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0)
+		{
+			iov->iov_base = (unsigned char *)iov->iov_base + rv;
+			iov->iov_len -= rv;
+		}
+	}
+
+	return 0;
+} /* write_all */
+
+
+/*****************************************************************************
+ *
+ *				get_speed: convert a speed in bauds in a termios speed
+ *
+ *****************************************************************************/
+static speed_t get_speed(unsigned int speed)
+{
+	switch (speed)
+	{
+		case 9600:
+			return B9600;
+		case 19200:
+			return B19200;
+		case 38400:
+			return B38400;
+		case 57600:
+			return B57600;
+		case 115200:
+			return B115200;
+#ifdef B230400
+		case 230400:
+			return B230400;
+#endif
+#ifdef B460800
+		case 460800:
+			return B460800;
+#endif
+#ifdef B921600
+		case 921600:
+			return B921600;
+#endif
+	}
+
+	return B0;
+} /* get_speed */
+
+
 /*****************************************************************************
  *
  *				OpenSerial: open the port
@@ -519,10 +734,10 @@ static status_t set_ccid_descriptor(unsigned int reader_index,
 		readerID = GEMPCPINPAD;
 
 	/* check if the same channel is not already used to manage multi-slots readers*/
-	for (i = 0; i < CCID_DRIVER_MAX_READERS; i++)
+	for (i = 0; i < serialDeviceSize; i++)
 	{
-		if (serialDevice[i].device
-			&& strcmp(serialDevice[i].device, dev_name) == 0)
+		if (serialDevice[i] && serialDevice[i]->device
+			&& strcmp(serialDevice[i]->device, dev_name) == 0)
 		{
 			already_used = TRUE;
 
@@ -535,29 +750,29 @@ static status_t set_ccid_descriptor(unsigned int reader_index,
 	if (already_used)
 	{
 		if ((previous_reader_index != -1)
-			&& serialDevice[previous_reader_index].device
-			&& (strcmp(serialDevice[previous_reader_index].device, dev_name) == 0)
-			&& serialDevice[previous_reader_index].ccid.bCurrentSlotIndex < serialDevice[previous_reader_index].ccid.bMaxSlotIndex)
+			&& serialDevice[previous_reader_index]->device
+			&& (strcmp(serialDevice[previous_reader_index]->device, dev_name) == 0)
+			&& serialDevice[previous_reader_index]->ccid.bCurrentSlotIndex < serialDevice[previous_reader_index]->ccid.bMaxSlotIndex)
 		{
 			/* we reuse the same device and the reader is multi-slot */
-			serialDevice[reader_index] = serialDevice[previous_reader_index];
+			*serialDevice[reader_index] = *serialDevice[previous_reader_index];
 
-			*serialDevice[reader_index].nb_opened_slots += 1;
-			serialDevice[reader_index].ccid.bCurrentSlotIndex++;
+			*serialDevice[reader_index]->nb_opened_slots += 1;
+			serialDevice[reader_index]->ccid.bCurrentSlotIndex++;
 			DEBUG_INFO2("Opening slot: %d",
-					serialDevice[reader_index].ccid.bCurrentSlotIndex);
+					serialDevice[reader_index]->ccid.bCurrentSlotIndex);
 			switch (readerID)
 			{
 				case GEMCOREPOSPRO:
 				case GEMCORESIMPRO:
-					serialDevice[reader_index].ccid.arrayOfSupportedDataRates = SerialCustomDataRates;
-					serialDevice[reader_index].ccid.dwMaxDataRate = 125000;
+					serialDevice[reader_index]->ccid.arrayOfSupportedDataRates = SerialCustomDataRates;
+					serialDevice[reader_index]->ccid.dwMaxDataRate = 125000;
 					break;
 
 				/* GemPC Twin or GemPC Card */
 				default:
-					serialDevice[reader_index].ccid.arrayOfSupportedDataRates = SerialTwinDataRates;
-					serialDevice[reader_index].ccid.dwMaxDataRate = 344086;
+					serialDevice[reader_index]->ccid.arrayOfSupportedDataRates = SerialTwinDataRates;
+					serialDevice[reader_index]->ccid.dwMaxDataRate = 344086;
 					break;
 			}
 			goto end;
@@ -571,50 +786,60 @@ static status_t set_ccid_descriptor(unsigned int reader_index,
 	}
 
 	/* Common to all readers */
-	serialDevice[reader_index].ccid.real_bSeq = 0;
-	serialDevice[reader_index].ccid.pbSeq = &serialDevice[reader_index].ccid.real_bSeq;
-	serialDevice[reader_index].real_nb_opened_slots = 1;
-	serialDevice[reader_index].nb_opened_slots = &serialDevice[reader_index].real_nb_opened_slots;
-	serialDevice[reader_index].ccid.bCurrentSlotIndex = 0;
-
-	serialDevice[reader_index].ccid.dwMaxCCIDMessageLength = 271;
-	serialDevice[reader_index].ccid.dwMaxIFSD = 254;
-	serialDevice[reader_index].ccid.dwFeatures = 0x00010230;
-	serialDevice[reader_index].ccid.dwDefaultClock = 4000;
-
-	serialDevice[reader_index].buffer_offset = 0;
-	serialDevice[reader_index].buffer_offset_last = 0;
-
-	serialDevice[reader_index].ccid.readerID = readerID;
-	serialDevice[reader_index].ccid.bPINSupport = 0x0;
-	serialDevice[reader_index].ccid.dwMaxDataRate = 344086;
-	serialDevice[reader_index].ccid.bMaxSlotIndex = 0;
-	serialDevice[reader_index].ccid.arrayOfSupportedDataRates = SerialTwinDataRates;
-	serialDevice[reader_index].ccid.dwSlotStatus = IFD_ICC_PRESENT;
-	serialDevice[reader_index].ccid.bVoltageSupport = 0x07;	/* 1.8V, 3V and 5V */
-	serialDevice[reader_index].echo = TRUE;
+	serialDevice[reader_index]->ccid.real_bSeq = 0;
+	serialDevice[reader_index]->ccid.pbSeq = &serialDevice[reader_index]->ccid.real_bSeq;
+	serialDevice[reader_index]->real_nb_opened_slots = 1;
+	serialDevice[reader_index]->nb_opened_slots = &serialDevice[reader_index]->real_nb_opened_slots;
+	serialDevice[reader_index]->ccid.bCurrentSlotIndex = 0;
+
+	serialDevice[reader_index]->ccid.dwMaxCCIDMessageLength = 271;
+	serialDevice[reader_index]->ccid.dwMaxIFSD = 254;
+	serialDevice[reader_index]->ccid.dwFeatures = 0x00010230;
+	serialDevice[reader_index]->ccid.dwDefaultClock = 4000;
+	serialDevice[reader_index]->ccid.readTimeoutMs = 0;
+	serialDevice[reader_index]->ccid.responseSamples = 0;
+	serialDevice[reader_index]->ccid.adaptiveExchange = FALSE;
+	serialDevice[reader_index]->ccid.lateAnswer = FALSE;
+
+	serialDevice[reader_index]->real_ring.head = 0;
+	serialDevice[reader_index]->real_ring.tail = 0;
+	serialDevice[reader_index]->ring = &serialDevice[reader_index]->real_ring;
+
+	memset(&serialDevice[reader_index]->real_stats, 0,
+		sizeof(serialDevice[reader_index]->real_stats));
+	serialDevice[reader_index]->real_stats.version = CCID_TRANSFER_STATS_VERSION;
+	serialDevice[reader_index]->stats = &serialDevice[reader_index]->real_stats;
+
+	serialDevice[reader_index]->ccid.readerID = readerID;
+	serialDevice[reader_index]->ccid.bPINSupport = 0x0;
+	serialDevice[reader_index]->ccid.dwMaxDataRate = 344086;
+	serialDevice[reader_index]->ccid.bMaxSlotIndex = 0;
+	serialDevice[reader_index]->ccid.arrayOfSupportedDataRates = SerialTwinDataRates;
+	serialDevice[reader_index]->ccid.dwSlotStatus = IFD_ICC_PRESENT;
+	serialDevice[reader_index]->ccid.bVoltageSupport = 0x07;	/* 1.8V, 3V and 5V */
+	serialDevice[reader_index]->echo = TRUE;
 
 	/* change some values depending on the reader */
 	switch (readerID)
 	{
 		case GEMCOREPOSPRO:
-			serialDevice[reader_index].ccid.bMaxSlotIndex = 4;	/* 5 slots */
-			serialDevice[reader_index].ccid.arrayOfSupportedDataRates = SerialExtendedDataRates;
-			serialDevice[reader_index].echo = FALSE;
-			serialDevice[reader_index].ccid.dwMaxDataRate = 500000;
+			serialDevice[reader_index]->ccid.bMaxSlotIndex = 4;	/* 5 slots */
+			serialDevice[reader_index]->ccid.arrayOfSupportedDataRates = SerialExtendedDataRates;
+			serialDevice[reader_index]->echo = FALSE;
+			serialDevice[reader_index]->ccid.dwMaxDataRate = 500000;
 			break;
 
 		case GEMCORESIMPRO:
-			serialDevice[reader_index].ccid.bMaxSlotIndex = 1; /* 2 slots */
-			serialDevice[reader_index].ccid.arrayOfSupportedDataRates = SerialExtendedDataRates;
-			serialDevice[reader_index].echo = FALSE;
-			serialDevice[reader_index].ccid.dwMaxDataRate = 500000;
+			serialDevice[reader_index]->ccid.bMaxSlotIndex = 1; /* 2 slots */
+			serialDevice[reader_index]->ccid.arrayOfSupportedDataRates = SerialExtendedDataRates;
+			serialDevice[reader_index]->echo = FALSE;
+			serialDevice[reader_index]->ccid.dwMaxDataRate = 500000;
 			break;
 
 		case GEMPCPINPAD:
-			serialDevice[reader_index].ccid.bPINSupport = 0x03;
-			serialDevice[reader_index].ccid.arrayOfSupportedDataRates = SerialExtendedDataRates;
-			serialDevice[reader_index].ccid.dwMaxDataRate = 500000;
+			serialDevice[reader_index]->ccid.bPINSupport = 0x03;
+			serialDevice[reader_index]->ccid.arrayOfSupportedDataRates = SerialExtendedDataRates;
+			serialDevice[reader_index]->ccid.dwMaxDataRate = 500000;
 			break;
 	}
 
@@ -641,20 +866,59 @@ status_t OpenSerialByName(unsigned int reader_index, char *dev_name)
 	struct termios current_termios;
 	unsigned int reader = reader_index;
 	char reader_name[TOKEN_MAX_VALUE_SIZE] = "GemPCTwin";
+	unsigned int speed = GEMPCTWIN_DEFAULT_SPEED;
 	char *p;
 	status_t ret;
 
 	DEBUG_COMM3("Reader index: %X, Device: %s", reader_index, dev_name);
 
-	/* parse dev_name using the pattern "device:name" */
+	/* parse dev_name using the pattern "device:name[:speed]" */
 	p = strchr(dev_name, ':');
 	if (p)
 	{
 		/* copy the second part of the string */
 		strncpy(reader_name, p+1, sizeof(reader_name));
+		reader_name[sizeof(reader_name)-1] = '\0';
 
 		/* replace ':' by '\0' so that dev_name only contains the device name */
 		*p = '\0';
+
+		/* serial port speed */
+		p = strchr(reader_name, ':');
+		if (p)
+		{
+			*p = '\0';
+			speed = strtoul(p+1, NULL, 10);
+			if (B0 == get_speed(speed))
+			{
+				DEBUG_CRITICAL2("Unsupported serial port speed: %s", p+1);
+				return STATUS_UNSUCCESSFUL;
+			}
+		}
+	}
+
+	if ((int)reader_index >= serialDeviceSize)
+	{
+		_serialDevice **devices;
+
+		devices = (_serialDevice **)GrowReaderArray((void **)serialDevice,
+			&serialDeviceSize, reader_index);
+		if (NULL == devices)
+		{
+			DEBUG_CRITICAL("Not enough memory");
+			return STATUS_UNSUCCESSFUL;
+		}
+		serialDevice = devices;
+	}
+
+	if (NULL == serialDevice[reader_index])
+	{
+		serialDevice[reader_index] = calloc(1, sizeof(_serialDevice));
+		if (NULL == serialDevice[reader_index])
+		{
+			DEBUG_CRITICAL("Not enough memory");
+			return STATUS_UNSUCCESSFUL;
+		}
 	}
 
 	ret = set_ccid_descriptor(reader_index, reader_name, dev_name);
@@ -665,9 +929,11 @@ status_t OpenSerialByName(unsigned int reader_index, char *dev_name)
 	if (STATUS_SECONDARY_SLOT == ret)
 		return STATUS_SUCCESS;
 
-	serialDevice[reader].fd = open(dev_name, O_RDWR | O_NOCTTY);
+	/* the port is used in non-blocking mode so that ReadChunk() gets
+	 * everything already received in one read() */
+	serialDevice[reader]->fd = open(dev_name, O_RDWR | O_NOCTTY | O_NONBLOCK);
 
-	if (-1 == serialDevice[reader].fd)
+	if (-1 == serialDevice[reader]->fd)
 	{
 		DEBUG_CRITICAL3("open %s: %s", dev_name, strerror(errno));
 		return STATUS_UNSUCCESSFUL;
@@ -678,7 +944,7 @@ status_t OpenSerialByName(unsigned int reader_index, char *dev_name)
 	{
 		int flags;
 
-		if (ioctl(serialDevice[reader].fd, TIOCMGET, &flags) < 0)
+		if (ioctl(serialDevice[reader]->fd, TIOCMGET, &flags) < 0)
 		{
 			DEBUG_CRITICAL2("Get RS232 signals state failed: %s",
 				strerror(errno));
@@ -686,7 +952,7 @@ status_t OpenSerialByName(unsigned int reader_index, char *dev_name)
 		else
 		{
 			flags &= ~TIOCM_RTS;
-			if (ioctl(serialDevice[reader].fd, TIOCMSET, &flags) < 0)
+			if (ioctl(serialDevice[reader]->fd, TIOCMSET, &flags) < 0)
 			{
 				DEBUG_CRITICAL2("Set RTS to low failed: %s", strerror(errno));
 			}
@@ -698,18 +964,18 @@ status_t OpenSerialByName(unsigned int reader_index, char *dev_name)
 	}
 
 	/* set channel used */
-	serialDevice[reader].device = strdup(dev_name);
+	serialDevice[reader]->device = strdup(dev_name);
 
 	/* empty in and out serial buffers */
-	if (tcflush(serialDevice[reader].fd, TCIOFLUSH))
+	if (tcflush(serialDevice[reader]->fd, TCIOFLUSH))
 			DEBUG_INFO2("tcflush() function error: %s", strerror(errno));
 
 	/* get config attributes */
-	if (tcgetattr(serialDevice[reader].fd, &current_termios) == -1)
+	if (tcgetattr(serialDevice[reader]->fd, &current_termios) == -1)
 	{
 		DEBUG_INFO2("tcgetattr() function error: %s", strerror(errno));
-		(void)close(serialDevice[reader].fd);
-		serialDevice[reader].fd = -1;
+		(void)close(serialDevice[reader]->fd);
+		serialDevice[reader]->fd = -1;
 
 		return STATUS_UNSUCCESSFUL;
 	}
@@ -728,14 +994,15 @@ status_t OpenSerialByName(unsigned int reader_index, char *dev_name)
 	 * will echo characters for you.  Don't generate signals. */
 	current_termios.c_lflag = 0;
 
-	/* set serial port speed to 115200 bauds */
-	(void)cfsetspeed(&current_termios, B115200);
+	/* set serial port speed (115200 bauds by default) */
+	(void)cfsetspeed(&current_termios, get_speed(speed));
 
-	DEBUG_INFO("Set serial port baudrate to 115200 and correct configuration");
-	if (tcsetattr(serialDevice[reader].fd, TCSANOW, &current_termios) == -1)
+	DEBUG_INFO2("Set serial port baudrate to %d and correct configuration",
+		speed);
+	if (tcsetattr(serialDevice[reader]->fd, TCSANOW, &current_termios) == -1)
 	{
-		(void)close(serialDevice[reader].fd);
-		serialDevice[reader].fd = -1;
+		(void)close(serialDevice[reader]->fd);
+		serialDevice[reader]->fd = -1;
 		DEBUG_INFO2("tcsetattr error: %s", strerror(errno));
 
 		return STATUS_UNSUCCESSFUL;
@@ -749,7 +1016,7 @@ status_t OpenSerialByName(unsigned int reader_index, char *dev_name)
 		unsigned int rx_length = sizeof(rx_buffer);
 
 		/* 2 seconds timeout to not wait too long if no reader is connected */
-		serialDevice[reader].ccid.readTimeout = 2;
+		serialDevice[reader]->ccid.readTimeout = 2;
 
 		if (IFD_SUCCESS != CmdEscape(reader_index, tx_buffer, sizeof(tx_buffer),
 			rx_buffer, &rx_length))
@@ -760,7 +1027,7 @@ status_t OpenSerialByName(unsigned int reader_index, char *dev_name)
 		}
 
 		/* normal timeout: 2 seconds */
-		serialDevice[reader].ccid.readTimeout = DEFAULT_COM_READ_TIMEOUT ;
+		serialDevice[reader]->ccid.readTimeout = DEFAULT_COM_READ_TIMEOUT ;
 
 		rx_buffer[rx_length] = '\0';
 		DEBUG_INFO2("Firmware: %s", rx_buffer);
@@ -797,24 +1064,26 @@ status_t CloseSerial(unsigned int reader_index)
 	unsigned int reader = reader_index;
 
 	/* device not opened */
-	if (NULL == serialDevice[reader_index].device)
+	if (((int)reader_index >= serialDeviceSize)
+		|| (NULL == serialDevice[reader_index])
+		|| (NULL == serialDevice[reader_index]->device))
 		return STATUS_UNSUCCESSFUL;
 
-	DEBUG_COMM2("Closing serial device: %s", serialDevice[reader_index].device);
+	DEBUG_COMM2("Closing serial device: %s", serialDevice[reader_index]->device);
 
 	/* Decrement number of opened slot */
-	(*serialDevice[reader_index].nb_opened_slots)--;
+	(*serialDevice[reader_index]->nb_opened_slots)--;
 
 	/* release the allocated ressources for the last slot only */
-	if (0 == *serialDevice[reader_index].nb_opened_slots)
+	if (0 == *serialDevice[reader_index]->nb_opened_slots)
 	{
 		DEBUG_COMM("Last slot closed. Release resources");
 
-		(void)close(serialDevice[reader].fd);
-		serialDevice[reader].fd = -1;
+		(void)close(serialDevice[reader]->fd);
+		serialDevice[reader]->fd = -1;
 
-		free(serialDevice[reader].device);
-		serialDevice[reader].device = NULL;
+		free(serialDevice[reader]->device);
+		serialDevice[reader]->device = NULL;
 	}
 
 	return STATUS_SUCCESS;
@@ -828,7 +1097,18 @@ status_t CloseSerial(unsigned int reader_index)
  ****************************************************************************/
 _ccid_descriptor *get_ccid_descriptor(unsigned int reader_index)
 {
-	return &serialDevice[reader_index].ccid;
+	return &serialDevice[reader_index]->ccid;
 } /* get_ccid_descriptor */
 
 
+/*****************************************************************************
+ *
+ *					get_transfer_stats
+ *
+ ****************************************************************************/
+ccid_transfer_stats *get_transfer_stats(unsigned int reader_index)
+{
+	return serialDevice[reader_index]->stats;
+} /* get_transfer_stats */
+
+
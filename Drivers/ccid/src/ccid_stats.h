@@ -0,0 +1,74 @@
+/*
+    ccid_stats.h: transfer statistics of a reader
+    Copyright (C) 2009   Ludovic Rousseau
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * $Id$
+ */
+
+#ifndef __CCID_STATS_H__
+#define __CCID_STATS_H__
+
+/*
+ * Transfer statistics of a reader, returned by
+ * IOCTL_SMARTCARD_VENDOR_TRANSFER_STATS
+ *
+ * This header is installed for the applications using SCardControl().
+ * SCARD_CTL_CODE() is defined by <reader.h> of pcsc-lite.
+ *
+ * The counters are shared by all the slots of a reader and are never
+ * reset: the caller computes the differences between two calls.
+ * write/read are the bulk out/bulk in endpoints of a USB reader, or
+ * the frames sent and received by a serial reader.
+ *
+ * The time histograms count the transfers by duration: bucket 0 is
+ * less than 64 us, bucket i (i>0) is from 64*2^(i-1) to 64*2^i us and
+ * the last bucket is everything longer. The time of a read includes
+ * the processing time of the card.
+ */
+#define IOCTL_SMARTCARD_VENDOR_TRANSFER_STATS	SCARD_CTL_CODE(2)
+
+#define CCID_TRANSFER_STATS_VERSION 1
+#define CCID_TRANSFER_STATS_BUCKETS 16
+
+typedef struct
+{
+	unsigned int version;	/* CCID_TRANSFER_STATS_VERSION */
+
+	unsigned int write_transfers;
+	unsigned int write_bytes;
+	unsigned int write_errors;
+	unsigned int write_timeouts;
+
+	unsigned int read_transfers;
+	unsigned int read_bytes;
+	unsigned int read_errors;
+	unsigned int read_timeouts;
+	unsigned int read_retries;	/* duplicate USB frames, serial NAK */
+
+	unsigned int interrupt_transfers;
+	unsigned int interrupt_errors;
+
+	unsigned int stalls;	/* endpoint halted (EPIPE) */
+
+	unsigned int write_time[CCID_TRANSFER_STATS_BUCKETS];
+	unsigned int read_time[CCID_TRANSFER_STATS_BUCKETS];
+} ccid_transfer_stats;
+
+#endif
+
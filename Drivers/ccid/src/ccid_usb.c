@@ -24,6 +24,7 @@
 #define __CCID_USB__
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 # ifdef S_SPLINT_S
@@ -74,6 +75,10 @@ typedef struct
 	int real_nb_opened_slots;
 	int *nb_opened_slots;
 
+	/* transfer statistics shared by all the slots of the device */
+	ccid_transfer_stats real_stats;
+	ccid_transfer_stats *stats;
+
 	/*
 	 * CCID infos common to USB and serial
 	 */
@@ -85,12 +90,17 @@ typedef struct
 #include "ccid_usb.h"
 
 static int get_end_points(struct usb_device *dev, _usbDevice *usbdevice, int num);
+static void count_error(ccid_transfer_stats *stats, unsigned int *errors,
+	unsigned int *timeouts);
 int ccid_check_firmware(struct usb_device *dev);
 static unsigned int *get_data_rates(unsigned int reader_index,
 	struct usb_device *dev, int num);
 
-/* ne need to initialize to 0 since it is static */
-static _usbDevice usbDevice[CCID_DRIVER_MAX_READERS];
+/* allocated the first time a reader_index is used and kept for the next
+ * reader using the same index since the other slots of a multi-slot
+ * reader point to the shared fields of the first slot */
+static _usbDevice **usbDevice = NULL;
+static int usbDeviceSize = 0;
 
 #define PCSCLITE_MANUKEY_NAME                   "ifdVendorID"
 #define PCSCLITE_PRODKEY_NAME                   "ifdProductID"
@@ -261,8 +271,32 @@ status_t OpenUSBByName(unsigned int reader_index, /*@null@*/ char *device)
 		return STATUS_UNSUCCESSFUL;
 	}
 
+	if ((int)reader_index >= usbDeviceSize)
+	{
+		_usbDevice **devices;
+
+		devices = (_usbDevice **)GrowReaderArray((void **)usbDevice,
+			&usbDeviceSize, reader_index);
+		if (NULL == devices)
+		{
+			DEBUG_CRITICAL("Not enough memory");
+			return STATUS_UNSUCCESSFUL;
+		}
+		usbDevice = devices;
+	}
+
+	if (NULL == usbDevice[reader_index])
+	{
+		usbDevice[reader_index] = calloc(1, sizeof(_usbDevice));
+		if (NULL == usbDevice[reader_index])
+		{
+			DEBUG_CRITICAL("Not enough memory");
+			return STATUS_UNSUCCESSFUL;
+		}
+	}
+
 	/* is the reader_index already used? */
-	if (usbDevice[reader_index].handle != NULL)
+	if (usbDevice[reader_index]->handle != NULL)
 	{
 		DEBUG_CRITICAL2("USB driver with index %X already in use",
 			reader_index);
@@ -375,12 +409,12 @@ status_t OpenUSBByName(unsigned int reader_index, /*@null@*/ char *device)
 
 					DEBUG_COMM3("Checking device: %s/%s",
 						bus->dirname, dev->filename);
-					for (r=0; r<CCID_DRIVER_MAX_READERS; r++)
+					for (r=0; r<usbDeviceSize; r++)
 					{
-						if (usbDevice[r].handle)
+						if (usbDevice[r] && usbDevice[r]->handle)
 						{
 							/* same busname, same filename */
-							if (strcmp(usbDevice[r].dirname, bus->dirname) == 0 && strcmp(usbDevice[r].filename, dev->filename) == 0)
+							if (strcmp(usbDevice[r]->dirname, bus->dirname) == 0 && strcmp(usbDevice[r]->filename, dev->filename) == 0)
 								already_used = TRUE;
 						}
 					}
@@ -389,28 +423,28 @@ status_t OpenUSBByName(unsigned int reader_index, /*@null@*/ char *device)
 					if (already_used)
 					{
 						if ((previous_reader_index != -1)
-							&& usbDevice[previous_reader_index].handle
-							&& (strcmp(usbDevice[previous_reader_index].dirname, bus->dirname)  == 0)
-							&& (strcmp(usbDevice[previous_reader_index].filename, dev->filename) == 0)
-							&& usbDevice[previous_reader_index].ccid.bCurrentSlotIndex < usbDevice[previous_reader_index].ccid.bMaxSlotIndex)
+							&& usbDevice[previous_reader_index]->handle
+							&& (strcmp(usbDevice[previous_reader_index]->dirname, bus->dirname)  == 0)
+							&& (strcmp(usbDevice[previous_reader_index]->filename, dev->filename) == 0)
+							&& usbDevice[previous_reader_index]->ccid.bCurrentSlotIndex < usbDevice[previous_reader_index]->ccid.bMaxSlotIndex)
 						{
 							/* we reuse the same device
 							 * and the reader is multi-slot */
-							usbDevice[reader_index] = usbDevice[previous_reader_index];
+							*usbDevice[reader_index] = *usbDevice[previous_reader_index];
 							/* the other slots do not have the same data rates */
-							if ((GEMCOREPOSPRO == usbDevice[reader_index].ccid.readerID)
-								|| (GEMCORESIMPRO == usbDevice[reader_index].ccid.readerID))
+							if ((GEMCOREPOSPRO == usbDevice[reader_index]->ccid.readerID)
+								|| (GEMCORESIMPRO == usbDevice[reader_index]->ccid.readerID))
 							{
-								usbDevice[reader_index].ccid.arrayOfSupportedDataRates = SerialCustomDataRates;
-								usbDevice[reader_index].ccid.dwMaxDataRate = 125000;
+								usbDevice[reader_index]->ccid.arrayOfSupportedDataRates = SerialCustomDataRates;
+								usbDevice[reader_index]->ccid.dwMaxDataRate = 125000;
 							}
 
-							*usbDevice[reader_index].nb_opened_slots += 1;
-							usbDevice[reader_index].ccid.bCurrentSlotIndex++;
-							usbDevice[reader_index].ccid.dwSlotStatus =
+							*usbDevice[reader_index]->nb_opened_slots += 1;
+							usbDevice[reader_index]->ccid.bCurrentSlotIndex++;
+							usbDevice[reader_index]->ccid.dwSlotStatus =
 								IFD_ICC_PRESENT;
 							DEBUG_INFO2("Opening slot: %d",
-								usbDevice[reader_index].ccid.bCurrentSlotIndex);
+								usbDevice[reader_index]->ccid.bCurrentSlotIndex);
 							goto end;
 						}
 						else
@@ -513,46 +547,55 @@ again:
 #endif
 
 					/* Get Endpoints values*/
-					(void)get_end_points(dev, &usbDevice[reader_index], num);
+					(void)get_end_points(dev, usbDevice[reader_index], num);
 
 					/* store device information */
-					usbDevice[reader_index].handle = dev_handle;
-					usbDevice[reader_index].dirname = strdup(bus->dirname);
-					usbDevice[reader_index].filename = strdup(dev->filename);
-					usbDevice[reader_index].interface = interface;
-					usbDevice[reader_index].real_nb_opened_slots = 1;
-					usbDevice[reader_index].nb_opened_slots = &usbDevice[reader_index].real_nb_opened_slots;
+					usbDevice[reader_index]->handle = dev_handle;
+					usbDevice[reader_index]->dirname = strdup(bus->dirname);
+					usbDevice[reader_index]->filename = strdup(dev->filename);
+					usbDevice[reader_index]->interface = interface;
+					usbDevice[reader_index]->real_nb_opened_slots = 1;
+					usbDevice[reader_index]->nb_opened_slots = &usbDevice[reader_index]->real_nb_opened_slots;
+					memset(&usbDevice[reader_index]->real_stats, 0,
+						sizeof(usbDevice[reader_index]->real_stats));
+					usbDevice[reader_index]->real_stats.version =
+						CCID_TRANSFER_STATS_VERSION;
+					usbDevice[reader_index]->stats = &usbDevice[reader_index]->real_stats;
 
 					/* CCID common informations */
-					usbDevice[reader_index].ccid.real_bSeq = 0;
-					usbDevice[reader_index].ccid.pbSeq = &usbDevice[reader_index].ccid.real_bSeq;
-					usbDevice[reader_index].ccid.readerID =
+					usbDevice[reader_index]->ccid.real_bSeq = 0;
+					usbDevice[reader_index]->ccid.pbSeq = &usbDevice[reader_index]->ccid.real_bSeq;
+					usbDevice[reader_index]->ccid.readerID =
 						(dev->descriptor.idVendor << 16) +
 						dev->descriptor.idProduct;
-					usbDevice[reader_index].ccid.dwFeatures = dw2i(usb_interface->altsetting->extra, 40);
-					usbDevice[reader_index].ccid.wLcdLayout =
+					usbDevice[reader_index]->ccid.dwFeatures = dw2i(usb_interface->altsetting->extra, 40);
+					usbDevice[reader_index]->ccid.wLcdLayout =
 						(usb_interface->altsetting->extra[51] << 8) +
 						usb_interface->altsetting->extra[50];
-					usbDevice[reader_index].ccid.bPINSupport = usb_interface->altsetting->extra[52];
-					usbDevice[reader_index].ccid.dwMaxCCIDMessageLength = dw2i(usb_interface->altsetting->extra, 44);
-					usbDevice[reader_index].ccid.dwMaxIFSD = dw2i(usb_interface->altsetting->extra, 28);
-					usbDevice[reader_index].ccid.dwDefaultClock = dw2i(usb_interface->altsetting->extra, 10);
-					usbDevice[reader_index].ccid.dwMaxDataRate = dw2i(usb_interface->altsetting->extra, 23);
-					usbDevice[reader_index].ccid.bMaxSlotIndex = usb_interface->altsetting->extra[4];
-					usbDevice[reader_index].ccid.bCurrentSlotIndex = 0;
-					usbDevice[reader_index].ccid.readTimeout = DEFAULT_COM_READ_TIMEOUT;
-					usbDevice[reader_index].ccid.arrayOfSupportedDataRates = get_data_rates(reader_index, dev, num);
-					usbDevice[reader_index].ccid.bInterfaceProtocol = usb_interface->altsetting->bInterfaceProtocol;
-					usbDevice[reader_index].ccid.bNumEndpoints = usb_interface->altsetting->bNumEndpoints;
-					usbDevice[reader_index].ccid.dwSlotStatus = IFD_ICC_PRESENT;
-					usbDevice[reader_index].ccid.bVoltageSupport = usb_interface->altsetting->extra[5];
+					usbDevice[reader_index]->ccid.bPINSupport = usb_interface->altsetting->extra[52];
+					usbDevice[reader_index]->ccid.dwMaxCCIDMessageLength = dw2i(usb_interface->altsetting->extra, 44);
+					usbDevice[reader_index]->ccid.dwMaxIFSD = dw2i(usb_interface->altsetting->extra, 28);
+					usbDevice[reader_index]->ccid.dwDefaultClock = dw2i(usb_interface->altsetting->extra, 10);
+					usbDevice[reader_index]->ccid.dwMaxDataRate = dw2i(usb_interface->altsetting->extra, 23);
+					usbDevice[reader_index]->ccid.bMaxSlotIndex = usb_interface->altsetting->extra[4];
+					usbDevice[reader_index]->ccid.bCurrentSlotIndex = 0;
+					usbDevice[reader_index]->ccid.readTimeout = DEFAULT_COM_READ_TIMEOUT;
+					usbDevice[reader_index]->ccid.readTimeoutMs = 0;
+					usbDevice[reader_index]->ccid.responseSamples = 0;
+					usbDevice[reader_index]->ccid.adaptiveExchange = FALSE;
+					usbDevice[reader_index]->ccid.lateAnswer = FALSE;
+					usbDevice[reader_index]->ccid.arrayOfSupportedDataRates = get_data_rates(reader_index, dev, num);
+					usbDevice[reader_index]->ccid.bInterfaceProtocol = usb_interface->altsetting->bInterfaceProtocol;
+					usbDevice[reader_index]->ccid.bNumEndpoints = usb_interface->altsetting->bNumEndpoints;
+					usbDevice[reader_index]->ccid.dwSlotStatus = IFD_ICC_PRESENT;
+					usbDevice[reader_index]->ccid.bVoltageSupport = usb_interface->altsetting->extra[5];
 					goto end;
 				}
 			}
 		}
 	}
 end:
-	if (usbDevice[reader_index].handle == NULL)
+	if (usbDevice[reader_index]->handle == NULL)
 		return STATUS_NO_SUCH_DEVICE;
 
 	/* memorise the current reader_index so we can detect
@@ -573,20 +616,28 @@ status_t WriteUSB(unsigned int reader_index, unsigned int length,
 {
 	int rv;
 	char debug_header[] = "-> 121234 ";
+	ccid_transfer_stats *stats = usbDevice[reader_index]->stats;
+	struct timeval start;
 
 	(void)snprintf(debug_header, sizeof(debug_header), "-> %06X ",
 		(int)reader_index);
 
 	DEBUG_XXD(debug_header, buffer, length);
 
-	rv = usb_bulk_write(usbDevice[reader_index].handle,
-		usbDevice[reader_index].bulk_out, (char *)buffer, length,
+	(void)gettimeofday(&start, NULL);
+	rv = usb_bulk_write(usbDevice[reader_index]->handle,
+		usbDevice[reader_index]->bulk_out, (char *)buffer, length,
 		USB_WRITE_TIMEOUT);
 
+	stats->write_transfers++;
+	StatsAddTime(stats->write_time, &start);
+
 	if (rv < 0)
 	{
+		count_error(stats, &stats->write_errors, &stats->write_timeouts);
+
 		DEBUG_CRITICAL4("usb_bulk_write(%s/%s): %s",
-			usbDevice[reader_index].dirname, usbDevice[reader_index].filename,
+			usbDevice[reader_index]->dirname, usbDevice[reader_index]->filename,
 			strerror(errno));
 
 		if (ENODEV == errno)
@@ -595,6 +646,8 @@ status_t WriteUSB(unsigned int reader_index, unsigned int length,
 		return STATUS_UNSUCCESSFUL;
 	}
 
+	stats->write_bytes += rv;
+
 	return STATUS_SUCCESS;
 } /* WriteUSB */
 
@@ -611,20 +664,28 @@ status_t ReadUSB(unsigned int reader_index, unsigned int * length,
 	char debug_header[] = "<- 121234 ";
 	_ccid_descriptor *ccid_descriptor = get_ccid_descriptor(reader_index);
 	int duplicate_frame = 0;
+	ccid_transfer_stats *stats = usbDevice[reader_index]->stats;
+	struct timeval start;
 
 read_again:
 	(void)snprintf(debug_header, sizeof(debug_header), "<- %06X ",
 		(int)reader_index);
 
-	rv = usb_bulk_read(usbDevice[reader_index].handle,
-		usbDevice[reader_index].bulk_in, (char *)buffer, *length,
-		usbDevice[reader_index].ccid.readTimeout * 1000);
+	(void)gettimeofday(&start, NULL);
+	rv = usb_bulk_read(usbDevice[reader_index]->handle,
+		usbDevice[reader_index]->bulk_in, (char *)buffer, *length,
+		READ_TIMEOUT_MS(ccid_descriptor));
+
+	stats->read_transfers++;
+	StatsAddTime(stats->read_time, &start);
 
 	if (rv < 0)
 	{
 		*length = 0;
+		count_error(stats, &stats->read_errors, &stats->read_timeouts);
+
 		DEBUG_CRITICAL4("usb_bulk_read(%s/%s): %s",
-			usbDevice[reader_index].dirname, usbDevice[reader_index].filename,
+			usbDevice[reader_index]->dirname, usbDevice[reader_index]->filename,
 			strerror(errno));
 
 		if (ENODEV == errno)
@@ -634,6 +695,7 @@ read_again:
 	}
 
 	*length = rv;
+	stats->read_bytes += rv;
 
 	DEBUG_XXD(debug_header, buffer, *length);
 
@@ -648,6 +710,7 @@ read_again:
 			return STATUS_UNSUCCESSFUL;
 		}
 		DEBUG_INFO("Duplicate frame detected");
+		stats->read_retries++;
 		goto read_again;
 	}
 
@@ -663,45 +726,47 @@ read_again:
 status_t CloseUSB(unsigned int reader_index)
 {
 	/* device not opened */
-	if (usbDevice[reader_index].handle == NULL)
+	if (((int)reader_index >= usbDeviceSize)
+		|| (NULL == usbDevice[reader_index])
+		|| (usbDevice[reader_index]->handle == NULL))
 		return STATUS_UNSUCCESSFUL;
 
 	DEBUG_COMM3("Closing USB device: %s/%s",
-		usbDevice[reader_index].dirname,
-		usbDevice[reader_index].filename);
+		usbDevice[reader_index]->dirname,
+		usbDevice[reader_index]->filename);
 
-	if (usbDevice[reader_index].ccid.arrayOfSupportedDataRates
-		&& (usbDevice[reader_index].ccid.bCurrentSlotIndex == 0))
+	if (usbDevice[reader_index]->ccid.arrayOfSupportedDataRates
+		&& (usbDevice[reader_index]->ccid.bCurrentSlotIndex == 0))
 	{
-		free(usbDevice[reader_index].ccid.arrayOfSupportedDataRates);
-		usbDevice[reader_index].ccid.arrayOfSupportedDataRates = NULL;
+		free(usbDevice[reader_index]->ccid.arrayOfSupportedDataRates);
+		usbDevice[reader_index]->ccid.arrayOfSupportedDataRates = NULL;
 	}
 
 	/* one slot closed */
-	(*usbDevice[reader_index].nb_opened_slots)--;
+	(*usbDevice[reader_index]->nb_opened_slots)--;
 
 	/* release the allocated ressources for the last slot only */
-	if (0 == *usbDevice[reader_index].nb_opened_slots)
+	if (0 == *usbDevice[reader_index]->nb_opened_slots)
 	{
 		DEBUG_COMM("Last slot closed. Release resources");
 
 		/* reset so that bSeq starts at 0 again */
 		if (DriverOptions & DRIVER_OPTION_RESET_ON_CLOSE)
-			(void)usb_reset(usbDevice[reader_index].handle);
+			(void)usb_reset(usbDevice[reader_index]->handle);
 
-		(void)usb_release_interface(usbDevice[reader_index].handle,
-			usbDevice[reader_index].interface);
-		(void)usb_close(usbDevice[reader_index].handle);
+		(void)usb_release_interface(usbDevice[reader_index]->handle,
+			usbDevice[reader_index]->interface);
+		(void)usb_close(usbDevice[reader_index]->handle);
 
-		free(usbDevice[reader_index].dirname);
-		free(usbDevice[reader_index].filename);
+		free(usbDevice[reader_index]->dirname);
+		free(usbDevice[reader_index]->filename);
 	}
 
 	/* mark the resource unused */
-	usbDevice[reader_index].handle = NULL;
-	usbDevice[reader_index].dirname = NULL;
-	usbDevice[reader_index].filename = NULL;
-	usbDevice[reader_index].interface = 0;
+	usbDevice[reader_index]->handle = NULL;
+	usbDevice[reader_index]->dirname = NULL;
+	usbDevice[reader_index]->filename = NULL;
+	usbDevice[reader_index]->interface = 0;
 
 	return STATUS_SUCCESS;
 } /* CloseUSB */
@@ -714,10 +779,40 @@ status_t CloseUSB(unsigned int reader_index)
  ****************************************************************************/
 _ccid_descriptor *get_ccid_descriptor(unsigned int reader_index)
 {
-	return &usbDevice[reader_index].ccid;
+	return &usbDevice[reader_index]->ccid;
 } /* get_ccid_descriptor */
 
 
+/*****************************************************************************
+ *
+ *					get_transfer_stats
+ *
+ ****************************************************************************/
+ccid_transfer_stats *get_transfer_stats(unsigned int reader_index)
+{
+	return usbDevice[reader_index]->stats;
+} /* get_transfer_stats */
+
+
+/*****************************************************************************
+ *
+ *					count_error: count a failed transfer
+ *
+ ****************************************************************************/
+static void count_error(ccid_transfer_stats *stats, unsigned int *errors,
+	unsigned int *timeouts)
+{
+	/* libusb reports a timeout with ETIMEDOUT, or EAGAIN on some systems */
+	if ((ETIMEDOUT == errno) || (EAGAIN == errno))
+		(*timeouts)++;
+	else
+		(*errors)++;
+
+	if (EPIPE == errno)
+		stats->stalls++;
+} /* count_error */
+
+
 /*****************************************************************************
  *
  *					get_end_points
@@ -945,9 +1040,9 @@ int ControlUSB(int reader_index, int requesttype, int request, int value,
 	if (0 == (requesttype & 0x80))
 		DEBUG_XXD("send: ", bytes, size);
 
-	ret = usb_control_msg(usbDevice[reader_index].handle, requesttype,
-		request, value, usbDevice[reader_index].interface, (char *)bytes, size,
-		usbDevice[reader_index].ccid.readTimeout * 1000);
+	ret = usb_control_msg(usbDevice[reader_index]->handle, requesttype,
+		request, value, usbDevice[reader_index]->interface, (char *)bytes, size,
+		usbDevice[reader_index]->ccid.readTimeout * 1000);
 
 	if (requesttype & 0x80)
 		DEBUG_XXD("receive: ", bytes, ret);
@@ -966,20 +1061,29 @@ int InterruptRead(int reader_index, int timeout /* in ms */)
 	char buffer[8];
 
 	DEBUG_PERIODIC2("before (%d)", reader_index);
-	ret = usb_interrupt_read(usbDevice[reader_index].handle,
-		usbDevice[reader_index].interrupt, buffer, sizeof(buffer), timeout);
+	ret = usb_interrupt_read(usbDevice[reader_index]->handle,
+		usbDevice[reader_index]->interrupt, buffer, sizeof(buffer), timeout);
 	DEBUG_PERIODIC3("after (%d) (%s)", reader_index, usb_strerror());
 
 	if (ret < 0)
 	{
 		/* if usb_interrupt_read() times out we get EILSEQ or EAGAIN */
 		if ((errno != EILSEQ) && (errno != EAGAIN) && (errno != ENODEV) && (errno != 0))
+		{
 			DEBUG_COMM4("usb_interrupt_read(%s/%s): %s",
-					usbDevice[reader_index].dirname,
-					usbDevice[reader_index].filename, strerror(errno));
+					usbDevice[reader_index]->dirname,
+					usbDevice[reader_index]->filename, strerror(errno));
+
+			/* the polling timeouts are not errors */
+			if (errno != ETIMEDOUT)
+				usbDevice[reader_index]->stats->interrupt_errors++;
+		}
 	}
 	else
+	{
 		DEBUG_XXD("NotifySlotChange: ", buffer, ret);
+		usbDevice[reader_index]->stats->interrupt_transfers++;
+	}
 
 	return ret;
 } /* InterruptRead */
@@ -24,6 +24,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <sys/time.h>
 #include <pcsclite.h>
 #include <ifdhandler.h>
 #include <reader.h>
@@ -37,6 +38,7 @@
 #include "config.h"
 #include "debug.h"
 #include "ccid_usb.h"
+#include "utils.h"
 
 /* All the pinpad readers I used are more or less bogus
  * I use code to change the user command and make the firmware happy */
@@ -70,6 +72,11 @@ static RESPONSECODE CmdXfrBlockTPDU_T1(unsigned int reader_index,
 
 static void i2dw(int value, unsigned char *buffer);
 
+static unsigned int adaptive_timeout(const _ccid_descriptor *ccid_descriptor);
+
+static void adaptive_timeout_update(_ccid_descriptor *ccid_descriptor,
+	const struct timeval *start);
+
 
 /*****************************************************************************
  *
@@ -1046,6 +1053,11 @@ RESPONSECODE CmdXfrBlock(unsigned int reader_index, unsigned int tx_length,
 	RESPONSECODE return_value = IFD_SUCCESS;
 	_ccid_descriptor *ccid_descriptor = get_ccid_descriptor(reader_index);
 
+	/* use a timeout based on the card response times for the APDU
+	 * exchanges only */
+	ccid_descriptor->adaptiveExchange =
+		DriverOptions & DRIVER_OPTION_ADAPTIVE_TIMEOUT;
+
 	/* APDU or TPDU? */
 	switch (ccid_descriptor->dwFeatures & CCID_CLASS_EXCHANGE_MASK)
 	{
@@ -1087,6 +1099,8 @@ RESPONSECODE CmdXfrBlock(unsigned int reader_index, unsigned int tx_length,
 			return_value = IFD_COMMUNICATION_ERROR;
 	}
 
+	ccid_descriptor->adaptiveExchange = FALSE;
+
 	return return_value;
 } /* CmdXfrBlock */
 
@@ -1150,6 +1164,7 @@ RESPONSECODE CCID_Transmit(unsigned int reader_index, unsigned int tx_length,
 	cmd[5] = ccid_descriptor->bCurrentSlotIndex;	/* slot number */
 	cmd[6] = (*ccid_descriptor->pbSeq)++;
 	cmd[7] = bBWI;	/* extend block waiting timeout */
+	ccid_descriptor->bBWI = bBWI;
 	cmd[8] = rx_length & 0xFF;	/* Expected length, in character mode only */
 	cmd[9] = (rx_length >> 8) & 0xFF;
 
@@ -1184,10 +1199,12 @@ RESPONSECODE CCID_Receive(unsigned int reader_index, unsigned int *rx_length,
 	unsigned int length;
 	RESPONSECODE return_value = IFD_SUCCESS;
 	status_t ret;
-
-#ifndef TWIN_SERIAL
 	_ccid_descriptor *ccid_descriptor = get_ccid_descriptor(reader_index);
+	struct timeval start;
+	unsigned int timeout, timeouts;
+	int time_extension = FALSE;
 
+#ifndef TWIN_SERIAL
 	if (ICCD_A == ccid_descriptor->bInterfaceProtocol)
 	{
 		int r;
@@ -1296,9 +1313,47 @@ time_request_ICCD_B:
 	}
 #endif
 
+	(void)gettimeofday(&start, NULL);
+
 time_request:
+	/* do not wait for a dead card longer than it usually takes to answer.
+	 * A card asking for more time (bBWI or time extension) gets the
+	 * normal timeout */
+	timeout = 0;
+	if (ccid_descriptor->adaptiveExchange && !time_extension
+		&& (ccid_descriptor->bBWI <= 1))
+	{
+		if (ccid_descriptor->responseSamples >= ADAPTIVE_TIMEOUT_SAMPLES)
+			timeout = adaptive_timeout(ccid_descriptor);
+		else
+			timeout = ccid_descriptor->readTimeout * 1000;
+		ccid_descriptor->readTimeoutMs = timeout;
+	}
+
 	length = sizeof(cmd);
+	timeouts = get_transfer_stats(reader_index)->read_timeouts;
 	ret = ReadPort(reader_index, &length, cmd);
+
+	if (timeout)
+	{
+		/* the serial transport clears readTimeoutMs if the card asked
+		 * for more time */
+		if (0 == ccid_descriptor->readTimeoutMs)
+			time_extension = TRUE;
+		else
+			/* only a timeout, not a NAK or another error */
+			if ((ret != STATUS_SUCCESS)
+				&& (timeouts != get_transfer_stats(reader_index)->read_timeouts)
+				&& (timeout < ccid_descriptor->readTimeout * 1000))
+			{
+				DEBUG_INFO2("adaptive timeout expired (%d ms)", timeout);
+
+				/* the answer may still come later */
+				ccid_descriptor->lateAnswer = TRUE;
+			}
+		ccid_descriptor->readTimeoutMs = 0;
+	}
+
 	if (ret != STATUS_SUCCESS)
 	{
 		if (STATUS_NO_SUCH_DEVICE == ret)
@@ -1306,6 +1361,9 @@ time_request:
 		return IFD_COMMUNICATION_ERROR;
 	}
 
+	/* the answer arrived in time, nothing is left to discard */
+	ccid_descriptor->lateAnswer = FALSE;
+
 	if (length < STATUS_OFFSET+1)
 	{
 		DEBUG_CRITICAL2("Not enough data received: %d bytes", length);
@@ -1344,9 +1402,15 @@ time_request:
 	if (cmd[STATUS_OFFSET] & CCID_TIME_EXTENSION)
 	{
 		DEBUG_COMM2("Time extension requested: 0x%02X", cmd[ERROR_OFFSET]);
+		time_extension = TRUE;
 		goto time_request;
 	}
 
+	/* a long operation of the card is not a normal response time */
+	if (ccid_descriptor->adaptiveExchange && !time_extension
+		&& (ccid_descriptor->bBWI <= 1))
+		adaptive_timeout_update(ccid_descriptor, &start);
+
 	/* we have read less (or more) data than the CCID frame says to contain */
 	if (length-10 != dw2i(cmd, 1))
 	{
@@ -1383,6 +1447,66 @@ time_request:
 } /* CCID_Receive */
 
 
+/*****************************************************************************
+ *
+ *					adaptive_timeout
+ *
+ ****************************************************************************/
+static unsigned int adaptive_timeout(const _ccid_descriptor *ccid_descriptor)
+{
+	unsigned int timeout;
+
+	/* smoothed response time + 4 * mean deviation, like the TCP RTO */
+	timeout = ccid_descriptor->responseTime / 8
+		+ ccid_descriptor->responseTimeDev;
+
+	if (timeout < ADAPTIVE_TIMEOUT_MIN)
+		timeout = ADAPTIVE_TIMEOUT_MIN;
+
+	/* never more than the normal timeout */
+	if (timeout > ccid_descriptor->readTimeout * 1000)
+		timeout = ccid_descriptor->readTimeout * 1000;
+
+	return timeout;
+} /* adaptive_timeout */
+
+
+/*****************************************************************************
+ *
+ *					adaptive_timeout_update
+ *
+ ****************************************************************************/
+static void adaptive_timeout_update(_ccid_descriptor *ccid_descriptor,
+	const struct timeval *start)
+{
+	struct timeval now;
+	int elapsed, err;
+
+	(void)gettimeofday(&now, NULL);
+	elapsed = (now.tv_sec - start->tv_sec) * 1000
+		+ (now.tv_usec - start->tv_usec) / 1000;
+
+	/* responseTime is scaled by 8 and responseTimeDev by 4 */
+	if (0 == ccid_descriptor->responseSamples)
+	{
+		ccid_descriptor->responseTime = elapsed * 8;
+		ccid_descriptor->responseTimeDev = elapsed * 2;
+	}
+	else
+	{
+		err = elapsed - ccid_descriptor->responseTime / 8;
+		ccid_descriptor->responseTime += err;
+		if (err < 0)
+			err = -err;
+		ccid_descriptor->responseTimeDev += err
+			- ccid_descriptor->responseTimeDev / 4;
+	}
+
+	if (ccid_descriptor->responseSamples < ADAPTIVE_TIMEOUT_SAMPLES)
+		ccid_descriptor->responseSamples++;
+} /* adaptive_timeout_update */
+
+
 /*****************************************************************************
  *
  *					CmdXfrBlockAPDU_extended
@@ -43,8 +43,11 @@
 #include <pthread.h>
 #endif
 
-/* Array of structures to hold the ATR and other state value of each slot */
-static CcidDesc CcidSlots[CCID_DRIVER_MAX_READERS];
+/* Array of structures to hold the ATR and other state value of each slot
+ * A slot is allocated when its reader_index is used for the first time
+ * and the array grows with the number of readers */
+static CcidDesc **CcidSlots = NULL;
+static int CcidSlotsSize = 0;
 
 /* global mutex */
 #ifdef HAVE_PTHREAD
@@ -62,6 +65,8 @@ static RESPONSECODE IFDHPolling(DWORD Lun);
 static RESPONSECODE IFDHSleep(DWORD Lun);
 #endif
 static void init_driver(void);
+static int new_reader_index(DWORD Lun, const char *readerName);
+static RESPONSECODE warm_up_reader(DWORD Lun, int reader_index);
 static void extra_egt(ATR_t *atr, _ccid_descriptor *ccid_desc, DWORD Protocol);
 static char find_baud_rate(unsigned int baudrate, unsigned int *list);
 static unsigned int T0_card_timeout(double f, double d, int TC1, int TC2,
@@ -81,65 +86,39 @@ EXTERNAL RESPONSECODE IFDHCreateChannelByName(DWORD Lun, LPSTR lpcDevice)
 
 	DEBUG_INFO3("lun: %X, device: %s", Lun, lpcDevice);
 
-	if (-1 == (reader_index = GetNewReaderIndex(Lun)))
-		return IFD_COMMUNICATION_ERROR;
-
-	/* Reset ATR buffer */
-	CcidSlots[reader_index].nATRLength = 0;
-	*CcidSlots[reader_index].pcATRBuffer = '\0';
-
-	/* Reset PowerFlags */
-	CcidSlots[reader_index].bPowerFlags = POWERFLAGS_RAZ;
-
-	/* reader name */
-	CcidSlots[reader_index].readerName = strdup(lpcDevice);
-
+	/* the global mutex only protects the reader tables and the bus scan.
+	 * The slow initialisation of the reader is done without it so that
+	 * it does not block the other readers */
 #ifdef HAVE_PTHREAD
 	(void)pthread_mutex_lock(&ifdh_context_mutex);
 #endif
 
-	ret = OpenPortByName(reader_index, lpcDevice);
-	if (ret != STATUS_SUCCESS)
-	{
-		DEBUG_CRITICAL("failed");
-		if (STATUS_NO_SUCH_DEVICE == ret)
-			return_value = IFD_NO_SUCH_DEVICE;
-		else
-			return_value = IFD_COMMUNICATION_ERROR;
-
-		/* release the allocated reader_index */
-		ReleaseReaderIndex(reader_index);
-	}
+	reader_index = new_reader_index(Lun, lpcDevice);
+	if (-1 == reader_index)
+		return_value = IFD_COMMUNICATION_ERROR;
 	else
 	{
-		/* Maybe we have a special treatment for this reader */
-		(void)ccid_open_hack_pre(reader_index);
-
-		/* Try to access the reader */
-		/* This "warm up" sequence is sometimes needed when pcscd is
-		 * restarted with the reader already connected. We get some
-		 * "usb_bulk_read: Resource temporarily unavailable" on the first
-		 * few tries. It is an empirical hack */
-		if ((IFD_COMMUNICATION_ERROR == IFDHICCPresence(Lun))
-			&& (IFD_COMMUNICATION_ERROR == IFDHICCPresence(Lun))
-			&& (IFD_COMMUNICATION_ERROR == IFDHICCPresence(Lun)))
+		ret = OpenPortByName(reader_index, lpcDevice);
+		if (ret != STATUS_SUCCESS)
 		{
 			DEBUG_CRITICAL("failed");
-			return_value = IFD_COMMUNICATION_ERROR;
+			if (STATUS_NO_SUCH_DEVICE == ret)
+				return_value = IFD_NO_SUCH_DEVICE;
+			else
+				return_value = IFD_COMMUNICATION_ERROR;
 
-			/* release the allocated resources */
-			(void)ClosePort(reader_index);
+			/* release the allocated reader_index */
 			ReleaseReaderIndex(reader_index);
 		}
-		else 
-			/* Maybe we have a special treatment for this reader */
-			(void)ccid_open_hack_post(reader_index);
 	}
 
 #ifdef HAVE_PTHREAD
 	(void)pthread_mutex_unlock(&ifdh_context_mutex);
 #endif
 
+	if (IFD_SUCCESS == return_value)
+		return_value = warm_up_reader(Lun, reader_index);
+
 	return return_value;
 } /* IFDHCreateChannelByName */
 
@@ -187,61 +166,30 @@ EXTERNAL RESPONSECODE IFDHCreateChannel(DWORD Lun, DWORD Channel)
 
 	DEBUG_INFO2("lun: %X", Lun);
 
-	if (-1 == (reader_index = GetNewReaderIndex(Lun)))
-		return IFD_COMMUNICATION_ERROR;
-
-	/* Reset ATR buffer */
-	CcidSlots[reader_index].nATRLength = 0;
-	*CcidSlots[reader_index].pcATRBuffer = '\0';
-
-	/* Reset PowerFlags */
-	CcidSlots[reader_index].bPowerFlags = POWERFLAGS_RAZ;
-
-	/* reader name */
-	CcidSlots[reader_index].readerName = strdup("no name");
-
 #ifdef HAVE_PTHREAD
 	(void)pthread_mutex_lock(&ifdh_context_mutex);
 #endif
 
-	if (OpenPort(reader_index, Channel) != STATUS_SUCCESS)
-	{
-		DEBUG_CRITICAL("failed");
+	reader_index = new_reader_index(Lun, "no name");
+	if (-1 == reader_index)
 		return_value = IFD_COMMUNICATION_ERROR;
-
-		/* release the allocated reader_index */
-		ReleaseReaderIndex(reader_index);
-	}
 	else
-	{
-		/* Maybe we have a special treatment for this reader */
-		(void)ccid_open_hack_pre(reader_index);
-
-		/* Try to access the reader */
-		/* This "warm up" sequence is sometimes needed when pcscd is
-		 * restarted with the reader already connected. We get some
-		 * "usb_bulk_read: Resource temporarily unavailable" on the first
-		 * few tries. It is an empirical hack */
-		if ((IFD_COMMUNICATION_ERROR == IFDHICCPresence(Lun))
-			&& (IFD_COMMUNICATION_ERROR == IFDHICCPresence(Lun))
-			&& (IFD_COMMUNICATION_ERROR == IFDHICCPresence(Lun)))
+		if (OpenPort(reader_index, Channel) != STATUS_SUCCESS)
 		{
 			DEBUG_CRITICAL("failed");
 			return_value = IFD_COMMUNICATION_ERROR;
 
-			/* release the allocated resources */
-			(void)ClosePort(reader_index);
+			/* release the allocated reader_index */
 			ReleaseReaderIndex(reader_index);
 		}
-		else
-			/* Maybe we have a special treatment for this reader */
-			(void)ccid_open_hack_post(reader_index);
-	}
 
 #ifdef HAVE_PTHREAD
 	(void)pthread_mutex_unlock(&ifdh_context_mutex);
 #endif
 
+	if (IFD_SUCCESS == return_value)
+		return_value = warm_up_reader(Lun, reader_index);
+
 	return return_value;
 } /* IFDHCreateChannel */
 
@@ -263,7 +211,7 @@ EXTERNAL RESPONSECODE IFDHCloseChannel(DWORD Lun)
 	if (-1 == (reader_index = LunToReaderIndex(Lun)))
 		return IFD_COMMUNICATION_ERROR;
 
-	DEBUG_INFO3("%s (lun: %X)", CcidSlots[reader_index].readerName, Lun);
+	DEBUG_INFO3("%s (lun: %X)", CcidSlots[reader_index]->readerName, Lun);
 
 	/* Restore the default timeout
 	 * No need to wait too long if the reader disapeared */
@@ -279,8 +227,8 @@ EXTERNAL RESPONSECODE IFDHCloseChannel(DWORD Lun)
 	(void)ClosePort(reader_index);
 	ReleaseReaderIndex(reader_index);
 
-	free(CcidSlots[reader_index].readerName);
-	memset(&CcidSlots[reader_index], 0, sizeof(CcidSlots[reader_index]));
+	free(CcidSlots[reader_index]->readerName);
+	memset(CcidSlots[reader_index], 0, sizeof(*CcidSlots[reader_index]));
 
 #ifdef HAVE_PTHREAD
 	(void)pthread_mutex_unlock(&ifdh_context_mutex);
@@ -290,6 +238,97 @@ EXTERNAL RESPONSECODE IFDHCloseChannel(DWORD Lun)
 } /* IFDHCloseChannel */
 
 
+/* allocate a reader_index for Lun and reset its slot
+ * called with ifdh_context_mutex locked */
+static int new_reader_index(DWORD Lun, const char *readerName)
+{
+	int reader_index;
+
+	if (-1 == (reader_index = GetNewReaderIndex(Lun)))
+		return -1;
+
+	if (reader_index >= CcidSlotsSize)
+	{
+		CcidDesc **slots;
+
+		slots = (CcidDesc **)GrowReaderArray((void **)CcidSlots,
+			&CcidSlotsSize, reader_index);
+		if (NULL == slots)
+		{
+			DEBUG_CRITICAL("Not enough memory");
+			ReleaseReaderIndex(reader_index);
+			return -1;
+		}
+		CcidSlots = slots;
+	}
+
+	/* the slot is allocated the first time the reader_index is used and
+	 * kept for the next reader using the same index */
+	if (NULL == CcidSlots[reader_index])
+	{
+		CcidSlots[reader_index] = calloc(1, sizeof(CcidDesc));
+		if (NULL == CcidSlots[reader_index])
+		{
+			DEBUG_CRITICAL("Not enough memory");
+			ReleaseReaderIndex(reader_index);
+			return -1;
+		}
+	}
+
+	/* Reset ATR buffer */
+	CcidSlots[reader_index]->nATRLength = 0;
+	*CcidSlots[reader_index]->pcATRBuffer = '\0';
+
+	/* Reset PowerFlags */
+	CcidSlots[reader_index]->bPowerFlags = POWERFLAGS_RAZ;
+
+	/* reader name */
+	CcidSlots[reader_index]->readerName = strdup(readerName);
+
+	return reader_index;
+} /* new_reader_index */
+
+
+/* first communication with a reader just opened
+ * called with ifdh_context_mutex unlocked */
+static RESPONSECODE warm_up_reader(DWORD Lun, int reader_index)
+{
+	/* Maybe we have a special treatment for this reader */
+	(void)ccid_open_hack_pre(reader_index);
+
+	/* Try to access the reader */
+	/* This "warm up" sequence is sometimes needed when pcscd is
+	 * restarted with the reader already connected. We get some
+	 * "usb_bulk_read: Resource temporarily unavailable" on the first
+	 * few tries. It is an empirical hack */
+	if ((IFD_COMMUNICATION_ERROR == IFDHICCPresence(Lun))
+		&& (IFD_COMMUNICATION_ERROR == IFDHICCPresence(Lun))
+		&& (IFD_COMMUNICATION_ERROR == IFDHICCPresence(Lun)))
+	{
+		DEBUG_CRITICAL("failed");
+
+		/* release the allocated resources */
+#ifdef HAVE_PTHREAD
+		(void)pthread_mutex_lock(&ifdh_context_mutex);
+#endif
+		(void)ClosePort(reader_index);
+		ReleaseReaderIndex(reader_index);
+		free(CcidSlots[reader_index]->readerName);
+		CcidSlots[reader_index]->readerName = NULL;
+#ifdef HAVE_PTHREAD
+		(void)pthread_mutex_unlock(&ifdh_context_mutex);
+#endif
+
+		return IFD_COMMUNICATION_ERROR;
+	}
+
+	/* Maybe we have a special treatment for this reader */
+	(void)ccid_open_hack_post(reader_index);
+
+	return IFD_SUCCESS;
+} /* warm_up_reader */
+
+
 #if HAVE_DECL_TAG_IFD_POLLING_THREAD && !defined(TWIN_SERIAL) && defined(USE_USB_INTERRUPT)
 static RESPONSECODE IFDHPolling(DWORD Lun)
 {
@@ -301,7 +340,7 @@ static RESPONSECODE IFDHPolling(DWORD Lun)
 
 	/* log only if DEBUG_LEVEL_PERIODIC is set */
 	if (LogLevel & DEBUG_LEVEL_PERIODIC)
-		DEBUG_INFO3("%s (lun: %X)", CcidSlots[reader_index].readerName, Lun);
+		DEBUG_INFO3("%s (lun: %X)", CcidSlots[reader_index]->readerName, Lun);
 
 	ret = InterruptRead(reader_index, 2*1000);	/* 2 seconds */
 	if (ret > 0)
@@ -320,7 +359,7 @@ static RESPONSECODE IFDHSleep(DWORD Lun)
 	if (-1 == (reader_index = LunToReaderIndex(Lun)))
 		return IFD_COMMUNICATION_ERROR;
 
-	DEBUG_INFO3("%s (lun: %X)", CcidSlots[reader_index].readerName, Lun);
+	DEBUG_INFO3("%s (lun: %X)", CcidSlots[reader_index]->readerName, Lun);
 
 	/* just sleep for 5 seconds since the polling thread is NOT killable
 	 * so pcscd event thread must loop to exit cleanly
@@ -361,7 +400,7 @@ EXTERNAL RESPONSECODE IFDHGetCapabilities(DWORD Lun, DWORD Tag,
 		return IFD_COMMUNICATION_ERROR;
 
 	DEBUG_INFO4("tag: 0x%X, %s (lun: %X)", Tag,
-		CcidSlots[reader_index].readerName, Lun);
+		CcidSlots[reader_index]->readerName, Lun);
 
 	switch (Tag)
 	{
@@ -370,11 +409,11 @@ EXTERNAL RESPONSECODE IFDHGetCapabilities(DWORD Lun, DWORD Tag,
 			/* If Length is not zero, powerICC has been performed.
 			 * Otherwise, return NULL pointer
 			 * Buffer size is stored in *Length */
-			*Length = (*Length < CcidSlots[reader_index].nATRLength) ?
-				*Length : CcidSlots[reader_index].nATRLength;
+			*Length = (*Length < CcidSlots[reader_index]->nATRLength) ?
+				*Length : CcidSlots[reader_index]->nATRLength;
 
 			if (*Length)
-				memcpy(Value, CcidSlots[reader_index].pcATRBuffer, *Length);
+				memcpy(Value, CcidSlots[reader_index]->pcATRBuffer, *Length);
 			break;
 
 #ifdef HAVE_PTHREAD
@@ -382,7 +421,8 @@ EXTERNAL RESPONSECODE IFDHGetCapabilities(DWORD Lun, DWORD Tag,
 			if (*Length >= 1)
 			{
 				*Length = 1;
-				*Value = CCID_DRIVER_MAX_READERS;
+				/* the value is on one byte */
+				*Value = min(CCID_DRIVER_MAX_READERS, 255);
 			}
 			break;
 
@@ -533,7 +573,7 @@ EXTERNAL RESPONSECODE IFDHSetCapabilities(DWORD Lun, DWORD Tag,
 		return IFD_COMMUNICATION_ERROR;
 
 	DEBUG_INFO4("tag: 0x%X, %s (lun: %X)", Tag,
-		CcidSlots[reader_index].readerName, Lun);
+		CcidSlots[reader_index]->readerName, Lun);
 
 	/* if (CheckLun(Lun))
 		return IFD_COMMUNICATION_ERROR; */
@@ -578,7 +618,7 @@ EXTERNAL RESPONSECODE IFDHSetProtocolParameters(DWORD Lun, DWORD Protocol,
 		return IFD_COMMUNICATION_ERROR;
 
 	DEBUG_INFO4("protocol T=%d, %s (lun: %X)", Protocol-SCARD_PROTOCOL_T0,
-		CcidSlots[reader_index].readerName, Lun);
+		CcidSlots[reader_index]->readerName, Lun);
 
 	/* Set to zero buffer */
 	memset(pps, 0, sizeof(pps));
@@ -1040,17 +1080,17 @@ EXTERNAL RESPONSECODE IFDHPowerICC(DWORD Lun, DWORD Action,
 		return IFD_COMMUNICATION_ERROR;
 
 	DEBUG_INFO4("action: %s, %s (lun: %X)", actions[Action-IFD_POWER_UP],
-		CcidSlots[reader_index].readerName, Lun);
+		CcidSlots[reader_index]->readerName, Lun);
 
 	switch (Action)
 	{
 		case IFD_POWER_DOWN:
 			/* Clear ATR buffer */
-			CcidSlots[reader_index].nATRLength = 0;
-			*CcidSlots[reader_index].pcATRBuffer = '\0';
+			CcidSlots[reader_index]->nATRLength = 0;
+			*CcidSlots[reader_index]->pcATRBuffer = '\0';
 
 			/* Memorise the request */
-			CcidSlots[reader_index].bPowerFlags |= MASK_POWERFLAGS_PDWN;
+			CcidSlots[reader_index]->bPowerFlags |= MASK_POWERFLAGS_PDWN;
 
 			/* send the command */
 			if (IFD_SUCCESS != CmdPowerOff(reader_index))
@@ -1080,6 +1120,9 @@ EXTERNAL RESPONSECODE IFDHPowerICC(DWORD Lun, DWORD Action,
 			 */
 			ccid_descriptor->readTimeout = 60;
 
+			/* the response times of the previous card are meaningless */
+			ccid_descriptor->responseSamples = 0;
+
 			nlength = sizeof(pcbuffer);
 			return_value = CmdPowerOn(reader_index, &nlength, pcbuffer,
 				PowerOnVoltage);
@@ -1099,14 +1142,14 @@ EXTERNAL RESPONSECODE IFDHPowerICC(DWORD Lun, DWORD Action,
 			}
 
 			/* Power up successful, set state variable to memorise it */
-			CcidSlots[reader_index].bPowerFlags |= MASK_POWERFLAGS_PUP;
-			CcidSlots[reader_index].bPowerFlags &= ~MASK_POWERFLAGS_PDWN;
+			CcidSlots[reader_index]->bPowerFlags |= MASK_POWERFLAGS_PUP;
+			CcidSlots[reader_index]->bPowerFlags &= ~MASK_POWERFLAGS_PDWN;
 
 			/* Reset is returned, even if TCK is wrong */
-			CcidSlots[reader_index].nATRLength = *AtrLength =
+			CcidSlots[reader_index]->nATRLength = *AtrLength =
 				(nlength < MAX_ATR_SIZE) ? nlength : MAX_ATR_SIZE;
 			memcpy(Atr, pcbuffer, *AtrLength);
-			memcpy(CcidSlots[reader_index].pcATRBuffer, pcbuffer, *AtrLength);
+			memcpy(CcidSlots[reader_index]->pcATRBuffer, pcbuffer, *AtrLength);
 
 			/* initialise T=1 context */
 			(void)t1_init(&(get_ccid_slot(reader_index) -> t1), reader_index);
@@ -1167,7 +1210,7 @@ EXTERNAL RESPONSECODE IFDHTransmitToICC(DWORD Lun, SCARD_IO_HEADER SendPci,
 	if (-1 == (reader_index = LunToReaderIndex(Lun)))
 		return IFD_COMMUNICATION_ERROR;
 
-	DEBUG_INFO3("%s (lun: %X)", CcidSlots[reader_index].readerName, Lun);
+	DEBUG_INFO3("%s (lun: %X)", CcidSlots[reader_index]->readerName, Lun);
 
 	rx_length = *RxLength;
 	return_value = CmdXfrBlock(reader_index, TxLength, TxBuffer, &rx_length,
@@ -1207,7 +1250,7 @@ EXTERNAL RESPONSECODE IFDHControl(DWORD Lun, DWORD dwControlCode,
 		return IFD_COMMUNICATION_ERROR;
 
 	DEBUG_INFO4("ControlCode: 0x%X, %s (lun: %X)", dwControlCode,
-		CcidSlots[reader_index].readerName, Lun);
+		CcidSlots[reader_index]->readerName, Lun);
 	DEBUG_INFO_XXD("Control TxBuffer: ", TxBuffer, TxLength);
 
 	/* Set the return length to 0 to avoid problems */
@@ -1253,6 +1296,18 @@ EXTERNAL RESPONSECODE IFDHControl(DWORD Lun, DWORD dwControlCode,
 		}
 	}
 
+	/* transfer statistics of the reader. No exchange with the reader */
+	if (IOCTL_SMARTCARD_VENDOR_TRANSFER_STATS == dwControlCode)
+	{
+		if (RxLength < sizeof(ccid_transfer_stats))
+			return IFD_COMMUNICATION_ERROR;
+
+		memcpy(RxBuffer, get_transfer_stats(reader_index),
+			sizeof(ccid_transfer_stats));
+		*pdwBytesReturned = sizeof(ccid_transfer_stats);
+		return_value = IFD_SUCCESS;
+	}
+
 	/* Implement the PC/SC v2.02.05 Part 10 IOCTL mechanism */
 
 	/* Query for features */
@@ -1413,7 +1468,7 @@ EXTERNAL RESPONSECODE IFDHICCPresence(DWORD Lun)
 	if (-1 == (reader_index = LunToReaderIndex(Lun)))
 		return IFD_COMMUNICATION_ERROR;
 
-	DEBUG_PERIODIC3("%s (lun: %X)", CcidSlots[reader_index].readerName, Lun);
+	DEBUG_PERIODIC3("%s (lun: %X)", CcidSlots[reader_index]->readerName, Lun);
 
 	ccid_descriptor = get_ccid_descriptor(reader_index);
 
@@ -1454,8 +1509,8 @@ EXTERNAL RESPONSECODE IFDHICCPresence(DWORD Lun)
 			break;
 
 		case CCID_ICC_PRESENT_INACTIVE:
-			if ((CcidSlots[reader_index].bPowerFlags == POWERFLAGS_RAZ)
-				|| (CcidSlots[reader_index].bPowerFlags & MASK_POWERFLAGS_PDWN))
+			if ((CcidSlots[reader_index]->bPowerFlags == POWERFLAGS_RAZ)
+				|| (CcidSlots[reader_index]->bPowerFlags & MASK_POWERFLAGS_PDWN))
 				/* the card was previously absent */
 				return_value = IFD_ICC_PRESENT;
 			else
@@ -1463,18 +1518,18 @@ EXTERNAL RESPONSECODE IFDHICCPresence(DWORD Lun)
 				/* the card was previously present but has been
 				 * removed and inserted between two consecutive
 				 * IFDHICCPresence() calls */
-				CcidSlots[reader_index].bPowerFlags = POWERFLAGS_RAZ;
+				CcidSlots[reader_index]->bPowerFlags = POWERFLAGS_RAZ;
 				return_value = IFD_ICC_NOT_PRESENT;
 			}
 			break;
 
 		case CCID_ICC_ABSENT:
 			/* Reset ATR buffer */
-			CcidSlots[reader_index].nATRLength = 0;
-			*CcidSlots[reader_index].pcATRBuffer = '\0';
+			CcidSlots[reader_index]->nATRLength = 0;
+			*CcidSlots[reader_index]->pcATRBuffer = '\0';
 
 			/* Reset PowerFlags */
-			CcidSlots[reader_index].bPowerFlags = POWERFLAGS_RAZ;
+			CcidSlots[reader_index]->bPowerFlags = POWERFLAGS_RAZ;
 
 			return_value = IFD_ICC_NOT_PRESENT;
 			break;
@@ -1518,11 +1573,11 @@ EXTERNAL RESPONSECODE IFDHICCPresence(DWORD Lun)
 		else
 		{
 			/* Reset ATR buffer */
-			CcidSlots[reader_index].nATRLength = 0;
-			*CcidSlots[reader_index].pcATRBuffer = '\0';
+			CcidSlots[reader_index]->nATRLength = 0;
+			*CcidSlots[reader_index]->pcATRBuffer = '\0';
 
 			/* Reset PowerFlags */
-			CcidSlots[reader_index].bPowerFlags = POWERFLAGS_RAZ;
+			CcidSlots[reader_index]->bPowerFlags = POWERFLAGS_RAZ;
 
 			return_value = IFD_ICC_NOT_PRESENT;
 		}
@@ -1539,7 +1594,7 @@ end:
 
 CcidDesc *get_ccid_slot(unsigned int reader_index)
 {
-	return &CcidSlots[reader_index];
+	return CcidSlots[reader_index];
 } /* get_ccid_slot */
 
 
@@ -21,64 +21,320 @@
  * $Id$
  */
 
+#include <stdlib.h>
+#include <string.h>
 #include <pcsclite.h>
 
+#include "config.h"
 #include "ccid.h"
 #include "defs.h"
 #include "ccid_ifdhandler.h"
 #include "utils.h"
 #include "debug.h"
 
-int ReaderIndex[CCID_DRIVER_MAX_READERS];
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+/* first size of ReaderIndex[], doubled when full up to
+ * CCID_DRIVER_MAX_READERS */
+#define READER_INDEX_FIRST_SIZE 16
+
+/* Lun of each reader_index, -1 if the index is free */
+static int *ReaderIndex = NULL;
+static int ReaderIndexSize = 0;
+
+/*
+ * Lun -> reader_index hash table with linear probing
+ * The table has twice as many entries as ReaderIndex[] and is rebuilt
+ * when ReaderIndex[] grows.
+ * A removed entry is kept as LUN_HASH_DELETED to not break the probe
+ * sequence of the other entries and is reused by the next insertion.
+ *
+ * LunToReaderIndex() is called by every IFDH function, for every
+ * reader, so it does not lock: two readers never contend there. Only
+ * the functions modifying the tables take LunHashMutex. An entry is
+ * published by writing Lun before reader_index, and a new table is
+ * complete before LunHash points to it. The old tables are not freed
+ * since a lookup may still use them (they double in size so only a few
+ * are kept).
+ */
+#define LUN_HASH_EMPTY -1
+#define LUN_HASH_DELETED -2
+
+typedef struct
+{
+	volatile int Lun;
+	volatile int reader_index;	/* or LUN_HASH_EMPTY or LUN_HASH_DELETED */
+} LunHashEntry;
+
+typedef struct
+{
+	int size;	/* power of 2 */
+	LunHashEntry *entries;	/* allocated after the structure */
+} LunHashTable;
+
+static LunHashTable * volatile LunHash = NULL;
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t LunHashMutex = PTHREAD_MUTEX_INITIALIZER;
+#define LUN_HASH_LOCK() (void)pthread_mutex_lock(&LunHashMutex)
+#define LUN_HASH_UNLOCK() (void)pthread_mutex_unlock(&LunHashMutex)
+#else
+#define LUN_HASH_LOCK()
+#define LUN_HASH_UNLOCK()
+#endif
+
+/* pcscd uses Lun = (reader << 16) + slot */
+#define LUN_HASH(table, Lun) ((((Lun) >> 16) * 31 + ((Lun) & 0xFFFF)) \
+	& ((table)->size-1))
+
+/* reader_index of Lun or -1, no lock needed */
+static int LunHashFind(const LunHashTable *table, const int Lun)
+{
+	int i, h, reader_index;
+
+	for (i=0, h=LUN_HASH(table, Lun); i<table->size;
+		i++, h=(h+1) & (table->size-1))
+	{
+		reader_index = table->entries[h].reader_index;
+
+		if (LUN_HASH_EMPTY == reader_index)
+			break;
+
+		/* Lun was written before reader_index */
+		__sync_synchronize();
+
+		if ((reader_index >= 0) && (Lun == table->entries[h].Lun))
+			return reader_index;
+	}
+
+	return -1;
+} /* LunHashFind */
+
+/* entry of Lun or -1
+ * called with LunHashMutex locked */
+static int LunHashEntryOf(const LunHashTable *table, const int Lun)
+{
+	int i, h;
+
+	for (i=0, h=LUN_HASH(table, Lun); i<table->size;
+		i++, h=(h+1) & (table->size-1))
+	{
+		if (LUN_HASH_EMPTY == table->entries[h].reader_index)
+			break;
+
+		if ((table->entries[h].reader_index >= 0)
+			&& (Lun == table->entries[h].Lun))
+			return h;
+	}
+
+	return -1;
+} /* LunHashEntryOf */
+
+/* called with LunHashMutex locked and Lun not in the table */
+static void LunHashInsert(LunHashTable *table, const int Lun,
+	const int reader_index)
+{
+	int h;
+
+	/* the table has twice as many entries as readers so a free
+	 * entry is always found */
+	for (h=LUN_HASH(table, Lun); table->entries[h].reader_index >= 0;
+		h=(h+1) & (table->size-1))
+		;
+
+	/* a lookup seeing reader_index also sees Lun */
+	table->entries[h].Lun = Lun;
+	__sync_synchronize();
+	table->entries[h].reader_index = reader_index;
+} /* LunHashInsert */
+
+/* double ReaderIndex[] and rebuild LunHash
+ * called with LunHashMutex locked */
+static int GrowReaderIndex(void)
+{
+	int *new_index;
+	LunHashTable *new_hash;
+	int i, new_size;
+
+	if (ReaderIndexSize >= CCID_DRIVER_MAX_READERS)
+		return -1;
+
+	new_size = ReaderIndexSize ? 2*ReaderIndexSize : READER_INDEX_FIRST_SIZE;
+	if (new_size > CCID_DRIVER_MAX_READERS)
+		new_size = CCID_DRIVER_MAX_READERS;
+
+	new_index = realloc(ReaderIndex, new_size * sizeof(*ReaderIndex));
+	if (NULL == new_index)
+		return -1;
+	ReaderIndex = new_index;
+
+	new_hash = malloc(sizeof(*new_hash)
+		+ 2 * new_size * sizeof(LunHashEntry));
+	if (NULL == new_hash)
+		return -1;
+
+	for (i=ReaderIndexSize; i<new_size; i++)
+		ReaderIndex[i] = -1;
+	ReaderIndexSize = new_size;
+
+	new_hash->size = 2 * new_size;
+	new_hash->entries = (LunHashEntry *)(new_hash + 1);
+	for (i=0; i<new_hash->size; i++)
+		new_hash->entries[i].reader_index = LUN_HASH_EMPTY;
+
+	/* the deleted entries are not copied */
+	for (i=0; i<ReaderIndexSize; i++)
+		if (ReaderIndex[i] != -1)
+			LunHashInsert(new_hash, ReaderIndex[i], i);
+
+	/* the new table is complete before it is published */
+	__sync_synchronize();
+	LunHash = new_hash;
+
+	return 0;
+} /* GrowReaderIndex */
 
 void InitReaderIndex(void)
 {
 	int i;
 
-	for (i=0; i<CCID_DRIVER_MAX_READERS; i++)
+	LUN_HASH_LOCK();
+
+	for (i=0; i<ReaderIndexSize; i++)
 		ReaderIndex[i] = -1;
+
+	if (LunHash)
+		for (i=0; i<LunHash->size; i++)
+			LunHash->entries[i].reader_index = LUN_HASH_EMPTY;
+
+	LUN_HASH_UNLOCK();
 } /* InitReaderIndex */
 
 int GetNewReaderIndex(const int Lun)
 {
-	int i;
+	int i, reader_index = -1;
 
-	/* check that Lun is NOT already used */
-	for (i=0; i<CCID_DRIVER_MAX_READERS; i++)
-		if (Lun == ReaderIndex[i])
-			break;
+	LUN_HASH_LOCK();
 
-	if (i < CCID_DRIVER_MAX_READERS)
+	/* check that Lun is NOT already used */
+	if (LunHash && (LunHashEntryOf(LunHash, Lun) != -1))
 	{
+		LUN_HASH_UNLOCK();
 		DEBUG_CRITICAL2("Lun: %d is already used", Lun);
 		return -1;
 	}
 
-	for (i=0; i<CCID_DRIVER_MAX_READERS; i++)
+	for (i=0; i<ReaderIndexSize; i++)
 		if (-1 == ReaderIndex[i])
 		{
-			ReaderIndex[i] = Lun;
-			return i;
+			reader_index = i;
+			break;
 		}
 
-	DEBUG_CRITICAL("ReaderIndex[] is full");
-	return -1;
+	if (-1 == reader_index)
+	{
+		/* the first new entry is free */
+		reader_index = ReaderIndexSize;
+		if (GrowReaderIndex() < 0)
+		{
+			LUN_HASH_UNLOCK();
+			DEBUG_CRITICAL("ReaderIndex[] is full");
+			return -1;
+		}
+	}
+
+	ReaderIndex[reader_index] = Lun;
+	LunHashInsert(LunHash, Lun, reader_index);
+
+	LUN_HASH_UNLOCK();
+
+	return reader_index;
 } /* GetReaderIndex */
 
 int LunToReaderIndex(const int Lun)
 {
-	int i;
+	LunHashTable *table;
+	int reader_index = -1;
 
-	for (i=0; i<CCID_DRIVER_MAX_READERS; i++)
-		if (Lun == ReaderIndex[i])
-			return i;
+	/* no lock: the table is complete when LunHash points to it */
+	table = LunHash;
+	__sync_synchronize();
 
-	DEBUG_CRITICAL2("Lun: %X not found", Lun);
-	return -1;
+	if (table)
+		reader_index = LunHashFind(table, Lun);
+
+	if (-1 == reader_index)
+		DEBUG_CRITICAL2("Lun: %X not found", Lun);
+
+	return reader_index;
 } /* LunToReaderIndex */
 
 void ReleaseReaderIndex(const int index)
 {
+	int h;
+
+	LUN_HASH_LOCK();
+
+	h = LunHashEntryOf(LunHash, ReaderIndex[index]);
+	if (h != -1)
+		LunHash->entries[h].reader_index = LUN_HASH_DELETED;
+
 	ReaderIndex[index] = -1;
+
+	LUN_HASH_UNLOCK();
 } /* ReleaseReaderIndex */
 
+/*
+ * Return an array of pointers large enough for reader_index, the new
+ * entries are NULL. The old array is not freed: the other threads may
+ * still read it without lock and it points to the same structures.
+ * Called with ifdh_context_mutex locked. NULL if out of memory.
+ */
+void **GrowReaderArray(void **array, int *size, const int reader_index)
+{
+	void **new_array;
+	int new_size;
+
+	if (reader_index < *size)
+		return array;
+
+	new_size = *size ? *size : READER_INDEX_FIRST_SIZE;
+	while (new_size <= reader_index)
+		new_size *= 2;
+
+	new_array = calloc(new_size, sizeof(*new_array));
+	if (NULL == new_array)
+		return NULL;
+
+	if (*size)
+		memcpy(new_array, array, *size * sizeof(*new_array));
+
+	/* the copy is complete before the new array is published */
+	__sync_synchronize();
+
+	*size = new_size;
+	return new_array;
+} /* GrowReaderArray */
+
+/* count the time elapsed since start in a ccid_transfer_stats histogram */
+void StatsAddTime(unsigned int histogram[], const struct timeval *start)
+{
+	struct timeval now;
+	long elapsed;
+	int bucket;
+
+	(void)gettimeofday(&now, NULL);
+	elapsed = (now.tv_sec - start->tv_sec) * 1000000
+		+ (now.tv_usec - start->tv_usec);
+
+	/* bucket 0 is < 64 us and each next bucket doubles */
+	elapsed >>= 6;
+	for (bucket = 0; (elapsed > 0) && (bucket < CCID_TRANSFER_STATS_BUCKETS-1);
+		bucket++)
+		elapsed >>= 1;
+
+	histogram[bucket]++;
+} /* StatsAddTime */
+
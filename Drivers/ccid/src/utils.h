@@ -21,6 +21,8 @@
  * $Id$
  */
 
+#include <sys/time.h>
+
 #ifndef TRUE
 #define FALSE 0
 #define TRUE 1
@@ -30,4 +32,7 @@ void InitReaderIndex(void);
 int GetNewReaderIndex(const int Lun);
 int LunToReaderIndex(int Lun);
 void ReleaseReaderIndex(const int idx);
+void **GrowReaderArray(void **array, int *size, const int reader_index);
+
+void StatsAddTime(unsigned int histogram[], const struct timeval *start);
 
@@ -84,6 +84,8 @@ PCSC_API void log_xxd(const int priority, const char *msg,
 	const unsigned char *buffer, const int size);
 
 void DebugLogSuppress(const int);
+int DebugLogStartThread(void);
+void DebugLogFlush(void);
 void DebugLogSetLogType(const int);
 int DebugLogSetCategory(const int);
 void DebugLogCategory(const int, const unsigned char *, const int);
@@ -97,6 +97,10 @@ extern "C"
 	PCSC_API LONG SCardSetAttrib(SCARDHANDLE hCard, DWORD dwAttrId,
 		LPCBYTE pbAttr, DWORD cbAttrLen);
 
+	/* pcsc-lite extension */
+	PCSC_API LONG SCardGetStatistics(/*@null@*/ /*@out@*/ LPSTR mszStatistics,
+		LPDWORD pcchStatistics);
+
 #ifdef __cplusplus
 }
 #endif
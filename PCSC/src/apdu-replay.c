@@ -0,0 +1,481 @@
+/*
+ * MUSCLE SmartCard Development ( http://www.linuxnet.com )
+ *
+ * Copyright (C) 2009
+ *  Ludovic Rousseau <ludovic.rousseau@free.fr>
+ *
+ * $Id$
+ */
+
+/**
+ * @file
+ * @brief Replays a capture recorded by pcscd --capture with a reader
+ * driver.
+ *
+ * The driver is loaded and used directly, like HandlerTest does, so
+ * pcscd must not use the reader at the same time. The commands are sent
+ * in the capture order. The responses and the time used by the driver
+ * are compared to the ones of the capture.
+ *
+ * Usage: apdu-replay [options] capture...
+ * The captures are given from the oldest to the newest: capture.1 capture
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <sys/time.h>
+
+#include "pcsclite.h"
+#include "ifdhandler.h"
+#include "capture.h"
+
+#define LUN 0
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+/** functions of the driver */
+static struct
+{
+	RESPONSECODE (*CreateChannel)(DWORD, DWORD);
+	RESPONSECODE (*CreateChannelByName)(DWORD, LPSTR);
+	RESPONSECODE (*CloseChannel)(DWORD);
+	RESPONSECODE (*SetProtocolParameters)(DWORD, DWORD, UCHAR, UCHAR,
+		UCHAR, UCHAR);
+	RESPONSECODE (*PowerICC)(DWORD, DWORD, PUCHAR, PDWORD);
+	RESPONSECODE (*TransmitToICC)(DWORD, SCARD_IO_HEADER, PUCHAR, DWORD,
+		PUCHAR, PDWORD, PSCARD_IO_HEADER);
+	RESPONSECODE (*Control)(DWORD, DWORD, PUCHAR, DWORD, PUCHAR, DWORD,
+		PDWORD);
+} f;
+
+/** statistics of a record type */
+struct stats
+{
+	int count;
+	int errors;	/**< the driver result differs */
+	int mismatches;	/**< the response differs */
+	double captured;	/**< time used by the driver in the capture (us) */
+	double replayed;	/**< time used by the driver now (us) */
+	long max;	/**< longest replayed exchange (us) */
+};
+
+static struct stats stats[CAPTURE_STATUS + 1];
+static int verbose = FALSE;
+static int print_only = FALSE;
+static int timed = FALSE;
+static int reader = 0;
+static int skipped = 0;
+static DWORD protocol = 0;	/**< PC/SC protocol set in the driver, 0 if none */
+static struct timeval first_record, replay_start;
+
+static int load_driver(const char *driver);
+static unsigned char *read_capture(const char *file);
+static int replay_record(const struct CaptureRecord *record,
+	const unsigned char *data);
+static void dump(const char *text, const unsigned char *buffer, int length);
+static long elapsed(struct timeval *start);
+static void usage(const char *name);
+
+int main(int argc, char *argv[])
+{
+	const char *driver = NULL, *device = NULL;
+	int opt, i, channel = -1;
+	RESPONSECODE rv;
+	const char *names[] = { "", "transmit", "control", "status" };
+
+	while ((opt = getopt(argc, argv, "l:d:c:r:ptvh")) != -1)
+	{
+		switch (opt)
+		{
+			case 'l':
+				driver = optarg;
+				break;
+
+			case 'd':
+				device = optarg;
+				break;
+
+			case 'c':
+				channel = atoi(optarg);
+				break;
+
+			case 'r':
+				reader = atoi(optarg);
+				break;
+
+			case 'p':
+				print_only = TRUE;
+				break;
+
+			case 't':
+				timed = TRUE;
+				break;
+
+			case 'v':
+				verbose = TRUE;
+				break;
+
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if ((optind >= argc) || (!print_only
+		&& ((NULL == driver) || ((NULL == device) && (channel < 0)))))
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!print_only)
+	{
+		if (load_driver(driver) < 0)
+			return 1;
+
+		if (device)
+		{
+			if (NULL == f.CreateChannelByName)
+			{
+				printf("%s does not support a device name\n", driver);
+				return 1;
+			}
+			rv = f.CreateChannelByName(LUN, (LPSTR)device);
+		}
+		else
+			rv = f.CreateChannel(LUN, channel);
+
+		if (rv != IFD_SUCCESS)
+		{
+			printf("Cannot open the reader: %ld\n", rv);
+			return 1;
+		}
+	}
+
+	for (i=optind; i<argc; i++)
+	{
+		struct CaptureHeader *header;
+		unsigned char *capture;
+		uint32_t offset;
+
+		capture = read_capture(argv[i]);
+		if (NULL == capture)
+			return 1;
+
+		header = (struct CaptureHeader *)capture;
+		for (offset = sizeof(*header); offset < header->used; )
+		{
+			struct CaptureRecord record;
+
+			memcpy(&record, capture + offset, sizeof(record));
+			if ((record.length < sizeof(record))
+				|| (record.length > header->used - offset)
+				|| (sizeof(record) + record.sendLength + record.recvLength
+					> record.length)
+				|| (record.type < CAPTURE_TRANSMIT)
+				|| (record.type > CAPTURE_STATUS))
+			{
+				printf("%s: invalid record at offset %u\n", argv[i], offset);
+				break;
+			}
+
+			(void)replay_record(&record, capture + offset + sizeof(record));
+			offset += record.length;
+		}
+
+		free(capture);
+	}
+
+	if (!print_only)
+	{
+		(void)f.CloseChannel(LUN);
+
+		printf("%-9s %7s %7s %10s %12s %12s %10s\n", "type", "records",
+			"errors", "mismatches", "captured us", "replayed us", "max us");
+		for (i=CAPTURE_TRANSMIT; i<=CAPTURE_STATUS; i++)
+		{
+			struct stats *s = &stats[i];
+
+			if (0 == s->count)
+				continue;
+
+			printf("%-9s %7d %7d %10d %12.0f %12.0f %10ld\n", names[i],
+				s->count, s->errors, s->mismatches, s->captured / s->count,
+				s->replayed / s->count, s->max);
+		}
+		if (skipped)
+			printf("%d records of other readers skipped\n", skipped);
+	}
+
+	return 0;
+}
+
+static int load_driver(const char *driver)
+{
+	void *handle;
+
+	handle = dlopen(driver, RTLD_NOW);
+	if (NULL == handle)
+	{
+		printf("%s\n", dlerror());
+		return -1;
+	}
+
+#define DLSYM(field, function) \
+	f.field = dlsym(handle, #function); \
+	if (NULL == f.field) \
+	{ \
+		printf("%s: %s\n", driver, dlerror()); \
+		return -1; \
+	}
+
+	DLSYM(CreateChannel, IFDHCreateChannel)
+	DLSYM(CloseChannel, IFDHCloseChannel)
+	DLSYM(SetProtocolParameters, IFDHSetProtocolParameters)
+	DLSYM(PowerICC, IFDHPowerICC)
+	DLSYM(TransmitToICC, IFDHTransmitToICC)
+	DLSYM(Control, IFDHControl)
+
+	/* IFD handler 3.0 only */
+	f.CreateChannelByName = dlsym(handle, "IFDHCreateChannelByName");
+
+	return 0;
+}
+
+/**
+ * Reads a whole capture file in memory
+ */
+static unsigned char *read_capture(const char *file)
+{
+	struct CaptureHeader header;
+	unsigned char *capture;
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (NULL == fp)
+	{
+		perror(file);
+		return NULL;
+	}
+
+	if ((fread(&header, sizeof(header), 1, fp) != 1)
+		|| memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic))
+		|| (header.used < sizeof(header)) || (header.used > header.size))
+	{
+		printf("%s: not a pcscd capture\n", file);
+		(void)fclose(fp);
+		return NULL;
+	}
+
+	capture = malloc(header.used);
+	if (NULL == capture)
+	{
+		printf("Not enough memory\n");
+		(void)fclose(fp);
+		return NULL;
+	}
+
+	memcpy(capture, &header, sizeof(header));
+	if (fread(capture + sizeof(header), header.used - sizeof(header), 1, fp)
+		!= 1 && (header.used > sizeof(header)))
+	{
+		printf("%s: truncated capture\n", file);
+		free(capture);
+		(void)fclose(fp);
+		return NULL;
+	}
+	(void)fclose(fp);
+
+	if (verbose)
+		printf("%s: %u records\n", file, header.records);
+
+	return capture;
+}
+
+static int replay_record(const struct CaptureRecord *record,
+	const unsigned char *data)
+{
+	const unsigned char *send = data;
+	const unsigned char *recv = data + record->sendLength;
+	unsigned char buffer[MAX_BUFFER_SIZE_EXTENDED];
+	DWORD length = sizeof(buffer);
+	struct stats *s = &stats[record->type];
+	struct timeval start;
+	RESPONSECODE rv = IFD_SUCCESS;
+	long latency;
+
+	/* the driver is used for only one reader */
+	if (0 == reader)
+		reader = record->reader;
+	if (record->reader != reader)
+	{
+		skipped++;
+		return 0;
+	}
+
+	if (print_only || verbose)
+	{
+		printf("%u.%06u reader %u hCard %d ", record->sec, record->usec,
+			record->reader, record->hCard);
+		switch (record->type)
+		{
+			case CAPTURE_TRANSMIT:
+				if (SCARD_PROTOCOL_RAW == record->param)
+					printf("transmit raw");
+				else
+					printf("transmit T=%d",
+						SCARD_PROTOCOL_T1 == record->param);
+				break;
+
+			case CAPTURE_CONTROL:
+				printf("control 0x%08X", record->param);
+				break;
+
+			case CAPTURE_STATUS:
+				printf("status 0x%04X", record->param);
+				break;
+		}
+		printf(" rv 0x%08X %u us\n", record->rv, record->latency);
+		dump(" > ", send, record->sendLength);
+		dump(" < ", recv, record->recvLength);
+
+		if (print_only)
+			return 0;
+	}
+
+	/* keep the time between the records of the capture */
+	if (timed)
+	{
+		long delay;
+
+		if (0 == first_record.tv_sec)
+		{
+			first_record.tv_sec = record->sec;
+			first_record.tv_usec = record->usec;
+			(void)gettimeofday(&replay_start, NULL);
+		}
+
+		delay = (record->sec - first_record.tv_sec) * 1000000
+			+ ((long)record->usec - first_record.tv_usec)
+			- elapsed(&replay_start);
+		if (delay > 0)
+			(void)usleep(delay);
+	}
+
+	(void)gettimeofday(&start, NULL);
+
+	switch (record->type)
+	{
+		case CAPTURE_TRANSMIT:
+			/* T=0 or T=1, a raw exchange does not use a protocol */
+			if ((record->param != protocol)
+				&& (record->param != SCARD_PROTOCOL_RAW))
+			{
+				(void)f.SetProtocolParameters(LUN, record->param,
+					0, 0, 0, 0);
+				protocol = record->param;
+				(void)gettimeofday(&start, NULL);
+			}
+			{
+				SCARD_IO_HEADER pci;
+
+				/* the same conversion as SCardTransmit() */
+				if (SCARD_PROTOCOL_T1 == record->param)
+					pci.Protocol = 1;
+				else if (SCARD_PROTOCOL_RAW == record->param)
+					pci.Protocol = SCARD_PROTOCOL_RAW;
+				else
+					pci.Protocol = 0;
+				pci.Length = 0;
+				rv = f.TransmitToICC(LUN, pci, (PUCHAR)send,
+					record->sendLength, buffer, &length, NULL);
+			}
+			break;
+
+		case CAPTURE_CONTROL:
+			rv = f.Control(LUN, record->param, (PUCHAR)send,
+				record->sendLength, buffer, sizeof(buffer), &length);
+			break;
+
+		case CAPTURE_STATUS:
+			/* card removed */
+			if (0 == record->recvLength)
+				return 0;
+
+			/* card inserted */
+			rv = f.PowerICC(LUN, IFD_RESET, buffer, &length);
+			protocol = 0;
+			break;
+	}
+
+	latency = elapsed(&start);
+
+	s->count++;
+	s->captured += record->latency;
+	s->replayed += latency;
+	if (latency > s->max)
+		s->max = latency;
+
+	if ((IFD_SUCCESS == rv) != (SCARD_S_SUCCESS == record->rv))
+	{
+		s->errors++;
+		printf("%u.%06u: driver returned %ld instead of 0x%08X\n",
+			record->sec, record->usec, rv, record->rv);
+		return -1;
+	}
+
+	if ((IFD_SUCCESS == rv) && ((length != record->recvLength)
+		|| memcmp(buffer, recv, length)))
+	{
+		s->mismatches++;
+		if (verbose)
+			dump(" ! ", buffer, length);
+	}
+
+	return 0;
+}
+
+static void dump(const char *text, const unsigned char *buffer, int length)
+{
+	int i;
+
+	if (0 == length)
+		return;
+
+	printf("%s", text);
+	for (i=0; i<length; i++)
+		printf("%02X ", buffer[i]);
+	printf("\n");
+}
+
+static long elapsed(struct timeval *start)
+{
+	struct timeval end;
+
+	(void)gettimeofday(&end, NULL);
+
+	return (end.tv_sec - start->tv_sec) * 1000000
+		+ (end.tv_usec - start->tv_usec);
+}
+
+static void usage(const char *name)
+{
+	(void)fprintf(stderr, "Usage: %s [options] capture...\n", name);
+	(void)fprintf(stderr,
+		"  -l driver\tdriver to use\n"
+		"  -d device\tdevice name given to IFDHCreateChannelByName()\n"
+		"  -c channel\tchannel given to IFDHCreateChannel()\n"
+		"  -r reader\treader to replay (default: the first one)\n"
+		"  -t\t\tkeep the time between the records\n"
+		"  -p\t\tprint the capture only, no driver is used\n"
+		"  -v\t\tverbose\n"
+		"Give the oldest capture first: %s -l driver -d device "
+		"capture.1 capture\n", name);
+}
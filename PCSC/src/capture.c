@@ -0,0 +1,259 @@
+/*
+ * MUSCLE SmartCard Development ( http://www.linuxnet.com )
+ *
+ * Copyright (C) 2009
+ *  Ludovic Rousseau <ludovic.rousseau@free.fr>
+ *
+ * $Id$
+ */
+
+/**
+ * @file
+ * @brief This records the traffic with the readers in a binary capture
+ * file. See capture.h for the file format.
+ *
+ * The file is mapped in memory so a record is only a memcpy() and the
+ * records are not lost if pcscd crashes.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include "misc.h"
+#include "pcscd.h"
+#include "ifdhandler.h"
+#include "debuglog.h"
+#include "thread_generic.h"
+#include "readerfactory.h"
+#include "capture.h"
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+/** a capture file is used */
+int CAPActive = FALSE;
+
+static char CaptureFile[PATH_MAX];
+static unsigned char *CaptureMap = NULL;
+static PCSCLITE_MUTEX CaptureMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int CAPCreateFile(int rotate);
+static void CAPUnmapFile(void);
+
+/**
+ * Starts the capture in a new file.
+ *
+ * @param file capture file. An existing file is overwritten.
+ * @return 0 or -1 in case of error
+ */
+int CAPOpen(const char *file)
+{
+	int fd;
+
+	/* pcscd changes its working directory when it becomes a daemon */
+	fd = open(file, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+	if ((fd < 0) || (NULL == realpath(file, CaptureFile)))
+	{
+		Log3(PCSC_LOG_CRITICAL, "Cannot create %s: %s", file,
+			strerror(errno));
+		if (fd >= 0)
+			(void)close(fd);
+		return -1;
+	}
+	(void)close(fd);
+
+	if (CAPCreateFile(FALSE) < 0)
+		return -1;
+
+	Log2(PCSC_LOG_INFO, "Capture to %s", CaptureFile);
+	CAPActive = TRUE;
+
+	return 0;
+} /* CAPOpen */
+
+void CAPClose(void)
+{
+	(void)SYS_MutexLock(&CaptureMutex);
+	CAPActive = FALSE;
+	CAPUnmapFile();
+	(void)SYS_MutexUnLock(&CaptureMutex);
+} /* CAPClose */
+
+/**
+ * Records an exchange with a reader.
+ *
+ * @param type CAPTURE_TRANSMIT, CAPTURE_CONTROL or CAPTURE_STATUS
+ * @param rContext reader
+ * @param hCard card handle used or 0
+ * @param param protocol (SCARD_PROTOCOL_T0, etc.), control code or
+ * reader state
+ * @param rv result of the exchange
+ * @param send command
+ * @param sendLength command length
+ * @param recv response or ATR
+ * @param recvLength response length
+ * @param start time of the request, now is the time of the response
+ */
+void CAPRecord(int type, struct ReaderContext *rContext, SCARDHANDLE hCard,
+	DWORD param, LONG rv, const UCHAR *send, DWORD sendLength,
+	const UCHAR *recv, DWORD recvLength, struct timeval *start)
+{
+	struct CaptureHeader *header;
+	struct CaptureRecord record;
+	struct timeval end;
+	uint32_t length;
+
+	(void)gettimeofday(&end, NULL);
+
+	/* records are 4 bytes aligned */
+	length = (sizeof(record) + sendLength + recvLength + 3) & ~3;
+	if (length > CAPTURE_FILE_SIZE - sizeof(*header))
+		return;
+
+	record.length = length;
+	record.type = type;
+	record.reader = rContext->dwIdentity >> IDENTITY_SHIFT;
+	record.sec = start->tv_sec;
+	record.usec = start->tv_usec;
+	record.latency = (end.tv_sec - start->tv_sec) * 1000000
+		+ (end.tv_usec - start->tv_usec);
+	record.hCard = hCard;
+	record.param = param;
+	record.rv = rv;
+	record.sendLength = sendLength;
+	record.recvLength = recvLength;
+
+	(void)SYS_MutexLock(&CaptureMutex);
+
+	if (NULL == CaptureMap)
+		goto end;
+
+	header = (struct CaptureHeader *)CaptureMap;
+	if (header->used + length > header->size)
+	{
+		/* the file is full, start a new one */
+		CAPUnmapFile();
+		if (CAPCreateFile(TRUE) < 0)
+		{
+			CAPActive = FALSE;
+			goto end;
+		}
+		header = (struct CaptureHeader *)CaptureMap;
+	}
+
+	memcpy(CaptureMap + header->used, &record, sizeof(record));
+	if (sendLength)
+		memcpy(CaptureMap + header->used + sizeof(record), send, sendLength);
+	if (recvLength)
+		memcpy(CaptureMap + header->used + sizeof(record) + sendLength,
+			recv, recvLength);
+
+	header->records++;
+	header->used += length;
+
+end:
+	(void)SYS_MutexUnLock(&CaptureMutex);
+} /* CAPRecord */
+
+/**
+ * Creates and maps a new capture file.
+ *
+ * The file is created with a temporary name and renamed once its blocks
+ * are allocated: a failed creation leaves the previous file untouched
+ * and a full disk cannot make a later write in the mapping fail with
+ * SIGBUS.
+ *
+ * @param rotate the current file is kept with a ".1" suffix
+ */
+static int CAPCreateFile(int rotate)
+{
+	struct CaptureHeader *header;
+	char temp[PATH_MAX + 4];
+	int fd, ret;
+
+	(void)snprintf(temp, sizeof(temp), "%s.new", CaptureFile);
+	(void)unlink(temp);
+	fd = open(temp, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+	if (fd < 0)
+	{
+		Log3(PCSC_LOG_CRITICAL, "Cannot create %s: %s", temp,
+			strerror(errno));
+		return -1;
+	}
+
+#ifdef HAVE_POSIX_FALLOCATE
+	/* posix_fallocate() returns the error instead of setting errno */
+	ret = posix_fallocate(fd, 0, CAPTURE_FILE_SIZE);
+#else
+	ret = (ftruncate(fd, CAPTURE_FILE_SIZE) < 0) ? errno : 0;
+#endif
+	if (ret != 0)
+	{
+		Log3(PCSC_LOG_CRITICAL, "Cannot allocate %s: %s", temp,
+			strerror(ret));
+		(void)close(fd);
+		(void)unlink(temp);
+		return -1;
+	}
+
+	CaptureMap = mmap(NULL, CAPTURE_FILE_SIZE, PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	(void)close(fd);
+	if (MAP_FAILED == CaptureMap)
+	{
+		Log3(PCSC_LOG_CRITICAL, "Cannot map %s: %s", temp,
+			strerror(errno));
+		CaptureMap = NULL;
+		(void)unlink(temp);
+		return -1;
+	}
+
+	header = (struct CaptureHeader *)CaptureMap;
+	memcpy(header->magic, CAPTURE_MAGIC, sizeof(header->magic));
+	header->size = CAPTURE_FILE_SIZE;
+	header->used = sizeof(*header);
+	header->records = 0;
+	header->reserved = 0;
+
+	if (rotate)
+	{
+		char previous[PATH_MAX + 2];
+
+		(void)snprintf(previous, sizeof(previous), "%s.1", CaptureFile);
+		if (rename(CaptureFile, previous) < 0)
+			Log3(PCSC_LOG_ERROR, "Cannot rename %s: %s", CaptureFile,
+				strerror(errno));
+	}
+
+	if (rename(temp, CaptureFile) < 0)
+	{
+		Log3(PCSC_LOG_CRITICAL, "Cannot rename %s: %s", temp,
+			strerror(errno));
+		CAPUnmapFile();
+		(void)unlink(temp);
+		return -1;
+	}
+
+	return 0;
+} /* CAPCreateFile */
+
+static void CAPUnmapFile(void)
+{
+	if (NULL == CaptureMap)
+		return;
+
+	(void)munmap(CaptureMap, CAPTURE_FILE_SIZE);
+	CaptureMap = NULL;
+} /* CAPUnmapFile */
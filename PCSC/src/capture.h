@@ -0,0 +1,89 @@
+/*
+ * MUSCLE SmartCard Development ( http://www.linuxnet.com )
+ *
+ * Copyright (C) 2009
+ *  Ludovic Rousseau <ludovic.rousseau@free.fr>
+ *
+ * $Id$
+ */
+
+/**
+ * @file
+ * @brief This records the traffic with the readers in a binary capture
+ * file.
+ *
+ * The capture file starts with a struct CaptureHeader followed by the
+ * records. Each record is a struct CaptureRecord followed by the
+ * command and the response. All the integers are in the byte order of
+ * the host running pcscd.
+ *
+ * When the file is full it is renamed with a ".1" suffix (replacing the
+ * previous one) and a new file is started.
+ */
+
+#ifndef __capture_h__
+#define __capture_h__
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define CAPTURE_MAGIC "PCSCCAP2"
+
+/** default size of a capture file */
+#define CAPTURE_FILE_SIZE (4 * 1024 * 1024)
+
+	struct CaptureHeader
+	{
+		char magic[8];	/**< CAPTURE_MAGIC */
+		uint32_t size;	/**< size of the file */
+		uint32_t used;	/**< bytes used, header included */
+		uint32_t records;	/**< number of records */
+		uint32_t reserved;
+	};
+
+	/** record types */
+	enum {
+		CAPTURE_TRANSMIT = 1,	/**< SCardTransmit() */
+		CAPTURE_CONTROL,	/**< SCardControl() */
+		CAPTURE_STATUS	/**< card inserted or removed */
+	};
+
+	struct CaptureRecord
+	{
+		uint32_t length;	/**< size of the record, data included */
+		uint16_t type;	/**< CAPTURE_TRANSMIT, etc. */
+		uint16_t reader;	/**< reader context number, from 1 */
+		uint32_t sec;	/**< time of the request */
+		uint32_t usec;
+		uint32_t latency;	/**< time used by the driver, in us */
+		int32_t hCard;	/**< 0 for CAPTURE_STATUS */
+		/** CAPTURE_TRANSMIT: protocol (SCARD_PROTOCOL_T0,
+		 * SCARD_PROTOCOL_T1 or SCARD_PROTOCOL_RAW)
+		 * CAPTURE_CONTROL: control code
+		 * CAPTURE_STATUS: reader state (SCARD_PRESENT, etc.) */
+		uint32_t param;
+		int32_t rv;	/**< value returned by the driver */
+		uint32_t sendLength;	/**< command length */
+		uint32_t recvLength;	/**< response (or ATR) length */
+		/* followed by the command and the response */
+	};
+
+#ifdef PCSCD
+	extern int CAPActive;
+
+	int CAPOpen(const char *);
+	void CAPClose(void);
+	void CAPRecord(int, struct ReaderContext *, SCARDHANDLE, DWORD, LONG,
+		const UCHAR *, DWORD, const UCHAR *, DWORD, struct timeval *);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -27,11 +27,14 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <time.h>
+#include <signal.h>
+#include <errno.h>
 
 #include "pcsclite.h"
 #include "misc.h"
 #include "debuglog.h"
 #include "sys_generic.h"
+#include "thread_generic.h"
 #include "strlcpycat.h"
 
 /**
@@ -40,6 +43,11 @@
  */
 #define DEBUG_BUF_SIZE 2048
 
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
 static char LogSuppress = DEBUGLOG_LOG_ENTRIES;
 static char LogMsgType = DEBUGLOG_NO_DEBUG;
 static char LogCategory = DEBUG_CATEGORY_NOTHING;
@@ -49,7 +57,75 @@ static char LogLevel = PCSC_LOG_ERROR;
 
 static signed char LogDoColor = 0;	/**< no color by default */
 
-static void log_line(const int priority, const char *DebugBuffer);
+#if defined(PCSCD) && defined(__GNUC__)
+/**
+ * The log lines are written by a separate thread started by
+ * DebugLogStartThread(). Each thread logging something gets its own
+ * ring of records. The thread only copies the message in its ring and
+ * the writer thread does the hex dumps and the writes to stderr or
+ * syslog. No lock is taken by the logging threads.
+ */
+#define LOG_THREAD
+
+/** number of records in a ring, must be a power of 2 */
+#define LOG_RING_SIZE 128
+
+/** size of a record data. A longer message ends with LOG_TRUNCATED and
+ * a longer hex dump is truncated */
+#define LOG_RECORD_DATA 512
+#define LOG_TRUNCATED "..."
+
+enum {
+	LOG_RECORD_TEXT = 0,	/**< data is the formatted message */
+	LOG_RECORD_XXD	/**< data is a message and a buffer to dump */
+};
+
+struct LogRecord
+{
+	unsigned int seq;	/**< order of the records of all the threads */
+	struct timeval time;	/**< only used by the colored output */
+	char priority;
+	char type;	/**< LOG_RECORD_TEXT or LOG_RECORD_XXD */
+	short msgLength;	/**< LOG_RECORD_XXD: length of the message */
+	int size;	/**< LOG_RECORD_XXD: bytes of the buffer in data */
+	int len;	/**< LOG_RECORD_XXD: size of the original buffer */
+	char data[LOG_RECORD_DATA];
+};
+
+struct LogRing
+{
+	struct LogRecord records[LOG_RING_SIZE];
+	volatile unsigned int head;	/**< next record written by the thread */
+	volatile unsigned int tail;	/**< next record read by the writer */
+	volatile unsigned int dropped;	/**< records lost because the ring was full */
+	unsigned int reported;	/**< dropped records already reported */
+	volatile int orphan;	/**< the thread has exited */
+	struct LogRing *next;
+};
+
+static int LogAsync = FALSE;	/**< the writer thread is running */
+static volatile unsigned int LogSeq = 0;
+static volatile int WriterSleeping = FALSE;
+static int WriterPipe[2] = { -1, -1 };
+static PCSCLITE_THREAD_T WriterThread;
+/** protects LogRings and the writes */
+static PCSCLITE_MUTEX WriterMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct LogRing *LogRings = NULL;
+static pthread_key_t LogRingKey;
+
+static struct LogRing *log_ring(void);
+static void log_ring_exit(void *arg);
+static int log_queue(const int priority, const int type, const char *msg,
+	int msgLength, const unsigned char *buffer, const int len);
+static int log_drain(void);
+static void *log_writer(void *arg);
+#endif
+
+static void log_line(const int priority, const char *DebugBuffer,
+	struct timeval *time);
+static void log_xxd_line(const int priority, const char *msg,
+	const unsigned char *buffer, const int size, const int len,
+	struct timeval *time);
 
 void log_msg(const int priority, const char *fmt, ...)
 {
@@ -65,10 +141,20 @@ void log_msg(const int priority, const char *fmt, ...)
 	vsnprintf(DebugBuffer, DEBUG_BUF_SIZE, fmt, argptr);
 	va_end(argptr);
 
-	log_line(priority, DebugBuffer);
+#ifdef LOG_THREAD
+	if (LogAsync && log_queue(priority, LOG_RECORD_TEXT, DebugBuffer,
+		strlen(DebugBuffer), NULL, 0))
+		return;
+#endif
+
+	log_line(priority, DebugBuffer, NULL);
 } /* log_msg */
 
-static void log_line(const int priority, const char *DebugBuffer)
+/**
+ * @param time time of the log or NULL for now
+ */
+static void log_line(const int priority, const char *DebugBuffer,
+	struct timeval *time)
 {
 	if (DEBUGLOG_SYSLOG_DEBUG == LogMsgType)
 		syslog(LOG_INFO, "%s", DebugBuffer);
@@ -103,7 +189,10 @@ static void log_line(const int priority, const char *DebugBuffer)
 					break;
 			}
 
-			gettimeofday(&new_time, NULL);
+			if (time)
+				new_time = *time;
+			else
+				gettimeofday(&new_time, NULL);
 			if (0 == last_time.tv_sec)
 				last_time = new_time;
 
@@ -128,8 +217,12 @@ static void log_line(const int priority, const char *DebugBuffer)
 	}
 } /* log_msg */
 
-static void log_xxd_always(const int priority, const char *msg,
-	const unsigned char *buffer, const int len)
+/**
+ * Dumps the size first bytes of a len bytes buffer
+ */
+static void log_xxd_line(const int priority, const char *msg,
+	const unsigned char *buffer, const int size, const int len,
+	struct timeval *time)
 {
 	char DebugBuffer[DEBUG_BUF_SIZE];
 	int i;
@@ -141,19 +234,303 @@ static void log_xxd_always(const int priority, const char *msg,
 	strlcpy(DebugBuffer, msg, sizeof(DebugBuffer));
 	c = DebugBuffer + strlen(DebugBuffer);
 
-	for (i = 0; (i < len) && (c < debug_buf_end); ++i)
+	for (i = 0; (i < size) && (c < debug_buf_end); ++i)
 	{
 		sprintf(c, "%02X ", buffer[i]);
 		c += 3;
 	}
 
 	/* the buffer is too small so end it with "..." */
-	if ((c >= debug_buf_end) && (i < len))
-		c[-3] = c[-2] = c[-1] = '.';
+	if (i < len)
+	{
+		if (c >= debug_buf_end)
+			c -= 3;
+		strcpy(c, "...");
+	}
+
+	log_line(priority, DebugBuffer, time);
+} /* log_xxd_line */
 
-	log_line(priority, DebugBuffer);
+static void log_xxd_always(const int priority, const char *msg,
+	const unsigned char *buffer, const int len)
+{
+#ifdef LOG_THREAD
+	if (LogAsync && log_queue(priority, LOG_RECORD_XXD, msg, strlen(msg),
+		buffer, len))
+		return;
+#endif
+
+	log_xxd_line(priority, msg, buffer, len, len, NULL);
 } /* log_xxd_always */
 
+#ifdef LOG_THREAD
+/**
+ * Returns the ring of the calling thread. The ring is created at the
+ * first log of the thread.
+ */
+static struct LogRing *log_ring(void)
+{
+	struct LogRing *ring;
+
+	ring = pthread_getspecific(LogRingKey);
+	if (ring)
+		return ring;
+
+	ring = calloc(1, sizeof(*ring));
+	if (NULL == ring)
+		return NULL;
+
+	(void)SYS_MutexLock(&WriterMutex);
+	ring->next = LogRings;
+	LogRings = ring;
+	(void)SYS_MutexUnLock(&WriterMutex);
+
+	(void)pthread_setspecific(LogRingKey, ring);
+
+	return ring;
+} /* log_ring */
+
+/**
+ * Called when a thread exits. The writer frees the ring once empty.
+ */
+static void log_ring_exit(void *arg)
+{
+	struct LogRing *ring = arg;
+
+	__sync_synchronize();
+	ring->orphan = TRUE;
+} /* log_ring_exit */
+
+/**
+ * Adds a record to the ring of the calling thread.
+ *
+ * @return 1 if the record is queued or dropped, 0 if it must be logged
+ * synchronously
+ */
+static int log_queue(const int priority, const int type, const char *msg,
+	int msgLength, const unsigned char *buffer, const int len)
+{
+	struct LogRing *ring;
+	struct LogRecord *record;
+	unsigned int head;
+
+	ring = log_ring();
+	if (NULL == ring)
+		return 0;
+
+	head = ring->head;
+	if (head - ring->tail >= LOG_RING_SIZE)
+	{
+		/* the writer is late */
+		ring->dropped++;
+		return 1;
+	}
+
+	record = &ring->records[head & (LOG_RING_SIZE - 1)];
+	record->seq = __sync_fetch_and_add(&LogSeq, 1);
+	if (LogDoColor)
+		gettimeofday(&record->time, NULL);
+	record->priority = priority;
+	record->type = type;
+
+	if (msgLength > LOG_RECORD_DATA - 1)
+	{
+		msgLength = LOG_RECORD_DATA - 1;
+		memcpy(record->data, msg, msgLength - sizeof(LOG_TRUNCATED) + 1);
+		memcpy(record->data + msgLength - sizeof(LOG_TRUNCATED) + 1,
+			LOG_TRUNCATED, sizeof(LOG_TRUNCATED) - 1);
+	}
+	else
+		memcpy(record->data, msg, msgLength);
+	record->data[msgLength] = '\0';
+
+	if (LOG_RECORD_XXD == type)
+	{
+		record->msgLength = msgLength;
+		record->len = len;
+		record->size = LOG_RECORD_DATA - msgLength - 1;
+		if (record->size > len)
+			record->size = len;
+		memcpy(record->data + msgLength + 1, buffer, record->size);
+	}
+
+	/* publish the record */
+	__sync_synchronize();
+	ring->head = head + 1;
+
+	/* the head store must be seen before WriterSleeping is read, the
+	 * writer does the opposite before its last log_drain() */
+	__sync_synchronize();
+
+	/* wake up the writer */
+	if (WriterSleeping
+		&& __sync_bool_compare_and_swap(&WriterSleeping, TRUE, FALSE))
+		(void)write(WriterPipe[1], "", 1);
+
+	return 1;
+} /* log_queue */
+
+/**
+ * Writes the queued records in the order they were logged.
+ * Must be called with WriterMutex locked.
+ *
+ * @return number of records written
+ */
+static int log_drain(void)
+{
+	struct LogRing *ring, **prev;
+	int written = 0;
+
+	for (;;)
+	{
+		struct LogRing *oldest = NULL;
+		struct LogRecord *record;
+
+		/* find the oldest record and free the rings of exited threads */
+		prev = &LogRings;
+		while ((ring = *prev) != NULL)
+		{
+			unsigned int dropped = ring->dropped;
+
+			if (dropped != ring->reported)
+			{
+				char DebugBuffer[80];
+
+				(void)snprintf(DebugBuffer, sizeof(DebugBuffer),
+					"%u log messages dropped", dropped - ring->reported);
+				log_line(PCSC_LOG_ERROR, DebugBuffer, NULL);
+				ring->reported = dropped;
+			}
+
+			if (ring->head != ring->tail)
+			{
+				__sync_synchronize();
+				if ((NULL == oldest) || ((int)(ring->records[ring->tail
+					& (LOG_RING_SIZE - 1)].seq - oldest->records[oldest->tail
+					& (LOG_RING_SIZE - 1)].seq) < 0))
+					oldest = ring;
+			}
+			else
+				if (ring->orphan)
+				{
+					*prev = ring->next;
+					free(ring);
+					continue;
+				}
+
+			prev = &ring->next;
+		}
+
+		if (NULL == oldest)
+			break;
+
+		record = &oldest->records[oldest->tail & (LOG_RING_SIZE - 1)];
+		if (LOG_RECORD_XXD == record->type)
+			log_xxd_line(record->priority, record->data,
+				(unsigned char *)record->data + record->msgLength + 1,
+				record->size, record->len, &record->time);
+		else
+			log_line(record->priority, record->data, &record->time);
+		written++;
+
+		/* the record can be reused */
+		__sync_synchronize();
+		oldest->tail++;
+	}
+
+	return written;
+} /* log_drain */
+
+static void *log_writer(void *arg)
+{
+	sigset_t set;
+	char c;
+
+	(void)arg;
+
+	/* the signals are handled by the other threads */
+	(void)sigfillset(&set);
+	(void)pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	for (;;)
+	{
+		int written;
+
+		(void)SYS_MutexLock(&WriterMutex);
+		(void)log_drain();
+
+		/* go to sleep and check again for a record queued meanwhile */
+		WriterSleeping = TRUE;
+		__sync_synchronize();
+		written = log_drain();
+		(void)SYS_MutexUnLock(&WriterMutex);
+
+		if (written
+			&& __sync_bool_compare_and_swap(&WriterSleeping, TRUE, FALSE))
+			continue;
+
+		if (read(WriterPipe[0], &c, 1) <= 0)
+			break;
+	}
+
+	return NULL;
+} /* log_writer */
+#endif
+
+#ifdef PCSCD
+/**
+ * Starts the thread writing the logs. The logs are written by the
+ * calling threads until this function is called. It must be called
+ * after the daemon has forked.
+ */
+int DebugLogStartThread(void)
+{
+#ifdef LOG_THREAD
+	if (LogAsync)
+		return 0;
+
+	if (pthread_key_create(&LogRingKey, log_ring_exit))
+		return -1;
+
+	if (pipe(WriterPipe) < 0)
+	{
+		Log2(PCSC_LOG_ERROR, "pipe: %s", strerror(errno));
+		return -1;
+	}
+
+	if (SYS_ThreadCreate(&WriterThread, THREAD_ATTR_DETACHED,
+		log_writer, NULL) != 0)
+	{
+		Log1(PCSC_LOG_ERROR, "Cannot create the log thread");
+		(void)close(WriterPipe[0]);
+		(void)close(WriterPipe[1]);
+		return -1;
+	}
+
+	LogAsync = TRUE;
+#endif
+
+	return 0;
+} /* DebugLogStartThread */
+
+/**
+ * Writes the logs still queued. The next logs are written by the
+ * calling threads. Used before exiting.
+ */
+void DebugLogFlush(void)
+{
+#ifdef LOG_THREAD
+	if (!LogAsync)
+		return;
+
+	(void)SYS_MutexLock(&WriterMutex);
+	LogAsync = FALSE;
+	(void)log_drain();
+	(void)SYS_MutexUnLock(&WriterMutex);
+#endif
+} /* DebugLogFlush */
+#endif
+
 void log_xxd(const int priority, const char *msg, const unsigned char *buffer,
 	const int len)
 {
@@ -21,6 +21,7 @@ extern "C"
 #endif
 
 	int DYN_LoadLibrary(void **, char *);
+	int DYN_LoadLibraryNow(void **, char *);
 	int DYN_CloseLibrary(void **);
 	int DYN_GetAddress(void *, /*@out@*/ void **, const char *);
 
@@ -44,6 +44,12 @@ int DYN_LoadLibrary(void **pvLHandle, char *pcLibrary)
 	return SCARD_S_SUCCESS;
 }
 
+int DYN_LoadLibraryNow(void **pvLHandle, char *pcLibrary)
+{
+	/* shl_load() already binds all the symbols with BIND_IMMEDIATE */
+	return DYN_LoadLibrary(pvLHandle, pcLibrary);
+}
+
 int DYN_CloseLibrary(void **pvLHandle)
 {
 
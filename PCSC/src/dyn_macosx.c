@@ -71,6 +71,12 @@ int DYN_LoadLibrary(void **pvLHandle, char *pcLibrary)
 	return SCARD_S_SUCCESS;
 }
 
+int DYN_LoadLibraryNow(void **pvLHandle, char *pcLibrary)
+{
+	/* the bundle code is loaded by DYN_LoadLibrary() */
+	return DYN_LoadLibrary(pvLHandle, pcLibrary);
+}
+
 int DYN_CloseLibrary(void **pvLHandle)
 {
 
@@ -26,10 +26,10 @@
 #include "debug.h"
 #include "dyn_generic.h"
 
-INTERNAL int DYN_LoadLibrary(void **pvLHandle, char *pcLibrary)
+static int DYN_Open(void **pvLHandle, char *pcLibrary, int mode)
 {
 	*pvLHandle = NULL;
-	*pvLHandle = dlopen(pcLibrary, RTLD_LAZY);
+	*pvLHandle = dlopen(pcLibrary, mode);
 
 	if (*pvLHandle == NULL)
 	{
@@ -40,6 +40,20 @@ INTERNAL int DYN_LoadLibrary(void **pvLHandle, char *pcLibrary)
 	return SCARD_S_SUCCESS;
 }
 
+INTERNAL int DYN_LoadLibrary(void **pvLHandle, char *pcLibrary)
+{
+	return DYN_Open(pvLHandle, pcLibrary, RTLD_LAZY);
+}
+
+/**
+ * Same as DYN_LoadLibrary() but all the symbols of the library are
+ * resolved now instead of at their first use.
+ */
+INTERNAL int DYN_LoadLibraryNow(void **pvLHandle, char *pcLibrary)
+{
+	return DYN_Open(pvLHandle, pcLibrary, RTLD_NOW);
+}
+
 INTERNAL int DYN_CloseLibrary(void **pvLHandle)
 {
 	int ret;
@@ -38,6 +38,8 @@
 #include "utils.h"
 #include "winscard_svc.h"
 #include "simclist.h"
+#include "capture.h"
+#include "metrics.h"
 
 READER_STATE readerStates[PCSCLITE_MAX_READERS_CONTEXTS];
 static list_t ClientsWaitingForEvent;	/**< list of client file descriptors */
@@ -95,6 +97,8 @@ LONG EHSignalEventToClients(void)
 	}
 	list_iterator_stop(&ClientsWaitingForEvent);
 
+	METEventFanout(list_size(&ClientsWaitingForEvent));
+
 	list_clear(&ClientsWaitingForEvent);
 
 	SYS_MutexUnLock(ClientsWaitingForEvent_lock);
@@ -266,6 +270,7 @@ static void EHStatusHandlerThread(PREADER_CONTEXT rContext)
 	DWORD dwStatus, dwReaderSharing;
 	DWORD dwCurrentState;
 	DWORD dwAtrLen;
+	struct timeval start;
 
 	/*
 	 * Zero out everything
@@ -283,6 +288,9 @@ static void EHStatusHandlerThread(PREADER_CONTEXT rContext)
 
 	if (dwStatus & SCARD_PRESENT)
 	{
+		if (CAPActive)
+			(void)gettimeofday(&start, NULL);
+
 		dwAtrLen = MAX_ATR_SIZE;
 		rv = IFDPowerICC(rContext, IFD_POWER_UP,
 			rContext->readerState->cardAtr,
@@ -323,6 +331,11 @@ static void EHStatusHandlerThread(PREADER_CONTEXT rContext)
 			Log3(PCSC_LOG_ERROR, "Error powering up card: %d 0x%04X", rv, rv);
 		}
 
+		if (CAPActive)
+			CAPRecord(CAPTURE_STATUS, rContext, 0, dwStatus, rv, NULL, 0,
+				rContext->readerState->cardAtr,
+				rContext->readerState->cardAtrLength, &start);
+
 		dwCurrentState = SCARD_PRESENT;
 	}
 	else
@@ -406,6 +419,14 @@ static void EHStatusHandlerThread(PREADER_CONTEXT rContext)
 				rContext->readerState->readerState &= ~SCARD_SPECIFIC;
 				dwCurrentState = SCARD_ABSENT;
 
+				if (CAPActive)
+				{
+					(void)gettimeofday(&start, NULL);
+					CAPRecord(CAPTURE_STATUS, rContext, 0,
+						rContext->readerState->readerState, SCARD_S_SUCCESS,
+						NULL, 0, NULL, 0, &start);
+				}
+
 				incrementEventCounter(rContext->readerState);
 
 				(void)EHSignalEventToClients();
@@ -420,6 +441,9 @@ static void EHStatusHandlerThread(PREADER_CONTEXT rContext)
 				/*
 				 * Power and reset the card
 				 */
+				if (CAPActive)
+					(void)gettimeofday(&start, NULL);
+
 				dwAtrLen = MAX_ATR_SIZE;
 				rv = IFDPowerICC(rContext, IFD_POWER_UP,
 					rContext->readerState->cardAtr,
@@ -453,6 +477,12 @@ static void EHStatusHandlerThread(PREADER_CONTEXT rContext)
 
 				dwCurrentState = SCARD_PRESENT;
 
+				if (CAPActive)
+					CAPRecord(CAPTURE_STATUS, rContext, 0,
+						rContext->readerState->readerState, rv, NULL, 0,
+						rContext->readerState->cardAtr,
+						rContext->readerState->cardAtrLength, &start);
+
 				incrementEventCounter(rContext->readerState);
 
 				(void)EHSignalEventToClients();
@@ -0,0 +1,129 @@
+/*
+ * MUSCLE SmartCard Development ( http://www.linuxnet.com )
+ *
+ * Copyright (C) 2009
+ *  Ludovic Rousseau <ludovic.rousseau@free.fr>
+ *
+ * $Id$
+ */
+
+/**
+ * @file
+ * @brief Histograms in the Prometheus text format.
+ *
+ * The callers serialize the accesses to a histogram.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+#include "histogram.h"
+
+/**
+ * Counts a value.
+ *
+ * @param histogram histogram
+ * @param bounds upper bounds of the buckets, in increasing order
+ * @param size number of bounds, at most \ref HISTOGRAM_BUCKETS
+ * @param value value to count
+ */
+void HISTAddValue(struct Histogram *histogram, const long *bounds,
+	size_t size, long value)
+{
+	size_t i;
+
+	for (i=0; (i<size) && (value > bounds[i]); i++)
+		;
+
+	histogram->buckets[i]++;
+	histogram->count++;
+	histogram->sum += value;
+} /* HISTAddValue */
+
+/**
+ * Appends to a text. After a memory error the text is freed and left
+ * NULL.
+ */
+void HISTPrintf(struct Text *text, const char *fmt, ...)
+{
+	va_list argptr;
+	int length;
+
+	/* a previous realloc() failed */
+	if ((NULL == text->buffer) && text->size)
+		return;
+
+	while (1)
+	{
+		va_start(argptr, fmt);
+		length = vsnprintf(text->buffer + text->length,
+			text->size - text->length, fmt, argptr);
+		va_end(argptr);
+
+		if ((length >= 0)
+			&& ((size_t)length < text->size - text->length))
+			break;
+
+		{
+			size_t size = text->size ? text->size * 2 : 16384;
+			char *buffer = realloc(text->buffer, size);
+
+			if (NULL == buffer)
+			{
+				free(text->buffer);
+				text->buffer = NULL;
+				return;
+			}
+			text->buffer = buffer;
+			text->size = size;
+		}
+	}
+
+	text->length += length;
+} /* HISTPrintf */
+
+/**
+ * Prints a histogram.
+ *
+ * @param text output
+ * @param name metric name
+ * @param label extra label or NULL
+ * @param histogram values
+ * @param bounds upper bounds of the buckets
+ * @param size number of bounds
+ * @param unit the bounds and the sum are divided by unit
+ */
+void HISTPrint(struct Text *text, const char *name, const char *label,
+	const struct Histogram *histogram, const long *bounds, size_t size,
+	double unit)
+{
+	const char *comma = label ? "," : "";
+	unsigned long count = 0;
+	size_t i;
+
+	if (NULL == label)
+		label = "";
+
+	for (i=0; i<size; i++)
+	{
+		count += histogram->buckets[i];
+		HISTPrintf(text, "%s_bucket{%s%sle=\"%g\"} %lu\n", name, label,
+			comma, bounds[i] / unit, count);
+	}
+	HISTPrintf(text, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, label, comma,
+		histogram->count);
+
+	if (*label)
+	{
+		HISTPrintf(text, "%s_sum{%s} %.6f\n", name, label,
+			histogram->sum / unit);
+		HISTPrintf(text, "%s_count{%s} %lu\n", name, label, histogram->count);
+	}
+	else
+	{
+		HISTPrintf(text, "%s_sum %.6f\n", name, histogram->sum / unit);
+		HISTPrintf(text, "%s_count %lu\n", name, histogram->count);
+	}
+} /* HISTPrint */
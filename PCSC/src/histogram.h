@@ -0,0 +1,60 @@
+/*
+ * MUSCLE SmartCard Development ( http://www.linuxnet.com )
+ *
+ * Copyright (C) 2009
+ *  Ludovic Rousseau <ludovic.rousseau@free.fr>
+ *
+ * $Id$
+ */
+
+/**
+ * @file
+ * @brief Histograms in the Prometheus text format.
+ *
+ * Shared by the pcscd counters (metrics.c) and the libpcsclite
+ * statistics (statistics.c).
+ */
+
+#ifndef __histogram_h__
+#define __histogram_h__
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** maximum number of bucket bounds of a histogram */
+#define HISTOGRAM_BUCKETS 16
+
+struct Histogram
+{
+	/** the one after the last bound is +Inf */
+	unsigned long buckets[HISTOGRAM_BUCKETS + 1];
+	unsigned long count;
+	unsigned long long sum;
+};
+
+/** text buffer growing as needed */
+struct Text
+{
+	char *buffer;	/**< NULL if a realloc() failed */
+	size_t length;
+	size_t size;
+};
+
+	void HISTAddValue(struct Histogram *, const long *, size_t, long);
+	void HISTPrintf(struct Text *, const char *, ...)
+#ifdef __GNUC__
+		__attribute__ ((format (printf, 2, 3)))
+#endif
+		;
+	void HISTPrint(struct Text *, const char *, /*@null@*/ const char *,
+		const struct Histogram *, const long *, size_t, double);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,385 @@
+/*
+ * MUSCLE SmartCard Development ( http://www.linuxnet.com )
+ *
+ * Copyright (C) 2009
+ *  Ludovic Rousseau <ludovic.rousseau@free.fr>
+ *
+ * $Id$
+ */
+
+/**
+ * @file
+ * @brief Benchmark of the USB device to driver matching of the libusb
+ * hotplug.
+ *
+ * A synthetic USB tree and a synthetic list of driver aliases are given
+ * to the hotplug code of hotplug_libusb.c through a fake libusb. The time
+ * of a bus rescan is compared to the time needed by the linear search of
+ * the drivers used before.
+ *
+ * Usage: hotplug-bench [-n rescans] [-d devices] [-a aliases]
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <usb.h>
+
+#include "misc.h"
+#include "wintypes.h"
+#include "pcscd.h"
+#include "debuglog.h"
+#include "readerfactory.h"
+#include "sys_generic.h"
+#include "hotplug_libusb.h"
+
+#define DEVICES_PER_BUS 20
+
+/** fake libusb bus tree */
+static struct usb_bus *bus_list = NULL;
+/** number of devices found by the linear search */
+static int linear_found;
+
+struct usb_bus *usb_get_busses(void)
+{
+	return bus_list;
+}
+
+void usb_init(void)
+{
+}
+
+int usb_find_busses(void)
+{
+	return 0;
+}
+
+int usb_find_devices(void)
+{
+	return 0;
+}
+
+usb_dev_handle *usb_open(struct usb_device *dev)
+{
+	(void)dev;
+
+	return NULL;
+}
+
+int usb_close(usb_dev_handle *dev)
+{
+	(void)dev;
+
+	return 0;
+}
+
+int usb_get_string_simple(usb_dev_handle *dev, int index, char *buf,
+	size_t buflen)
+{
+	(void)dev;
+	(void)index;
+	(void)buf;
+	(void)buflen;
+
+	return -1;
+}
+
+char *usb_strerror(void)
+{
+	return "fake libusb";
+}
+
+/* the reader factory and the bundle parser of pcscd are not used */
+LONG RFAddReader(LPSTR lpcReader, DWORD dwPort, LPSTR lpcLibrary,
+	LPSTR lpcDevice)
+{
+	(void)lpcReader;
+	(void)dwPort;
+	(void)lpcLibrary;
+	(void)lpcDevice;
+
+	return SCARD_S_SUCCESS;
+}
+
+LONG RFAddReaders(READER_ADD readers[], int count)
+{
+	int i;
+
+	for (i=0; i<count; i++)
+		readers[i].rv = SCARD_S_SUCCESS;
+
+	return SCARD_S_SUCCESS;
+}
+
+LONG RFPreloadDriver(LPSTR lpcLibrary)
+{
+	(void)lpcLibrary;
+
+	return SCARD_S_SUCCESS;
+}
+
+void RFReleasePreloadedDriver(LPSTR lpcLibrary)
+{
+	(void)lpcLibrary;
+}
+
+LONG RFRemoveReader(LPSTR lpcReader, DWORD dwPort)
+{
+	(void)lpcReader;
+	(void)dwPort;
+
+	return SCARD_S_SUCCESS;
+}
+
+void RFReCheckReaderConf(void)
+{
+}
+
+int CheckForOpenCT(void)
+{
+	return 0;
+}
+
+int LTPBundleFindValueWithKey(const char *fileName, const char *tokenKey,
+	char *tokenValue, int tokenIndice)
+{
+	(void)fileName;
+	(void)tokenKey;
+	(void)tokenValue;
+	(void)tokenIndice;
+
+	return -1;
+}
+
+void log_msg(const int priority, const char *fmt, ...)
+{
+	(void)priority;
+	(void)fmt;
+}
+
+void log_xxd(const int priority, const char *msg, const unsigned char *buffer,
+	const int size)
+{
+	(void)priority;
+	(void)msg;
+	(void)buffer;
+	(void)size;
+}
+
+int HPForceReaderPolling = 0;
+
+/**
+ * Creates aliases drivers, like the Info.plist of a big driver would do.
+ */
+static int create_drivers(int aliases)
+{
+	int i;
+
+	driverTracker = calloc(aliases, sizeof(*driverTracker));
+	if (NULL == driverTracker)
+		return -1;
+
+	for (i=0; i<aliases; i++)
+	{
+		char name[MAX_READERNAME];
+
+		/* a few vendors with many products each */
+		driverTracker[i].manuID = 0x0400 + (rand() % 64) * 0x10;
+		driverTracker[i].productID = rand() % 0x10000;
+		driverTracker[i].bundleName = strdup(i % 4 ?
+			"ifd-ccid.bundle" : "ifd-other.bundle");
+		driverTracker[i].libraryPath = strdup("/usr/lib/pcsc/libfake.so");
+		snprintf(name, sizeof(name), "Fake Reader %d", i);
+		driverTracker[i].readerName = strdup(name);
+	}
+	driverSize = aliases;
+
+	/* as done by HPReadBundleValues() */
+	qsort(driverTracker, driverSize, sizeof(*driverTracker),
+		HPCompareDrivers);
+
+	return 0;
+}
+
+/**
+ * Creates the USB tree. One device every devices/readers is a reader
+ * supported by a driver.
+ */
+static int create_devices(int devices, int readers)
+{
+	struct usb_bus *bus = NULL;
+	int i;
+
+	for (i=0; i<devices; i++)
+	{
+		struct usb_device *dev;
+
+		if (0 == i % DEVICES_PER_BUS)
+		{
+			bus = calloc(1, sizeof(*bus));
+			if (NULL == bus)
+				return -1;
+
+			snprintf(bus->dirname, sizeof(bus->dirname), "%03d",
+				i / DEVICES_PER_BUS + 1);
+			bus->next = bus_list;
+			bus_list = bus;
+		}
+
+		dev = calloc(1, sizeof(*dev));
+		if (NULL == dev)
+			return -1;
+
+		snprintf(dev->filename, sizeof(dev->filename), "%03d",
+			i % DEVICES_PER_BUS + 1);
+
+		if (readers && (0 == i % (devices / readers)))
+		{
+			int driver = rand() % driverSize;
+
+			dev->descriptor.idVendor = driverTracker[driver].manuID;
+			dev->descriptor.idProduct = driverTracker[driver].productID;
+		}
+		else
+		{
+			/* not a smart card reader */
+			dev->descriptor.idVendor = 0x8000 + rand() % 0x1000;
+			dev->descriptor.idProduct = rand() % 0x10000;
+		}
+
+		dev->next = bus->devices;
+		bus->devices = dev;
+	}
+
+	return 0;
+}
+
+/**
+ * Matches the USB tree the way HPRescanUsbBus() did before the drivers
+ * were sorted.
+ */
+static void linear_rescan(void)
+{
+	struct usb_bus *bus;
+	struct usb_device *dev;
+	int i;
+
+	for (bus = usb_get_busses(); bus; bus = bus->next)
+		for (dev = bus->devices; dev; dev = dev->next)
+			for (i=0; i<driverSize; i++)
+				if (driverTracker[i].libraryPath != NULL &&
+					dev->descriptor.idVendor == driverTracker[i].manuID &&
+					dev->descriptor.idProduct == driverTracker[i].productID)
+				{
+					linear_found++;
+					break;
+				}
+}
+
+static long elapsed(struct timeval *start)
+{
+	struct timeval end;
+
+	(void)gettimeofday(&end, NULL);
+
+	return (end.tv_sec - start->tv_sec) * 1000000
+		+ (end.tv_usec - start->tv_usec);
+}
+
+static void usage(const char *name)
+{
+	(void)fprintf(stderr, "Usage: %s [options]\n", name);
+	(void)fprintf(stderr,
+		"  -n rescans\tnumber of bus rescans (default 1000)\n"
+		"  -d devices\tnumber of USB devices (default 500)\n"
+		"  -a aliases\tnumber of driver aliases (default 300)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct timeval start;
+	long linear_time, indexed_time;
+	int opt, i, readers;
+	int rescans = 1000, devices = 500, aliases = 300;
+
+	while ((opt = getopt(argc, argv, "n:d:a:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'n':
+				rescans = atoi(optarg);
+				break;
+
+			case 'd':
+				devices = atoi(optarg);
+				break;
+
+			case 'a':
+				aliases = atoi(optarg);
+				break;
+
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if ((rescans < 1) || (devices < 1) || (aliases < 1))
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* same tree for each run */
+	srand(1);
+
+	readers = devices < PCSCLITE_MAX_READERS_CONTEXTS / 2 ?
+		devices : PCSCLITE_MAX_READERS_CONTEXTS / 2;
+
+	if ((create_drivers(aliases) < 0) || (create_devices(devices, readers) < 0))
+	{
+		printf("Not enough memory\n");
+		return 1;
+	}
+
+	for (i=0; i<PCSCLITE_MAX_READERS_CONTEXTS; i++)
+	{
+		readerTracker[i].status = READER_ABSENT;
+		readerTracker[i].bus_device[0] = '\0';
+		readerTracker[i].fullName = NULL;
+	}
+	(void)SYS_MutexInit(&usbNotifierMutex);
+
+	(void)gettimeofday(&start, NULL);
+	for (i=0; i<rescans; i++)
+		linear_rescan();
+	linear_time = elapsed(&start);
+
+	(void)gettimeofday(&start, NULL);
+	for (i=0; i<rescans; i++)
+		HPRescanUsbBus();
+	indexed_time = elapsed(&start);
+
+	for (i=0; (i<PCSCLITE_MAX_READERS_CONTEXTS)
+		&& (readerTracker[i].fullName != NULL); i++)
+		;
+
+	printf("%d devices, %d driver aliases, %d readers found\n", devices,
+		driverSize, i);
+	printf("linear: %d rescans in %ld ms, %.2f us per rescan\n", rescans,
+		linear_time / 1000, (double)linear_time / rescans);
+	printf("sorted: %d rescans in %ld ms, %.2f us per rescan\n", rescans,
+		indexed_time / 1000, (double)indexed_time / rescans);
+
+	if (linear_found != i * rescans)
+	{
+		printf("ERROR: the linear search found %d readers\n",
+			linear_found / rescans);
+		return 1;
+	}
+
+	return 0;
+}
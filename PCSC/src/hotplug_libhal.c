@@ -265,7 +265,10 @@ LONG HPSearchHotPluggables(void)
 		readerTracker[i].fullName = NULL;
 	}
 
-	return HPReadBundleValues();
+	if (HPReadBundleValues())
+		return -1;
+
+	return 0;
 } /* HPSearchHotPluggables */
 
 
@@ -20,6 +20,8 @@
 
 #include <string.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <stdio.h>
 #include <dirent.h>
 #include <fcntl.h>
@@ -28,6 +30,11 @@
 #include <unistd.h>
 #include <errno.h>
 #include <usb.h>
+#ifdef HAVE_LINUX_NETLINK_H
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <poll.h>
+#endif
 
 #include "misc.h"
 #include "wintypes.h"
@@ -38,24 +45,19 @@
 #include "winscard_msg.h"
 #include "sys_generic.h"
 #include "hotplug.h"
+#include "hotplug_libusb.h"
 #include "utils.h"
 
 #undef DEBUG_HOTPLUG
 #define ADD_SERIAL_NUMBER
 
-#define BUS_DEVICE_STRSIZE	256
-
-#define READER_ABSENT		0
-#define READER_PRESENT		1
-#define READER_FAILED		2
-
 #define FALSE			0
 #define TRUE			1
 
 PCSCLITE_MUTEX usbNotifierMutex;
 
 static PCSCLITE_THREAD_T usbNotifyThread;
-static int driverSize = -1;
+HP_STATIC int driverSize = -1;
 static char AraKiriHotPlug = FALSE;
 static int rescan_pipe[] = { -1, -1 };
 extern int HPForceReaderPolling;
@@ -63,37 +65,83 @@ extern int HPForceReaderPolling;
 /* values of ifdCapabilities bits */
 #define IFD_GENERATE_HOTPLUG 1
 
+HP_STATIC struct _driverTracker *driverTracker = NULL;
+#define DRIVER_TRACKER_SIZE_STEP 8
+
 /**
- * keep track of drivers in a dynamically allocated array
+ * Info.plist file of a bundle as seen when the drivers were read
  */
-static struct _driverTracker
+struct _bundleStamp
+{
+	char *name;
+	time_t mtime;
+	off_t size;
+};
+
+/*
+ * drivers cache file, in the native byte order:
+ * header, bundle stamps, drivers and a table of NUL terminated strings.
+ * Strings are referenced by their offset in the table, -1 is NULL.
+ */
+#define HP_CACHE_MAGIC "PCSCHPC1"
+
+struct _cacheHeader
+{
+	char magic[8];
+	int bundles;
+	int drivers;
+	int stringsSize;
+	time_t mtime;	/**< of PCSCLITE_HP_DROPDIR */
+};
+
+struct _cacheBundle
+{
+	time_t mtime;
+	off_t size;
+	int name;
+};
+
+struct _cacheDriver
 {
 	long manuID;
 	long productID;
-
-	char *bundleName;
-	char *libraryPath;
-	char *readerName;
 	int ifdCapabilities;
-} *driverTracker = NULL;
-#define DRIVER_TRACKER_SIZE_STEP 8
+	int bundleName;
+	int libraryPath;
+	int readerName;
+};
 
-/**
- * keep track of PCSCLITE_MAX_READERS_CONTEXTS simultaneous readers
- */
-static struct _readerTracker
-{
-	char status;
-	char bus_device[BUS_DEVICE_STRSIZE];	/**< device name */
-	char *fullName;	/**< full reader name (including serial number) */
-} readerTracker[PCSCLITE_MAX_READERS_CONTEXTS];
+HP_STATIC struct _readerTracker readerTracker[PCSCLITE_MAX_READERS_CONTEXTS];
 
 static LONG HPReadBundleValues(void);
-static LONG HPAddHotPluggable(struct usb_device *dev, const char bus_device[],
+static int HPReadBundleCache(const struct stat *dirStat);
+static void HPWriteBundleCache(const struct stat *dirStat,
+	const struct _bundleStamp *stamps, int stampCount);
+static int HPAddBundleStamp(struct _bundleStamp **stamps, int stampCount,
+	const char *name, const char *path);
+static void HPFreeBundleStamps(struct _bundleStamp *stamps, int stampCount);
+static int HPCacheString(char *strings, int *offset, const char *string);
+HP_STATIC int HPCompareDrivers(const void *a, const void *b);
+static int HPFindDriver(long vendorID, long productID);
+static LONG HPAddHotPluggable(const char bus_device[], int vendorID,
+	int productID, /*@null@*/ const char *serialNumber,
 	struct _driverTracker *driver);
+static void HPAddPendingReaders(void);
 static LONG HPRemoveHotPluggable(int reader_index);
-static void HPRescanUsbBus(void);
+static int HPFindReader(const char bus_device[]);
+#ifdef ADD_SERIAL_NUMBER
+static const char *HPGetSerialNumber(struct usb_device *dev, char *serialNumber,
+	int length);
+#endif
+HP_STATIC void HPRescanUsbBus(void);
 static void HPEstablishUSBNotifications(void);
+#ifdef HAVE_LINUX_NETLINK_H
+static int HPOpenUevent(void);
+static void HPUeventLoop(int uevent_socket);
+static void HPProcessUevent(char *buffer, int length);
+static void HPUeventAdd(const char bus_device[], const char *product,
+	const char *devpath, const char *devname);
+#endif
 
 static LONG HPReadBundleValues(void)
 {
@@ -104,6 +152,19 @@ static LONG HPReadBundleValues(void)
 	char fullLibPath[FILENAME_MAX];
 	char keyValue[TOKEN_MAX_VALUE_SIZE];
 	int listCount = 0;
+	struct stat dirStat;
+	struct _bundleStamp *stamps = NULL;
+	int stampCount = 0;
+
+	/* Info.plist files are not parsed again if they have not changed */
+	if (stat(PCSCLITE_HP_DROPDIR, &dirStat) < 0)
+		dirStat.st_mtime = 0;
+	else
+		if (HPReadBundleCache(&dirStat))
+		{
+			listCount = driverSize;
+			goto end;
+		}
 
 	hpDir = opendir(PCSCLITE_HP_DROPDIR);
 
@@ -137,6 +198,10 @@ static LONG HPReadBundleValues(void)
 				PCSCLITE_HP_DROPDIR, currFP->d_name);
 			fullPath[sizeof(fullPath) - 1] = '\0';
 
+			if (stampCount >= 0)
+				stampCount = HPAddBundleStamp(&stamps, stampCount,
+					currFP->d_name, fullPath);
+
 			/* while we find a nth ifdVendorID in Info.plist */
 			while (LTPBundleFindValueWithKey(fullPath, PCSCLITE_HP_MANUKEY_NAME,
 				keyValue, alias) == 0)
@@ -208,6 +273,8 @@ static LONG HPReadBundleValues(void)
 					{
 						Log1(PCSC_LOG_CRITICAL, "Not enough memory");
 						driverSize = -1;
+						HPFreeBundleStamps(stamps, stampCount);
+						closedir(hpDir);
 						return -1;
 					}
 
@@ -229,6 +296,18 @@ static LONG HPReadBundleValues(void)
 	driverSize = listCount;
 	closedir(hpDir);
 
+	/* sort by VID/PID for HPFindDriver() */
+	if (driverSize > 0)
+		qsort(driverTracker, driverSize, sizeof(*driverTracker),
+			HPCompareDrivers);
+
+	if (stampCount >= 0)
+	{
+		HPWriteBundleCache(&dirStat, stamps, stampCount);
+		HPFreeBundleStamps(stamps, stampCount);
+	}
+
+end:
 	rv = TRUE;
 	if (driverSize == 0)
 	{
@@ -244,7 +323,381 @@ static LONG HPReadBundleValues(void)
 	return rv;
 }
 
-static void HPRescanUsbBus(void)
+/**
+ * Records the name, modification time and size of a bundle Info.plist.
+ *
+ * @return the new number of stamps or -1 if no memory is available. The
+ * stamps are freed in that case.
+ */
+static int HPAddBundleStamp(struct _bundleStamp **stamps, int stampCount,
+	const char *name, const char *path)
+{
+	struct stat fileStat;
+
+	if (0 == stampCount % DRIVER_TRACKER_SIZE_STEP)
+	{
+		struct _bundleStamp *newStamps;
+
+		newStamps = realloc(*stamps,
+			(stampCount + DRIVER_TRACKER_SIZE_STEP) * sizeof(**stamps));
+		if (NULL == newStamps)
+		{
+			HPFreeBundleStamps(*stamps, stampCount);
+			*stamps = NULL;
+			return -1;
+		}
+		*stamps = newStamps;
+	}
+
+	/* a missing file is recorded as such */
+	if (stat(path, &fileStat) < 0)
+	{
+		fileStat.st_mtime = 0;
+		fileStat.st_size = 0;
+	}
+
+	(*stamps)[stampCount].name = strdup(name);
+	(*stamps)[stampCount].mtime = fileStat.st_mtime;
+	(*stamps)[stampCount].size = fileStat.st_size;
+	if (NULL == (*stamps)[stampCount].name)
+	{
+		HPFreeBundleStamps(*stamps, stampCount);
+		*stamps = NULL;
+		return -1;
+	}
+
+	return stampCount + 1;
+}
+
+static void HPFreeBundleStamps(struct _bundleStamp *stamps, int stampCount)
+{
+	int i;
+
+	for (i=0; i<stampCount; i++)
+		free(stamps[i].name);
+	free(stamps);
+}
+
+/**
+ * Loads driverTracker[] from PCSCLITE_HP_CACHE.
+ *
+ * The cache is used only if PCSCLITE_HP_DROPDIR and all the Info.plist
+ * files have the modification time (and size) they had when the cache
+ * was written. A bundle added or removed changes the directory
+ * modification time.
+ *
+ * @return TRUE if driverTracker[] and driverSize are set from the cache.
+ */
+static int HPReadBundleCache(const struct stat *dirStat)
+{
+	int fd, i, ret = FALSE;
+	struct stat cacheStat;
+	char *map;
+	const struct _cacheHeader *header;
+	const struct _cacheBundle *bundles;
+	const struct _cacheDriver *drivers;
+	const char *strings;
+	size_t size;
+
+	fd = open(PCSCLITE_HP_CACHE, O_RDONLY);
+	if (fd < 0)
+		return FALSE;
+
+	if ((fstat(fd, &cacheStat) < 0)
+		|| (cacheStat.st_size < (off_t)sizeof(*header)))
+	{
+		close(fd);
+		return FALSE;
+	}
+
+	map = mmap(NULL, cacheStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (MAP_FAILED == map)
+		return FALSE;
+
+	header = (const struct _cacheHeader *)map;
+	bundles = (const struct _cacheBundle *)(header + 1);
+	drivers = (const struct _cacheDriver *)(bundles + header->bundles);
+	strings = (const char *)(drivers + header->drivers);
+
+	/* the file shall be exactly what the header describes */
+	if (memcmp(header->magic, HP_CACHE_MAGIC, sizeof(header->magic))
+		|| (header->bundles < 0) || (header->drivers < 0)
+		|| (header->stringsSize < 1))
+		goto end;
+
+	size = sizeof(*header) + header->bundles * sizeof(*bundles)
+		+ header->drivers * sizeof(*drivers) + header->stringsSize;
+	if ((size != (size_t)cacheStat.st_size)
+		|| (strings[header->stringsSize - 1] != '\0'))
+		goto end;
+
+	/* the first string is the drivers directory and architecture */
+	if (strcmp(strings, PCSCLITE_HP_DROPDIR ":" PCSC_ARCH))
+		goto end;
+
+	if (header->mtime != dirStat->st_mtime)
+		goto end;
+
+	for (i=0; i<header->bundles; i++)
+	{
+		char fullPath[FILENAME_MAX];
+		struct stat fileStat;
+
+		if ((bundles[i].name < 0) || (bundles[i].name >= header->stringsSize))
+			goto end;
+
+		snprintf(fullPath, sizeof(fullPath), "%s/%s/Contents/Info.plist",
+			PCSCLITE_HP_DROPDIR, strings + bundles[i].name);
+		fullPath[sizeof(fullPath) - 1] = '\0';
+
+		if (stat(fullPath, &fileStat) < 0)
+		{
+			fileStat.st_mtime = 0;
+			fileStat.st_size = 0;
+		}
+
+		if ((fileStat.st_mtime != bundles[i].mtime)
+			|| (fileStat.st_size != bundles[i].size))
+		{
+#ifdef DEBUG_HOTPLUG
+			Log2(PCSC_LOG_DEBUG, "Drivers cache outdated by %s", fullPath);
+#endif
+			goto end;
+		}
+	}
+
+	for (i=0; i<header->drivers; i++)
+		if ((drivers[i].bundleName < -1)
+			|| (drivers[i].bundleName >= header->stringsSize)
+			|| (drivers[i].readerName < 0)
+			|| (drivers[i].readerName >= header->stringsSize)
+			|| (drivers[i].libraryPath < -1)
+			|| (drivers[i].libraryPath >= header->stringsSize))
+			goto end;
+
+	/* at least one entry, as done by HPReadBundleValues() */
+	driverTracker = calloc(header->drivers + 1, sizeof(*driverTracker));
+	if (NULL == driverTracker)
+	{
+		Log1(PCSC_LOG_CRITICAL, "Not enough memory");
+		goto end;
+	}
+
+	for (i=0; i<header->drivers; i++)
+	{
+		driverTracker[i].manuID = drivers[i].manuID;
+		driverTracker[i].productID = drivers[i].productID;
+		driverTracker[i].ifdCapabilities = drivers[i].ifdCapabilities;
+		if (drivers[i].bundleName >= 0)
+			driverTracker[i].bundleName =
+				strdup(strings + drivers[i].bundleName);
+		driverTracker[i].readerName = strdup(strings + drivers[i].readerName);
+		if (drivers[i].libraryPath >= 0)
+			driverTracker[i].libraryPath =
+				strdup(strings + drivers[i].libraryPath);
+	}
+	driverSize = header->drivers;
+
+	Log2(PCSC_LOG_DEBUG, "Drivers read from " PCSCLITE_HP_CACHE
+		" (%d bundles)", header->bundles);
+	ret = TRUE;
+
+end:
+	(void)munmap(map, cacheStat.st_size);
+
+	return ret;
+}
+
+/**
+ * Appends a string to the cache strings table.
+ * @return the offset of the string or -1 for NULL.
+ */
+static int HPCacheString(char *strings, int *offset, const char *string)
+{
+	int start = *offset;
+
+	if (NULL == string)
+		return -1;
+
+	strcpy(strings + start, string);
+	*offset += strlen(string) + 1;
+
+	return start;
+}
+
+/**
+ * Writes driverTracker[] to PCSCLITE_HP_CACHE.
+ *
+ * The file is written in a temporary file and renamed so pcscd never
+ * sees a partial cache. Errors are not fatal: the drivers will be read
+ * from the bundles again at the next start.
+ */
+static void HPWriteBundleCache(const struct stat *dirStat,
+	const struct _bundleStamp *stamps, int stampCount)
+{
+	struct _cacheHeader *header;
+	struct _cacheBundle *bundles;
+	struct _cacheDriver *drivers;
+	char *buffer, *strings;
+	size_t size;
+	ssize_t ret;
+	time_t now;
+	int i, fd, offset, stringsSize;
+
+	/* a file modified during the current second could be modified
+	 * again without changing its mtime */
+	now = time(NULL);
+	if (dirStat->st_mtime >= now)
+		return;
+	for (i=0; i<stampCount; i++)
+		if (stamps[i].mtime >= now)
+			return;
+
+	stringsSize = sizeof(PCSCLITE_HP_DROPDIR ":" PCSC_ARCH);
+	for (i=0; i<stampCount; i++)
+		stringsSize += strlen(stamps[i].name) + 1;
+	for (i=0; i<driverSize; i++)
+	{
+		if (driverTracker[i].bundleName)
+			stringsSize += strlen(driverTracker[i].bundleName) + 1;
+		if (driverTracker[i].readerName)
+			stringsSize += strlen(driverTracker[i].readerName) + 1;
+		if (driverTracker[i].libraryPath)
+			stringsSize += strlen(driverTracker[i].libraryPath) + 1;
+	}
+
+	size = sizeof(*header) + stampCount * sizeof(*bundles)
+		+ driverSize * sizeof(*drivers) + stringsSize;
+	buffer = calloc(1, size);
+	if (NULL == buffer)
+		return;
+
+	header = (struct _cacheHeader *)buffer;
+	bundles = (struct _cacheBundle *)(header + 1);
+	drivers = (struct _cacheDriver *)(bundles + stampCount);
+	strings = (char *)(drivers + driverSize);
+
+	memcpy(header->magic, HP_CACHE_MAGIC, sizeof(header->magic));
+	header->bundles = stampCount;
+	header->drivers = driverSize;
+	header->stringsSize = stringsSize;
+	header->mtime = dirStat->st_mtime;
+
+	offset = 0;
+	(void)HPCacheString(strings, &offset, PCSCLITE_HP_DROPDIR ":" PCSC_ARCH);
+
+	for (i=0; i<stampCount; i++)
+	{
+		bundles[i].mtime = stamps[i].mtime;
+		bundles[i].size = stamps[i].size;
+		bundles[i].name = HPCacheString(strings, &offset, stamps[i].name);
+	}
+
+	for (i=0; i<driverSize; i++)
+	{
+		drivers[i].manuID = driverTracker[i].manuID;
+		drivers[i].productID = driverTracker[i].productID;
+		drivers[i].ifdCapabilities = driverTracker[i].ifdCapabilities;
+		drivers[i].bundleName = HPCacheString(strings, &offset,
+			driverTracker[i].bundleName);
+		drivers[i].readerName = HPCacheString(strings, &offset,
+			driverTracker[i].readerName);
+		drivers[i].libraryPath = HPCacheString(strings, &offset,
+			driverTracker[i].libraryPath);
+	}
+
+	/* the cache directory is not created at install time */
+	if ((mkdir(PCSCLITE_CACHE_DIR, 0755) < 0) && (errno != EEXIST))
+	{
+		Log2(PCSC_LOG_DEBUG, "Cannot create " PCSCLITE_CACHE_DIR ": %s",
+			strerror(errno));
+		free(buffer);
+		return;
+	}
+
+	/* never write through a file or a link left there by someone else */
+	(void)unlink(PCSCLITE_HP_CACHE ".tmp");
+	fd = open(PCSCLITE_HP_CACHE ".tmp",
+		O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0644);
+	if (fd < 0)
+	{
+		Log2(PCSC_LOG_DEBUG, "Cannot create " PCSCLITE_HP_CACHE ": %s",
+			strerror(errno));
+		free(buffer);
+		return;
+	}
+
+	ret = write(fd, buffer, size);
+	if (close(fd) < 0)
+		ret = -1;
+
+	if ((ret != (ssize_t)size)
+		|| (rename(PCSCLITE_HP_CACHE ".tmp", PCSCLITE_HP_CACHE) < 0))
+	{
+		Log2(PCSC_LOG_ERROR, "Cannot write " PCSCLITE_HP_CACHE ": %s",
+			strerror(errno));
+		(void)unlink(PCSCLITE_HP_CACHE ".tmp");
+	}
+
+	free(buffer);
+}
+
+/**
+ * Orders the driverTracker[] entries by vendor ID and product ID.
+ *
+ * Drivers supporting the same device are ordered by bundle name so the
+ * driver used does not depend on the readdir() order.
+ */
+HP_STATIC int HPCompareDrivers(const void *a, const void *b)
+{
+	const struct _driverTracker *da = a;
+	const struct _driverTracker *db = b;
+
+	if (da->manuID != db->manuID)
+		return (da->manuID < db->manuID) ? -1 : 1;
+
+	if (da->productID != db->productID)
+		return (da->productID < db->productID) ? -1 : 1;
+
+	if ((NULL == da->bundleName) || (NULL == db->bundleName))
+		return (da->bundleName != NULL) - (db->bundleName != NULL);
+
+	return strcmp(da->bundleName, db->bundleName);
+}
+
+/**
+ * Binary search of a device in the sorted driverTracker[].
+ *
+ * @return index of the first driver supporting the device. The next
+ * entries with the same VID/PID are the other drivers supporting it.
+ * @return -1 if no driver supports the device.
+ */
+static int HPFindDriver(long vendorID, long productID)
+{
+	int low = 0, high = driverSize;
+
+	/* find the first entry not lower than vendorID/productID */
+	while (low < high)
+	{
+		int middle = low + (high - low) / 2;
+
+		if ((driverTracker[middle].manuID < vendorID)
+			|| ((driverTracker[middle].manuID == vendorID)
+			&& (driverTracker[middle].productID < productID)))
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	if ((low < driverSize) && (driverTracker[low].manuID == vendorID)
+		&& (driverTracker[low].productID == productID))
+		return low;
+
+	return -1;
+}
+
+HP_STATIC void HPRescanUsbBus(void)
 {
 	int i, j;
 	struct usb_bus *bus;
@@ -265,14 +718,16 @@ static void HPRescanUsbBus(void)
 		for (dev = bus->devices; dev; dev = dev->next)
 		{
 			/* check if the device is supported by one driver */
-			for (i=0; i<driverSize; i++)
+			i = HPFindDriver(dev->descriptor.idVendor,
+				dev->descriptor.idProduct);
+			for (; (i >= 0) && (i < driverSize); i++)
 			{
-				if (driverTracker[i].libraryPath != NULL &&
-					dev->descriptor.idVendor == driverTracker[i].manuID &&
-					dev->descriptor.idProduct == driverTracker[i].productID)
-				{
-					int newreader;
+				if (dev->descriptor.idVendor != driverTracker[i].manuID ||
+					dev->descriptor.idProduct != driverTracker[i].productID)
+					break;
 
+				if (driverTracker[i].libraryPath != NULL)
+				{
 					/* A known device has been found */
 					snprintf(bus_device, BUS_DEVICE_STRSIZE, "%s:%s",
 						bus->dirname, dev->filename);
@@ -281,34 +736,43 @@ static void HPRescanUsbBus(void)
 					Log2(PCSC_LOG_DEBUG, "Found matching USB device: %s",
 						bus_device);
 #endif
-					newreader = TRUE;
 
 					/* Check if the reader is a new one */
-					for (j=0; j<PCSCLITE_MAX_READERS_CONTEXTS; j++)
+					j = HPFindReader(bus_device);
+					if (j >= 0)
 					{
-						if (strncmp(readerTracker[j].bus_device,
-							bus_device, BUS_DEVICE_STRSIZE) == 0)
-						{
-							/* The reader is already known */
+						/* The reader is already known, or queued by a
+						 * previous driver of the same device */
+						if (readerTracker[j].status != READER_PENDING)
 							readerTracker[j].status = READER_PRESENT;
-							newreader = FALSE;
 #ifdef DEBUG_HOTPLUG
-							Log2(PCSC_LOG_DEBUG, "Refresh USB device: %s",
-								bus_device);
+						Log2(PCSC_LOG_DEBUG, "Refresh USB device: %s",
+							bus_device);
 #endif
-							break;
-						}
 					}
+					else
+					{
+						/* New reader found */
+						const char *serialNumber = NULL;
+#ifdef ADD_SERIAL_NUMBER
+						char buffer[MAX_READERNAME];
 
-					/* New reader found */
-					if (newreader)
-						HPAddHotPluggable(dev, bus_device, &driverTracker[i]);
+						serialNumber = HPGetSerialNumber(dev, buffer,
+							sizeof(buffer));
+#endif
+						HPAddHotPluggable(bus_device,
+							dev->descriptor.idVendor,
+							dev->descriptor.idProduct, serialNumber,
+							&driverTracker[i]);
+					}
 				}
 			}
 		} /* End of USB device for..loop */
 
 	} /* End of USB bus for..loop */
 
+	HPAddPendingReaders();
+
 	/*
 	 * check if all the previously found readers are still present
 	 */
@@ -392,6 +856,23 @@ static void HPEstablishUSBNotifications(void)
 	/* scan the USB bus for devices at startup */
 	HPRescanUsbBus();
 
+#ifdef HAVE_LINUX_NETLINK_H
+	/* the kernel sends an event for each USB device added or removed so
+	 * no polling and no bus rescan are needed. Polling is still used if
+	 * requested on the command line */
+	if (0 == HPForceReaderPolling)
+	{
+		int uevent_socket = HPOpenUevent();
+
+		if (uevent_socket >= 0)
+		{
+			Log1(PCSC_LOG_INFO, "Using kernel uevents for USB hotplug");
+			HPUeventLoop(uevent_socket);
+			return;
+		}
+	}
+#endif
+
 	/* if at least one driver do not have IFD_GENERATE_HOTPLUG */
 	do_polling = FALSE;
 	for (i=0; i<driverSize; i++)
@@ -425,7 +906,12 @@ static void HPEstablishUSBNotifications(void)
 	{
 		char dummy;
 
-	  	pipe(rescan_pipe);
+		if (pipe(rescan_pipe) < 0)
+		{
+			Log2(PCSC_LOG_ERROR, "pipe: %s", strerror(errno));
+			return;
+		}
+
 		while (read(rescan_pipe[0], &dummy, sizeof(dummy)) > 0)
 		{
 			Log1(PCSC_LOG_INFO, "Reload serial configuration");
@@ -468,18 +954,17 @@ LONG HPStopHotPluggables(void)
 	return 0;
 }
 
-static LONG HPAddHotPluggable(struct usb_device *dev, const char bus_device[],
-	struct _driverTracker *driver)
+/**
+ * Reserves a readerTracker[] entry for a new reader. The reader is
+ * started by HPAddPendingReaders().
+ */
+static LONG HPAddHotPluggable(const char bus_device[], int vendorID,
+	int productID, const char *serialNumber, struct _driverTracker *driver)
 {
 	int i;
-	char deviceName[MAX_DEVICENAME];
 
 	Log2(PCSC_LOG_INFO, "Adding USB device: %s", bus_device);
 
-	snprintf(deviceName, sizeof(deviceName), "usb:%04x/%04x:libusb:%s",
-		dev->descriptor.idVendor, dev->descriptor.idProduct, bus_device);
-	deviceName[sizeof(deviceName) -1] = '\0';
-
 	SYS_MutexLock(&usbNotifierMutex);
 
 	/* find a free entry */
@@ -501,51 +986,87 @@ static LONG HPAddHotPluggable(struct usb_device *dev, const char bus_device[],
 		sizeof(readerTracker[i].bus_device));
 	readerTracker[i].bus_device[sizeof(readerTracker[i].bus_device) - 1] = '\0';
 
-#ifdef ADD_SERIAL_NUMBER
-	if (dev->descriptor.iSerialNumber)
+	if (serialNumber)
 	{
-		usb_dev_handle *device;
-		char serialNumber[MAX_READERNAME];
 		char fullname[MAX_READERNAME];
-		int ret;
-
-		device = usb_open(dev);
-		ret = usb_get_string_simple(device, dev->descriptor.iSerialNumber,
-			serialNumber, MAX_READERNAME);
-		usb_close(device);
 
-		if (ret < 0)
-		{
-			Log2(PCSC_LOG_ERROR, "usb_get_string_simple failed: %s",
-				usb_strerror());
-			readerTracker[i].fullName = strdup(driver->readerName);
-		}
-		else
-		{
-			snprintf(fullname, sizeof(fullname), "%s (%s)",
-				driver->readerName, serialNumber);
-			readerTracker[i].fullName = strdup(fullname);
-		}
+		snprintf(fullname, sizeof(fullname), "%s (%s)",
+			driver->readerName, serialNumber);
+		readerTracker[i].fullName = strdup(fullname);
 	}
 	else
-#endif
 		readerTracker[i].fullName = strdup(driver->readerName);
 
-	if (RFAddReader(readerTracker[i].fullName, PCSCLITE_HP_BASE_PORT + i,
-		driver->libraryPath, deviceName) == SCARD_S_SUCCESS)
-		readerTracker[i].status = READER_PRESENT;
-	else
-	{
-		readerTracker[i].status = READER_FAILED;
+	snprintf(readerTracker[i].deviceName, sizeof(readerTracker[i].deviceName),
+		"usb:%04x/%04x:libusb:%s", vendorID, productID, bus_device);
+	readerTracker[i].deviceName[sizeof(readerTracker[i].deviceName) -1] = '\0';
 
-		(void)CheckForOpenCT();
-	}
+	readerTracker[i].driver = driver;
+	readerTracker[i].status = READER_PENDING;
 
 	SYS_MutexUnLock(&usbNotifierMutex);
 
 	return 1;
 }	/* End of function */
 
+/**
+ * Starts the readers found since the last call. A hub can bring many
+ * readers at once so they are opened in parallel by RFAddReaders().
+ */
+static void HPAddPendingReaders(void)
+{
+	READER_ADD readers[PCSCLITE_MAX_READERS_CONTEXTS];
+	int reader_index[PCSCLITE_MAX_READERS_CONTEXTS];
+	char preloaded[PCSCLITE_MAX_READERS_CONTEXTS];
+	int i, count = 0, failed = FALSE;
+
+	SYS_MutexLock(&usbNotifierMutex);
+
+	for (i=0; i<PCSCLITE_MAX_READERS_CONTEXTS; i++)
+	{
+		if (readerTracker[i].status != READER_PENDING)
+			continue;
+
+		readers[count].lpcReader = readerTracker[i].fullName;
+		readers[count].dwPort = PCSCLITE_HP_BASE_PORT + i;
+		readers[count].lpcLibrary = readerTracker[i].driver->libraryPath;
+		readers[count].lpcDevice = readerTracker[i].deviceName;
+		reader_index[count] = i;
+		count++;
+	}
+
+	if (count > 0)
+	{
+		/* only the drivers of the readers found are loaded, once for all
+		 * their readers, and unloaded with their last reader */
+		for (i=0; i<count; i++)
+			preloaded[i] = (SCARD_S_SUCCESS ==
+				RFPreloadDriver(readers[i].lpcLibrary));
+
+		(void)RFAddReaders(readers, count);
+
+		for (i=0; i<count; i++)
+			if (preloaded[i])
+				RFReleasePreloadedDriver(readers[i].lpcLibrary);
+
+		for (i=0; i<count; i++)
+		{
+			if (SCARD_S_SUCCESS == readers[i].rv)
+				readerTracker[reader_index[i]].status = READER_PRESENT;
+			else
+			{
+				readerTracker[reader_index[i]].status = READER_FAILED;
+				failed = TRUE;
+			}
+		}
+
+		if (failed)
+			(void)CheckForOpenCT();
+	}
+
+	SYS_MutexUnLock(&usbNotifierMutex);
+}
+
 static LONG HPRemoveHotPluggable(int reader_index)
 {
 	SYS_MutexLock(&usbNotifierMutex);
@@ -565,6 +1086,317 @@ static LONG HPRemoveHotPluggable(int reader_index)
 	return 1;
 }	/* End of function */
 
+/**
+ * Returns the readerTracker[] index of a device or -1 if not found.
+ */
+static int HPFindReader(const char bus_device[])
+{
+	int i;
+
+	for (i=0; i<PCSCLITE_MAX_READERS_CONTEXTS; i++)
+		if (strncmp(readerTracker[i].bus_device, bus_device,
+			BUS_DEVICE_STRSIZE) == 0)
+			return i;
+
+	return -1;
+}
+
+#ifdef ADD_SERIAL_NUMBER
+/**
+ * Reads the serial number string of a device.
+ * Returns serialNumber or NULL if the device has no serial number.
+ */
+static const char *HPGetSerialNumber(struct usb_device *dev, char *serialNumber,
+	int length)
+{
+	usb_dev_handle *device;
+	int ret;
+
+	if (0 == dev->descriptor.iSerialNumber)
+		return NULL;
+
+	device = usb_open(dev);
+	ret = usb_get_string_simple(device, dev->descriptor.iSerialNumber,
+		serialNumber, length);
+	usb_close(device);
+
+	if (ret < 0)
+	{
+		Log2(PCSC_LOG_ERROR, "usb_get_string_simple failed: %s",
+			usb_strerror());
+		return NULL;
+	}
+
+	return serialNumber;
+}
+#endif
+
+#ifdef HAVE_LINUX_NETLINK_H
+/* maximum size of a kernel uevent */
+#define UEVENT_BUFFER_SIZE 2048
+
+/* maximum time to wait for udev to create the device node */
+#define UEVENT_NODE_TIMEOUT 1000	/* ms */
+
+/**
+ * Opens a socket receiving the kernel uevents.
+ * Returns -1 if the kernel uevents are not available.
+ */
+static int HPOpenUevent(void)
+{
+	struct sockaddr_nl addr;
+	int uevent_socket;
+
+	uevent_socket = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+	if (uevent_socket < 0)
+	{
+		Log2(PCSC_LOG_INFO, "Kernel uevents not available: %s",
+			strerror(errno));
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_pid = 0;	/* let the kernel choose */
+	addr.nl_groups = 1;	/* kernel events */
+
+	if (bind(uevent_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		Log2(PCSC_LOG_INFO, "Kernel uevents not available: %s",
+			strerror(errno));
+		close(uevent_socket);
+		return -1;
+	}
+
+	return uevent_socket;
+}
+
+/**
+ * Waits for the kernel uevents and for the serial configuration reload
+ * requests until pcscd stops.
+ */
+static void HPUeventLoop(int uevent_socket)
+{
+	struct pollfd fds[2];
+	struct sockaddr_nl addr;
+	socklen_t addr_length;
+	char buffer[UEVENT_BUFFER_SIZE];
+	char dummy;
+	int length, lost;
+
+	/* without the pipe the serial configuration is not reloaded */
+	if (pipe(rescan_pipe) < 0)
+		Log2(PCSC_LOG_ERROR, "pipe: %s", strerror(errno));
+
+	fds[0].fd = uevent_socket;
+	fds[0].events = POLLIN;
+	fds[1].fd = rescan_pipe[0];	/* ignored by poll() if -1 */
+	fds[1].events = POLLIN;
+
+	while (!AraKiriHotPlug)
+	{
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (EINTR == errno)
+				continue;
+
+			Log2(PCSC_LOG_ERROR, "poll: %s", strerror(errno));
+			break;
+		}
+
+		if (fds[1].revents)
+		{
+			/* HPStopHotPluggables() closed the pipe */
+			if (read(rescan_pipe[0], &dummy, sizeof(dummy)) <= 0)
+				break;
+
+			Log1(PCSC_LOG_INFO, "Reload serial configuration");
+			HPRescanUsbBus();
+			RFReCheckReaderConf();
+			Log1(PCSC_LOG_INFO, "End reload serial configuration");
+		}
+
+		if (fds[0].revents & POLLIN)
+		{
+			/* the events already received are processed together so
+			 * the readers of a hub are started at the same time */
+			lost = FALSE;
+			do
+			{
+				addr_length = sizeof(addr);
+				length = recvfrom(uevent_socket, buffer, sizeof(buffer) - 1,
+					MSG_DONTWAIT, (struct sockaddr *)&addr, &addr_length);
+
+				/* the socket buffer overflowed and some events are lost */
+				if ((length < 0) && (ENOBUFS == errno))
+					lost = TRUE;
+
+				/* only trust the messages sent by the kernel */
+				if ((length > 0) && (0 == addr.nl_pid))
+				{
+					buffer[length] = '\0';
+					HPProcessUevent(buffer, length);
+				}
+			} while (length > 0);
+
+			if (lost)
+			{
+				Log1(PCSC_LOG_ERROR, "uevents lost, rescan the USB bus");
+				HPRescanUsbBus();
+			}
+
+			HPAddPendingReaders();
+		}
+	}
+
+	close(uevent_socket);
+	close(rescan_pipe[0]);
+	rescan_pipe[0] = -1;
+}
+
+/**
+ * Parses a kernel uevent "action@devpath\0KEY=value\0..." and adds or
+ * removes the USB device it is about.
+ */
+static void HPProcessUevent(char *buffer, int length)
+{
+	const char *action = NULL, *subsystem = NULL, *devtype = NULL;
+	const char *product = NULL, *devpath = NULL, *devname = NULL;
+	int busnum = -1, devnum = -1;
+	char bus_device[BUS_DEVICE_STRSIZE];
+	char *p;
+
+	for (p = buffer; p < buffer + length; p += strlen(p) + 1)
+	{
+		if (0 == strncmp(p, "ACTION=", 7))
+			action = p + 7;
+		else if (0 == strncmp(p, "SUBSYSTEM=", 10))
+			subsystem = p + 10;
+		else if (0 == strncmp(p, "DEVTYPE=", 8))
+			devtype = p + 8;
+		else if (0 == strncmp(p, "PRODUCT=", 8))
+			product = p + 8;
+		else if (0 == strncmp(p, "DEVPATH=", 8))
+			devpath = p + 8;
+		else if (0 == strncmp(p, "DEVNAME=", 8))
+			devname = p + 8;
+		else if (0 == strncmp(p, "BUSNUM=", 7))
+			busnum = atoi(p + 7);
+		else if (0 == strncmp(p, "DEVNUM=", 7))
+			devnum = atoi(p + 7);
+	}
+
+	/* only the USB devices, not their interfaces */
+	if ((NULL == action) || (NULL == subsystem) || (NULL == devtype)
+		|| strcmp(subsystem, "usb") || strcmp(devtype, "usb_device"))
+		return;
+
+#ifdef DEBUG_HOTPLUG
+	Log3(PCSC_LOG_DEBUG, "uevent %s: %s", action, devpath);
+#endif
+
+	if ((busnum < 0) || (devnum < 0))
+	{
+		/* old kernel. We do not know which device it is */
+		HPRescanUsbBus();
+		return;
+	}
+
+	/* same name as the libusb bus->dirname and dev->filename */
+	snprintf(bus_device, sizeof(bus_device), "%03d:%03d", busnum, devnum);
+
+	if (0 == strcmp(action, "add"))
+		HPUeventAdd(bus_device, product, devpath, devname);
+	else
+		if (0 == strcmp(action, "remove"))
+		{
+			int i = HPFindReader(bus_device);
+
+			if ((i >= 0) && (readerTracker[i].fullName != NULL))
+				HPRemoveHotPluggable(i);
+		}
+}
+
+/**
+ * Adds a device reported by a kernel uevent if a driver supports it.
+ */
+static void HPUeventAdd(const char bus_device[], const char *product,
+	const char *devpath, const char *devname)
+{
+	unsigned int vendorID, productID;
+	const char *serialNumber = NULL;
+	const char *usbfs;
+	char path[FILENAME_MAX], usbfs_path[FILENAME_MAX];
+	char buffer[MAX_READERNAME];
+	int i, fd, ret;
+
+	/* PRODUCT=vendor/product/bcdDevice in hex */
+	if ((NULL == product)
+		|| (sscanf(product, "%x/%x", &vendorID, &productID) != 2))
+		return;
+
+	i = HPFindDriver(vendorID, productID);
+	if (i < 0)
+		/* not a smart card reader */
+		return;
+
+	while (NULL == driverTracker[i].libraryPath)
+	{
+		i++;
+		if ((i == driverSize) || ((long)vendorID != driverTracker[i].manuID)
+			|| ((long)productID != driverTracker[i].productID))
+			return;
+	}
+
+	if (HPFindReader(bus_device) >= 0)
+		return;
+
+	/* the kernel event is received before udev creates the device node
+	 * in /dev used by the driver. The usbfs node, if usbfs is used, is
+	 * created by the kernel itself */
+	usbfs = getenv("USB_DEVFS_PATH");
+	if (usbfs)
+		snprintf(usbfs_path, sizeof(usbfs_path), "%s/%.3s/%s", usbfs,
+			bus_device, bus_device + 4);
+	if (devname)
+	{
+		int timeout;
+
+		snprintf(path, sizeof(path), "/dev/%s", devname);
+		for (timeout = 0; (timeout < UEVENT_NODE_TIMEOUT)
+			&& (access(path, R_OK | W_OK) < 0)
+			&& (NULL == usbfs || access(usbfs_path, R_OK | W_OK) < 0);
+			timeout += 10)
+			SYS_USleep(10 * 1000);
+	}
+
+	/* the serial number is already available in sysfs */
+	if (devpath)
+	{
+		snprintf(path, sizeof(path), "/sys%s/serial", devpath);
+		fd = open(path, O_RDONLY);
+		if (fd >= 0)
+		{
+			ret = read(fd, buffer, sizeof(buffer) - 1);
+			close(fd);
+
+			/* remove the ending \n */
+			while ((ret > 0) && ('\n' == buffer[ret - 1]))
+				ret--;
+
+			if (ret > 0)
+			{
+				buffer[ret] = '\0';
+				serialNumber = buffer;
+			}
+		}
+	}
+
+	HPAddHotPluggable(bus_device, vendorID, productID, serialNumber,
+		&driverTracker[i]);
+}
+#endif
+
 /**
  * Sets up callbacks for device hotplug events.
  */
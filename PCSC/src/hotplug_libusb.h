@@ -0,0 +1,78 @@
+/*
+ * MUSCLE SmartCard Development ( http://www.linuxnet.com )
+ *
+ * Copyright (C) 2009
+ *  Ludovic Rousseau <ludovic.rousseau@free.fr>
+ *
+ * $Id$
+ */
+
+/**
+ * @file
+ * @brief Private structures of the libusb hotplug.
+ *
+ * Only used by hotplug_libusb.c and by hotplug-bench.c which links with
+ * a build of hotplug_libusb.c made with HOTPLUG_BENCH defined.
+ */
+
+#ifndef __hotplug_libusb_h__
+#define __hotplug_libusb_h__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define BUS_DEVICE_STRSIZE	256
+
+#define READER_ABSENT		0
+#define READER_PRESENT		1
+#define READER_FAILED		2
+#define READER_PENDING		3
+
+/**
+ * keep track of drivers in a dynamically allocated array
+ */
+struct _driverTracker
+{
+	long manuID;
+	long productID;
+
+	char *bundleName;
+	char *libraryPath;
+	char *readerName;
+	int ifdCapabilities;
+};
+
+/**
+ * keep track of PCSCLITE_MAX_READERS_CONTEXTS simultaneous readers
+ */
+struct _readerTracker
+{
+	char status;
+	char bus_device[BUS_DEVICE_STRSIZE];	/**< device name */
+	char *fullName;	/**< full reader name (including serial number) */
+	char deviceName[MAX_DEVICENAME];	/**< device name used by the driver */
+	struct _driverTracker *driver;
+};
+
+#ifdef HOTPLUG_BENCH
+/* hotplug-bench.c fills the drivers and reads the readers found */
+#define HP_STATIC
+
+	extern struct _driverTracker *driverTracker;
+	extern int driverSize;
+	extern struct _readerTracker readerTracker[PCSCLITE_MAX_READERS_CONTEXTS];
+	extern PCSCLITE_MUTEX usbNotifierMutex;
+
+	int HPCompareDrivers(const void *a, const void *b);
+	void HPRescanUsbBus(void);
+#else
+#define HP_STATIC static
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -15,6 +15,9 @@
  */
 
 #include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include "config.h"
 #include "misc.h"
 #include "pcscd.h"
@@ -26,9 +29,54 @@
 #include "dyn_generic.h"
 #include "sys_generic.h"
 #include "utils.h"
+#include "metrics.h"
+#include "trace.h"
 
 #undef PCSCLITE_STATIC_DRIVER
 
+/** us spent in the IFD handler by the calling thread, see IFDDriverTime() */
+static pthread_key_t DriverTimeKey;
+static pthread_once_t DriverTimeOnce = PTHREAD_ONCE_INIT;
+
+static void IFDDriverTimeInit(void)
+{
+	(void)pthread_key_create(&DriverTimeKey, NULL);
+}
+
+/**
+ * Adds the time of a driver call to the counter of the calling thread.
+ * The counter is stored in the key value itself to avoid an allocation.
+ */
+static void IFDAddDriverTime(struct timeval *start, struct timeval *end)
+{
+	intptr_t total;
+
+	(void)pthread_once(&DriverTimeOnce, IFDDriverTimeInit);
+
+	total = (intptr_t)pthread_getspecific(DriverTimeKey);
+	total += time_sub(end, start);
+	(void)pthread_setspecific(DriverTimeKey, (void *)total);
+}
+
+/**
+ * Returns the time spent in the IFD handler by the calling thread since
+ * the previous call.
+ *
+ * @return time in us
+ */
+long IFDDriverTime(void)
+{
+	intptr_t total;
+
+	(void)pthread_once(&DriverTimeOnce, IFDDriverTimeInit);
+
+	total = (intptr_t)pthread_getspecific(DriverTimeKey);
+	if (total)
+		(void)pthread_setspecific(DriverTimeKey, NULL);
+
+	return total;
+}
+
 /**
  * Set the protocol type selection (PTS).
  * This function sets the appropriate protocol to be used on the card.
@@ -103,6 +151,9 @@ LONG IFDSetPTS(PREADER_CONTEXT rContext, DWORD dwProtocol, UCHAR ucFlags,
 	}
 #endif
 
+	if (rv != IFD_SUCCESS)
+		METDriverError(rv);
+
 	return rv;
 }
 
@@ -172,6 +223,9 @@ LONG IFDOpenIFD(PREADER_CONTEXT rContext)
 	/* END OF LOCKED REGION */
 	(void)SYS_MutexUnLock(rContext->mMutex);
 
+	if (rv != IFD_SUCCESS)
+		METDriverError(rv);
+
 	return rv;
 }
 
@@ -323,6 +377,7 @@ LONG IFDPowerICC(PREADER_CONTEXT rContext, DWORD dwAction,
 	SMARTCARD_EXTENSION sSmartCard;
 	DWORD dwStatus;
 	UCHAR ucValue[1];
+	struct timeval start, end;
 
 #ifndef PCSCLITE_STATIC_DRIVER
 	RESPONSECODE(*IFD_power_icc) (DWORD) = NULL;
@@ -353,6 +408,8 @@ LONG IFDPowerICC(PREADER_CONTEXT rContext, DWORD dwAction,
 	/* LOCK THIS CODE REGION */
 	(void)SYS_MutexLock(rContext->mMutex);
 
+	(void)gettimeofday(&start, NULL);
+
 #ifndef PCSCLITE_STATIC_DRIVER
 	if (rContext->dwVersion == IFD_HVERSION_1_0)
 	{
@@ -378,15 +435,21 @@ LONG IFDPowerICC(PREADER_CONTEXT rContext, DWORD dwAction,
 		rv = IFDHPowerICC(rContext->dwSlot, dwAction, pucAtr, pdwAtrLen);
 #endif
 
+	(void)gettimeofday(&end, NULL);
+
 	/* END OF LOCKED REGION */
 	(void)SYS_MutexUnLock(rContext->mMutex);
 
+	IFDAddDriverTime(&start, &end);
+
 	/* use clean values in case of error */
 	if (rv != IFD_SUCCESS)
 	{
 		*pdwAtrLen = 0;
 		pucAtr[0] = '\0';
 
+		METDriverError(rv);
+
 		if (rv == IFD_NO_SUCH_DEVICE)
 		{
 			(void)SendHotplugSignal();
@@ -587,6 +650,7 @@ LONG IFDControl_v2(PREADER_CONTEXT rContext, PUCHAR TxBuffer,
 		Log2(PCSC_LOG_ERROR, "Card not transacted: %ld", rv);
 		LogXxd(PCSC_LOG_DEBUG, "TxBuffer ", TxBuffer, TxLength);
 		LogXxd(PCSC_LOG_DEBUG, "RxBuffer ", RxBuffer, *RxLength);
+		METDriverError(rv);
 		return SCARD_E_NOT_TRANSACTED;
 	}
 }
@@ -605,6 +669,7 @@ LONG IFDControl(PREADER_CONTEXT rContext, DWORD ControlCode,
 	LPDWORD BytesReturned)
 {
 	RESPONSECODE rv = IFD_SUCCESS;
+	struct timeval start, end;
 
 #ifndef PCSCLITE_STATIC_DRIVER
 	RESPONSECODE(*IFDH_control) (DWORD, DWORD, LPCVOID, DWORD, LPVOID, DWORD, LPDWORD);
@@ -620,6 +685,8 @@ LONG IFDControl(PREADER_CONTEXT rContext, DWORD ControlCode,
 	/* LOCK THIS CODE REGION */
 	(void)SYS_MutexLock(rContext->mMutex);
 
+	(void)gettimeofday(&start, NULL);
+	TRACE_START("IFDHControl");
 #ifndef PCSCLITE_STATIC_DRIVER
 	rv = (*IFDH_control) (rContext->dwSlot, ControlCode, TxBuffer,
 		TxLength, RxBuffer, RxLength, BytesReturned);
@@ -627,10 +694,14 @@ LONG IFDControl(PREADER_CONTEXT rContext, DWORD ControlCode,
 	rv = IFDHControl(rContext->dwSlot, ControlCode, TxBuffer,
 		TxLength, RxBuffer, RxLength, BytesReturned);
 #endif
+	TRACE_END("IFDHControl", rv);
+	(void)gettimeofday(&end, NULL);
 
 	/* END OF LOCKED REGION */
 	(void)SYS_MutexUnLock(rContext->mMutex);
 
+	IFDAddDriverTime(&start, &end);
+
 	if (rv == IFD_SUCCESS)
 		return SCARD_S_SUCCESS;
 	else
@@ -640,6 +711,7 @@ LONG IFDControl(PREADER_CONTEXT rContext, DWORD ControlCode,
 			ControlCode, *BytesReturned);
 		LogXxd(PCSC_LOG_DEBUG, "TxBuffer ", TxBuffer, TxLength);
 		LogXxd(PCSC_LOG_DEBUG, "RxBuffer ", RxBuffer, *BytesReturned);
+		METDriverError(rv);
 
 		if (rv == IFD_NO_SUCH_DEVICE)
 		{
@@ -663,6 +735,7 @@ LONG IFDTransmit(PREADER_CONTEXT rContext, SCARD_IO_HEADER pioTxPci,
 {
 	RESPONSECODE rv = IFD_SUCCESS;
 	UCHAR ucValue[1] = "\x00";
+	struct timeval start, end;
 
 #ifndef PCSCLITE_STATIC_DRIVER
 	RESPONSECODE(*IFD_transmit_to_icc) (SCARD_IO_HEADER, PUCHAR, DWORD,
@@ -686,6 +759,9 @@ LONG IFDTransmit(PREADER_CONTEXT rContext, SCARD_IO_HEADER pioTxPci,
 	/* LOCK THIS CODE REGION */
 	(void)SYS_MutexLock(rContext->mMutex);
 
+	(void)gettimeofday(&start, NULL);
+	TRACE_START("IFDHTransmitToICC");
+
 #ifndef PCSCLITE_STATIC_DRIVER
 	if (rContext->dwVersion == IFD_HVERSION_1_0)
 	{
@@ -712,17 +788,26 @@ LONG IFDTransmit(PREADER_CONTEXT rContext, SCARD_IO_HEADER pioTxPci,
 			pucRxBuffer, pdwRxLength, pioRxPci);
 #endif
 
+	TRACE_END("IFDHTransmitToICC", rv);
+	(void)gettimeofday(&end, NULL);
+
 	/* END OF LOCKED REGION */
 	(void)SYS_MutexUnLock(rContext->mMutex);
 
+	IFDAddDriverTime(&start, &end);
+
 	/* log the returned status word */
 	DebugLogCategory(DEBUG_CATEGORY_SW, pucRxBuffer, *pdwRxLength);
 
+	METTransmit(rContext, dwTxLength, rv == IFD_SUCCESS ? *pdwRxLength : 0,
+		time_sub(&end, &start));
+
 	if (rv == IFD_SUCCESS)
 		return SCARD_S_SUCCESS;
 	else
 	{
 		Log2(PCSC_LOG_ERROR, "Card not transacted: %ld", rv);
+		METDriverError(rv);
 
 		if (rv == IFD_NO_SUCH_DEVICE)
 		{
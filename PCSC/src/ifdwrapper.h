@@ -36,6 +36,7 @@ extern "C"
 	LONG IFDSetPTS(PREADER_CONTEXT, DWORD, UCHAR, UCHAR, UCHAR, UCHAR);
 	LONG IFDSetCapabilities(PREADER_CONTEXT, DWORD, DWORD, PUCHAR);
 	LONG IFDGetCapabilities(PREADER_CONTEXT, DWORD, PDWORD, /*@out@*/ PUCHAR);
+	long IFDDriverTime(void);
 
 #ifdef __cplusplus
 }
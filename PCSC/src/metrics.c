@@ -0,0 +1,388 @@
+/*
+ * MUSCLE SmartCard Development ( http://www.linuxnet.com )
+ *
+ * Copyright (C) 2009
+ *  Ludovic Rousseau <ludovic.rousseau@free.fr>
+ *
+ * $Id$
+ */
+
+/**
+ * @file
+ * @brief Performance counters of pcscd.
+ *
+ * The counters are updated by the threads serving the clients and the
+ * readers. They are only read to build the Prometheus text exposition.
+ * Durations are kept in microseconds and given in seconds.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "misc.h"
+#include "pcscd.h"
+#include "ifdhandler.h"
+#include "debuglog.h"
+#include "thread_generic.h"
+#include "readerfactory.h"
+#include "winscard_msg.h"
+#include "winscard_svc.h"
+#include "strlcpycat.h"
+#include "histogram.h"
+#include "metrics.h"
+
+/** one more than the last command of \ref pcsc_msg_commands */
+#define METRICS_COMMANDS (CMD_GET_METRICS + 1)
+
+/** upper bounds of the latency buckets, in us */
+static const long LatencyBuckets[] = {
+	100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000,
+	5000000, 10000000
+};
+#define LATENCY_BUCKETS (sizeof(LatencyBuckets)/sizeof(LatencyBuckets[0]))
+
+/** upper bounds of the event fan-out buckets, in clients */
+static const long FanoutBuckets[] = {
+	0, 1, 2, 5, 10, 20, 50, 100
+};
+#define FANOUT_BUCKETS (sizeof(FanoutBuckets)/sizeof(FanoutBuckets[0]))
+
+/** driver errors are IFD_ERROR_SET_FAILURE (601) to IFD_NO_SUCH_DEVICE (617) */
+#define DRIVER_ERROR_FIRST IFD_ERROR_SET_FAILURE
+#define DRIVER_ERROR_LAST IFD_NO_SUCH_DEVICE
+
+struct ReaderMetrics
+{
+	char name[MAX_READERNAME];	/**< empty if the reader was never used */
+	unsigned long transmits;
+	unsigned long long sent;	/**< bytes */
+	unsigned long long received;	/**< bytes */
+	unsigned long long time;	/**< us */
+};
+
+static struct Histogram Commands[METRICS_COMMANDS];
+static struct ReaderMetrics Readers[PCSCLITE_MAX_READERS_CONTEXTS];
+static unsigned long LockWaits;
+static unsigned long long LockWaitTime;
+static struct Histogram Fanout;
+static unsigned long DriverErrors[DRIVER_ERROR_LAST - DRIVER_ERROR_FIRST + 2];
+static PCSCLITE_MUTEX MetricsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *DriverErrorsText[] = {
+	"IFD_ERROR_SET_FAILURE",	/* 601 */
+	"IFD_ERROR_VALUE_READ_ONLY",
+	"603",
+	"604",
+	"IFD_ERROR_PTS_FAILURE",	/* 605 */
+	"IFD_ERROR_NOT_SUPPORTED",
+	"IFD_PROTOCOL_NOT_SUPPORTED",
+	"IFD_ERROR_POWER_ACTION",
+	"IFD_ERROR_SWALLOW",
+	"IFD_ERROR_EJECT",	/* 610 */
+	"IFD_ERROR_CONFISCATE",
+	"IFD_COMMUNICATION_ERROR",
+	"IFD_RESPONSE_TIMEOUT",
+	"IFD_NOT_SUPPORTED",
+	"IFD_ICC_PRESENT",	/* 615 */
+	"IFD_ICC_NOT_PRESENT",
+	"IFD_NO_SUCH_DEVICE",
+	"other"
+};
+
+/** name and help of the struct ReaderMetrics counters */
+static const char *ReaderMetricsText[][2] = {
+	{ "transmits_total", "APDUs exchanged with the reader." },
+	{ "sent_bytes_total", "Bytes sent to the reader." },
+	{ "received_bytes_total", "Bytes received from the reader." },
+	{ "transmit_seconds_total",
+		"Time used by the driver to exchange the APDUs." }
+};
+
+static void METEscape(char *, size_t, const char *);
+
+/**
+ * Counts a command received from a client.
+ *
+ * @param command one of \ref pcsc_msg_commands
+ * @param usec time used to serve the command
+ */
+void METCommand(uint32_t command, long usec)
+{
+	if (command >= METRICS_COMMANDS)
+		return;
+
+	(void)SYS_MutexLock(&MetricsMutex);
+	HISTAddValue(&Commands[command], LatencyBuckets, LATENCY_BUCKETS, usec);
+	(void)SYS_MutexUnLock(&MetricsMutex);
+} /* METCommand */
+
+/**
+ * Counts an APDU exchanged with a reader.
+ *
+ * @param rContext reader
+ * @param sent command length
+ * @param received response length
+ * @param usec time used by the driver
+ */
+void METTransmit(struct ReaderContext *rContext, DWORD sent, DWORD received,
+	long usec)
+{
+	struct ReaderMetrics *reader;
+	DWORD id = (rContext->dwIdentity >> IDENTITY_SHIFT) - 1;
+
+	if (id >= PCSCLITE_MAX_READERS_CONTEXTS)
+		return;
+
+	reader = &Readers[id];
+
+	(void)SYS_MutexLock(&MetricsMutex);
+
+	/* the reader context is used by a new reader */
+	if (strcmp(reader->name, rContext->lpcReader))
+	{
+		memset(reader, 0, sizeof(*reader));
+		(void)strlcpy(reader->name, rContext->lpcReader,
+			sizeof(reader->name));
+	}
+
+	reader->transmits++;
+	reader->sent += sent;
+	reader->received += received;
+	reader->time += usec;
+
+	(void)SYS_MutexUnLock(&MetricsMutex);
+} /* METTransmit */
+
+/**
+ * Counts a wait for the lock of a reader held by another handle.
+ *
+ * @param usec time waited
+ */
+void METLockWait(long usec)
+{
+	(void)SYS_MutexLock(&MetricsMutex);
+	LockWaits++;
+	LockWaitTime += usec;
+	(void)SYS_MutexUnLock(&MetricsMutex);
+} /* METLockWait */
+
+/**
+ * Counts an event sent to the waiting clients.
+ *
+ * @param clients number of clients signaled
+ */
+void METEventFanout(int clients)
+{
+	(void)SYS_MutexLock(&MetricsMutex);
+	HISTAddValue(&Fanout, FanoutBuckets, FANOUT_BUCKETS, clients);
+	(void)SYS_MutexUnLock(&MetricsMutex);
+} /* METEventFanout */
+
+/**
+ * Counts an error returned by a driver.
+ *
+ * @param rv value returned by the IFDH function
+ */
+void METDriverError(RESPONSECODE rv)
+{
+	int index;
+
+	if ((rv >= DRIVER_ERROR_FIRST) && (rv <= DRIVER_ERROR_LAST))
+		index = rv - DRIVER_ERROR_FIRST;
+	else
+		index = DRIVER_ERROR_LAST - DRIVER_ERROR_FIRST + 1;
+
+	(void)SYS_MutexLock(&MetricsMutex);
+	DriverErrors[index]++;
+	(void)SYS_MutexUnLock(&MetricsMutex);
+} /* METDriverError */
+
+/**
+ * Gives the counters in the Prometheus text format.
+ *
+ * @param length length of the text
+ * @return text to free() or NULL if no memory is available
+ */
+char *METFormat(size_t *length)
+{
+	struct Text text = { NULL, 0, 0 };
+	int i, m, clients, contexts, handles;
+
+	ContextsCount(&clients, &contexts, &handles);
+
+	(void)SYS_MutexLock(&MetricsMutex);
+
+	HISTPrintf(&text, "# HELP pcscd_command_duration_seconds"
+		" Time to serve a client command.\n"
+		"# TYPE pcscd_command_duration_seconds histogram\n");
+	for (i=1; i<METRICS_COMMANDS; i++)
+	{
+		char label[64];
+
+		if (0 == Commands[i].count)
+			continue;
+
+		(void)snprintf(label, sizeof(label), "command=\"%s\"",
+			CommandsText[i]);
+		HISTPrint(&text, "pcscd_command_duration_seconds", label,
+			&Commands[i], LatencyBuckets, LATENCY_BUCKETS, 1000000);
+	}
+
+	/* all the lines of a metric must be grouped */
+	for (m=0; m<4; m++)
+	{
+		HISTPrintf(&text, "# HELP pcscd_reader_%s %s\n"
+			"# TYPE pcscd_reader_%s counter\n", ReaderMetricsText[m][0],
+			ReaderMetricsText[m][1], ReaderMetricsText[m][0]);
+
+		for (i=0; i<PCSCLITE_MAX_READERS_CONTEXTS; i++)
+		{
+			struct ReaderMetrics *reader = &Readers[i];
+			char name[2 * MAX_READERNAME];
+
+			if ('\0' == reader->name[0])
+				continue;
+
+			METEscape(name, sizeof(name), reader->name);
+			HISTPrintf(&text, "pcscd_reader_%s{reader=\"%s\"} ",
+				ReaderMetricsText[m][0], name);
+			switch (m)
+			{
+				case 0:
+					HISTPrintf(&text, "%lu\n", reader->transmits);
+					break;
+
+				case 1:
+					HISTPrintf(&text, "%llu\n", reader->sent);
+					break;
+
+				case 2:
+					HISTPrintf(&text, "%llu\n", reader->received);
+					break;
+
+				default:
+					HISTPrintf(&text, "%.6f\n", reader->time / 1000000.);
+			}
+		}
+	}
+
+	HISTPrintf(&text, "# HELP pcscd_lock_waits_total"
+		" Waits for a reader locked by another handle.\n"
+		"# TYPE pcscd_lock_waits_total counter\n"
+		"pcscd_lock_waits_total %lu\n"
+		"# HELP pcscd_lock_wait_seconds_total"
+		" Time waited for a reader locked by another handle.\n"
+		"# TYPE pcscd_lock_wait_seconds_total counter\n"
+		"pcscd_lock_wait_seconds_total %.6f\n",
+		LockWaits, LockWaitTime / 1000000.);
+
+	HISTPrintf(&text, "# HELP pcscd_clients Connected clients.\n"
+		"# TYPE pcscd_clients gauge\n"
+		"pcscd_clients %d\n"
+		"# HELP pcscd_contexts Established contexts.\n"
+		"# TYPE pcscd_contexts gauge\n"
+		"pcscd_contexts %d\n"
+		"# HELP pcscd_handles Connected card handles.\n"
+		"# TYPE pcscd_handles gauge\n"
+		"pcscd_handles %d\n", clients, contexts, handles);
+
+	HISTPrintf(&text, "# HELP pcscd_event_fanout_clients"
+		" Clients signaled for a reader event.\n"
+		"# TYPE pcscd_event_fanout_clients histogram\n");
+	HISTPrint(&text, "pcscd_event_fanout_clients", NULL, &Fanout,
+		FanoutBuckets, FANOUT_BUCKETS, 1);
+
+	HISTPrintf(&text, "# HELP pcscd_driver_errors_total"
+		" Errors returned by the drivers.\n"
+		"# TYPE pcscd_driver_errors_total counter\n");
+	for (i=0; i<=DRIVER_ERROR_LAST - DRIVER_ERROR_FIRST + 1; i++)
+		if (DriverErrors[i])
+			HISTPrintf(&text,
+				"pcscd_driver_errors_total{error=\"%s\"} %lu\n",
+				DriverErrorsText[i], DriverErrors[i]);
+
+	(void)SYS_MutexUnLock(&MetricsMutex);
+
+	if (NULL == text.buffer)
+		return NULL;
+
+	*length = text.length;
+	return text.buffer;
+} /* METFormat */
+
+/**
+ * Writes the counters in a file. The file is replaced atomically so
+ * a reader never sees a partial content.
+ *
+ * @param file file to write
+ * @return 0 or -1 in case of error
+ */
+int METDump(const char *file)
+{
+	char tmp[FILENAME_MAX];
+	char *text;
+	size_t length;
+	FILE *fp;
+	int rv = 0;
+
+	text = METFormat(&length);
+	if (NULL == text)
+		return -1;
+
+	(void)snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+	fp = fopen(tmp, "w");
+	if (NULL == fp)
+	{
+		Log3(PCSC_LOG_ERROR, "Cannot create %s: %s", tmp, strerror(errno));
+		free(text);
+		return -1;
+	}
+
+	if (fwrite(text, 1, length, fp) != length)
+		rv = -1;
+	if (fclose(fp) != 0)
+		rv = -1;
+	free(text);
+
+	if ((rv < 0) || (rename(tmp, file) < 0))
+	{
+		Log3(PCSC_LOG_ERROR, "Cannot write %s: %s", file, strerror(errno));
+		(void)remove(tmp);
+		return -1;
+	}
+
+	return 0;
+} /* METDump */
+
+/**
+ * Escapes a label value: \\, " and new line
+ */
+static void METEscape(char *out, size_t size, const char *in)
+{
+	size_t i = 0;
+
+	for (; *in && (i + 2 < size); in++)
+	{
+		switch (*in)
+		{
+			case '\\':
+			case '"':
+				out[i++] = '\\';
+				out[i++] = *in;
+				break;
+
+			case '\n':
+				out[i++] = '\\';
+				out[i++] = 'n';
+				break;
+
+			default:
+				out[i++] = *in;
+		}
+	}
+	out[i] = '\0';
+} /* METEscape */
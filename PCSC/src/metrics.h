@@ -0,0 +1,42 @@
+/*
+ * MUSCLE SmartCard Development ( http://www.linuxnet.com )
+ *
+ * Copyright (C) 2009
+ *  Ludovic Rousseau <ludovic.rousseau@free.fr>
+ *
+ * $Id$
+ */
+
+/**
+ * @file
+ * @brief Performance counters of pcscd.
+ *
+ * The counters are given in the Prometheus text format by the
+ * \ref CMD_GET_METRICS command of the client socket and written in the
+ * file given with --stats when pcscd receives SIGUSR1.
+ */
+
+#ifndef __metrics_h__
+#define __metrics_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+	void METCommand(uint32_t, long);
+	void METTransmit(struct ReaderContext *, DWORD, DWORD, long);
+	void METLockWait(long);
+	void METEventFanout(int);
+	void METDriverError(RESPONSECODE);
+	char *METFormat(size_t *);
+	int METDump(const char *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -107,6 +107,7 @@ check_constants (void)
     CHECK_VALUE (CMD_GET_READERS_STATE);
     CHECK_VALUE (CMD_WAIT_READER_STATE_CHANGE);
     CHECK_VALUE (CMD_STOP_WAITING_READER_STATE_CHANGE);
+    CHECK_VALUE (CMD_GET_METRICS);
 }
 
 static void
@@ -214,6 +215,16 @@ check_types (void)
     CHECK_MEMBER (getset_struct, cbAttrLen);
     CHECK_MEMBER (getset_struct, rv);
 
+    BLANK_LINE ();
+    CHECK_STRUCT (metrics_struct);
+    CHECK_MEMBER (metrics_struct, size);
+    CHECK_MEMBER (metrics_struct, rv);
+
+    BLANK_LINE ();
+    CHECK_STRUCT (reply_times);
+    CHECK_MEMBER (reply_times, server);
+    CHECK_MEMBER (reply_times, driver);
+
     BLANK_LINE ();
     CHECK_STRUCT (pubReaderStatesList);
     CHECK_MEMBER (pubReaderStatesList, readerID);
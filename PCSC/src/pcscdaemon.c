@@ -29,6 +29,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #ifdef HAVE_GETOPT_H
 #include <getopt.h>
 #endif
@@ -46,6 +47,10 @@
 #include "configfile.h"
 #include "powermgt_generic.h"
 #include "utils.h"
+#include "strlcpycat.h"
+#include "capture.h"
+#include "metrics.h"
+#include "trace.h"
 
 #ifndef TRUE
 #define TRUE 1
@@ -56,6 +61,11 @@ char AraKiri = FALSE;
 static char Init = TRUE;
 static int ExitValue = EXIT_SUCCESS;
 int HPForceReaderPolling = 0;
+static char StatsFile[PATH_MAX];	/**< metrics written on SIGUSR1 */
+static volatile sig_atomic_t DumpStats = FALSE;
+#ifdef PCSC_TRACE
+static volatile sig_atomic_t ToggleTrace = FALSE;
+#endif
 
 /*
  * Some internal functions
@@ -63,6 +73,9 @@ int HPForceReaderPolling = 0;
 static void at_exit(void);
 static void clean_temp_files(void);
 static void signal_reload(int sig);
+#ifdef PCSC_TRACE
+static void signal_trace(int sig);
+#endif
 static void signal_trap(int);
 static void print_version (void);
 static void print_usage (char const * const);
@@ -168,6 +181,28 @@ static void SVCServiceRunLoop(void)
 			break;
 		}
 
+		/* SIGUSR1 received. The signal handler cannot do it itself */
+		if (DumpStats)
+		{
+			DumpStats = FALSE;
+			if (0 == METDump(StatsFile))
+				Log2(PCSC_LOG_INFO, "Metrics written in %s", StatsFile);
+		}
+
+#ifdef PCSC_TRACE
+		/* SIGUSR2 received */
+		if (ToggleTrace)
+		{
+			int enable = TraceEnabled <= 0;
+
+			ToggleTrace = FALSE;
+			if (TRCSetEnabled(enable) < 0)
+				Log1(PCSC_LOG_ERROR, "PCSCLITE_TRACE is not set");
+			else
+				Log2(PCSC_LOG_INFO, "Trace %s", enable ? "resumed" : "paused");
+		}
+#endif
+
 		if (AraKiri)
 		{
 			/* stop the hotpug thread and waits its exit */
@@ -202,6 +237,8 @@ int main(int argc, char **argv)
 		{"critical", 0, NULL, 'C'},
 		{"hotplug", 0, NULL, 'H'},
 		{"force-reader-polling", optional_argument, NULL, 0},
+		{"capture", 1, NULL, 0},
+		{"stats", 1, NULL, 0},
 		{NULL, 0, NULL, 0}
 	};
 #endif
@@ -245,6 +282,30 @@ int main(int argc, char **argv)
 				if (strcmp(long_options[option_index].name,
 					"force-reader-polling") == 0)
 					HPForceReaderPolling = optarg ? abs(atoi(optarg)) : 1;
+				if (strcmp(long_options[option_index].name,
+					"capture") == 0)
+					if (CAPOpen(optarg) < 0)
+						return EXIT_FAILURE;
+				if (strcmp(long_options[option_index].name,
+					"stats") == 0)
+				{
+					char cwd[PATH_MAX];
+					int len;
+
+					/* pcscd changes its working directory */
+					if (('/' == optarg[0]) || (NULL == getcwd(cwd, sizeof(cwd))))
+						len = strlcpy(StatsFile, optarg, sizeof(StatsFile));
+					else
+						len = snprintf(StatsFile, sizeof(StatsFile), "%s/%s",
+							cwd, optarg);
+
+					if ((len < 0) || (len >= (int)sizeof(StatsFile)))
+					{
+						Log2(PCSC_LOG_CRITICAL, "Statistics file name too long: %s",
+							optarg);
+						return EXIT_FAILURE;
+					}
+				}
 				break;
 #endif
 			case 'c':
@@ -374,6 +435,9 @@ int main(int argc, char **argv)
 				strerror(errno));
 	}
 
+	/* the logs are written by a dedicated thread from now on */
+	(void)DebugLogStartThread();
+
 	/*
 	 * cleanly remove /var/run/pcscd/files when exiting
 	 */
@@ -500,6 +564,9 @@ int main(int argc, char **argv)
 	(void)signal(SIGHUP, signal_trap);
 
 	(void)signal(SIGUSR1, signal_reload);
+#ifdef PCSC_TRACE
+	(void)signal(SIGUSR2, signal_trace);
+#endif
 
 	SVCServiceRunLoop();
 
@@ -513,6 +580,7 @@ static void at_exit(void)
 
 	clean_temp_files();
 
+	DebugLogFlush();
 	SYS_Exit(ExitValue);
 }
 
@@ -540,9 +608,23 @@ static void signal_reload(/*@unused@*/ int sig)
 	if (AraKiri)
 		return;
 
+	if (StatsFile[0])
+		DumpStats = TRUE;
+
 	HPReCheckSerialReaders();
 } /* signal_reload */
 
+#ifdef PCSC_TRACE
+static void signal_trace(/*@unused@*/ int sig)
+{
+	(void)signal(SIGUSR2, signal_trace);
+
+	(void)sig;
+
+	ToggleTrace = TRUE;
+} /* signal_trace */
+#endif
+
 static void signal_trap(/*@unused@*/ int sig)
 {
 	(void)sig;
@@ -592,6 +674,8 @@ static void print_usage (char const * const progname)
 	printf("  -e  --error	 	display error level debug messages\n");
 	printf("  -C  --critical 	display critical only level debug messages\n");
 	printf("  --force-reader-polling ignore the IFD_GENERATE_HOTPLUG reader capability\n");
+	printf("  --capture file	record the exchanges with the readers in file\n");
+	printf("  --stats file	write the metrics in file on SIGUSR1\n");
 #else
 	printf("  -a    log APDU commands and results\n");
 	printf("  -c 	path to reader.conf\n");
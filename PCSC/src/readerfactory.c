@@ -50,7 +50,52 @@ static char *ConfigFile = NULL;
 static int ConfigFileCRC = 0;
 static PCSCLITE_MUTEX LockMutex = PTHREAD_MUTEX_INITIALIZER;
 
-#define IDENTITY_SHIFT 16
+/** maximum number of readers opened at the same time by RFAddReaders() */
+#define MAX_PARALLEL_OPEN 8
+
+/**
+ * readers opened in parallel by RFOpenReaders()
+ */
+struct OpenQueue
+{
+	PCSCLITE_MUTEX mutex;
+	DWORD *dwContexts;	/**< contexts of the readers to open */
+	LONG *results;	/**< results of RFOpenPort() */
+	int count;
+	int next;	/**< next reader to open */
+};
+
+/** maximum number of drivers loaded at the same time */
+#define MAX_DRIVERS (2 * PCSCLITE_MAX_READERS_CONTEXTS)
+
+/**
+ * driver library shared by all the readers using it
+ */
+struct IFDDriver
+{
+	char lpcLibrary[MAX_LIBNAME];	/**< Library Path, empty if unused */
+	LPVOID vHandle;	/**< Dlopen handle */
+	DWORD dwVersion;	/**< IFD Handler version, 0 if not bound yet */
+	union FctMap psFunctions;	/**< driver functions */
+	int iReferences;	/**< reader contexts and preloads using the driver */
+	int iPreloads;	/**< references taken by RFPreloadDriver() */
+};
+
+static struct IFDDriver sDrivers[MAX_DRIVERS];
+
+static LONG RFPrepareReader(LPSTR lpcReader, DWORD dwPort, LPSTR lpcLibrary,
+	LPSTR lpcDevice, DWORD *pdwContext);
+static LONG RFStartReader(LPSTR lpcReader, DWORD dwPort, LPSTR lpcLibrary,
+	LPSTR lpcDevice, DWORD dwContext);
+static int RFLibraryThreadSafe(LPSTR lpcLibrary);
+static void RFOpenReaders(DWORD dwContexts[], LONG results[], int count);
+static void *RFOpenReaderThread(void *arg);
+static LONG RFLoadDriver(PREADER_CONTEXT rContext);
+static LONG RFOpenReader(PREADER_CONTEXT rContext);
+static LONG RFOpenPort(PREADER_CONTEXT rContext);
+static struct IFDDriver *RFFindDriver(LPSTR lpcLibrary);
+static struct IFDDriver *RFFindDriverByHandle(LPVOID vHandle);
+static struct IFDDriver *RFNewDriver(LPSTR lpcLibrary);
 
 LONG RFAllocateReaderSpace(void)
 {
@@ -69,11 +114,134 @@ LONG RFAllocateReaderSpace(void)
 }
 
 LONG RFAddReader(LPSTR lpcReader, DWORD dwPort, LPSTR lpcLibrary, LPSTR lpcDevice)
+{
+	READER_ADD reader;
+
+	reader.lpcReader = lpcReader;
+	reader.dwPort = dwPort;
+	reader.lpcLibrary = lpcLibrary;
+	reader.lpcDevice = lpcDevice;
+
+	(void)RFAddReaders(&reader, 1);
+
+	return reader.rv;
+}
+
+/**
+ * Adds several readers.
+ *
+ * The drivers are loaded and the reader names are set in the readers[]
+ * order. The readers are then opened in parallel, since opening a reader
+ * can take seconds, and started in the readers[] order again so the
+ * reader contexts used do not depend on the time needed to open them.
+ *
+ * The first reader of a driver is opened before the other readers of
+ * the same driver since they get their name and shared resources from it.
+ *
+ * @param readers readers to add. readers[i].rv is set to the result of
+ * the addition.
+ * @param count number of readers
+ * @return SCARD_S_SUCCESS or SCARD_E_NO_MEMORY
+ */
+LONG RFAddReaders(READER_ADD readers[], int count)
+{
+	DWORD *dwContexts;
+	LONG *results;
+	int *wave;
+	char *done;
+	int i, j, waveSize, remaining;
+
+	dwContexts = calloc(count, sizeof(*dwContexts));
+	results = calloc(count, sizeof(*results));
+	wave = calloc(count, sizeof(*wave));
+	done = calloc(count, sizeof(*done));
+	if ((NULL == dwContexts) || (NULL == results) || (NULL == wave)
+		|| (NULL == done))
+	{
+		Log1(PCSC_LOG_CRITICAL, "Not enough memory");
+		for (i=0; i<count; i++)
+			readers[i].rv = SCARD_E_NO_MEMORY;
+		free(dwContexts);
+		free(results);
+		free(wave);
+		free(done);
+		return SCARD_E_NO_MEMORY;
+	}
+
+	remaining = count;
+	while (remaining > 0)
+	{
+		waveSize = 0;
+		for (i=0; i<count; i++)
+		{
+			if (done[i])
+				continue;
+
+			/* open the readers of a driver one at a time, unless a
+			 * started reader says the driver is thread safe */
+			for (j=0; j<waveSize; j++)
+				if (strcmp(readers[wave[j]].lpcLibrary,
+					readers[i].lpcLibrary) == 0)
+					break;
+			if ((j < waveSize) && !RFLibraryThreadSafe(readers[i].lpcLibrary))
+				continue;
+
+			done[i] = TRUE;
+			remaining--;
+
+			readers[i].rv = RFPrepareReader(readers[i].lpcReader,
+				readers[i].dwPort, readers[i].lpcLibrary,
+				readers[i].lpcDevice, &dwContexts[waveSize]);
+			if (readers[i].rv != SCARD_S_SUCCESS)
+				continue;
+
+			wave[waveSize] = i;
+			waveSize++;
+		}
+
+		RFOpenReaders(dwContexts, results, waveSize);
+
+		for (j=0; j<waveSize; j++)
+		{
+			READER_ADD *reader = &readers[wave[j]];
+
+			if (results[j] != SCARD_S_SUCCESS)
+			{
+				/* the driver is unloaded here and not by the opening
+				 * threads since sDrivers[] is not locked */
+				(void)RFUnBindFunctions(sReadersContexts[dwContexts[j]]);
+				(void)RFUnloadReader(sReadersContexts[dwContexts[j]]);
+
+				/* Cannot connect to reader. Exit gracefully */
+				Log2(PCSC_LOG_ERROR, "%s init failed.", reader->lpcReader);
+				(void)RFRemoveReader(reader->lpcReader, reader->dwPort);
+				reader->rv = results[j];
+			}
+			else
+				reader->rv = RFStartReader(reader->lpcReader, reader->dwPort,
+					reader->lpcLibrary, reader->lpcDevice, dwContexts[j]);
+		}
+	}
+
+	free(dwContexts);
+	free(results);
+	free(wave);
+	free(done);
+
+	return SCARD_S_SUCCESS;
+}
+
+/**
+ * Checks the reader parameters, reserves a reader context, sets the
+ * reader name and loads the driver.
+ */
+static LONG RFPrepareReader(LPSTR lpcReader, DWORD dwPort, LPSTR lpcLibrary,
+	LPSTR lpcDevice, DWORD *pdwContext)
 {
 	DWORD dwContext = 0, dwGetSize;
-	UCHAR ucGetData[1], ucThread[1];
+	UCHAR ucThread[1];
 	LONG rv, parentNode;
-	int i, j;
+	int i;
 
 	if ((lpcReader == NULL) || (lpcLibrary == NULL) || (lpcDevice == NULL))
 		return SCARD_E_INVALID_VALUE;
@@ -226,7 +394,7 @@ LONG RFAddReader(LPSTR lpcReader, DWORD dwPort, LPSTR lpcLibrary, LPSTR lpcDevic
 
 	dwNumReadersContexts += 1;
 
-	rv = RFInitializeReader(sReadersContexts[dwContext]);
+	rv = RFLoadDriver(sReadersContexts[dwContext]);
 	if (rv != SCARD_S_SUCCESS)
 	{
 		/* Cannot connect to reader. Exit gracefully */
@@ -235,6 +403,22 @@ LONG RFAddReader(LPSTR lpcReader, DWORD dwPort, LPSTR lpcLibrary, LPSTR lpcDevic
 		return rv;
 	}
 
+	*pdwContext = dwContext;
+
+	return SCARD_S_SUCCESS;
+}
+
+/**
+ * Starts the event handler of an opened reader and adds its other slots.
+ */
+static LONG RFStartReader(LPSTR lpcReader, DWORD dwPort, LPSTR lpcLibrary,
+	LPSTR lpcDevice, DWORD dwContext)
+{
+	DWORD dwGetSize;
+	UCHAR ucGetData[1], ucThread[1];
+	LONG rv;
+	int i, j;
+
 	/* asynchronous card movement?  */
 	{
 		RESPONSECODE (*fct)(DWORD) = NULL;
@@ -399,6 +583,100 @@ LONG RFAddReader(LPSTR lpcReader, DWORD dwPort, LPSTR lpcLibrary, LPSTR lpcDevic
 	return SCARD_S_SUCCESS;
 }
 
+/**
+ * Returns TRUE if a started reader using the driver lpcLibrary reports
+ * TAG_IFD_THREAD_SAFE: the driver can then open several readers at the
+ * same time.
+ */
+static int RFLibraryThreadSafe(LPSTR lpcLibrary)
+{
+	int i;
+
+	for (i = 0; i < PCSCLITE_MAX_READERS_CONTEXTS; i++)
+		if (((sReadersContexts[i])->vHandle != 0)
+			&& ((sReadersContexts[i])->readerState != NULL)
+			&& (strcmp((sReadersContexts[i])->lpcLibrary, lpcLibrary) == 0))
+		{
+			DWORD dwGetSize;
+			UCHAR ucThread[1];
+			LONG rv;
+
+			dwGetSize = sizeof(ucThread);
+			rv = IFDGetCapabilities((sReadersContexts[i]),
+				TAG_IFD_THREAD_SAFE, &dwGetSize, ucThread);
+
+			return (rv == IFD_SUCCESS) && (dwGetSize == 1)
+				&& (ucThread[0] == 1);
+		}
+
+	return FALSE;
+}
+
+/**
+ * Opens the readers of the dwContexts[] contexts, using up to
+ * MAX_PARALLEL_OPEN threads. The driver of a reader which cannot be
+ * opened is not unloaded: the caller does it once the threads are done.
+ */
+static void RFOpenReaders(DWORD dwContexts[], LONG results[], int count)
+{
+	struct OpenQueue queue;
+	PCSCLITE_THREAD_T threads[MAX_PARALLEL_OPEN];
+	int i, threadsCount = 0;
+
+	if (count <= 1)
+	{
+		if (1 == count)
+			results[0] = RFOpenPort(sReadersContexts[dwContexts[0]]);
+		return;
+	}
+
+	queue.dwContexts = dwContexts;
+	queue.results = results;
+	queue.count = count;
+	queue.next = 0;
+	(void)SYS_MutexInit(&queue.mutex);
+
+	/* the current thread also opens readers */
+	for (i = 1; (i < count) && (i < MAX_PARALLEL_OPEN); i++)
+	{
+		if (SYS_ThreadCreate(&threads[threadsCount], THREAD_ATTR_DEFAULT,
+			(PCSCLITE_THREAD_FUNCTION( ))RFOpenReaderThread, &queue))
+		{
+			Log1(PCSC_LOG_ERROR, "SYS_ThreadCreate failed");
+			break;
+		}
+		threadsCount++;
+	}
+
+	(void)RFOpenReaderThread(&queue);
+
+	for (i = 0; i < threadsCount; i++)
+		(void)SYS_ThreadJoin(threads[i], NULL);
+
+	(void)SYS_MutexDestroy(&queue.mutex);
+}
+
+static void *RFOpenReaderThread(void *arg)
+{
+	struct OpenQueue *queue = arg;
+
+	while (1)
+	{
+		int i;
+
+		(void)SYS_MutexLock(&queue->mutex);
+		i = queue->next++;
+		(void)SYS_MutexUnLock(&queue->mutex);
+
+		if (i >= queue->count)
+			break;
+
+		queue->results[i] = RFOpenPort(sReadersContexts[queue->dwContexts[i]]);
+	}
+
+	return NULL;
+}
+
 LONG RFRemoveReader(LPSTR lpcReader, DWORD dwPort)
 {
 	LONG rv;
@@ -492,31 +770,42 @@ LONG RFSetReaderName(PREADER_CONTEXT rContext, LPSTR readerName,
 
 	if ((0 == dwSlot) && (dwNumReadersContexts != 0))
 	{
+		/* Ask the driver if it supports multiple channels. Only a started
+		 * reader can answer: the readers added by RFAddReaders() at the
+		 * same time are not opened yet */
 		for (i = 0; i < PCSCLITE_MAX_READERS_CONTEXTS; i++)
 		{
-			if ((sReadersContexts[i])->vHandle != 0)
+			if (((sReadersContexts[i])->vHandle != 0)
+				&& ((sReadersContexts[i])->readerState != NULL)
+				&& (strcmp((sReadersContexts[i])->lpcLibrary, libraryName) == 0))
 			{
-				if (strcmp((sReadersContexts[i])->lpcLibrary, libraryName) == 0)
-				{
-					UCHAR tagValue[1];
-					LONG ret;
+				UCHAR tagValue[1];
+				LONG ret;
 
-					/* Ask the driver if it supports multiple channels */
-					valueLength = sizeof(tagValue);
-					ret = IFDGetCapabilities((sReadersContexts[i]),
-						TAG_IFD_SIMULTANEOUS_ACCESS,
-						&valueLength, tagValue);
+				valueLength = sizeof(tagValue);
+				ret = IFDGetCapabilities((sReadersContexts[i]),
+					TAG_IFD_SIMULTANEOUS_ACCESS,
+					&valueLength, tagValue);
 
-					if ((ret == IFD_SUCCESS) && (valueLength == 1) &&
-						(tagValue[0] > 1))
-					{
-						supportedChannels = tagValue[0];
-						Log2(PCSC_LOG_INFO,
-							"Support %d simultaneous readers", tagValue[0]);
-					}
-					else
-						supportedChannels = 1;
+				if ((ret == IFD_SUCCESS) && (valueLength == 1) &&
+					(tagValue[0] > 1))
+				{
+					supportedChannels = tagValue[0];
+					Log2(PCSC_LOG_INFO,
+						"Support %d simultaneous readers", tagValue[0]);
+				}
+				else
+					supportedChannels = 1;
+				break;
+			}
+		}
 
+		for (i = 0; i < PCSCLITE_MAX_READERS_CONTEXTS; i++)
+		{
+			if ((sReadersContexts[i])->vHandle != 0)
+			{
+				if (strcmp((sReadersContexts[i])->lpcLibrary, libraryName) == 0)
+				{
 					/* Check to see if it is a hotplug reader and different */
 					if (((((sReadersContexts[i])->dwPort & 0xFFFF0000) ==
 							PCSCLITE_HP_BASE_PORT)
@@ -530,7 +819,8 @@ LONG RFSetReaderName(PREADER_CONTEXT rContext, LPSTR readerName,
 						 * clone is so it can use it's shared
 						 * resources like mutex/etc.
 						 */
-						parent = i;
+						if ((sReadersContexts[i])->readerState != NULL)
+							parent = i;
 
 						/*
 						 * If the same reader already exists and it is
@@ -735,22 +1025,161 @@ LONG RFReaderInfoById(DWORD dwIdentity, PREADER_CONTEXT * sReader)
 
 LONG RFLoadReader(PREADER_CONTEXT rContext)
 {
-	if (rContext->vHandle != 0)
+	struct IFDDriver *driver;
+
+	driver = RFFindDriver(rContext->lpcLibrary);
+	if (driver != NULL)
 	{
 		Log2(PCSC_LOG_INFO, "Reusing already loaded driver for %s",
 			rContext->lpcLibrary);
 		/* Another reader exists with this library loaded */
-		return SCARD_S_SUCCESS;
 	}
+	else
+	{
+		LONG rv;
+
+		driver = RFNewDriver(rContext->lpcLibrary);
+		if (NULL == driver)
+			return SCARD_E_NO_MEMORY;
+
+		rv = DYN_LoadLibrary(&driver->vHandle, rContext->lpcLibrary);
+		if (rv != SCARD_S_SUCCESS)
+		{
+			driver->lpcLibrary[0] = '\0';
+			return rv;
+		}
+	}
+
+	driver->iReferences++;
+	rContext->vHandle = driver->vHandle;
+
+	return SCARD_S_SUCCESS;
+}
+
+/**
+ * Loads the driver of readers about to be started.
+ *
+ * All the symbols of the driver are resolved now and the readers using
+ * it are then started without loading and binding the library again.
+ * The reference taken is dropped by RFReleasePreloadedDriver() once the
+ * readers are started so a driver no reader uses is unloaded.
+ */
+LONG RFPreloadDriver(LPSTR lpcLibrary)
+{
+	struct IFDDriver *driver;
+	LONG rv;
+
+	if (strlen(lpcLibrary) >= MAX_LIBNAME)
+		return SCARD_E_INVALID_VALUE;
+
+	driver = RFFindDriver(lpcLibrary);
+	if (NULL == driver)
+	{
+		driver = RFNewDriver(lpcLibrary);
+		if (NULL == driver)
+			return SCARD_E_NO_MEMORY;
+
+		Log2(PCSC_LOG_DEBUG, "Preloading %s", lpcLibrary);
+		rv = DYN_LoadLibraryNow(&driver->vHandle, lpcLibrary);
+		if (rv != SCARD_S_SUCCESS)
+		{
+			driver->lpcLibrary[0] = '\0';
+			return rv;
+		}
+	}
+
+	driver->iReferences++;
+	driver->iPreloads++;
+
+	return SCARD_S_SUCCESS;
+}
+
+/**
+ * Drops the reference taken by a successful RFPreloadDriver().
+ */
+void RFReleasePreloadedDriver(LPSTR lpcLibrary)
+{
+	struct IFDDriver *driver;
+
+	driver = RFFindDriver(lpcLibrary);
+	if ((NULL == driver) || (0 == driver->iPreloads))
+		return;
+
+	driver->iPreloads--;
+	driver->iReferences--;
 
-	return DYN_LoadLibrary(&rContext->vHandle, rContext->lpcLibrary);
+	/* no reader was started with this driver */
+	if (0 == driver->iReferences)
+	{
+		Log2(PCSC_LOG_INFO, "Unloading unused driver %s", lpcLibrary);
+		(void)DYN_CloseLibrary(&driver->vHandle);
+		driver->lpcLibrary[0] = '\0';
+	}
+}
+
+static struct IFDDriver *RFFindDriver(LPSTR lpcLibrary)
+{
+	int i;
+
+	for (i=0; i<MAX_DRIVERS; i++)
+		if ((sDrivers[i].lpcLibrary[0] != '\0')
+			&& (strcmp(sDrivers[i].lpcLibrary, lpcLibrary) == 0))
+			return &sDrivers[i];
+
+	return NULL;
+}
+
+static struct IFDDriver *RFFindDriverByHandle(LPVOID vHandle)
+{
+	int i;
+
+	for (i=0; i<MAX_DRIVERS; i++)
+		if ((sDrivers[i].lpcLibrary[0] != '\0')
+			&& (sDrivers[i].vHandle == vHandle))
+			return &sDrivers[i];
+
+	return NULL;
+}
+
+/**
+ * Reserves an unused sDrivers[] entry.
+ */
+static struct IFDDriver *RFNewDriver(LPSTR lpcLibrary)
+{
+	int i;
+
+	for (i=0; i<MAX_DRIVERS; i++)
+		if ('\0' == sDrivers[i].lpcLibrary[0])
+		{
+			(void)strlcpy(sDrivers[i].lpcLibrary, lpcLibrary,
+				sizeof(sDrivers[i].lpcLibrary));
+			sDrivers[i].vHandle = NULL;
+			sDrivers[i].dwVersion = 0;
+			sDrivers[i].iReferences = 0;
+			sDrivers[i].iPreloads = 0;
+			return &sDrivers[i];
+		}
+
+	Log2(PCSC_LOG_CRITICAL, "Too many drivers loaded: %s", lpcLibrary);
+	return NULL;
 }
 
 LONG RFBindFunctions(PREADER_CONTEXT rContext)
 {
+	struct IFDDriver *driver;
 	int rv1, rv2, rv3;
 	void *f;
 
+	/* the functions are resolved only once per driver */
+	driver = RFFindDriverByHandle(rContext->vHandle);
+	if ((driver != NULL) && (driver->dwVersion != 0))
+	{
+		rContext->dwVersion = driver->dwVersion;
+		memcpy(&rContext->psFunctions, &driver->psFunctions,
+			sizeof(rContext->psFunctions));
+		return SCARD_S_SUCCESS;
+	}
+
 	/*
 	 * Use this function as a dummy to determine the IFD Handler version
 	 * type  1.0/2.0/3.0.  Suppress error messaging since it can't be 1.0,
@@ -895,6 +1324,13 @@ LONG RFBindFunctions(PREADER_CONTEXT rContext)
 		exit(1);
 	}
 
+	if (driver != NULL)
+	{
+		driver->dwVersion = rContext->dwVersion;
+		memcpy(&driver->psFunctions, &rContext->psFunctions,
+			sizeof(driver->psFunctions));
+	}
+
 	return SCARD_S_SUCCESS;
 }
 
@@ -908,11 +1344,25 @@ LONG RFUnBindFunctions(PREADER_CONTEXT rContext)
 
 LONG RFUnloadReader(PREADER_CONTEXT rContext)
 {
-	/* Make sure no one else is using this library */
-	if (*rContext->pdwFeeds == 1)
+	struct IFDDriver *driver;
+
+	if (NULL == rContext->vHandle)
+		return SCARD_S_SUCCESS;
+
+	driver = RFFindDriverByHandle(rContext->vHandle);
+	if (NULL == driver)
+		Log2(PCSC_LOG_ERROR, "Unknown driver for %s", rContext->lpcReader);
+	else
 	{
-		Log1(PCSC_LOG_INFO, "Unloading reader driver.");
-		(void)DYN_CloseLibrary(&rContext->vHandle);
+		driver->iReferences--;
+
+		/* Make sure no one else is using this library */
+		if (0 == driver->iReferences)
+		{
+			Log1(PCSC_LOG_INFO, "Unloading reader driver.");
+			(void)DYN_CloseLibrary(&driver->vHandle);
+			driver->lpcLibrary[0] = '\0';
+		}
 	}
 
 	rContext->vHandle = NULL;
@@ -1019,6 +1469,17 @@ LONG RFInitializeReader(PREADER_CONTEXT rContext)
 {
 	LONG rv;
 
+	rv = RFLoadDriver(rContext);
+	if (rv != SCARD_S_SUCCESS)
+		return rv;
+
+	return RFOpenReader(rContext);
+}
+
+static LONG RFLoadDriver(PREADER_CONTEXT rContext)
+{
+	LONG rv;
+
 	/* Spawn the event handler thread */
 	Log3(PCSC_LOG_INFO, "Attempting startup of %s using %s",
 		rContext->lpcReader, rContext->lpcLibrary);
@@ -1041,6 +1502,31 @@ LONG RFInitializeReader(PREADER_CONTEXT rContext)
 		return rv;
 	}
 
+	return SCARD_S_SUCCESS;
+}
+
+static LONG RFOpenReader(PREADER_CONTEXT rContext)
+{
+	LONG rv;
+
+	rv = RFOpenPort(rContext);
+	if (rv != SCARD_S_SUCCESS)
+	{
+		(void)RFUnBindFunctions(rContext);
+		(void)RFUnloadReader(rContext);
+	}
+
+	return rv;
+}
+
+/**
+ * Opens the port of a reader whose driver is loaded. Only touches
+ * rContext so it can be called by several threads at the same time.
+ */
+static LONG RFOpenPort(PREADER_CONTEXT rContext)
+{
+	LONG rv;
+
 	/* tries to open the port */
 	rv = IFDOpenIFD(rContext);
 
@@ -1048,8 +1534,6 @@ LONG RFInitializeReader(PREADER_CONTEXT rContext)
 	{
 		Log3(PCSC_LOG_CRITICAL, "Open Port %X Failed (%s)",
 			rContext->dwPort, rContext->lpcDevice);
-		(void)RFUnBindFunctions(rContext);
-		(void)RFUnloadReader(rContext);
 		if (IFD_NO_SUCH_DEVICE == rv)
 			return SCARD_E_UNKNOWN_READER;
 		else
@@ -1298,7 +1782,9 @@ void RFCleanupReaders(int shouldExit)
 int RFStartSerialReaders(const char *readerconf)
 {
 	SerialReader *reader_list;
-	int i, rv;
+	READER_ADD *readers;
+	char *preloaded;
+	int i, count, rv;
 
 	/* remember the ocnfiguration filename for RFReCheckReaderConf() */
 	ConfigFile = strdup(readerconf);
@@ -1309,14 +1795,46 @@ int RFStartSerialReaders(const char *readerconf)
 	if (NULL == reader_list)
 		return rv;
 
+	for (count=0; reader_list[count].pcFriendlyname; count++)
+		;
+
+	/* load each driver only once and before the readers use it */
+	preloaded = calloc(count + 1, sizeof(*preloaded));
+	if (preloaded != NULL)
+		for (i=0; i<count; i++)
+			preloaded[i] = (SCARD_S_SUCCESS ==
+				RFPreloadDriver(reader_list[i].pcLibpath));
+
+	/* the readers are opened in parallel */
+	readers = calloc(count + 1, sizeof(*readers));
+	if (NULL == readers)
+		Log1(PCSC_LOG_CRITICAL, "Not enough memory");
+	else
+	{
+		for (i=0; i<count; i++)
+		{
+			readers[i].lpcReader = reader_list[i].pcFriendlyname;
+			readers[i].dwPort = reader_list[i].dwChannelId;
+			readers[i].lpcLibrary = reader_list[i].pcLibpath;
+			readers[i].lpcDevice = reader_list[i].pcDevicename;
+		}
+		(void)RFAddReaders(readers, count);
+		free(readers);
+	}
+
+	/* the drivers of the readers that failed are unloaded */
+	if (preloaded != NULL)
+	{
+		for (i=0; i<count; i++)
+			if (preloaded[i])
+				RFReleasePreloadedDriver(reader_list[i].pcLibpath);
+		free(preloaded);
+	}
+
 	for (i=0; reader_list[i].pcFriendlyname; i++)
 	{
 		int j;
 
-		(void)RFAddReader(reader_list[i].pcFriendlyname,
-			reader_list[i].dwChannelId,
-			reader_list[i].pcLibpath, reader_list[i].pcDevicename);
-
 		/* update the ConfigFileCRC (this false "CRC" is very weak) */
 		for (j=0; j<reader_list[i].pcFriendlyname[j]; j++)
 			ConfigFileCRC += reader_list[i].pcFriendlyname[j];
@@ -112,7 +112,7 @@ extern "C"
 		PCSCLITE_MUTEX_T mMutex;	/**< Mutex for this connection */
 		RDR_CLIHANDLES psHandles[PCSCLITE_MAX_READER_CONTEXT_CHANNELS];
                                          /**< Structure of connected handles */
-		union
+		union FctMap
 		{
 			FCT_MAP_V1 psFunctions_v1;	/**< API V1.0 */
 			FCT_MAP_V2 psFunctions_v2;	/**< API V2.0 */
@@ -138,8 +138,24 @@ extern "C"
 
 	typedef struct ReaderContext READER_CONTEXT, *PREADER_CONTEXT;
 
+	/** the reader context number is in the high bits of dwIdentity */
+#define IDENTITY_SHIFT 16
+
+	/**
+	 * reader to add with RFAddReaders()
+	 */
+	typedef struct
+	{
+		LPSTR lpcReader;	/**< Reader Name */
+		DWORD dwPort;		/**< Port ID */
+		LPSTR lpcLibrary;	/**< Library Path */
+		LPSTR lpcDevice;	/**< Device Name */
+		LONG rv;			/**< result of the addition */
+	} READER_ADD;
+
 	LONG RFAllocateReaderSpace(void);
 	LONG RFAddReader(LPSTR, DWORD, LPSTR, LPSTR);
+	LONG RFAddReaders(READER_ADD *, int);
 	LONG RFRemoveReader(LPSTR, DWORD);
 	LONG RFSetReaderName(PREADER_CONTEXT, LPSTR, LPSTR, DWORD, DWORD);
 	LONG RFListReaders(LPSTR, LPDWORD);
@@ -156,6 +172,8 @@ extern "C"
 	LONG RFBindFunctions(PREADER_CONTEXT);
 	LONG RFUnBindFunctions(PREADER_CONTEXT);
 	LONG RFUnloadReader(PREADER_CONTEXT);
+	LONG RFPreloadDriver(LPSTR);
+	void RFReleasePreloadedDriver(LPSTR);
 	LONG RFInitializeReader(PREADER_CONTEXT);
 	LONG RFUnInitializeReader(PREADER_CONTEXT);
 	SCARDHANDLE RFCreateReaderHandle(PREADER_CONTEXT);
@@ -0,0 +1,213 @@
+/*
+ * MUSCLE SmartCard Development ( http://www.linuxnet.com )
+ *
+ * Copyright (C) 2009
+ *  Ludovic Rousseau <ludovic.rousseau@free.fr>
+ *
+ * $Id$
+ */
+
+/**
+ * @file
+ * @brief Latency of the PC/SC calls seen by the application.
+ *
+ * For each call the time seen by the application is split with the
+ * \ref reply_times sent by pcscd: the time used by pcscd to serve the
+ * call, including the time used by the driver. The rest is the time
+ * spent in the socket and in the library. With a pcscd older than
+ * protocol \ref PROTOCOL_VERSION_MINOR_TIMES only the time seen by the
+ * application is known.
+ *
+ * The statistics use the Prometheus text format, like the pcscd
+ * counters.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "misc.h"
+#include "pcsclite.h"
+#include "pcscd.h"
+#include "debug.h"
+#include "thread_generic.h"
+#include "winscard_msg.h"
+#include "histogram.h"
+#include "statistics.h"
+
+/** one more than the last SCard* command of \ref pcsc_msg_commands */
+#define STATISTICS_COMMANDS (SCARD_SET_ATTRIB + 1)
+
+/** upper bounds of the latency buckets, in us */
+static const long LatencyBuckets[] = {
+	50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000,
+	500000, 1000000, 5000000
+};
+#define LATENCY_BUCKETS (sizeof(LatencyBuckets)/sizeof(LatencyBuckets[0]))
+
+/** the times of a call */
+enum
+{
+	STAT_CALL,		/**< seen by the application */
+	STAT_PCSCD,		/**< used by pcscd */
+	STAT_DRIVER,	/**< used by the driver */
+	STAT_TIMES
+};
+
+static struct Histogram Calls[STATISTICS_COMMANDS][STAT_TIMES];
+static PCSCLITE_MUTEX StatisticsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *FunctionsText[STATISTICS_COMMANDS] = {
+	NULL,
+	"SCardEstablishContext",	/* 0x01 */
+	"SCardReleaseContext",
+	"SCardListReaders",
+	"SCardConnect",
+	"SCardReconnect",	/* 0x05 */
+	"SCardDisconnect",
+	"SCardBeginTransaction",
+	"SCardEndTransaction",
+	"SCardTransmit",
+	"SCardControl",	/* 0x0A */
+	"SCardStatus",
+	"SCardGetStatusChange",
+	"SCardCancel",
+	"SCardCancelTransaction",
+	"SCardGetAttrib",	/* 0x0F */
+	"SCardSetAttrib"
+};
+
+/** name and help of the histograms */
+static const char *TimesText[STAT_TIMES][2] = {
+	{ "pcsclite_call_duration_seconds",
+		"Duration of the PC/SC calls seen by the application." },
+	{ "pcsclite_call_pcscd_seconds",
+		"Part of the call duration used by pcscd." },
+	{ "pcsclite_call_driver_seconds",
+		"Part of the call duration used by the driver." }
+};
+
+/**
+ * Counts a call.
+ *
+ * @param command one of the SCard* \ref pcsc_msg_commands
+ * @param usec duration seen by the application
+ * @param times times sent by pcscd or NULL. SCardListReaders() and
+ * SCardGetStatusChange() always give NULL since they are not answered
+ * by a single message.
+ */
+void STATRecord(uint32_t command, long usec, const struct reply_times *times)
+{
+	if ((0 == command) || (command >= STATISTICS_COMMANDS))
+		return;
+
+	(void)SYS_MutexLock(&StatisticsMutex);
+	HISTAddValue(&Calls[command][STAT_CALL], LatencyBuckets,
+		LATENCY_BUCKETS, usec);
+	if (times)
+	{
+		HISTAddValue(&Calls[command][STAT_PCSCD], LatencyBuckets,
+			LATENCY_BUCKETS, times->server);
+		HISTAddValue(&Calls[command][STAT_DRIVER], LatencyBuckets,
+			LATENCY_BUCKETS, times->driver);
+	}
+	(void)SYS_MutexUnLock(&StatisticsMutex);
+} /* STATRecord */
+
+/**
+ * Gives the statistics in the Prometheus text format.
+ *
+ * @param length length of the text
+ * @return text to free() or NULL if no memory is available
+ */
+char *STATFormat(size_t *length)
+{
+	struct Text text = { NULL, 0, 0 };
+	int i, t;
+
+	(void)SYS_MutexLock(&StatisticsMutex);
+
+	/* all the lines of a metric must be grouped */
+	for (t=0; t<STAT_TIMES; t++)
+	{
+		const char *name = TimesText[t][0];
+
+		HISTPrintf(&text, "# HELP %s %s\n# TYPE %s histogram\n", name,
+			TimesText[t][1], name);
+
+		for (i=1; i<STATISTICS_COMMANDS; i++)
+		{
+			char label[64];
+
+			if (0 == Calls[i][t].count)
+				continue;
+
+			(void)snprintf(label, sizeof(label), "function=\"%s\"",
+				FunctionsText[i]);
+			HISTPrint(&text, name, label, &Calls[i][t], LatencyBuckets,
+				LATENCY_BUCKETS, 1000000);
+		}
+	}
+
+	(void)SYS_MutexUnLock(&StatisticsMutex);
+
+	if (NULL == text.buffer)
+		return NULL;
+
+	*length = text.length;
+	return text.buffer;
+} /* STATFormat */
+
+/**
+ * Writes the statistics in a file.
+ *
+ * The file must not exist and must not be a symbolic link so an existing
+ * file is never overwritten.
+ *
+ * @param file file to write, "-" for stderr, or NULL to do nothing
+ */
+void STATDump(const char *file)
+{
+	char *text;
+	size_t length;
+	FILE *fp = NULL;
+	int fd;
+
+	if ((NULL == file) || ('\0' == *file))
+		return;
+
+	text = STATFormat(&length);
+	if (NULL == text)
+		return;
+
+	if (0 == strcmp(file, "-"))
+		fp = stderr;
+	else
+	{
+		fd = open(file, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW,
+			S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		if (fd >= 0)
+		{
+			fp = fdopen(fd, "w");
+			if (NULL == fp)
+				(void)close(fd);
+		}
+		if (NULL == fp)
+		{
+			Log3(PCSC_LOG_ERROR, "Cannot create %s: %s", file,
+				strerror(errno));
+			free(text);
+			return;
+		}
+	}
+
+	(void)fwrite(text, 1, length, fp);
+	if (fp != stderr)
+		(void)fclose(fp);
+	free(text);
+} /* STATDump */
@@ -0,0 +1,41 @@
+/*
+ * MUSCLE SmartCard Development ( http://www.linuxnet.com )
+ *
+ * Copyright (C) 2009
+ *  Ludovic Rousseau <ludovic.rousseau@free.fr>
+ *
+ * $Id$
+ */
+
+/**
+ * @file
+ * @brief Latency of the PC/SC calls seen by the application.
+ *
+ * The statistics are given by SCardGetStatistics(). With
+ * --enable-statistics-dump they are also written when libpcsclite is
+ * unloaded in the file named by the \c PCSCLITE_STATISTICS environment
+ * variable.
+ */
+
+#ifndef __statistics_h__
+#define __statistics_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+	struct reply_times;
+
+	void STATRecord(uint32_t, long, /*@null@*/ const struct reply_times *);
+	char *STATFormat(size_t *);
+	void STATDump(const char *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -77,6 +77,8 @@ extern "C"
 
 	void SYS_Exit(int);
 
+	const char *SYS_GetEnv(const char *);
+
 #ifdef __cplusplus
 }
 #endif
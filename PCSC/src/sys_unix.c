@@ -15,6 +15,9 @@
  */
 
 #include "config.h"
+#ifdef HAVE_SECURE_GETENV
+#define _GNU_SOURCE		/* secure_getenv() */
+#endif
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -425,3 +428,20 @@ INTERNAL void SYS_Exit(int iRetVal)
 	_exit(iRetVal);
 }
 
+
+/**
+ * @brief getenv() returning NULL in a setuid or setgid program.
+ *
+ * The environment is then controlled by the user calling the program.
+ */
+INTERNAL const char *SYS_GetEnv(const char *name)
+{
+#ifdef HAVE_SECURE_GETENV
+	return secure_getenv(name);
+#else
+	if ((getuid() != geteuid()) || (getgid() != getegid()))
+		return NULL;
+
+	return getenv(name);
+#endif
+}
@@ -0,0 +1,400 @@
+/*
+ * MUSCLE SmartCard Development ( http://www.linuxnet.com )
+ *
+ * Copyright (C) 2009
+ *  Ludovic Rousseau <ludovic.rousseau@free.fr>
+ *
+ * $Id$
+ */
+
+/**
+ * @file
+ * @brief Tracing of the PC/SC calls in libpcsclite and pcscd.
+ *
+ * Each thread records its events in its own buffer without any lock.
+ * The thread writes its buffer in the trace file when the buffer is
+ * full or when the thread exits. The other buffers are written at the
+ * exit of the process.
+ *
+ * The trace file uses the JSON array format of the Chrome trace
+ * format. The closing ] is optional in this format so each process can
+ * append its events to the same file. Each buffer is written with
+ * write() calls of complete lines on a file opened with O_APPEND so the
+ * events of different processes are not mixed.
+ */
+
+#include "config.h"
+
+#ifdef PCSC_TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "sys_generic.h"
+#include "trace.h"
+
+/** events kept by a thread before writing them */
+#define TRACE_EVENTS 1024
+/** nested calls traced by a thread */
+#define TRACE_DEPTH 8
+
+struct TraceEvent
+{
+	const char *name;
+	unsigned long long start;	/**< ns */
+	unsigned long long duration;	/**< ns */
+	long rv;
+};
+
+struct TraceThread
+{
+	struct TraceThread *next;
+	int tid;	/**< small number, easier to read than pthread_self() */
+	int depth;
+	struct
+	{
+		const char *name;
+		unsigned long long start;
+	} stack[TRACE_DEPTH];
+	int count;
+	struct TraceEvent events[TRACE_EVENTS];
+};
+
+volatile int TraceEnabled = -1;
+
+static int TraceFd = -1;
+static pid_t TracePid;
+static int TraceThreads = 0;
+static struct TraceThread *TraceList = NULL;
+static pthread_mutex_t TraceMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t TraceKey;
+static pthread_once_t TraceOnce = PTHREAD_ONCE_INIT;
+
+static void TRCInit(void);
+static struct TraceThread *TRCGetThread(void);
+static void TRCThreadExit(void *);
+static void TRCForkChild(void);
+static void TRCWriteEvents(struct TraceThread *);
+static void TRCWriteProcess(void);
+static void TRCWrite(const char *, size_t);
+static unsigned long long TRCNow(void);
+
+/* libpcsclite may be unloaded with dlclose() before the exit */
+#ifdef __GNUC__
+static void TRCExit(void) __attribute__ ((destructor));
+#else
+static void TRCExit(void);
+#endif
+
+/**
+ * Starts a traced call.
+ *
+ * @param name function or command name
+ */
+void TRCStart(const char *name)
+{
+	struct TraceThread *thread;
+
+	if (TraceEnabled < 0)
+		(void)pthread_once(&TraceOnce, TRCInit);
+
+	if (TraceEnabled <= 0)
+		return;
+
+	thread = TRCGetThread();
+	if (NULL == thread)
+		return;
+
+	/* deeper calls are not traced */
+	if (thread->depth < TRACE_DEPTH)
+	{
+		thread->stack[thread->depth].name = name;
+		thread->stack[thread->depth].start = TRCNow();
+		thread->depth++;
+	}
+} /* TRCStart */
+
+/**
+ * Ends a traced call and records its event.
+ *
+ * @param name same name as given to TRCStart()
+ * @param rv value returned by the call
+ */
+void TRCEnd(const char *name, long rv)
+{
+	struct TraceThread *thread;
+	struct TraceEvent *event;
+	int i;
+
+	if (TraceEnabled <= 0)
+		return;
+
+	thread = pthread_getspecific(TraceKey);
+	if (NULL == thread)
+		return;
+
+	/* the ends missing because of an early return are ignored */
+	for (i=thread->depth-1; i>=0; i--)
+		if ((thread->stack[i].name == name)
+			|| (0 == strcmp(thread->stack[i].name, name)))
+			break;
+
+	/* started before the trace was enabled */
+	if (i < 0)
+		return;
+
+	event = &thread->events[thread->count];
+	event->name = name;
+	event->start = thread->stack[i].start;
+	event->duration = TRCNow() - event->start;
+	event->rv = rv;
+	thread->depth = i;
+
+	if (++thread->count == TRACE_EVENTS)
+	{
+		(void)pthread_mutex_lock(&TraceMutex);
+		TRCWriteEvents(thread);
+		(void)pthread_mutex_unlock(&TraceMutex);
+	}
+} /* TRCEnd */
+
+/**
+ * Pauses or resumes the trace. Not to be called from a signal handler.
+ *
+ * @param enabled 0 to pause the trace
+ * @return 0 or -1 if no trace file is available
+ */
+int TRCSetEnabled(int enabled)
+{
+	(void)pthread_once(&TraceOnce, TRCInit);
+
+	if (TraceFd < 0)
+		return -1;
+
+	TraceEnabled = enabled ? 1 : 0;
+
+	return 0;
+} /* TRCSetEnabled */
+
+/**
+ * Writes the events of all the threads. Called at the exit of the
+ * process, the other threads may still record events.
+ */
+void TRCFlush(void)
+{
+	struct TraceThread *thread;
+
+	if (TraceFd < 0)
+		return;
+
+	(void)pthread_mutex_lock(&TraceMutex);
+	for (thread = TraceList; thread; thread = thread->next)
+		TRCWriteEvents(thread);
+	(void)pthread_mutex_unlock(&TraceMutex);
+} /* TRCFlush */
+
+static void TRCInit(void)
+{
+	const char *file;
+
+	TraceEnabled = 0;
+
+	/* not for a setuid or setgid program */
+	file = SYS_GetEnv("PCSCLITE_TRACE");
+	if (NULL == file)
+		return;
+
+	/* the first process writes the start of the JSON array */
+	TraceFd = open(file, O_WRONLY | O_APPEND | O_CREAT | O_EXCL,
+		S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (TraceFd >= 0)
+		TRCWrite("[\n", 2);
+	else
+		if (EEXIST == errno)
+			TraceFd = open(file, O_WRONLY | O_APPEND);
+
+	if (TraceFd < 0)
+	{
+		(void)fprintf(stderr, "Cannot open %s: %s\n", file, strerror(errno));
+		return;
+	}
+
+	if (pthread_key_create(&TraceKey, TRCThreadExit))
+	{
+		(void)close(TraceFd);
+		TraceFd = -1;
+		return;
+	}
+
+#ifndef __GNUC__
+	(void)atexit(TRCExit);
+#endif
+	(void)pthread_atfork(NULL, NULL, TRCForkChild);
+
+	TraceEnabled = 1;
+} /* TRCInit */
+
+static void TRCExit(void)
+{
+	if (TraceFd < 0)
+		return;
+
+	TraceEnabled = 0;
+	TRCFlush();
+	(void)pthread_key_delete(TraceKey);
+	(void)close(TraceFd);
+	TraceFd = -1;
+} /* TRCExit */
+
+static struct TraceThread *TRCGetThread(void)
+{
+	struct TraceThread *thread;
+
+	thread = pthread_getspecific(TraceKey);
+	if (thread)
+		return thread;
+
+	thread = calloc(1, sizeof(*thread));
+	if (NULL == thread)
+		return NULL;
+
+	(void)pthread_mutex_lock(&TraceMutex);
+	thread->tid = ++TraceThreads;
+	thread->next = TraceList;
+	TraceList = thread;
+	(void)pthread_mutex_unlock(&TraceMutex);
+
+	(void)pthread_setspecific(TraceKey, thread);
+
+	return thread;
+} /* TRCGetThread */
+
+static void TRCThreadExit(void *arg)
+{
+	struct TraceThread *thread = arg, **p;
+
+	(void)pthread_mutex_lock(&TraceMutex);
+	TRCWriteEvents(thread);
+	for (p = &TraceList; *p; p = &(*p)->next)
+		if (*p == thread)
+		{
+			*p = thread->next;
+			break;
+		}
+	(void)pthread_mutex_unlock(&TraceMutex);
+
+	free(thread);
+} /* TRCThreadExit */
+
+/**
+ * The events recorded before a fork() are written by the parent only
+ */
+static void TRCForkChild(void)
+{
+	struct TraceThread *thread;
+
+	for (thread = TraceList; thread; thread = thread->next)
+		thread->count = 0;
+} /* TRCForkChild */
+
+/**
+ * Writes the events of a thread. TraceMutex is locked by the caller.
+ */
+static void TRCWriteEvents(struct TraceThread *thread)
+{
+	char buffer[16384];
+	size_t length = 0;
+	int i;
+
+	/* pcscd may have forked since the trace started */
+	if (getpid() != TracePid)
+		TRCWriteProcess();
+
+	for (i=0; i<thread->count; i++)
+	{
+		struct TraceEvent *event = &thread->events[i];
+		int size;
+
+		/* keep some room for a complete line */
+		if (length > sizeof(buffer) - 512)
+		{
+			TRCWrite(buffer, length);
+			length = 0;
+		}
+
+		size = snprintf(buffer + length, sizeof(buffer) - length,
+			"{\"name\":\"%.300s\",\"cat\":\"pcsc\",\"ph\":\"X\","
+			"\"ts\":%llu.%03u,\"dur\":%llu.%03u,\"pid\":%d,\"tid\":%d,"
+			"\"args\":{\"rv\":\"0x%08lX\"}},\n", event->name,
+			event->start / 1000, (unsigned int)(event->start % 1000),
+			event->duration / 1000, (unsigned int)(event->duration % 1000),
+			(int)TracePid, thread->tid, event->rv);
+		if (size > 0)
+			length += size;
+	}
+
+	if (length)
+		TRCWrite(buffer, length);
+
+	thread->count = 0;
+} /* TRCWriteEvents */
+
+/**
+ * Names the process in the trace viewer
+ */
+static void TRCWriteProcess(void)
+{
+	char line[128];
+
+	TracePid = getpid();
+	(void)snprintf(line, sizeof(line), "{\"name\":\"process_name\","
+		"\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s %d\"}},\n",
+		(int)TracePid,
+#ifdef PCSCD
+		"pcscd",
+#else
+		"libpcsclite",
+#endif
+		(int)TracePid);
+	TRCWrite(line, strlen(line));
+} /* TRCWriteProcess */
+
+static void TRCWrite(const char *buffer, size_t length)
+{
+	while (length)
+	{
+		ssize_t ret = write(TraceFd, buffer, length);
+
+		if (ret < 0)
+		{
+			if (EINTR == errno)
+				continue;
+			return;
+		}
+
+		buffer += ret;
+		length -= ret;
+	}
+} /* TRCWrite */
+
+/**
+ * Same clock for all the processes so the events can be compared.
+ */
+static unsigned long long TRCNow(void)
+{
+	struct timespec now;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (unsigned long long)now.tv_sec * 1000000000 + now.tv_nsec;
+} /* TRCNow */
+
+#endif
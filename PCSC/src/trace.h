@@ -0,0 +1,69 @@
+/*
+ * MUSCLE SmartCard Development ( http://www.linuxnet.com )
+ *
+ * Copyright (C) 2009
+ *  Ludovic Rousseau <ludovic.rousseau@free.fr>
+ *
+ * $Id$
+ */
+
+/**
+ * @file
+ * @brief Tracing of the PC/SC calls in libpcsclite and pcscd.
+ *
+ * Available if pcsc-lite is configured with --enable-trace. Each
+ * TRACE_START()/TRACE_END() pair gives a "complete" event of the Chrome
+ * trace format (chrome://tracing, Perfetto) written in the file named by
+ * the \c PCSCLITE_TRACE environment variable. pcscd and its clients can
+ * share the same file so their events are on the same time line.
+ *
+ * If <sys/sdt.h> is available the pcsclite:function__entry and
+ * pcsclite:function__return USDT probes are also defined, for perf and
+ * SystemTap. They are used even if \c PCSCLITE_TRACE is not set.
+ */
+
+#ifndef __trace_h__
+#define __trace_h__
+
+#ifdef PCSC_TRACE
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE_PROBE_START(f) DTRACE_PROBE1(pcsclite, function__entry, f)
+#define TRACE_PROBE_END(f, rv) DTRACE_PROBE2(pcsclite, function__return, f, rv)
+#else
+#define TRACE_PROBE_START(f)
+#define TRACE_PROBE_END(f, rv)
+#endif
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+	/** -1 until the first event, then 0 or 1 */
+	extern volatile int TraceEnabled;
+
+	void TRCStart(const char *);
+	void TRCEnd(const char *, long);
+	int TRCSetEnabled(int);
+	void TRCFlush(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+/** f must be a string constant or live until the trace is written */
+#define TRACE_START(f) do { TRACE_PROBE_START(f); \
+	if (TraceEnabled) TRCStart(f); } while (0)
+#define TRACE_END(f, rv) do { TRACE_PROBE_END(f, rv); \
+	if (TraceEnabled) TRCEnd(f, rv); } while (0)
+
+#else
+
+#define TRACE_START(f)
+#define TRACE_END(f, rv)
+
+#endif
+
+#endif
@@ -94,74 +94,13 @@
 #include "sys_generic.h"
 #include "eventhandler.h"
 #include "utils.h"
+#include "capture.h"
+#include "metrics.h"
+#include "trace.h"
 
-#undef DO_PROFILE
-#ifdef DO_PROFILE
-
-#ifndef FALSE
-#define FALSE 0
-#define TRUE 1
-#endif
-
-#define PROFILE_FILE "/tmp/pcscd_profile"
-#include <stdio.h>
-#include <sys/time.h>
-#include <errno.h>
-#include <unistd.h>
-
-struct timeval profile_time_start;
-FILE *fd;
-char profile_tty;
-
-#define PROFILE_START profile_start(__FUNCTION__);
-#define PROFILE_END profile_end(__FUNCTION__, __LINE__);
-
-static void profile_start(const char *f)
-{
-	static char initialized = FALSE;
-
-	if (!initialized)
-	{
-		initialized = TRUE;
-		fd = fopen(PROFILE_FILE, "a+");
-		if (NULL == fd)
-		{
-			fprintf(stderr, "\33[01;31mCan't open %s: %s\33[0m\n",
-				PROFILE_FILE, strerror(errno));
-			exit(-1);
-		}
-		fprintf(fd, "\nStart a new profile\n");
-		fflush(fd);
-
-		if (isatty(fileno(stderr)))
-			profile_tty = TRUE;
-		else
-			profile_tty = FALSE;
-	}
-
-	gettimeofday(&profile_time_start, NULL);
-} /* profile_start */
-
-
-static void profile_end(const char *f, int line)
-{
-	struct timeval profile_time_end;
-	long d;
-
-	gettimeofday(&profile_time_end, NULL);
-	d = time_sub(&profile_time_end, &profile_time_start);
-
-	if (profile_tty)
-		fprintf(stderr, "\33[01;31mRESULT %s \33[35m%ld\33[0m (%d)\n", f, d,
-			line);
-	fprintf(fd, "%s %ld\n", f, d);
-	fflush(fd);
-} /* profile_end */
-
-#else
-#define PROFILE_START
-#define PROFILE_END
-#endif
+/* the PC/SC calls are traced if configured with --enable-trace */
+#define PROFILE_START TRACE_START(__FUNCTION__);
+#define PROFILE_END(rv) TRACE_END(__FUNCTION__, rv);
 
 /** used for backward compatibility */
 #define SCARD_PROTOCOL_ANY_OLD	 0x1000
@@ -322,9 +261,14 @@ LONG SCardConnect(/*@unused@*/ SCARDCONTEXT hContext, LPCSTR szReader,
 	 */
 	if (rContext->dwLockId != 0)
 	{
+		struct timeval start, end;
+
 		Log1(PCSC_LOG_INFO, "Waiting for release of lock");
+		(void)gettimeofday(&start, NULL);
 		while (rContext->dwLockId != 0)
 			(void)SYS_USleep(PCSCLITE_LOCK_POLL_RATE);
+		(void)gettimeofday(&end, NULL);
+		METLockWait(time_sub(&end, &start));
 		Log1(PCSC_LOG_INFO, "Lock released");
 	}
 
@@ -493,7 +437,7 @@ LONG SCardConnect(/*@unused@*/ SCARDCONTEXT hContext, LPCSTR szReader,
 
 		*phCard = 0;
 
-		PROFILE_END
+		PROFILE_END(SCARD_F_INTERNAL_ERROR)
 
 		return SCARD_F_INTERNAL_ERROR;
 	}
@@ -503,7 +447,7 @@ LONG SCardConnect(/*@unused@*/ SCARDCONTEXT hContext, LPCSTR szReader,
 	 */
 	rContext->readerState->readerSharing = rContext->dwContexts;
 
-	PROFILE_END
+	PROFILE_END(SCARD_S_SUCCESS)
 
 	return SCARD_S_SUCCESS;
 }
@@ -847,9 +791,14 @@ LONG SCardDisconnect(SCARDHANDLE hCard, DWORD dwDisposition)
 	if ((dwDisposition != SCARD_LEAVE_CARD) && (rContext->dwLockId != 0)
 		&& (rContext->dwLockId != hCard))
 	{
+		struct timeval start, end;
+
 		Log1(PCSC_LOG_INFO, "Waiting for release of lock");
+		(void)gettimeofday(&start, NULL);
 		while (rContext->dwLockId != 0)
 			(void)SYS_USleep(PCSCLITE_LOCK_POLL_RATE);
+		(void)gettimeofday(&end, NULL);
+		METLockWait(time_sub(&end, &start));
 		Log1(PCSC_LOG_INFO, "Lock released");
 	}
 
@@ -1038,7 +987,10 @@ LONG SCardBeginTransaction(SCARDHANDLE hCard)
 	/* if the transaction is not yet ready we sleep a bit so the client
 	 * do not retry immediately */
 	if (SCARD_E_SHARING_VIOLATION == rv)
+	{
 		(void)SYS_USleep(PCSCLITE_LOCK_POLL_RATE);
+		METLockWait(PCSCLITE_LOCK_POLL_RATE);
+	}
 
 	Log2(PCSC_LOG_DEBUG, "Status: 0x%08X", rv);
 
@@ -1368,6 +1320,7 @@ LONG SCardControl(SCARDHANDLE hCard, DWORD dwControlCode,
 {
 	LONG rv;
 	PREADER_CONTEXT rContext = NULL;
+	struct timeval start;
 
 	/* 0 bytes returned by default */
 	*lpBytesReturned = 0;
@@ -1406,19 +1359,29 @@ LONG SCardControl(SCARDHANDLE hCard, DWORD dwControlCode,
 	if ((rv = RFCheckReaderEventState(rContext, hCard)) != SCARD_S_SUCCESS)
 		return rv;
 
+	if (CAPActive)
+		(void)gettimeofday(&start, NULL);
+
 	if (IFD_HVERSION_2_0 == rContext->dwVersion)
 	{
 		/* we must wrap a API 3.0 client in an API 2.0 driver */
 		*lpBytesReturned = cbRecvLength;
-		return IFDControl_v2(rContext, (PUCHAR)pbSendBuffer,
+		rv = IFDControl_v2(rContext, (PUCHAR)pbSendBuffer,
 			cbSendLength, pbRecvBuffer, lpBytesReturned);
 	}
 	else
 		if (IFD_HVERSION_3_0 == rContext->dwVersion)
-			return IFDControl(rContext, dwControlCode, pbSendBuffer,
+			rv = IFDControl(rContext, dwControlCode, pbSendBuffer,
 				cbSendLength, pbRecvBuffer, cbRecvLength, lpBytesReturned);
 		else
 			return SCARD_E_UNSUPPORTED_FEATURE;
+
+	if (CAPActive)
+		CAPRecord(CAPTURE_CONTROL, rContext, hCard, dwControlCode, rv,
+			pbSendBuffer, cbSendLength, pbRecvBuffer,
+			rv == SCARD_S_SUCCESS ? *lpBytesReturned : 0, &start);
+
+	return rv;
 }
 
 LONG SCardGetAttrib(SCARDHANDLE hCard, DWORD dwAttrId,
@@ -1522,6 +1485,7 @@ LONG SCardTransmit(SCARDHANDLE hCard, LPCSCARD_IO_REQUEST pioSendPci,
 	PREADER_CONTEXT rContext = NULL;
 	SCARD_IO_HEADER sSendPci, sRecvPci;
 	DWORD dwRxLength, tempRxLength;
+	struct timeval start;
 
 	if (pcbRecvLength == 0)
 		return SCARD_E_INVALID_PARAMETER;
@@ -1628,6 +1592,9 @@ LONG SCardTransmit(SCARDHANDLE hCard, LPCSCARD_IO_REQUEST pioSendPci,
 
 	tempRxLength = dwRxLength;
 
+	if (CAPActive)
+		(void)gettimeofday(&start, NULL);
+
 	if ((pioSendPci->dwProtocol == SCARD_PROTOCOL_RAW)
 		&& (rContext->dwVersion == IFD_HVERSION_2_0))
 	{
@@ -1639,6 +1606,15 @@ LONG SCardTransmit(SCARDHANDLE hCard, LPCSCARD_IO_REQUEST pioSendPci,
 			cbSendLength, pbRecvBuffer, &dwRxLength, &sRecvPci);
 	}
 
+	/* the PC/SC protocol is recorded, not the IFD handler one */
+	if (CAPActive)
+		CAPRecord(CAPTURE_TRANSMIT, rContext, hCard,
+			(SCARD_PROTOCOL_ANY_OLD == pioSendPci->dwProtocol) ?
+			rContext->readerState->cardProtocol : pioSendPci->dwProtocol, rv,
+			pbSendBuffer, cbSendLength, pbRecvBuffer,
+			(rv == SCARD_S_SUCCESS) && (dwRxLength <= tempRxLength) ?
+			dwRxLength : 0, &start);
+
 	pioRecvPci->dwProtocol = sRecvPci.Protocol;
 	pioRecvPci->cbPciLength = sRecvPci.Length;
 
@@ -73,6 +73,8 @@
 #include "sys_generic.h"
 #include "winscard_msg.h"
 #include "utils.h"
+#include "trace.h"
+#include "statistics.h"
 
 /** used for backward compatibility */
 #define SCARD_PROTOCOL_ANY_OLD	0x1000
@@ -82,95 +84,9 @@
 #define FALSE 0
 #endif
 
-
-#undef DO_PROFILE
-#ifdef DO_PROFILE
-
-#define PROFILE_FILE "/tmp/pcsc_profile"
-#include <stdio.h>
-#include <sys/time.h>
-
-struct timeval profile_time_start;
-FILE *profile_fd;
-char profile_tty;
-char fct_name[100];
-
-#define PROFILE_START profile_start(__FUNCTION__);
-#define PROFILE_END(rv) profile_end(__FUNCTION__, rv);
-
-static void profile_start(const char *f)
-{
-	static char initialized = FALSE;
-
-	if (!initialized)
-	{
-		char filename[80];
-
-		initialized = TRUE;
-		sprintf(filename, "%s-%d", PROFILE_FILE, getuid());
-		profile_fd = fopen(filename, "a+");
-		if (NULL == profile_fd)
-		{
-			fprintf(stderr, "\33[01;31mCan't open %s: %s\33[0m\n",
-				PROFILE_FILE, strerror(errno));
-			exit(-1);
-		}
-		fprintf(profile_fd, "\nStart a new profile\n");
-
-		if (isatty(fileno(stderr)))
-			profile_tty = TRUE;
-		else
-			profile_tty = FALSE;
-	}
-
-	/* PROFILE_END was not called before? */
-	if (profile_tty && fct_name[0])
-		printf("\33[01;34m WARNING: %s starts before %s finishes\33[0m\n",
-			f, fct_name);
-
-	strlcpy(fct_name, f, sizeof(fct_name));
-
-	gettimeofday(&profile_time_start, NULL);
-} /* profile_start */
-
-static void profile_end(const char *f, LONG rv)
-{
-	struct timeval profile_time_end;
-	long d;
-
-	gettimeofday(&profile_time_end, NULL);
-	d = time_sub(&profile_time_end, &profile_time_start);
-
-	if (profile_tty)
-	{
-		if (fct_name[0])
-		{
-			if (strncmp(fct_name, f, sizeof(fct_name)))
-				printf("\33[01;34m WARNING: %s ends before %s\33[0m\n",
-						f, fct_name);
-		}
-		else
-			printf("\33[01;34m WARNING: %s ends but we lost its start\33[0m\n",
-				f);
-
-		/* allow to detect missing PROFILE_END calls */
-		fct_name[0] = '\0';
-
-		if (rv != SCARD_S_SUCCESS)
-			fprintf(stderr,
-				"\33[01;31mRESULT %s \33[35m%ld \33[34m0x%08lX %s\33[0m\n",
-				f, d, rv, pcsc_stringify_error(rv));
-		else
-			fprintf(stderr, "\33[01;31mRESULT %s \33[35m%ld\33[0m\n", f, d);
-	}
-	fprintf(profile_fd, "%s %ld\n", f, d);
-	fflush(profile_fd);
-} /* profile_end */
-
-#else
-#define PROFILE_START
-#define PROFILE_END(rv)
-#endif
+/* the PC/SC calls are traced if configured with --enable-trace */
+#define PROFILE_START TRACE_START(__FUNCTION__);
+#define PROFILE_END(rv) TRACE_END(__FUNCTION__, rv);
 
 /**
  * Represents an Application Context Channel.
@@ -195,6 +111,7 @@ static struct _psContextMap
 	SCARDCONTEXT hContext;			/**< Application Context ID */
 	DWORD contextBlockStatus;
 	PCSCLITE_MUTEX_T mMutex;		/**< Mutex for this context */
+	int replyTimes;					/**< pcscd sends \ref reply_times */
 	CHANNEL_MAP psChannelMap[PCSCLITE_MAX_APPLICATION_CONTEXT_CHANNELS];
 } psContextMap[PCSCLITE_MAX_APPLICATION_CONTEXTS];
 
@@ -231,7 +148,7 @@ PCSC_API SCARD_IO_REQUEST g_rgSCardT1Pci = { SCARD_PROTOCOL_T1, 8 };	/**< Protoc
 PCSC_API SCARD_IO_REQUEST g_rgSCardRawPci = { SCARD_PROTOCOL_RAW, 8 };	/**< Protocol Control Information for raw access */
 
 
-static LONG SCardAddContext(SCARDCONTEXT, DWORD);
+static LONG SCardAddContext(SCARDCONTEXT, DWORD, int);
 static LONG SCardGetContextIndice(SCARDCONTEXT);
 static LONG SCardGetContextIndiceTH(SCARDCONTEXT);
 static LONG SCardRemoveContext(SCARDCONTEXT);
@@ -247,7 +164,12 @@ static LONG SCardRemoveHandle(SCARDHANDLE);
 static LONG SCardGetSetAttrib(SCARDHANDLE hCard, int command, DWORD dwAttrId,
 	LPBYTE pbAttr, LPDWORD pcbAttrLen);
 
+static int32_t SCardReceiveReply(uint32_t, /*@out@*/ void *, uint64_t,
+	DWORD, int, struct timeval *);
+
+#ifdef PCSC_STATISTICS_DUMP
 void DESTRUCTOR SCardUnload(void);
+#endif
 static LONG getReaderStates(LONG dwContextIndex);
 
 /*
@@ -369,7 +291,9 @@ static LONG SCardEstablishContextTH(DWORD dwScope,
 	LONG rv;
 	int i;
 	struct establish_struct scEstablishStruct;
+	struct timeval start;
 	uint32_t dwClientID = 0;
+	int replyTimes;
 
 	(void)pvReserved1;
 	(void)pvReserved2;
@@ -442,28 +366,43 @@ static LONG SCardEstablishContextTH(DWORD dwScope,
 
 	{	/* exchange client/server protocol versions */
 		struct version_struct veStr;
+		int32_t minor = PROTOCOL_VERSION_MINOR;
 
-		veStr.major = PROTOCOL_VERSION_MAJOR;
-		veStr.minor = PROTOCOL_VERSION_MINOR;
+		while (1)
+		{
+			veStr.major = PROTOCOL_VERSION_MAJOR;
+			veStr.minor = minor;
 
-		if (-1 == SHMMessageSendWithHeader(CMD_VERSION, dwClientID, sizeof(veStr),
-			PCSCLITE_WRITE_TIMEOUT, &veStr))
-			return SCARD_E_NO_SERVICE;
+			if (-1 == SHMMessageSendWithHeader(CMD_VERSION, dwClientID,
+				sizeof(veStr), PCSCLITE_WRITE_TIMEOUT, &veStr))
+				return SCARD_E_NO_SERVICE;
 
-		/* Read a message from the server */
-		if (-1 == SHMMessageReceive(&veStr, sizeof(veStr), dwClientID,
-			PCSCLITE_READ_TIMEOUT))
-		{
-			Log1(PCSC_LOG_CRITICAL, "Your pcscd is too old and does not support CMD_VERSION");
-			return SCARD_F_COMM_ERROR;
-		}
+			/* Read a message from the server */
+			if (-1 == SHMMessageReceive(&veStr, sizeof(veStr), dwClientID,
+				PCSCLITE_READ_TIMEOUT))
+			{
+				Log1(PCSC_LOG_CRITICAL, "Your pcscd is too old and does not support CMD_VERSION");
+				return SCARD_F_COMM_ERROR;
+			}
+
+			Log3(PCSC_LOG_INFO, "Server is protocol version %d:%d",
+				veStr.major, veStr.minor);
 
-		Log3(PCSC_LOG_INFO, "Server is protocol version %d:%d",
-			veStr.major, veStr.minor);
+			/* an older pcscd with the same major version refuses our
+			 * minor version: use its own */
+			if ((veStr.rv != SCARD_S_SUCCESS)
+				&& (PROTOCOL_VERSION_MAJOR == veStr.major)
+				&& (veStr.minor < minor))
+				minor = veStr.minor;
+			else
+				break;
+		}
 
 		if (veStr.rv != SCARD_S_SUCCESS)
 			return veStr.rv;
 
+		replyTimes = (minor >= PROTOCOL_VERSION_MINOR_TIMES);
+
 		isExecuted = 1;
 	}
 
@@ -475,6 +414,7 @@ again:
 	scEstablishStruct.hContext = 0;
 	scEstablishStruct.rv = SCARD_S_SUCCESS;
 
+	(void)gettimeofday(&start, NULL);
 	rv = SHMMessageSendWithHeader(SCARD_ESTABLISH_CONTEXT, dwClientID,
 		sizeof(scEstablishStruct), PCSCLITE_WRITE_TIMEOUT,
 		(void *) &scEstablishStruct);
@@ -485,7 +425,8 @@ again:
 	/*
 	 * Read the response from the server
 	 */
-	rv = SHMMessageReceive(&scEstablishStruct, sizeof(scEstablishStruct), dwClientID, PCSCLITE_READ_TIMEOUT);
+	rv = SCardReceiveReply(SCARD_ESTABLISH_CONTEXT, &scEstablishStruct,
+		sizeof(scEstablishStruct), dwClientID, replyTimes, &start);
 
 	if (rv == -1)
 		return SCARD_F_COMM_ERROR;
@@ -504,7 +445,7 @@ again:
 	/*
 	 * Allocate the new hContext - if allocator full return an error
 	 */
-	rv = SCardAddContext(*phContext, dwClientID);
+	rv = SCardAddContext(*phContext, dwClientID, replyTimes);
 
 	return rv;
 }
@@ -534,6 +475,7 @@ LONG SCardReleaseContext(SCARDCONTEXT hContext)
 {
 	LONG rv;
 	struct release_struct scReleaseStruct;
+	struct timeval start;
 	LONG dwContextIndex;
 
 	PROFILE_START
@@ -575,6 +517,7 @@ LONG SCardReleaseContext(SCARDCONTEXT hContext)
 	scReleaseStruct.hContext = hContext;
 	scReleaseStruct.rv = SCARD_S_SUCCESS;
 
+	(void)gettimeofday(&start, NULL);
 	rv = SHMMessageSendWithHeader(SCARD_RELEASE_CONTEXT,
 		psContextMap[dwContextIndex].dwClientID,
 		sizeof(scReleaseStruct),
@@ -589,9 +532,9 @@ LONG SCardReleaseContext(SCARDCONTEXT hContext)
 	/*
 	 * Read a message from the server
 	 */
-	rv = SHMMessageReceive(&scReleaseStruct, sizeof(scReleaseStruct),
-		psContextMap[dwContextIndex].dwClientID,
-		PCSCLITE_READ_TIMEOUT);
+	rv = SCardReceiveReply(SCARD_RELEASE_CONTEXT, &scReleaseStruct,
+		sizeof(scReleaseStruct), psContextMap[dwContextIndex].dwClientID,
+		psContextMap[dwContextIndex].replyTimes, &start);
 
 	if (rv == -1)
 	{
@@ -696,6 +639,7 @@ LONG SCardConnect(SCARDCONTEXT hContext, LPCSTR szReader,
 {
 	LONG rv;
 	struct connect_struct scConnectStruct;
+	struct timeval start;
 	LONG dwContextIndex;
 
 	PROFILE_START
@@ -747,6 +691,7 @@ LONG SCardConnect(SCARDCONTEXT hContext, LPCSTR szReader,
 	scConnectStruct.dwActiveProtocol = 0;
 	scConnectStruct.rv = SCARD_S_SUCCESS;
 
+	(void)gettimeofday(&start, NULL);
 	rv = SHMMessageSendWithHeader(SCARD_CONNECT, psContextMap[dwContextIndex].dwClientID,
 		sizeof(scConnectStruct),
 		PCSCLITE_READ_TIMEOUT, (void *) &scConnectStruct);
@@ -760,9 +705,9 @@ LONG SCardConnect(SCARDCONTEXT hContext, LPCSTR szReader,
 	/*
 	 * Read a message from the server
 	 */
-	rv = SHMMessageReceive(&scConnectStruct, sizeof(scConnectStruct),
-		psContextMap[dwContextIndex].dwClientID,
-		PCSCLITE_READ_TIMEOUT);
+	rv = SCardReceiveReply(SCARD_CONNECT, &scConnectStruct,
+		sizeof(scConnectStruct), psContextMap[dwContextIndex].dwClientID,
+		psContextMap[dwContextIndex].replyTimes, &start);
 
 	if (rv == -1)
 	{
@@ -866,6 +811,7 @@ LONG SCardReconnect(SCARDHANDLE hCard, DWORD dwShareMode,
 {
 	LONG rv;
 	struct reconnect_struct scReconnectStruct;
+	struct timeval start;
 	int i;
 	DWORD dwContextIndex, dwChannelIndex;
 
@@ -924,6 +870,7 @@ LONG SCardReconnect(SCARDHANDLE hCard, DWORD dwShareMode,
 		scReconnectStruct.dwActiveProtocol = *pdwActiveProtocol;
 		scReconnectStruct.rv = SCARD_S_SUCCESS;
 
+		(void)gettimeofday(&start, NULL);
 		rv = SHMMessageSendWithHeader(SCARD_RECONNECT, psContextMap[dwContextIndex].dwClientID,
 			sizeof(scReconnectStruct),
 			PCSCLITE_READ_TIMEOUT, (void *) &scReconnectStruct);
@@ -937,10 +884,9 @@ LONG SCardReconnect(SCARDHANDLE hCard, DWORD dwShareMode,
 		/*
 		 * Read a message from the server
 		 */
-		rv = SHMMessageReceive(&scReconnectStruct,
-			sizeof(scReconnectStruct),
-			psContextMap[dwContextIndex].dwClientID,
-			PCSCLITE_READ_TIMEOUT);
+		rv = SCardReceiveReply(SCARD_RECONNECT, &scReconnectStruct,
+			sizeof(scReconnectStruct), psContextMap[dwContextIndex].dwClientID,
+			psContextMap[dwContextIndex].replyTimes, &start);
 
 		if (rv == -1)
 		{
@@ -994,6 +940,7 @@ LONG SCardDisconnect(SCARDHANDLE hCard, DWORD dwDisposition)
 {
 	LONG rv;
 	struct disconnect_struct scDisconnectStruct;
+	struct timeval start;
 	DWORD dwContextIndex, dwChannelIndex;
 
 	PROFILE_START
@@ -1023,6 +970,7 @@ LONG SCardDisconnect(SCARDHANDLE hCard, DWORD dwDisposition)
 	scDisconnectStruct.dwDisposition = dwDisposition;
 	scDisconnectStruct.rv = SCARD_S_SUCCESS;
 
+	(void)gettimeofday(&start, NULL);
 	rv = SHMMessageSendWithHeader(SCARD_DISCONNECT, psContextMap[dwContextIndex].dwClientID,
 		sizeof(scDisconnectStruct),
 		PCSCLITE_READ_TIMEOUT, (void *) &scDisconnectStruct);
@@ -1036,10 +984,9 @@ LONG SCardDisconnect(SCARDHANDLE hCard, DWORD dwDisposition)
 	/*
 	 * Read a message from the server
 	 */
-	rv = SHMMessageReceive(&scDisconnectStruct,
-		sizeof(scDisconnectStruct),
-		psContextMap[dwContextIndex].dwClientID,
-		PCSCLITE_READ_TIMEOUT);
+	rv = SCardReceiveReply(SCARD_DISCONNECT, &scDisconnectStruct,
+		sizeof(scDisconnectStruct), psContextMap[dwContextIndex].dwClientID,
+		psContextMap[dwContextIndex].replyTimes, &start);
 
 	if (rv == -1)
 	{
@@ -1096,6 +1043,7 @@ LONG SCardBeginTransaction(SCARDHANDLE hCard)
 
 	LONG rv;
 	struct begin_struct scBeginStruct;
+	struct timeval start;
 	int i;
 	DWORD dwContextIndex, dwChannelIndex;
 
@@ -1152,6 +1100,7 @@ LONG SCardBeginTransaction(SCARDHANDLE hCard)
 
 	do
 	{
+		(void)gettimeofday(&start, NULL);
 		rv = SHMMessageSendWithHeader(SCARD_BEGIN_TRANSACTION, psContextMap[dwContextIndex].dwClientID,
 			sizeof(scBeginStruct),
 			PCSCLITE_READ_TIMEOUT, (void *) &scBeginStruct);
@@ -1165,9 +1114,9 @@ LONG SCardBeginTransaction(SCARDHANDLE hCard)
 		/*
 		 * Read a message from the server
 		 */
-		rv = SHMMessageReceive(&scBeginStruct, sizeof(scBeginStruct),
-			psContextMap[dwContextIndex].dwClientID,
-			PCSCLITE_READ_TIMEOUT);
+		rv = SCardReceiveReply(SCARD_BEGIN_TRANSACTION, &scBeginStruct,
+			sizeof(scBeginStruct), psContextMap[dwContextIndex].dwClientID,
+			psContextMap[dwContextIndex].replyTimes, &start);
 
 		if (rv == -1)
 		{
@@ -1231,6 +1180,7 @@ LONG SCardEndTransaction(SCARDHANDLE hCard, DWORD dwDisposition)
 {
 	LONG rv;
 	struct end_struct scEndStruct;
+	struct timeval start;
 	int randnum, i;
 	DWORD dwContextIndex, dwChannelIndex;
 
@@ -1286,6 +1236,7 @@ LONG SCardEndTransaction(SCARDHANDLE hCard, DWORD dwDisposition)
 	scEndStruct.dwDisposition = dwDisposition;
 	scEndStruct.rv = SCARD_S_SUCCESS;
 
+	(void)gettimeofday(&start, NULL);
 	rv = SHMMessageSendWithHeader(SCARD_END_TRANSACTION,
 		psContextMap[dwContextIndex].dwClientID,
 		sizeof(scEndStruct),
@@ -1300,9 +1251,9 @@ LONG SCardEndTransaction(SCARDHANDLE hCard, DWORD dwDisposition)
 	/*
 	 * Read a message from the server
 	 */
-	rv = SHMMessageReceive(&scEndStruct, sizeof(scEndStruct),
-		psContextMap[dwContextIndex].dwClientID,
-		PCSCLITE_READ_TIMEOUT);
+	rv = SCardReceiveReply(SCARD_END_TRANSACTION, &scEndStruct,
+		sizeof(scEndStruct), psContextMap[dwContextIndex].dwClientID,
+		psContextMap[dwContextIndex].replyTimes, &start);
 
 	if (rv == -1)
 	{
@@ -1335,6 +1286,7 @@ LONG SCardCancelTransaction(SCARDHANDLE hCard)
 {
 	LONG rv;
 	struct cancel_transaction_struct scCancelStruct;
+	struct timeval start;
 	int i;
 	DWORD dwContextIndex, dwChannelIndex;
 
@@ -1383,6 +1335,7 @@ LONG SCardCancelTransaction(SCARDHANDLE hCard)
 
 	scCancelStruct.hCard = hCard;
 
+	(void)gettimeofday(&start, NULL);
 	rv = SHMMessageSendWithHeader(SCARD_CANCEL_TRANSACTION,
 		psContextMap[dwContextIndex].dwClientID,
 		sizeof(scCancelStruct),
@@ -1397,9 +1350,9 @@ LONG SCardCancelTransaction(SCARDHANDLE hCard)
 	/*
 	 * Read a message from the server
 	 */
-	rv = SHMMessageReceive(&scCancelStruct, sizeof(scCancelStruct),
-		psContextMap[dwContextIndex].dwClientID,
-		PCSCLITE_READ_TIMEOUT);
+	rv = SCardReceiveReply(SCARD_CANCEL_TRANSACTION, &scCancelStruct,
+		sizeof(scCancelStruct), psContextMap[dwContextIndex].dwClientID,
+		psContextMap[dwContextIndex].replyTimes, &start);
 
 	if (rv == -1)
 	{
@@ -1511,6 +1464,7 @@ LONG SCardStatus(SCARDHANDLE hCard, LPSTR mszReaderName,
 	LONG rv;
 	int i;
 	struct status_struct scStatusStruct;
+	struct timeval start;
 	DWORD dwContextIndex, dwChannelIndex;
 	char *r;
 	char *bufReader = NULL;
@@ -1588,6 +1542,7 @@ LONG SCardStatus(SCARDHANDLE hCard, LPSTR mszReaderName,
 	scStatusStruct.pcchReaderLen = sizeof(scStatusStruct.mszReaderNames);
 	scStatusStruct.pcbAtrLen = sizeof(scStatusStruct.pbAtr);
 
+	(void)gettimeofday(&start, NULL);
 	rv = SHMMessageSendWithHeader(SCARD_STATUS, psContextMap[dwContextIndex].dwClientID,
 		sizeof(scStatusStruct),
 		PCSCLITE_READ_TIMEOUT, (void *) &scStatusStruct);
@@ -1601,9 +1556,9 @@ LONG SCardStatus(SCARDHANDLE hCard, LPSTR mszReaderName,
 	/*
 	 * Read a message from the server
 	 */
-	rv = SHMMessageReceive(&scStatusStruct, sizeof(scStatusStruct),
-		psContextMap[dwContextIndex].dwClientID,
-		PCSCLITE_READ_TIMEOUT);
+	rv = SCardReceiveReply(SCARD_STATUS, &scStatusStruct,
+		sizeof(scStatusStruct), psContextMap[dwContextIndex].dwClientID,
+		psContextMap[dwContextIndex].replyTimes, &start);
 
 	if (rv == -1)
 	{
@@ -1801,9 +1756,13 @@ LONG SCardGetStatusChange(SCARDCONTEXT hContext, DWORD dwTimeout,
 	LONG dwContextIndex;
 	int currentReaderCount = 0;
 	LONG rv = SCARD_S_SUCCESS;
+	struct timeval start, end;
 
 	PROFILE_START
 
+	/* no single message to pcscd gives the duration of the call */
+	(void)gettimeofday(&start, NULL);
+
 	if ((rgReaderStates == NULL && cReaders > 0)
 		|| (cReaders > PCSCLITE_MAX_READERS_CONTEXTS))
 		return SCARD_E_INVALID_PARAMETER;
@@ -1885,6 +1844,9 @@ LONG SCardGetStatusChange(SCARDCONTEXT hContext, DWORD dwTimeout,
 			if (psContextMap[dwContextIndex].mMutex)
 				(void)SYS_MutexUnLock(psContextMap[dwContextIndex].mMutex);
 
+			(void)gettimeofday(&end, NULL);
+			STATRecord(SCARD_GET_STATUS_CHANGE, time_sub(&end, &start), NULL);
+
 			PROFILE_END(rv)
 
 			return rv;
@@ -2263,6 +2225,9 @@ end:
 
 	(void)SYS_MutexUnLock(psContextMap[dwContextIndex].mMutex);
 
+	(void)gettimeofday(&end, NULL);
+	STATRecord(SCARD_GET_STATUS_CHANGE, time_sub(&end, &start), NULL);
+
 	PROFILE_END(rv)
 
 	return rv;
@@ -2325,6 +2290,7 @@ LONG SCardControl(SCARDHANDLE hCard, DWORD dwControlCode, LPCVOID pbSendBuffer,
 {
 	LONG rv;
 	struct control_struct scControlStruct;
+	struct timeval start;
 	int i;
 	DWORD dwContextIndex, dwChannelIndex;
 
@@ -2390,6 +2356,7 @@ LONG SCardControl(SCARDHANDLE hCard, DWORD dwControlCode, LPCVOID pbSendBuffer,
 	scControlStruct.cbSendLength = cbSendLength;
 	scControlStruct.cbRecvLength = cbRecvLength;
 
+	(void)gettimeofday(&start, NULL);
 	rv = SHMMessageSendWithHeader(SCARD_CONTROL,
 		psContextMap[dwContextIndex].dwClientID,
 		sizeof(scControlStruct), PCSCLITE_READ_TIMEOUT, &scControlStruct);
@@ -2413,9 +2380,9 @@ LONG SCardControl(SCARDHANDLE hCard, DWORD dwControlCode, LPCVOID pbSendBuffer,
 	/*
 	 * Read a message from the server
 	 */
-	rv = SHMMessageReceive(&scControlStruct, sizeof(scControlStruct),
-		psContextMap[dwContextIndex].dwClientID,
-		PCSCLITE_READ_TIMEOUT);
+	rv = SCardReceiveReply(SCARD_CONTROL, &scControlStruct,
+		sizeof(scControlStruct), psContextMap[dwContextIndex].dwClientID,
+		psContextMap[dwContextIndex].replyTimes, &start);
 
 	if (rv == -1)
 	{
@@ -2648,6 +2615,7 @@ static LONG SCardGetSetAttrib(SCARDHANDLE hCard, int command, DWORD dwAttrId,
 {
 	LONG rv;
 	struct getset_struct scGetSetStruct;
+	struct timeval start;
 	int i;
 	DWORD dwContextIndex, dwChannelIndex;
 
@@ -2706,6 +2674,7 @@ static LONG SCardGetSetAttrib(SCARDHANDLE hCard, int command, DWORD dwAttrId,
 	if (SCARD_SET_ATTRIB == command)
 		memcpy(scGetSetStruct.pbAttr, pbAttr, *pcbAttrLen);
 
+	(void)gettimeofday(&start, NULL);
 	rv = SHMMessageSendWithHeader(command,
 		psContextMap[dwContextIndex].dwClientID, sizeof(scGetSetStruct),
 		PCSCLITE_READ_TIMEOUT, &scGetSetStruct);
@@ -2719,9 +2688,9 @@ static LONG SCardGetSetAttrib(SCARDHANDLE hCard, int command, DWORD dwAttrId,
 	/*
 	 * Read a message from the server
 	 */
-	rv = SHMMessageReceive(&scGetSetStruct, sizeof(scGetSetStruct),
-		psContextMap[dwContextIndex].dwClientID,
-		PCSCLITE_READ_TIMEOUT);
+	rv = SCardReceiveReply(command, &scGetSetStruct,
+		sizeof(scGetSetStruct), psContextMap[dwContextIndex].dwClientID,
+		psContextMap[dwContextIndex].replyTimes, &start);
 
 	if (rv == -1)
 	{
@@ -2822,6 +2791,7 @@ LONG SCardTransmit(SCARDHANDLE hCard, LPCSCARD_IO_REQUEST pioSendPci,
 	int i;
 	DWORD dwContextIndex, dwChannelIndex;
 	struct transmit_struct scTransmitStruct;
+	struct timeval start;
 
 	PROFILE_START
 
@@ -2899,6 +2869,7 @@ LONG SCardTransmit(SCARDHANDLE hCard, LPCSCARD_IO_REQUEST pioSendPci,
 		scTransmitStruct.ioRecvPciLength = sizeof(SCARD_IO_REQUEST);
 	}
 
+	(void)gettimeofday(&start, NULL);
 	rv = SHMMessageSendWithHeader(SCARD_TRANSMIT,
 		psContextMap[dwContextIndex].dwClientID, sizeof(scTransmitStruct),
 		PCSCLITE_WRITE_TIMEOUT, (void *) &scTransmitStruct);
@@ -2922,9 +2893,9 @@ LONG SCardTransmit(SCARDHANDLE hCard, LPCSCARD_IO_REQUEST pioSendPci,
 	/*
 	 * Read a message from the server
 	 */
-	rv = SHMMessageReceive(&scTransmitStruct, sizeof(scTransmitStruct),
-		psContextMap[dwContextIndex].dwClientID,
-		PCSCLITE_READ_TIMEOUT);
+	rv = SCardReceiveReply(SCARD_TRANSMIT, &scTransmitStruct,
+		sizeof(scTransmitStruct), psContextMap[dwContextIndex].dwClientID,
+		psContextMap[dwContextIndex].replyTimes, &start);
 
 	if (rv == -1)
 	{
@@ -3019,10 +2990,14 @@ LONG SCardListReaders(SCARDCONTEXT hContext, /*@unused@*/ LPCSTR mszGroups,
 	LONG dwContextIndex;
 	LONG rv = SCARD_S_SUCCESS;
 	char *buf = NULL;
+	struct timeval start, end;
 
 	(void)mszGroups;
 	PROFILE_START
 
+	/* the reader list is read from the shared reader states */
+	(void)gettimeofday(&start, NULL);
+
 	/*
 	 * Check for NULL parameters
 	 */
@@ -3121,6 +3096,9 @@ end:
 
 	(void)SYS_MutexUnLock(psContextMap[dwContextIndex].mMutex);
 
+	(void)gettimeofday(&end, NULL);
+	STATRecord(SCARD_LIST_READERS, time_sub(&end, &start), NULL);
+
 	PROFILE_END(rv)
 
 	return rv;
@@ -3318,6 +3296,7 @@ LONG SCardCancel(SCARDCONTEXT hContext)
 	LONG rv = SCARD_S_SUCCESS;
 	uint32_t dwClientID = 0;
 	struct cancel_struct scCancelStruct;
+	struct timeval start;
 
 	PROFILE_START
 
@@ -3344,6 +3323,7 @@ LONG SCardCancel(SCARDCONTEXT hContext)
 	scCancelStruct.hContext = hContext;
 	scCancelStruct.rv = SCARD_S_SUCCESS;
 
+	(void)gettimeofday(&start, NULL);
 	rv = SHMMessageSendWithHeader(SCARD_CANCEL,
 		dwClientID,
 		sizeof(scCancelStruct), PCSCLITE_READ_TIMEOUT, (void *)
@@ -3358,8 +3338,8 @@ LONG SCardCancel(SCARDCONTEXT hContext)
 	/*
 	 * Read a message from the server
 	 */
-	rv = SHMMessageReceive(&scCancelStruct, sizeof(scCancelStruct),
-		dwClientID, PCSCLITE_READ_TIMEOUT);
+	rv = SCardReceiveReply(SCARD_CANCEL, &scCancelStruct,
+		sizeof(scCancelStruct), dwClientID, 0, &start);
 
 	if (rv == -1)
 	{
@@ -3426,6 +3406,73 @@ LONG SCardIsValidContext(SCARDCONTEXT hContext)
 	return rv;
 }
 
+/**
+ * @brief Returns the latency of the PC/SC calls made by the application.
+ *
+ * This function is a pcsc-lite extension. For each function the time seen
+ * by the application, the part used by pcscd and the part used by the
+ * driver are given as histograms in the Prometheus text format. The time
+ * spent in the socket and in the library is the difference between the
+ * first one and the second one.
+ *
+ * The same text is written when the library is unloaded in the file named
+ * by the \c PCSCLITE_STATISTICS environment variable.
+ *
+ * @ingroup API
+ * @param[out] mszStatistics text of the statistics. If the value is
+ * NULL, SCardGetStatistics() ignores the buffer length supplied in
+ * \p pcchStatistics and returns the length of the buffer that would have
+ * been returned if this parameter had not been NULL.
+ * @param[in,out] pcchStatistics Size of the \p mszStatistics buffer,
+ * including the NULL terminator.
+ *
+ * @return Error code.
+ * @retval SCARD_S_SUCCESS Successful (\ref SCARD_S_SUCCESS)
+ * @retval SCARD_E_INVALID_PARAMETER \p pcchStatistics is NULL (\ref SCARD_E_INVALID_PARAMETER)
+ * @retval SCARD_E_INSUFFICIENT_BUFFER Buffer not large enough (\ref SCARD_E_INSUFFICIENT_BUFFER)
+ * @retval SCARD_E_NO_MEMORY Memory allocation failed (\ref SCARD_E_NO_MEMORY)
+ *
+ * @code
+ * LPSTR mszStatistics;
+ * DWORD dwStatistics;
+ * LONG rv;
+ * ...
+ * rv = SCardGetStatistics(NULL, &dwStatistics);
+ * mszStatistics = malloc(dwStatistics);
+ * rv = SCardGetStatistics(mszStatistics, &dwStatistics);
+ * @endcode
+ */
+LONG SCardGetStatistics(LPSTR mszStatistics, LPDWORD pcchStatistics)
+{
+	LONG rv = SCARD_S_SUCCESS;
+	char *text;
+	size_t length;
+
+	if (NULL == pcchStatistics)
+		return SCARD_E_INVALID_PARAMETER;
+
+	text = STATFormat(&length);
+	if (NULL == text)
+		return SCARD_E_NO_MEMORY;
+
+	/* for the NULL byte */
+	length++;
+
+	if (mszStatistics)
+	{
+		/* more calls may have been counted since the size request */
+		if (*pcchStatistics < length)
+			rv = SCARD_E_INSUFFICIENT_BUFFER;
+		else
+			memcpy(mszStatistics, text, length);
+	}
+
+	*pcchStatistics = length;
+	free(text);
+
+	return rv;
+}
+
 /**
  * Functions for managing instances of SCardEstablishContext() These functions
  * keep track of Context handles and associate the blocking
@@ -3437,12 +3484,14 @@ LONG SCardIsValidContext(SCARDCONTEXT hContext)
  *
  * @param[in] hContext Application Context ID.
  * @param[in] dwClientID Client connection ID.
+ * @param[in] replyTimes pcscd sends \ref reply_times on this connection.
  *
  * @return Error code.
  * @retval SCARD_S_SUCCESS Success (\ref SCARD_S_SUCCESS)
  * @retval SCARD_E_NO_MEMORY There is no free slot to store \p hContext (\ref SCARD_E_NO_MEMORY)
  */
-static LONG SCardAddContext(SCARDCONTEXT hContext, DWORD dwClientID)
+static LONG SCardAddContext(SCARDCONTEXT hContext, DWORD dwClientID,
+	int replyTimes)
 {
 	int i;
 
@@ -3452,6 +3501,7 @@ static LONG SCardAddContext(SCARDCONTEXT hContext, DWORD dwClientID)
 		{
 			psContextMap[i].hContext = hContext;
 			psContextMap[i].dwClientID = dwClientID;
+			psContextMap[i].replyTimes = replyTimes;
 			psContextMap[i].contextBlockStatus = BLOCK_STATUS_RESUME;
 			psContextMap[i].mMutex = malloc(sizeof(PCSCLITE_MUTEX));
 			(void)SYS_MutexInit(psContextMap[i].mMutex);
@@ -3724,3 +3774,49 @@ static LONG getReaderStates(LONG dwContextIndex)
 	return SCARD_S_SUCCESS;
 }
 
+/**
+ * @brief Reads the answer to a SCard* command and counts the call.
+ *
+ * @param[in] command command sent
+ * @param[out] buffer answer
+ * @param[in] size size of the answer
+ * @param[in] dwClientID Client connection ID.
+ * @param[in] replyTimes pcscd sends \ref reply_times after the answer.
+ * @param[in] start time the command was sent
+ *
+ * @return Same error codes as SHMMessageReceive().
+ */
+static int32_t SCardReceiveReply(uint32_t command, void *buffer,
+	uint64_t size, DWORD dwClientID, int replyTimes, struct timeval *start)
+{
+	struct reply_times times;
+	struct timeval end;
+
+	if (-1 == SHMMessageReceive(buffer, size, dwClientID,
+		PCSCLITE_READ_TIMEOUT))
+		return -1;
+
+	if (replyTimes && (-1 == SHMMessageReceive(&times, sizeof(times),
+		dwClientID, PCSCLITE_READ_TIMEOUT)))
+		return -1;
+
+	(void)gettimeofday(&end, NULL);
+	STATRecord(command, time_sub(&end, start), replyTimes ? &times : NULL);
+
+	return 0;
+}
+
+#ifdef PCSC_STATISTICS_DUMP
+/**
+ * @brief Writes the statistics of the calls when the library is unloaded.
+ *
+ * Available if pcsc-lite is configured with --enable-statistics-dump.
+ * The statistics are written in the file named by the
+ * \c PCSCLITE_STATISTICS environment variable, or on stderr if its value
+ * is "-". The variable is ignored by a setuid or setgid program.
+ */
+void DESTRUCTOR SCardUnload(void)
+{
+	STATDump(SYS_GetEnv("PCSCLITE_STATISTICS"));
+}
+#endif
@@ -23,7 +23,10 @@
 /** Major version of the current message protocol */
 #define PROTOCOL_VERSION_MAJOR 4
 /** Minor version of the current message protocol */
-#define PROTOCOL_VERSION_MINOR 0
+#define PROTOCOL_VERSION_MINOR 1
+
+/** First minor version sending a \ref reply_times after the answers */
+#define PROTOCOL_VERSION_MINOR_TIMES 1
 
 #ifdef __cplusplus
 extern "C"
@@ -73,7 +76,33 @@ extern "C"
 		CMD_VERSION = 0x11,				/**< get the client/server protocol version */
 		CMD_GET_READERS_STATE = 0x12,	/**< get the readers state */
 		CMD_WAIT_READER_STATE_CHANGE = 0x13,	/**< wait for a reader state change */
-		CMD_STOP_WAITING_READER_STATE_CHANGE = 0x14	/**< stop waiting for a reader state change */
+		CMD_STOP_WAITING_READER_STATE_CHANGE = 0x14,	/**< stop waiting for a reader state change */
+		CMD_GET_METRICS = 0x15	/**< get the pcscd counters */
+	};
+
+	/**
+	 * @brief Answer to a \ref CMD_GET_METRICS Message.
+	 *
+	 * The message has no body. The answer is followed by \c size bytes
+	 * of text in the Prometheus text format.
+	 */
+	struct metrics_struct
+	{
+		uint32_t size;
+		uint32_t rv;
+	};
+
+	/**
+	 * @brief Processing times of a SCard* command (\ref SCARD_ESTABLISH_CONTEXT
+	 * to \ref SCARD_SET_ATTRIB) measured by pcscd.
+	 *
+	 * Sent right after the answer structure, before any data, if the
+	 * client announced protocol \ref PROTOCOL_VERSION_MINOR_TIMES or later.
+	 */
+	struct reply_times
+	{
+		uint32_t server;	/**< us from the request to the answer */
+		uint32_t driver;	/**< us spent in the IFD handler */
 	};
 
 	struct client_struct
@@ -1205,6 +1205,11 @@ LONG SCardSetAttrib(SCARDHANDLE hCard, DWORD dwAttrId, LPCBYTE pbAttr,
 	return SCARD_E_NOT_TRANSACTED;
 }
 
+LONG SCardGetStatistics(LPSTR mszStatistics, LPDWORD pcchStatistics)
+{
+	return SCARD_E_UNSUPPORTED_FEATURE;
+}
+
 static LONG SCardGetHandleIndice(SCARDHANDLE hCard)
 {
 	int i = 0;
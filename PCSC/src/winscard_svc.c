@@ -24,6 +24,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <sys/time.h>
 
 #include "pcscd.h"
 #include "winscard.h"
@@ -34,6 +36,10 @@
 #include "thread_generic.h"
 #include "readerfactory.h"
 #include "eventhandler.h"
+#include "ifdwrapper.h"
+#include "utils.h"
+#include "metrics.h"
+#include "trace.h"
 
 /**
  * @brief Represents an Application Context on the Server side.
@@ -55,6 +61,7 @@ static LONG MSGRemoveContext(SCARDCONTEXT, DWORD);
 static LONG MSGAddHandle(SCARDCONTEXT, SCARDHANDLE, DWORD);
 static LONG MSGRemoveHandle(SCARDHANDLE, DWORD);
 static LONG MSGCleanupClient(DWORD);
+static int32_t MSGSendReplyTimes(int32_t, struct timeval *);
 
 static void ContextThread(LPVOID pdwIndex);
 
@@ -132,7 +139,7 @@ LONG CreateContextThread(uint32_t *pdwClientID)
  * @param[in] dwIndex Index of an avaiable Application Context slot in
  * \c psContext.
  */
-static const char *CommandsText[] = {
+const char *CommandsText[] = {
 	"NULL",
 	"ESTABLISH_CONTEXT",	/* 0x01 */
 	"RELEASE_CONTEXT",
@@ -154,6 +161,7 @@ static const char *CommandsText[] = {
 	"CMD_GET_READERS_STATE",
 	"CMD_WAIT_READER_STATE_CHANGE",
 	"CMD_STOP_WAITING_READER_STATE_CHANGE",	/* 0x14 */
+	"CMD_GET_METRICS",
 	"NULL"
 };
 
@@ -165,6 +173,14 @@ static const char *CommandsText[] = {
 #define WRITE_BODY(v) \
 	ret = SHMMessageSend(&v, sizeof(v), filedes, PCSCLITE_WRITE_TIMEOUT);
 
+/* answer to a SCard* command, followed by its processing times */
+#define WRITE_REPLY(v) \
+	rv = v.rv; \
+	WRITE_BODY(v) \
+	if ((0 == ret) && (PROTOCOL_VERSION_MAJOR == psContext[dwContextIndex].protocol_major) \
+		&& (psContext[dwContextIndex].protocol_minor >= PROTOCOL_VERSION_MINOR_TIMES)) \
+		ret = MSGSendReplyTimes(filedes, &start);
+
 static void ContextThread(LPVOID dwIndex)
 {
 	DWORD dwContextIndex = (DWORD)dwIndex;
@@ -176,6 +192,8 @@ static void ContextThread(LPVOID dwIndex)
 	while (1)
 	{
 		struct rxHeader header;
+		struct timeval start, end;
+		LONG rv = SCARD_S_SUCCESS;	/* result of the command, for the trace */
 		int32_t ret = SHMMessageReceive(&header, sizeof(header), filedes, PCSCLITE_READ_TIMEOUT);
 
 		if (-1 == ret)
@@ -185,8 +203,18 @@ static void ContextThread(LPVOID dwIndex)
 			goto exit;
 		}
 
+		if (header.command > CMD_GET_METRICS)
+		{
+			Log2(PCSC_LOG_CRITICAL, "Unknown command: %d", header.command);
+			goto exit;
+		}
+
 		Log2(PCSC_LOG_DEBUG, "Received command: %s", CommandsText[header.command]);
 
+		(void)gettimeofday(&start, NULL);
+		(void)IFDDriverTime();
+		TRACE_START(CommandsText[header.command]);
+
 		switch (header.command)
 		{
 			/* pcsc-lite client/server protocol version */
@@ -225,6 +253,7 @@ static void ContextThread(LPVOID dwIndex)
 				veStr.minor = PROTOCOL_VERSION_MINOR;
 
 				/* send back the response */
+				rv = veStr.rv;
 				WRITE_BODY(veStr)
 			}
 			break;
@@ -238,6 +267,28 @@ static void ContextThread(LPVOID dwIndex)
 			}
 			break;
 
+			case CMD_GET_METRICS:
+			{
+				struct metrics_struct meStr;
+				char *text;
+				size_t length = 0;
+
+				/* nothing to read */
+
+				text = METFormat(&length);
+				meStr.size = length;
+				meStr.rv = text ? SCARD_S_SUCCESS : SCARD_E_NO_MEMORY;
+
+				rv = meStr.rv;
+				WRITE_BODY(meStr)
+
+				if ((0 == ret) && text)
+					ret = SHMMessageSend(text, length, filedes,
+						PCSCLITE_WRITE_TIMEOUT);
+				free(text);
+			}
+			break;
+
 			case CMD_WAIT_READER_STATE_CHANGE:
 			{
 				struct wait_reader_state_change waStr;
@@ -262,6 +313,7 @@ static void ContextThread(LPVOID dwIndex)
 				/* add the client fd to the list */
 				waStr.rv = EHUnregisterClientForEvent(filedes);
 
+				rv = waStr.rv;
 				WRITE_BODY(waStr)
 			}
 			break;
@@ -281,7 +333,7 @@ static void ContextThread(LPVOID dwIndex)
 					esStr.rv =
 						MSGAddContext(esStr.hContext, dwContextIndex);
 
-				WRITE_BODY(esStr)
+				WRITE_REPLY(esStr)
 			}
 			break;
 
@@ -297,7 +349,7 @@ static void ContextThread(LPVOID dwIndex)
 					reStr.rv =
 						MSGRemoveContext(reStr.hContext, dwContextIndex);
 
-				WRITE_BODY(reStr)
+				WRITE_REPLY(reStr)
 			}
 			break;
 
@@ -323,7 +375,7 @@ static void ContextThread(LPVOID dwIndex)
 					coStr.rv =
 						MSGAddHandle(coStr.hContext, coStr.hCard, dwContextIndex);
 
-				WRITE_BODY(coStr)
+				WRITE_REPLY(coStr)
 			}
 			break;
 
@@ -342,7 +394,7 @@ static void ContextThread(LPVOID dwIndex)
 						rcStr.dwInitialization, &dwActiveProtocol);
 				rcStr.dwActiveProtocol = dwActiveProtocol;
 
-				WRITE_BODY(rcStr)
+				WRITE_REPLY(rcStr)
 			}
 			break;
 
@@ -363,7 +415,7 @@ static void ContextThread(LPVOID dwIndex)
 							MSGRemoveHandle(diStr.hCard, dwContextIndex);
 				}
 
-				WRITE_BODY(diStr)
+				WRITE_REPLY(diStr)
 			}
 			break;
 
@@ -378,7 +430,7 @@ static void ContextThread(LPVOID dwIndex)
 				if (0 == rv)
 					beStr.rv = SCardBeginTransaction(beStr.hCard);
 
-				WRITE_BODY(beStr)
+				WRITE_REPLY(beStr)
 			}
 			break;
 
@@ -394,7 +446,7 @@ static void ContextThread(LPVOID dwIndex)
 					enStr.rv =
 						SCardEndTransaction(enStr.hCard, enStr.dwDisposition);
 
-				WRITE_BODY(enStr)
+				WRITE_REPLY(enStr)
 			}
 			break;
 
@@ -409,7 +461,7 @@ static void ContextThread(LPVOID dwIndex)
 				if (0 == rv)
 					caStr.rv = SCardCancelTransaction(caStr.hCard);
 
-				WRITE_BODY(caStr)
+				WRITE_REPLY(caStr)
 			}
 			break;
 
@@ -436,7 +488,7 @@ static void ContextThread(LPVOID dwIndex)
 				else
 					caStr.rv = SCARD_E_INVALID_VALUE;
 
-				WRITE_BODY(caStr)
+				WRITE_REPLY(caStr)
 			}
 			break;
 
@@ -480,7 +532,7 @@ static void ContextThread(LPVOID dwIndex)
 					}
 				}
 
-				WRITE_BODY(stStr)
+				WRITE_REPLY(stStr)
 			}
 			break;
 
@@ -528,7 +580,7 @@ static void ContextThread(LPVOID dwIndex)
 				trStr.ioRecvPciLength = ioRecvPci.cbPciLength;
 				trStr.pcbRecvLength = cbRecvLength;
 
-				WRITE_BODY(trStr)
+				WRITE_REPLY(trStr)
 
 				/* write received buffer */
 				if (SCARD_S_SUCCESS == trStr.rv)
@@ -574,7 +626,7 @@ static void ContextThread(LPVOID dwIndex)
 
 				ctStr.dwBytesReturned = dwBytesReturned;
 
-				WRITE_BODY(ctStr)
+				WRITE_REPLY(ctStr)
 
 				/* write received buffer */
 				if (SCARD_S_SUCCESS == ctStr.rv)
@@ -604,7 +656,7 @@ static void ContextThread(LPVOID dwIndex)
 
 				gsStr.cbAttrLen = cbAttrLen;
 
-				WRITE_BODY(gsStr)
+				WRITE_REPLY(gsStr)
 			}
 			break;
 
@@ -624,7 +676,7 @@ static void ContextThread(LPVOID dwIndex)
 				gsStr.rv = SCardSetAttrib(gsStr.hCard, gsStr.dwAttrId,
 					gsStr.pbAttr, gsStr.cbAttrLen);
 
-				WRITE_BODY(gsStr)
+				WRITE_REPLY(gsStr)
 			}
 			break;
 
@@ -633,6 +685,10 @@ static void ContextThread(LPVOID dwIndex)
 				goto exit;
 		}
 
+		TRACE_END(CommandsText[header.command], rv);
+		(void)gettimeofday(&end, NULL);
+		METCommand(header.command, time_sub(&end, &start));
+
 		/* SHMMessageSend() failed */
 		if (-1 == ret)
 		{
@@ -653,6 +709,49 @@ exit:
 	(void)SYS_ThreadExit((LPVOID) NULL);
 }
 
+/**
+ * @brief Sends the \ref reply_times of the current command.
+ *
+ * The driver time is the one of the calling thread, the only one
+ * working for this client.
+ */
+static int32_t MSGSendReplyTimes(int32_t filedes, struct timeval *start)
+{
+	struct reply_times times;
+	struct timeval now;
+
+	(void)gettimeofday(&now, NULL);
+	times.server = time_sub(&now, start);
+	times.driver = IFDDriverTime();
+
+	return SHMMessageSend(&times, sizeof(times), filedes,
+		PCSCLITE_WRITE_TIMEOUT);
+}
+
+/**
+ * @brief Counts the connected clients, their contexts and card handles.
+ */
+void ContextsCount(int *pClients, int *pContexts, int *pHandles)
+{
+	int i, j;
+
+	*pClients = *pContexts = *pHandles = 0;
+
+	for (i = 0; i < PCSCLITE_MAX_APPLICATIONS_CONTEXTS; i++)
+	{
+		if (0 == psContext[i].dwClientID)
+			continue;
+
+		(*pClients)++;
+		if (psContext[i].hContext)
+			(*pContexts)++;
+
+		for (j = 0; j < PCSCLITE_MAX_APPLICATION_CONTEXT_CHANNELS; j++)
+			if (psContext[i].hCard[j])
+				(*pHandles)++;
+	}
+} /* ContextsCount */
+
 LONG MSGSignalClient(uint32_t filedes, LONG rv)
 {
 	uint32_t ret;
@@ -24,6 +24,9 @@ extern "C"
 	LONG ContextsInitialize(void);
 	LONG CreateContextThread(uint32_t *);
 	LONG MSGSignalClient(uint32_t filedes, LONG rv);
+	void ContextsCount(int *, int *, int *);
+
+	extern const char *CommandsText[];
 #ifdef __cplusplus
 }
 #endif
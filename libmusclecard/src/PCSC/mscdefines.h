@@ -72,6 +72,9 @@ extern "C"
 		MSCPVoid32 pvfListObjects;
 		MSCPVoid32 pvfLogoutAll;
 		MSCPVoid32 pvfGetChallenge;
+		MSCPVoid32 pvfWriteObjectEx;	/* optional, 32 bits length */
+		MSCPVoid32 pvfReadObjectEx;	/* optional, 32 bits length */
+		MSCPVoid32 pvfComputeCryptEx;	/* optional, one cipher step */
 
 	}
 	CFDyLibPointers, *LPCFDyLibPointers;
@@ -120,6 +123,8 @@ extern "C"
 	MSCEventWaitInfo, *MSCLPEventWaitInfo;
 
 	typedef MSC_RV(*LPRWEventCallback) (MSCPVoid32, int);
+	typedef MSC_RV(*LPCryptEventCallback) (MSCPVoid32, MSCPUChar8,
+		MSCULong32);
 
 	typedef struct
 	{
@@ -134,6 +139,10 @@ extern "C"
 		MSCUChar8 loggedIDs;	/* Verification bit mask */
 		MSCULong32 shareMode;	/* Sharing mode for this */
 		LPRWEventCallback rwCallback;	/* Registered callback */
+		MSCULong32 ioChunkSize;	/* Object I/O size, 0 if unknown */
+		MSCULong32 cryptChunkSize;	/* Cipher step size, 0 if unknown */
+		MSCPVoid32 objectCache;	/* Objects and keys kept in memory */
+		MSCPVoid32 connectionLock;	/* Serializes the calls on this */
 	}
 	MSCTokenConnection, *MSCLPTokenConnection;
 
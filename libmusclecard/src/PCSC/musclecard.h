@@ -146,6 +146,7 @@ extern "C"
 #define MSC_MAX_PINS                        8
 #define MSC_SIZEOF_KEYPACKET              200
 #define MSC_MAXSIZEOF_APDU_DATALEN        255
+#define MSC_MAXSIZEOF_EXT_APDU_DATALEN  65535
 #define MSC_PERCENT_STEPSIZE             1000
 #define MSC_SINGLE_READ_PACKET            255
 #define MSC_MAXSIZE_TOKENARRAY            255
@@ -440,6 +441,9 @@ extern "C"
 #define MSC_TAG_CAPABLE_MD5           207	/* MD5 capabilities */
 #define MSC_TAG_CAPABLE_SHA1          208	/* SHA1 capabilities */
 
+#define MSC_TAG_CAPABLE_CRYPT_MAXIO   209	/* largest data processed by
+											 * one cipher step */
+
 	/*
 	 * object related tags 
 	 */
@@ -448,6 +452,8 @@ extern "C"
 #define MSC_TAG_CAPABLE_OBJ_AUTH      303	/* return AUT needed for
 											 * create */
 #define MSC_TAG_CAPABLE_OBJ_MAXNUM    304	/* maximum number of objects */
+#define MSC_TAG_CAPABLE_OBJ_MAXIO     305	/* largest object data read or
+											 * written by one command */
 
 	/*
 	 * pin related tags 
@@ -664,6 +670,8 @@ extern "C"
 
 	/*
 	 * Establishes a connection to the specified token 
+	 * The connections share at most 8 PC/SC contexts since pcscd
+	 * accepts 16 contexts per process.
 	 */
 	PCSC_API
 	MSC_RV MSCEstablishConnection(MSCLPTokenInfo tokenStruct,	/* The
@@ -678,6 +686,8 @@ extern "C"
 
 	/*
 	 * Releases a connection to the specified token 
+	 * No other call may use the connection at the same time or later
+	 * since the lock of the connection is freed.
 	 */
 	PCSC_API
 	MSC_RV MSCReleaseConnection(MSCLPTokenConnection pConnection,	/* Connection 
@@ -705,7 +715,8 @@ extern "C"
 		);
 
 	/*
-	 * Registers a callback function for event change 
+	 * Registers a callback function for event change. Several
+	 * callbacks may be registered, they are called by the same thread
 	 */
 	PCSC_API
 	MSC_RV MSCCallbackForTokenEvent(MSCLPTokenInfo tokenArray,	/* Array
@@ -726,6 +737,9 @@ extern "C"
 
 	/*
 	 * Locks a transaction to the token 
+	 * Only the other applications are kept away from the token: the
+	 * threads sharing the connection must serialize their calls
+	 * between MSCBeginTransaction() and MSCEndTransaction() themselves.
 	 */
 	PCSC_API
 	MSC_RV MSCBeginTransaction(MSCLPTokenConnection pConnection	/* Connection 
@@ -808,6 +822,22 @@ extern "C"
 		MSCULong32 inputDataSize,
 		MSCPUChar8 pOutputData, MSCPULong32 outputDataSize);
 
+	/*
+	 * Same as MSCComputeCrypt() for data of any size. The output is
+	 * given to outputCallback as soon as the token returns it. Any
+	 * callback result other than MSC_SUCCESS (MSC_CANCELLED for example)
+	 * stops the operation and is returned. The output already given is
+	 * not valid if an error is returned.
+	 * The callback may run while another thread sends the next input to
+	 * the token: it must not use pConnection.
+	 */
+	PCSC_API
+	MSC_RV MSCComputeCryptStream(MSCLPTokenConnection pConnection,
+		MSCLPCryptInit cryptInit,
+		MSCPUChar8 pInputData,
+		MSCULong32 inputDataSize,
+		LPCryptEventCallback outputCallback, MSCPVoid32 addParams);
+
 	PCSC_API
 	MSC_RV MSCExtAuthenticate(MSCLPTokenConnection pConnection,
 				  MSCUChar8 keyNum,
@@ -947,6 +977,131 @@ extern "C"
 	PCSC_API
 	MSCUChar8 MSCIsTokenKnown(MSCLPTokenConnection pConnection);
 
+	/*
+	 * Crypt job queue: the MSCComputeCrypt() jobs are spread over all
+	 * the known tokens holding the key. An idle token takes the jobs
+	 * waiting for another one. A token failing is suspended and
+	 * connected again later, its jobs are done by the others.
+	 */
+	typedef struct MSCCryptQueue *MSCLPCryptQueue;
+
+	typedef struct
+	{
+		MSCCryptInit cryptInit;
+		MSCPUChar8 pInputData;
+		MSCULong32 inputDataSize;
+		MSCPUChar8 pOutputData;
+		MSCULong32 outputDataSize;	/* buffer size, then output size */
+		MSC_RV rv;		/* result of the job */
+	}
+	MSCCryptJob, *MSCLPCryptJob;
+
+	/*
+	 * Called by a thread of the queue when the job is done
+	 */
+	typedef void (*LPCryptJobCallback) (MSCLPCryptJob, MSCPVoid32);
+
+#define MSC_QUEUE_TOKEN_READY		0	/* takes jobs */
+#define MSC_QUEUE_TOKEN_SUSPENDED	1	/* failed, connected again later */
+#define MSC_QUEUE_TOKEN_REMOVED		2	/* not used any more */
+
+	typedef struct
+	{
+		MSCChar8 slotName[MAX_READERNAME];
+		MSCULong32 tokenState;	/* MSC_QUEUE_TOKEN_* */
+		MSCULong32 jobsDone;	/* completed, with or without a job error */
+		MSCULong32 jobsFailed;	/* token errors, retried while possible */
+		MSCULong32 jobsStolen;	/* taken from another token */
+		MSCULong32 jobsQueued;	/* waiting for this token */
+		MSCULong32 reconnects;
+		MSCULong32 busyTime;	/* ms used by the token */
+	}
+	MSCCryptQueueStats, *MSCLPCryptQueueStats;
+
+	/*
+	 * The PIN is verified on each token if pinCodeSize is not 0
+	 */
+	PCSC_API
+	MSC_RV MSCCreateCryptQueue(MSCUChar8 keyNum, MSCUChar8 pinNum,
+		MSCPUChar8 pPinCode, MSCULong32 pinCodeSize,
+		MSCLPCryptQueue *pQueue);
+
+	/*
+	 * The job must stay valid until the callback is called
+	 */
+	PCSC_API
+	MSC_RV MSCSubmitCryptJob(MSCLPCryptQueue queue, MSCLPCryptJob job,
+		LPCryptJobCallback callback, MSCPVoid32 addParams);
+
+	/*
+	 * Waits for all the jobs submitted. The job of a callback is
+	 * completed when the callback returns, so a callback calling
+	 * MSCWaitCryptQueue() or MSCDestroyCryptQueue() gets
+	 * MSC_OPERATION_NOT_ALLOWED.
+	 */
+	PCSC_API
+	MSC_RV MSCWaitCryptQueue(MSCLPCryptQueue queue);
+
+	/*
+	 * One entry per token, same use of statsLength as MSCListTokens()
+	 */
+	PCSC_API
+	MSC_RV MSCGetCryptQueueStats(MSCLPCryptQueue queue,
+		MSCLPCryptQueueStats pStats, MSCPULong32 statsLength);
+
+	PCSC_API
+	MSC_RV MSCDestroyCryptQueue(MSCLPCryptQueue queue);
+
+	/*
+	 * Connection pool: the connections released are kept and given
+	 * again for the same token, application and sharing mode. A
+	 * connection is only checked with SCardStatus() when given again
+	 * and replaced if the token was reset or removed.
+	 */
+	typedef struct MSCConnectionPool *MSCLPConnectionPool;
+
+#define MSC_POOL_KEEP_PIN	0x01	/* a PIN verified is not verified
+									 * again until the token is reset */
+
+	PCSC_API
+	MSC_RV MSCCreateConnectionPool(MSCULong32 maxIdle, MSCULong32 flags,
+		MSCLPConnectionPool *pPool);
+
+	/*
+	 * Same as MSCEstablishConnection() but the connection is allocated
+	 * by the pool
+	 */
+	PCSC_API
+	MSC_RV MSCPoolEstablishConnection(MSCLPConnectionPool pool,
+		MSCLPTokenInfo tokenStruct, MSCULong32 sharingMode,
+		MSCPUChar8 applicationName, MSCULong32 nameSize,
+		MSCLPTokenConnection *ppConnection);
+
+	/*
+	 * Same as MSCVerifyPIN(), the token is not used if the same PIN
+	 * was already verified with MSC_POOL_KEEP_PIN
+	 */
+	PCSC_API
+	MSC_RV MSCPoolVerifyPIN(MSCLPConnectionPool pool,
+		MSCLPTokenConnection pConnection, MSCUChar8 pinNum,
+		MSCPUChar8 pPinCode, MSCULong32 pinCodeSize);
+
+	/*
+	 * The connection is kept with SCARD_LEAVE_CARD, any other action
+	 * really releases it. Without MSC_POOL_KEEP_PIN the identities are
+	 * logged out first. The token is reset instead, and the connection
+	 * released, if the logout fails or is not supported by the token.
+	 */
+	PCSC_API
+	MSC_RV MSCPoolReleaseConnection(MSCLPConnectionPool pool,
+		MSCLPTokenConnection pConnection, MSCULong32 endAction);
+
+	/*
+	 * The connections given by the pool must be released before
+	 */
+	PCSC_API
+	MSC_RV MSCDestroyConnectionPool(MSCLPConnectionPool pool);
+
 #ifdef __cplusplus
 }
 #endif
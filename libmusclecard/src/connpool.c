@@ -0,0 +1,315 @@
+/*
+ * This keeps the connections to the tokens for later use.
+ *
+ * MUSCLE SmartCard Development ( http://www.linuxnet.com )
+ *
+ * Copyright (C) 2009
+ *  Ludovic Rousseau <ludovic.rousseau@free.fr>
+ *
+ * $Id$
+ */
+
+/*
+ * MSCEstablishConnection() does SCardConnect(), the search of the token
+ * library, the initialization of the library and the selection of the
+ * applet. A connection released to the pool keeps all that. When it is
+ * given again only SCardStatus() is used to check the token was not
+ * reset or removed meanwhile, otherwise a new connection is
+ * established.
+ *
+ * With MSC_POOL_KEEP_PIN the PINs verified are kept with the connection
+ * so a second MSCPoolVerifyPIN() with the same PIN does not use the
+ * token. Without it the identities are logged out when the connection
+ * is released. A reset of the token loses the PINs kept too: the connection
+ * is replaced, and MSCReEstablishConnection() and MSCLogoutAll() clear
+ * loggedIDs.
+ */
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include "misc.h"
+#include <winscard.h>
+#include "debug.h"
+
+#include "musclecard.h"
+
+#include <wintypes.h>
+#include <thread_generic.h>
+
+/*
+ * internal function
+ */
+void mscWipe(void *, size_t);
+
+typedef struct PooledConnection
+{
+	MSCTokenConnection connection;	/* first, given to the application */
+	struct PooledConnection *next;
+	MSCULong32 sharingMode;
+	MSCUChar8 application[MSC_MAXSIZE_AID];
+	MSCULong32 applicationSize;
+	MSCPUChar8 pinCode[MSC_MAX_PINS];
+	MSCULong32 pinCodeSize[MSC_MAX_PINS];
+}
+PooledConnection;
+
+struct MSCConnectionPool
+{
+	PooledConnection *idle;
+	MSCULong32 idleCount;
+	MSCULong32 maxIdle;
+	MSCULong32 flags;
+	PCSCLITE_MUTEX mutex;
+};
+
+static PooledConnection *CPTakeIdle(MSCLPConnectionPool, MSCLPTokenInfo,
+	MSCULong32, MSCPUChar8, MSCULong32);
+static void CPForgetPIN(PooledConnection *, MSCUChar8);
+static void CPDiscard(PooledConnection *, MSCULong32);
+
+MSC_RV MSCCreateConnectionPool(MSCULong32 maxIdle, MSCULong32 flags,
+	MSCLPConnectionPool *pPool)
+{
+	struct MSCConnectionPool *pool;
+
+	if (pPool == NULL)
+		return MSC_INVALID_PARAMETER;
+
+	pool = calloc(1, sizeof(*pool));
+	if (pool == NULL)
+		return MSC_INTERNAL_ERROR;
+
+	pool->maxIdle = maxIdle;
+	pool->flags = flags;
+	(void)SYS_MutexInit(&pool->mutex);
+
+	*pPool = pool;
+
+	return MSC_SUCCESS;
+}
+
+MSC_RV MSCPoolEstablishConnection(MSCLPConnectionPool pool,
+	MSCLPTokenInfo tokenStruct, MSCULong32 sharingMode,
+	MSCPUChar8 applicationName, MSCULong32 nameSize,
+	MSCLPTokenConnection *ppConnection)
+{
+	PooledConnection *pooled;
+	MSC_RV rv;
+
+	if ((pool == NULL) || (tokenStruct == NULL) || (ppConnection == NULL))
+		return MSC_INVALID_PARAMETER;
+	if (nameSize > MSC_MAXSIZE_AID)
+		return MSC_INVALID_PARAMETER;
+
+	while ((pooled = CPTakeIdle(pool, tokenStruct, sharingMode,
+				applicationName, nameSize)) != NULL)
+	{
+		/* the only use of pcscd for a connection still valid */
+		if (!MSCIsTokenChanged(&pooled->connection))
+		{
+			*ppConnection = &pooled->connection;
+			return MSC_SUCCESS;
+		}
+
+#ifndef NO_MSC_DEBUG
+		Log2(PCSC_LOG_DEBUG, "Token in %s changed, connection dropped",
+			tokenStruct->slotName);
+#endif
+		CPDiscard(pooled, SCARD_LEAVE_CARD);
+	}
+
+	pooled = calloc(1, sizeof(*pooled));
+	if (pooled == NULL)
+		return MSC_INTERNAL_ERROR;
+
+	rv = MSCEstablishConnection(tokenStruct, sharingMode, applicationName,
+		nameSize, &pooled->connection);
+	if (rv != MSC_SUCCESS)
+	{
+		free(pooled);
+		return rv;
+	}
+
+	pooled->sharingMode = sharingMode;
+	if (nameSize)
+		memcpy(pooled->application, applicationName, nameSize);
+	pooled->applicationSize = nameSize;
+
+	*ppConnection = &pooled->connection;
+
+	return MSC_SUCCESS;
+}
+
+MSC_RV MSCPoolVerifyPIN(MSCLPConnectionPool pool,
+	MSCLPTokenConnection pConnection, MSCUChar8 pinNum,
+	MSCPUChar8 pPinCode, MSCULong32 pinCodeSize)
+{
+	PooledConnection *pooled = (PooledConnection *) pConnection;
+	MSCUChar8 mask;
+	MSC_RV rv;
+
+	if ((pool == NULL) || (pConnection == NULL))
+		return MSC_INVALID_PARAMETER;
+
+	if (pinNum >= MSC_MAX_PINS)
+		return MSCVerifyPIN(pConnection, pinNum, pPinCode, pinCodeSize);
+
+	mask = 1 << pinNum;
+
+	if ((pool->flags & MSC_POOL_KEEP_PIN) && (pConnection->loggedIDs & mask)
+		&& pooled->pinCode[pinNum]
+		&& (pooled->pinCodeSize[pinNum] == pinCodeSize)
+		&& !MSCIsTokenChanged(pConnection))
+	{
+		MSCUChar8 diff = 0;
+		MSCULong32 i;
+
+		/* same time whatever the PIN given */
+		for (i = 0; i < pinCodeSize; i++)
+			diff |= pooled->pinCode[pinNum][i] ^ pPinCode[i];
+
+		if (diff == 0)
+			return MSC_SUCCESS;
+	}
+
+	CPForgetPIN(pooled, pinNum);
+
+	rv = MSCVerifyPIN(pConnection, pinNum, pPinCode, pinCodeSize);
+	if (rv != MSC_SUCCESS)
+	{
+		pConnection->loggedIDs &= ~mask;
+		return rv;
+	}
+
+	pConnection->loggedIDs |= mask;
+
+	if ((pool->flags & MSC_POOL_KEEP_PIN) && pinCodeSize)
+	{
+		pooled->pinCode[pinNum] = malloc(pinCodeSize);
+		if (pooled->pinCode[pinNum])
+		{
+			memcpy(pooled->pinCode[pinNum], pPinCode, pinCodeSize);
+			pooled->pinCodeSize[pinNum] = pinCodeSize;
+		}
+	}
+
+	return MSC_SUCCESS;
+}
+
+MSC_RV MSCPoolReleaseConnection(MSCLPConnectionPool pool,
+	MSCLPTokenConnection pConnection, MSCULong32 endAction)
+{
+	PooledConnection *pooled = (PooledConnection *) pConnection;
+	MSC_RV rv;
+
+	if ((pool == NULL) || (pConnection == NULL))
+		return MSC_INVALID_PARAMETER;
+
+	/* the next user must verify the PINs again. MSCVerifyPIN() may have
+	 * been used so loggedIDs is not enough to skip the logout. A reset
+	 * of the token clears the PINs if the logout fails or is not
+	 * supported */
+	if (!(pool->flags & MSC_POOL_KEEP_PIN) && (endAction == SCARD_LEAVE_CARD))
+	{
+		rv = MSCLogoutAll(pConnection);
+		if (rv != MSC_SUCCESS)
+			endAction = SCARD_RESET_CARD;
+	}
+
+	(void)SYS_MutexLock(&pool->mutex);
+	if ((endAction == SCARD_LEAVE_CARD) && (pool->idleCount < pool->maxIdle))
+	{
+		pooled->next = pool->idle;
+		pool->idle = pooled;
+		pool->idleCount++;
+		pooled = NULL;
+	}
+	(void)SYS_MutexUnLock(&pool->mutex);
+
+	if (pooled)
+		CPDiscard(pooled, endAction);
+
+	return MSC_SUCCESS;
+}
+
+MSC_RV MSCDestroyConnectionPool(MSCLPConnectionPool pool)
+{
+	PooledConnection *pooled;
+
+	if (pool == NULL)
+		return MSC_INVALID_PARAMETER;
+
+	while ((pooled = pool->idle) != NULL)
+	{
+		pool->idle = pooled->next;
+		CPDiscard(pooled, SCARD_LEAVE_CARD);
+	}
+
+	(void)SYS_MutexDestroy(&pool->mutex);
+	free(pool);
+
+	return MSC_SUCCESS;
+}
+
+/*
+ * Removes from the pool an idle connection to the same token with the
+ * same application and sharing mode
+ */
+static PooledConnection *CPTakeIdle(MSCLPConnectionPool pool,
+	MSCLPTokenInfo tokenStruct, MSCULong32 sharingMode,
+	MSCPUChar8 applicationName, MSCULong32 nameSize)
+{
+	PooledConnection **previous, *pooled;
+	MSCLPTokenInfo tokenInfo;
+
+	(void)SYS_MutexLock(&pool->mutex);
+
+	for (previous = &pool->idle; (pooled = *previous) != NULL;
+		previous = &pooled->next)
+	{
+		tokenInfo = &pooled->connection.tokenInfo;
+
+		if ((pooled->sharingMode == sharingMode)
+			&& (pooled->applicationSize == nameSize)
+			&& ((nameSize == 0)
+				|| (memcmp(pooled->application, applicationName,
+						nameSize) == 0))
+			&& (strcmp(tokenInfo->slotName, tokenStruct->slotName) == 0)
+			&& (tokenInfo->tokenIdLength == tokenStruct->tokenIdLength)
+			&& (memcmp(tokenInfo->tokenId, tokenStruct->tokenId,
+				tokenStruct->tokenIdLength) == 0))
+		{
+			*previous = pooled->next;
+			pool->idleCount--;
+			break;
+		}
+	}
+
+	(void)SYS_MutexUnLock(&pool->mutex);
+
+	return pooled;
+}
+
+static void CPForgetPIN(PooledConnection *pooled, MSCUChar8 pinNum)
+{
+	if (pooled->pinCode[pinNum] == NULL)
+		return;
+
+	mscWipe(pooled->pinCode[pinNum], pooled->pinCodeSize[pinNum]);
+	free(pooled->pinCode[pinNum]);
+	pooled->pinCode[pinNum] = NULL;
+	pooled->pinCodeSize[pinNum] = 0;
+}
+
+static void CPDiscard(PooledConnection *pooled, MSCULong32 endAction)
+{
+	MSCUChar8 i;
+
+	for (i = 0; i < MSC_MAX_PINS; i++)
+		CPForgetPIN(pooled, i);
+
+	(void)MSCReleaseConnection(&pooled->connection, endAction);
+	free(pooled);
+}
@@ -0,0 +1,718 @@
+/*
+ * This spreads crypt jobs over several tokens.
+ *
+ * MUSCLE SmartCard Development ( http://www.linuxnet.com )
+ *
+ * Copyright (C) 2009
+ *  Ludovic Rousseau <ludovic.rousseau@free.fr>
+ *
+ * $Id$
+ */
+
+/*
+ * Each token of the queue has its own connection, its own thread and
+ * its own list of waiting jobs. A job is given to the ready token with
+ * the shortest list. A token with an empty list takes the last job of
+ * the longest list of the others.
+ *
+ * A token error (removed, reset, transport, ...) suspends the token:
+ * its waiting jobs go to the other tokens, the failed job is retried
+ * elsewhere and the token is connected again later, immediately the
+ * first time, then after a delay doubling up to CQ_SUSPEND_MAX. A token
+ * removed or replaced, or refusing the PIN, is not used any more. The
+ * PIN is never tried again on a token once refused, so the tries of
+ * the other tokens are not used.
+ */
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "misc.h"
+#include <winscard.h>
+#include "debug.h"
+
+#include "musclecard.h"
+#include "strlcpycat.h"
+
+#include <wintypes.h>
+#include <thread_generic.h>
+
+/*
+ * internal function
+ */
+void mscWipe(void *, size_t);
+
+/* tries for a job getting token errors */
+#define CQ_MAX_ATTEMPTS 3
+
+/* longest suspension of a token, in ms */
+#define CQ_SUSPEND_MAX 30000
+
+typedef struct QueuedJob
+{
+	struct QueuedJob *next;
+	struct QueuedJob *prev;
+	MSCLPCryptJob job;
+	LPCryptJobCallback callback;
+	MSCPVoid32 addParams;
+	int attempts;
+}
+QueuedJob;
+
+typedef struct
+{
+	struct MSCCryptQueue *queue;
+	MSCTokenInfo tokenInfo;
+	MSCTokenConnection connection;
+	int connected;
+	PCSCLITE_THREAD_T thread;
+	int running;
+	QueuedJob *head;
+	QueuedJob *tail;
+	int failures;			/* consecutive token errors */
+	struct timeval resume;	/* end of the suspension */
+	MSCCryptQueueStats stats;
+}
+CQWorker;
+
+struct MSCCryptQueue
+{
+	MSCUChar8 keyNum;
+	MSCUChar8 pinNum;
+	MSCPUChar8 pinCode;
+	MSCULong32 pinCodeSize;
+	CQWorker *workers;
+	MSCULong32 workerCount;
+	MSCULong32 pending;		/* submitted and not completed */
+	int stopping;
+	PCSCLITE_MUTEX mutex;
+	pthread_cond_t cond;	/* jobs or stop for the workers */
+	pthread_cond_t done;	/* for MSCWaitCryptQueue() */
+};
+
+static MSC_RV CQConnect(CQWorker *);
+static void CQDisconnect(CQWorker *);
+static void *CQRun(void *);
+static QueuedJob *CQTakeJob(CQWorker *);
+static int CQQueueJob(struct MSCCryptQueue *, QueuedJob *, CQWorker *);
+static void CQMoveJobs(CQWorker *);
+static void CQTokenFailed(CQWorker *, MSC_RV);
+static void CQComplete(struct MSCCryptQueue *, QueuedJob *, MSC_RV);
+static int CQTokenError(MSC_RV);
+static int CQInCallback(struct MSCCryptQueue *);
+
+MSC_RV MSCCreateCryptQueue(MSCUChar8 keyNum, MSCUChar8 pinNum,
+	MSCPUChar8 pPinCode, MSCULong32 pinCodeSize, MSCLPCryptQueue *pQueue)
+{
+	struct MSCCryptQueue *queue;
+	MSCLPTokenInfo tokenList;
+	MSCULong32 tokenCount, i;
+	MSC_RV rv;
+
+	if (pQueue == NULL)
+		return MSC_INVALID_PARAMETER;
+	if (pinCodeSize && (pPinCode == NULL))
+		return MSC_INVALID_PARAMETER;
+
+	*pQueue = NULL;
+
+	tokenCount = 0;
+	rv = MSCListTokens(MSC_LIST_KNOWN, NULL, &tokenCount);
+	if (rv != MSC_SUCCESS)
+		return rv;
+	if (tokenCount == 0)
+		return MSC_TOKEN_REMOVED;
+
+	tokenList = calloc(tokenCount, sizeof(MSCTokenInfo));
+	if (tokenList == NULL)
+		return MSC_INTERNAL_ERROR;
+
+	i = tokenCount;
+	rv = MSCListTokens(MSC_LIST_KNOWN, tokenList, &tokenCount);
+
+	/* tokens inserted since the first call are ignored */
+	if (rv == MSC_INSUFFICIENT_BUFFER)
+	{
+		tokenCount = i;
+		rv = MSC_SUCCESS;
+	}
+
+	if (rv != MSC_SUCCESS)
+	{
+		free(tokenList);
+		return rv;
+	}
+
+	queue = calloc(1, sizeof(*queue));
+	if (queue)
+		queue->workers = calloc(tokenCount, sizeof(CQWorker));
+	if (pinCodeSize && queue)
+		queue->pinCode = malloc(pinCodeSize);
+	if ((queue == NULL) || (queue->workers == NULL)
+		|| (pinCodeSize && (queue->pinCode == NULL)))
+	{
+		if (queue)
+		{
+			free(queue->workers);
+			free(queue);
+		}
+		free(tokenList);
+		return MSC_INTERNAL_ERROR;
+	}
+
+	queue->keyNum = keyNum;
+	queue->pinNum = pinNum;
+	if (pinCodeSize)
+		memcpy(queue->pinCode, pPinCode, pinCodeSize);
+	queue->pinCodeSize = pinCodeSize;
+	(void)SYS_MutexInit(&queue->mutex);
+	(void)pthread_cond_init(&queue->cond, NULL);
+	(void)pthread_cond_init(&queue->done, NULL);
+
+	/* keep the tokens holding the key */
+	rv = MSC_TOKEN_REMOVED;
+	for (i = 0; i < tokenCount; i++)
+	{
+		CQWorker *worker = &queue->workers[queue->workerCount];
+		MSC_RV ret;
+
+		if (tokenList[i].tokenType & MSC_TOKEN_TYPE_REMOVED)
+			continue;
+
+		worker->queue = queue;
+		worker->tokenInfo = tokenList[i];
+		strlcpy(worker->stats.slotName, tokenList[i].slotName,
+			sizeof(worker->stats.slotName));
+
+		ret = CQConnect(worker);
+		if (ret == MSC_SUCCESS)
+		{
+			queue->workerCount++;
+			continue;
+		}
+
+		/* a token without the key is expected, not the other errors */
+		Log3((ret == MSC_OBJECT_NOT_FOUND) ? PCSC_LOG_DEBUG : PCSC_LOG_ERROR,
+			"Token in %s not used: %s", worker->stats.slotName,
+			msc_error(ret));
+
+		memset(worker, 0, sizeof(*worker));
+		rv = ret;
+
+		/* the PIN is wrong, do not block the other tokens */
+		if ((ret == MSC_AUTH_FAILED) || (ret == MSC_IDENTITY_BLOCKED))
+			break;
+	}
+
+	free(tokenList);
+
+	if ((i < tokenCount) || (queue->workerCount == 0))
+	{
+		(void)MSCDestroyCryptQueue(queue);
+		return rv;
+	}
+
+	for (i = 0; i < queue->workerCount; i++)
+	{
+		CQWorker *worker = &queue->workers[i];
+
+		if (SYS_ThreadCreate(&worker->thread, THREAD_ATTR_DEFAULT, CQRun,
+				worker) != 0)
+		{
+			(void)MSCDestroyCryptQueue(queue);
+			return MSC_INTERNAL_ERROR;
+		}
+		worker->running = 1;
+	}
+
+#ifndef NO_MSC_DEBUG
+	Log2(PCSC_LOG_DEBUG, "Crypt queue with %ld tokens", queue->workerCount);
+#endif
+
+	*pQueue = queue;
+
+	return MSC_SUCCESS;
+}
+
+MSC_RV MSCSubmitCryptJob(MSCLPCryptQueue queue, MSCLPCryptJob job,
+	LPCryptJobCallback callback, MSCPVoid32 addParams)
+{
+	QueuedJob *queuedJob;
+
+	if ((queue == NULL) || (job == NULL) || (callback == NULL))
+		return MSC_INVALID_PARAMETER;
+	if (job->cryptInit.keyNum != queue->keyNum)
+		return MSC_INVALID_PARAMETER;
+
+	queuedJob = calloc(1, sizeof(*queuedJob));
+	if (queuedJob == NULL)
+		return MSC_INTERNAL_ERROR;
+
+	queuedJob->job = job;
+	queuedJob->callback = callback;
+	queuedJob->addParams = addParams;
+
+	(void)SYS_MutexLock(&queue->mutex);
+
+	if (!CQQueueJob(queue, queuedJob, NULL))
+	{
+		(void)SYS_MutexUnLock(&queue->mutex);
+		free(queuedJob);
+		return MSC_TOKEN_REMOVED;
+	}
+	queue->pending++;
+
+	(void)SYS_MutexUnLock(&queue->mutex);
+
+	return MSC_SUCCESS;
+}
+
+MSC_RV MSCWaitCryptQueue(MSCLPCryptQueue queue)
+{
+	if (queue == NULL)
+		return MSC_INVALID_PARAMETER;
+
+	/* the job of the callback is pending: it would wait for itself */
+	if (CQInCallback(queue))
+		return MSC_OPERATION_NOT_ALLOWED;
+
+	(void)SYS_MutexLock(&queue->mutex);
+	while (queue->pending)
+		(void)pthread_cond_wait(&queue->done, &queue->mutex);
+	(void)SYS_MutexUnLock(&queue->mutex);
+
+	return MSC_SUCCESS;
+}
+
+MSC_RV MSCGetCryptQueueStats(MSCLPCryptQueue queue,
+	MSCLPCryptQueueStats pStats, MSCPULong32 statsLength)
+{
+	MSCULong32 i;
+
+	if ((queue == NULL) || (statsLength == NULL))
+		return MSC_INVALID_PARAMETER;
+
+	if (pStats == NULL)
+	{
+		*statsLength = queue->workerCount;
+		return MSC_SUCCESS;
+	}
+
+	if (*statsLength < queue->workerCount)
+	{
+		*statsLength = queue->workerCount;
+		return MSC_INSUFFICIENT_BUFFER;
+	}
+
+	(void)SYS_MutexLock(&queue->mutex);
+	for (i = 0; i < queue->workerCount; i++)
+		pStats[i] = queue->workers[i].stats;
+	(void)SYS_MutexUnLock(&queue->mutex);
+
+	*statsLength = queue->workerCount;
+
+	return MSC_SUCCESS;
+}
+
+MSC_RV MSCDestroyCryptQueue(MSCLPCryptQueue queue)
+{
+	MSCULong32 i;
+
+	if (queue == NULL)
+		return MSC_INVALID_PARAMETER;
+
+	/* the worker calling the callback would join itself */
+	if (CQInCallback(queue))
+		return MSC_OPERATION_NOT_ALLOWED;
+
+	(void)MSCWaitCryptQueue(queue);
+
+	(void)SYS_MutexLock(&queue->mutex);
+	queue->stopping = 1;
+	(void)pthread_cond_broadcast(&queue->cond);
+	(void)SYS_MutexUnLock(&queue->mutex);
+
+	for (i = 0; i < queue->workerCount; i++)
+	{
+		CQWorker *worker = &queue->workers[i];
+
+		if (worker->running)
+			(void)SYS_ThreadJoin(worker->thread, NULL);
+		CQDisconnect(worker);
+	}
+
+	if (queue->pinCode)
+	{
+		mscWipe(queue->pinCode, queue->pinCodeSize);
+		free(queue->pinCode);
+	}
+	(void)pthread_cond_destroy(&queue->done);
+	(void)pthread_cond_destroy(&queue->cond);
+	(void)SYS_MutexDestroy(&queue->mutex);
+	free(queue->workers);
+	free(queue);
+
+	return MSC_SUCCESS;
+}
+
+/*
+ * Connects to the token, verifies the PIN and checks the key
+ */
+static MSC_RV CQConnect(CQWorker *worker)
+{
+	struct MSCCryptQueue *queue = worker->queue;
+	MSCKeyInfo keyInfo;
+	MSC_RV rv;
+
+	rv = MSCEstablishConnection(&worker->tokenInfo, MSC_SHARE_SHARED,
+		NULL, 0, &worker->connection);
+	if (rv != MSC_SUCCESS)
+		return rv;
+
+	worker->connected = 1;
+
+	if (queue->pinCodeSize)
+	{
+		rv = MSCVerifyPIN(&worker->connection, queue->pinNum,
+			queue->pinCode, queue->pinCodeSize);
+		if (rv != MSC_SUCCESS)
+		{
+			CQDisconnect(worker);
+			return rv;
+		}
+	}
+
+	rv = MSCGetKeyAttributes(&worker->connection, queue->keyNum, &keyInfo);
+	if (rv != MSC_SUCCESS)
+	{
+		CQDisconnect(worker);
+		return rv;
+	}
+
+	return MSC_SUCCESS;
+}
+
+static void CQDisconnect(CQWorker *worker)
+{
+	if (!worker->connected)
+		return;
+
+	(void)MSCReleaseConnection(&worker->connection, SCARD_LEAVE_CARD);
+	worker->connected = 0;
+}
+
+static void *CQRun(void *arg)
+{
+	CQWorker *worker = arg;
+	struct MSCCryptQueue *queue = worker->queue;
+	QueuedJob *queuedJob;
+	MSCLPCryptJob job;
+	MSCULong32 outputSize;
+	struct timeval start, end;
+	MSC_RV rv;
+
+	(void)SYS_MutexLock(&queue->mutex);
+
+	while (!queue->stopping
+		&& (worker->stats.tokenState != MSC_QUEUE_TOKEN_REMOVED))
+	{
+		if (worker->stats.tokenState == MSC_QUEUE_TOKEN_SUSPENDED)
+		{
+			struct timespec timeout;
+
+			(void)gettimeofday(&start, NULL);
+			if (timercmp(&start, &worker->resume, <))
+			{
+				timeout.tv_sec = worker->resume.tv_sec;
+				timeout.tv_nsec = worker->resume.tv_usec * 1000;
+				(void)pthread_cond_timedwait(&queue->cond, &queue->mutex,
+					&timeout);
+				continue;
+			}
+
+			(void)SYS_MutexUnLock(&queue->mutex);
+			CQDisconnect(worker);
+			rv = CQConnect(worker);
+			(void)SYS_MutexLock(&queue->mutex);
+
+			worker->stats.reconnects++;
+			if (rv == MSC_SUCCESS)
+				worker->stats.tokenState = MSC_QUEUE_TOKEN_READY;
+			else
+				CQTokenFailed(worker, rv);
+			continue;
+		}
+
+		queuedJob = CQTakeJob(worker);
+		if (queuedJob == NULL)
+		{
+			(void)pthread_cond_wait(&queue->cond, &queue->mutex);
+			continue;
+		}
+
+		(void)SYS_MutexUnLock(&queue->mutex);
+
+		job = queuedJob->job;
+		outputSize = job->outputDataSize;
+
+		(void)gettimeofday(&start, NULL);
+		rv = MSCComputeCrypt(&worker->connection, &job->cryptInit,
+			job->pInputData, job->inputDataSize, job->pOutputData,
+			&job->outputDataSize);
+		(void)gettimeofday(&end, NULL);
+
+		(void)SYS_MutexLock(&queue->mutex);
+
+		worker->stats.busyTime += (end.tv_sec - start.tv_sec) * 1000
+			+ (end.tv_usec - start.tv_usec) / 1000;
+
+		if (CQTokenError(rv))
+		{
+			worker->stats.jobsFailed++;
+			CQTokenFailed(worker, rv);
+
+			job->outputDataSize = outputSize;
+			if ((++queuedJob->attempts < CQ_MAX_ATTEMPTS)
+				&& CQQueueJob(queue, queuedJob, worker))
+				continue;
+		}
+		else
+		{
+			worker->failures = 0;
+			worker->stats.jobsDone++;
+		}
+
+		CQComplete(queue, queuedJob, rv);
+	}
+
+	/* removed token or queue destroyed */
+	CQMoveJobs(worker);
+
+	(void)SYS_MutexUnLock(&queue->mutex);
+
+	return NULL;
+}
+
+/*
+ * Gives the next job of the worker or the last one of the longest list
+ * of the others. The queue mutex is locked by the caller.
+ */
+static QueuedJob *CQTakeJob(CQWorker *worker)
+{
+	struct MSCCryptQueue *queue = worker->queue;
+	CQWorker *victim = worker;
+	QueuedJob *queuedJob;
+	MSCULong32 i;
+
+	if (worker->head)
+	{
+		queuedJob = worker->head;
+		worker->head = queuedJob->next;
+		if (worker->head)
+			worker->head->prev = NULL;
+		else
+			worker->tail = NULL;
+	}
+	else
+	{
+		for (i = 0; i < queue->workerCount; i++)
+			if (queue->workers[i].stats.jobsQueued
+				> victim->stats.jobsQueued)
+				victim = &queue->workers[i];
+
+		if (victim == worker)
+			return NULL;
+
+		queuedJob = victim->tail;
+		victim->tail = queuedJob->prev;
+		if (victim->tail)
+			victim->tail->next = NULL;
+		else
+			victim->head = NULL;
+
+		worker->stats.jobsStolen++;
+	}
+
+	victim->stats.jobsQueued--;
+	queuedJob->next = queuedJob->prev = NULL;
+
+	return queuedJob;
+}
+
+/*
+ * Adds the job to the ready token with the shortest list, or to a
+ * suspended token if none is ready. The worker excluded gave the job
+ * back. Returns 0 if all the tokens are removed. The queue mutex is
+ * locked by the caller.
+ */
+static int CQQueueJob(struct MSCCryptQueue *queue, QueuedJob *queuedJob,
+	CQWorker *excluded)
+{
+	CQWorker *best = NULL;
+	MSCULong32 i;
+
+	for (i = 0; i < queue->workerCount; i++)
+	{
+		CQWorker *worker = &queue->workers[i];
+
+		if ((worker == excluded)
+			|| (worker->stats.tokenState == MSC_QUEUE_TOKEN_REMOVED))
+			continue;
+
+		if ((best == NULL)
+			|| ((worker->stats.tokenState == MSC_QUEUE_TOKEN_READY)
+				&& (best->stats.tokenState != MSC_QUEUE_TOKEN_READY))
+			|| ((worker->stats.tokenState == best->stats.tokenState)
+				&& (worker->stats.jobsQueued < best->stats.jobsQueued)))
+			best = worker;
+	}
+
+	/* the job is retried on the same token if it is the last one */
+	if ((best == NULL) && excluded
+		&& (excluded->stats.tokenState != MSC_QUEUE_TOKEN_REMOVED))
+		best = excluded;
+
+	if (best == NULL)
+		return 0;
+
+	queuedJob->next = NULL;
+	queuedJob->prev = best->tail;
+	if (best->tail)
+		best->tail->next = queuedJob;
+	else
+		best->head = queuedJob;
+	best->tail = queuedJob;
+	best->stats.jobsQueued++;
+
+	(void)pthread_cond_broadcast(&queue->cond);
+
+	return 1;
+}
+
+/*
+ * Gives the waiting jobs of the worker to the other tokens. The jobs
+ * are completed with an error if no other token is usable. The queue
+ * mutex is locked by the caller.
+ */
+static void CQMoveJobs(CQWorker *worker)
+{
+	struct MSCCryptQueue *queue = worker->queue;
+	QueuedJob *queuedJob, *next;
+
+	queuedJob = worker->head;
+	worker->head = worker->tail = NULL;
+	worker->stats.jobsQueued = 0;
+
+	while (queuedJob)
+	{
+		next = queuedJob->next;
+		if (!CQQueueJob(queue, queuedJob, worker))
+			CQComplete(queue, queuedJob, MSC_TOKEN_REMOVED);
+		queuedJob = next;
+	}
+}
+
+/*
+ * Suspends or removes the token. The queue mutex is locked by the
+ * caller.
+ */
+static void CQTokenFailed(CQWorker *worker, MSC_RV rv)
+{
+	long delay = 0;
+	int i;
+
+	Log3(PCSC_LOG_ERROR, "Token in %s failed: %s", worker->stats.slotName,
+		msc_error(rv));
+
+	/* MSC_OBJECT_NOT_FOUND and MSC_UNRECOGNIZED_TOKEN come from
+	 * CQConnect(): another token was inserted in the reader */
+	if ((rv == MSC_TOKEN_REMOVED) || (rv == MSC_INCONSISTENT_STATUS)
+		|| (rv == MSC_UNRECOGNIZED_TOKEN) || (rv == MSC_OBJECT_NOT_FOUND)
+		|| (rv == MSC_AUTH_FAILED) || (rv == MSC_IDENTITY_BLOCKED))
+	{
+		worker->stats.tokenState = MSC_QUEUE_TOKEN_REMOVED;
+		CQMoveJobs(worker);
+		return;
+	}
+
+	/* 0, then 1 s, 2 s, 4 s, ... */
+	for (i = 0; i < worker->failures; i++)
+	{
+		delay = delay ? delay * 2 : 1000;
+		if (delay >= CQ_SUSPEND_MAX)
+		{
+			delay = CQ_SUSPEND_MAX;
+			break;
+		}
+	}
+	worker->failures++;
+
+	(void)gettimeofday(&worker->resume, NULL);
+	worker->resume.tv_sec += delay / 1000;
+	worker->resume.tv_usec += (delay % 1000) * 1000;
+	if (worker->resume.tv_usec >= 1000000)
+	{
+		worker->resume.tv_sec++;
+		worker->resume.tv_usec -= 1000000;
+	}
+
+	worker->stats.tokenState = MSC_QUEUE_TOKEN_SUSPENDED;
+	CQMoveJobs(worker);
+}
+
+/*
+ * Calls the callback of the job. The queue mutex is locked by the
+ * caller and unlocked during the callback.
+ */
+static void CQComplete(struct MSCCryptQueue *queue, QueuedJob *queuedJob,
+	MSC_RV rv)
+{
+	queuedJob->job->rv = rv;
+
+	(void)SYS_MutexUnLock(&queue->mutex);
+	(*queuedJob->callback) (queuedJob->job, queuedJob->addParams);
+	free(queuedJob);
+	(void)SYS_MutexLock(&queue->mutex);
+
+	queue->pending--;
+	if (queue->pending == 0)
+		(void)pthread_cond_broadcast(&queue->done);
+}
+
+/*
+ * Errors of the token or of the reader, not of the job
+ */
+static int CQTokenError(MSC_RV rv)
+{
+	switch (rv)
+	{
+		case MSC_TOKEN_REMOVED:
+		case MSC_TOKEN_RESET:
+		case MSC_TOKEN_UNRESPONSIVE:
+		case MSC_TRANSPORT_ERROR:
+		case MSC_SERVICE_UNRESPONSIVE:
+		case MSC_TIMEOUT_OCCURRED:
+		case MSC_INVALID_HANDLE:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/*
+ * The callbacks are called by the workers
+ */
+static int CQInCallback(struct MSCCryptQueue *queue)
+{
+	PCSCLITE_THREAD_T self = SYS_ThreadSelf();
+	MSCULong32 i;
+
+	for (i = 0; i < queue->workerCount; i++)
+		if (queue->workers[i].running
+			&& SYS_ThreadEqual(&self, &queue->workers[i].thread))
+			return 1;
+
+	return 0;
+}
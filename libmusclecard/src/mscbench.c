@@ -0,0 +1,672 @@
+/*
+ * This measures the performance of libmusclecard for muscletest.
+ *
+ * MUSCLE SmartCard Development ( http://www.linuxnet.com )
+ *
+ * Copyright (C) 2009
+ *  Ludovic Rousseau <ludovic.rousseau@free.fr>
+ *
+ * $Id$
+ */
+
+/*
+ * Usage: muscletest -b [-s] [-n tokens] [-i iterations] [-z sizes]
+ *	[-p PIN] [-k keyNum] [-g keygens] [-d delay]
+ *
+ * One thread per token runs the same steps: PIN verification, write
+ * and read of an object of each size, key generation and ComputeCrypt.
+ * All the threads start a step at the same time so the result of "all"
+ * is the throughput of the tokens used in parallel.
+ *
+ * The tokens known by pcscd are used. Without them, or with -s,
+ * simulated tokens are used instead (see simtoken.c) so the time used
+ * by libmusclecard itself can be followed from one version to the
+ * next. -s and -d need configure --enable-simulated-tokens.
+ *
+ * The key generation overwrites the keys keyNum and keyNum + 1: on a
+ * real token it is only done with -k.
+ *
+ * The results are written on stdout, one JSON object per line:
+ *	{"op":"read_object","size":1024,"token":"all","count":100,"errors":0,
+ *	 "ops_per_sec":..., "min_us":..., "p50_us":..., "p90_us":...,
+ *	 "p99_us":..., "max_us":...}
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "winscard.h"
+#include "musclecard.h"
+#include "mscbench.h"
+#ifdef MSC_SIMULATED_TOKENS
+#include "simtoken.h"
+#include "mscsimulated.h"
+#endif
+
+#define BM_MAX_SIZES	16
+#define BM_MAX_PHASES	(2 * BM_MAX_SIZES + 3)
+#define BM_MAX_PINSIZE	16
+#define BM_CRYPT_SIZE	128		/* RSA 1024 */
+
+enum
+{
+	BM_PIN,
+	BM_WRITE,
+	BM_READ,
+	BM_KEYGEN,
+	BM_CRYPT
+};
+
+static const char *OpsText[] = {
+	"verify_pin", "write_object", "read_object", "generate_keys",
+	"compute_crypt"
+};
+
+typedef struct
+{
+	int op;
+	MSCULong32 size;	/* of the object, 0 if none */
+	int count;
+	struct timeval start;
+	struct timeval end;
+}
+BenchPhase;
+
+typedef struct
+{
+	MSCTokenInfo tokenInfo;
+	MSCTokenConnection connection;
+	long *latency[BM_MAX_PHASES];	/* us of the successful calls */
+	int done[BM_MAX_PHASES];
+	int errors[BM_MAX_PHASES];
+	MSC_RV lastError[BM_MAX_PHASES];
+}
+BenchToken;
+
+static struct
+{
+	BenchPhase phases[BM_MAX_PHASES];
+	int phaseCount;
+	BenchToken *tokens;
+	int tokenCount;
+	MSCUChar8 pin[BM_MAX_PINSIZE];
+	MSCULong32 pinSize;
+	int keyNum;
+	MSCULong32 bufferSize;	/* of each thread, the largest object */
+
+	/* all the threads start and stop each phase together */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int waiting;
+	unsigned int generation;
+}
+Bench;
+
+static long BMElapsed(struct timeval *start, struct timeval *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000
+		+ (end->tv_usec - start->tv_usec);
+}
+
+/*
+ * The last thread arriving writes the time in *when and releases the
+ * others
+ */
+static void BMBarrier(struct timeval *when)
+{
+	unsigned int generation;
+
+	pthread_mutex_lock(&Bench.mutex);
+
+	generation = Bench.generation;
+	if (++Bench.waiting == Bench.tokenCount)
+	{
+		gettimeofday(when, NULL);
+		Bench.waiting = 0;
+		Bench.generation++;
+		pthread_cond_broadcast(&Bench.cond);
+	}
+	else
+		while (generation == Bench.generation)
+			pthread_cond_wait(&Bench.cond, &Bench.mutex);
+
+	pthread_mutex_unlock(&Bench.mutex);
+}
+
+static void BMObjectID(MSCChar8 *objectID, MSCULong32 size)
+{
+	snprintf(objectID, MSC_MAXSIZE_OBJID, "bm%lu", size);
+}
+
+static MSC_RV BMRun(BenchToken *token, BenchPhase *phase,
+	MSCPUChar8 buffer)
+{
+	MSCLPTokenConnection pConnection = &token->connection;
+	MSCChar8 objectID[MSC_MAXSIZE_OBJID];
+	MSCGenKeyParams keyParams;
+	MSCCryptInit cryptInit;
+	MSCUChar8 output[BM_CRYPT_SIZE];
+	MSCULong32 outputSize;
+
+	switch (phase->op)
+	{
+		case BM_PIN:
+			return MSCVerifyPIN(pConnection, 0, Bench.pin, Bench.pinSize);
+
+		case BM_WRITE:
+			BMObjectID(objectID, phase->size);
+			return MSCWriteObject(pConnection, objectID, 0, buffer,
+				phase->size, NULL, NULL);
+
+		case BM_READ:
+			BMObjectID(objectID, phase->size);
+			return MSCReadObject(pConnection, objectID, 0, buffer,
+				phase->size, NULL, NULL);
+
+		case BM_KEYGEN:
+			memset(&keyParams, 0, sizeof(keyParams));
+			keyParams.algoType = MSC_GEN_ALG_RSA_CRT;
+			keyParams.keySize = BM_CRYPT_SIZE * 8;
+			keyParams.privateKeyACL.readPermission = MSC_AUT_NONE;
+			keyParams.privateKeyACL.writePermission = MSC_AUT_PIN_0;
+			keyParams.privateKeyACL.usePermission = MSC_AUT_PIN_0;
+			keyParams.publicKeyACL.readPermission = MSC_AUT_ALL;
+			keyParams.publicKeyACL.writePermission = MSC_AUT_PIN_0;
+			keyParams.publicKeyACL.usePermission = MSC_AUT_ALL;
+			keyParams.keyGenOptions = MSC_OPT_DEFAULT;
+			return MSCGenerateKeys(pConnection, Bench.keyNum,
+				Bench.keyNum + 1, &keyParams);
+
+		case BM_CRYPT:
+			/* smaller than the modulus */
+			buffer[0] = 0;
+			cryptInit.keyNum = Bench.keyNum;
+			cryptInit.cipherMode = MSC_MODE_RSA_NOPAD;
+			cryptInit.cipherDirection = MSC_DIR_DECRYPT;
+			cryptInit.optParams = NULL;
+			cryptInit.optParamsSize = 0;
+			outputSize = sizeof(output);
+			return MSCComputeCrypt(pConnection, &cryptInit, buffer,
+				BM_CRYPT_SIZE, output, &outputSize);
+	}
+
+	return MSC_INVALID_PARAMETER;
+}
+
+static void *BMWorker(void *arg)
+{
+	BenchToken *token = arg;
+	struct timeval before, after;
+	MSCUChar8 *buffer;
+	MSC_RV rv;
+	int p, i;
+
+	buffer = malloc(Bench.bufferSize);
+
+	for (p = 0; p < Bench.phaseCount; p++)
+	{
+		BenchPhase *phase = &Bench.phases[p];
+
+		BMBarrier(&phase->start);
+
+		for (i = 0; (i < phase->count) && buffer; i++)
+		{
+			gettimeofday(&before, NULL);
+			rv = BMRun(token, phase, buffer);
+			gettimeofday(&after, NULL);
+
+			if (rv == MSC_SUCCESS)
+				token->latency[p][token->done[p]++] =
+					BMElapsed(&before, &after);
+			else
+			{
+				token->errors[p]++;
+				token->lastError[p] = rv;
+			}
+		}
+
+		BMBarrier(&phase->end);
+	}
+
+	free(buffer);
+
+	return NULL;
+}
+
+static int BMCompare(const void *a, const void *b)
+{
+	long la = *(const long *)a, lb = *(const long *)b;
+
+	return (la > lb) - (la < lb);
+}
+
+/* nearest rank of the sorted latencies */
+static long BMPercentile(long *latency, int count, int percent)
+{
+	int rank = (count * percent + 99) / 100;
+
+	return latency[rank > 0 ? rank - 1 : 0];
+}
+
+static void BMPrintString(const char *string)
+{
+	putchar('"');
+	for (; *string; string++)
+	{
+		if ((*string == '"') || (*string == '\\'))
+			printf("\\%c", *string);
+		else if ((unsigned char)*string < ' ')
+			printf("\\u%04x", *string);
+		else
+			putchar(*string);
+	}
+	putchar('"');
+}
+
+static void BMPrintResult(BenchPhase *phase, const char *tokenName,
+	long *latency, int count, int errors, long elapsed)
+{
+	qsort(latency, count, sizeof(long), BMCompare);
+
+	printf("{\"op\":\"%s\",\"size\":%lu,\"token\":", OpsText[phase->op],
+		phase->size);
+	BMPrintString(tokenName);
+	printf(",\"count\":%d,\"errors\":%d,\"ops_per_sec\":%.1f", count,
+		errors, elapsed > 0 ? count * 1000000. / elapsed : 0.);
+	if (count)
+		printf(",\"min_us\":%ld,\"p50_us\":%ld,\"p90_us\":%ld,"
+			"\"p99_us\":%ld,\"max_us\":%ld", latency[0],
+			BMPercentile(latency, count, 50),
+			BMPercentile(latency, count, 90),
+			BMPercentile(latency, count, 99), latency[count - 1]);
+	printf("}\n");
+}
+
+static void BMReport(void)
+{
+	long *all;
+	int p, t, i, maxCount = 0;
+
+	for (p = 0; p < Bench.phaseCount; p++)
+		if (Bench.phases[p].count > maxCount)
+			maxCount = Bench.phases[p].count;
+
+	all = malloc(sizeof(long) * Bench.tokenCount * (maxCount + 1));
+
+	for (p = 0; p < Bench.phaseCount; p++)
+	{
+		BenchPhase *phase = &Bench.phases[p];
+		int count = 0, errors = 0;
+
+		if (phase->count == 0)
+			continue;
+
+		for (t = 0; t < Bench.tokenCount; t++)
+		{
+			BenchToken *token = &Bench.tokens[t];
+			long busy = 0;
+
+			for (i = 0; i < token->done[p]; i++)
+			{
+				busy += token->latency[p][i];
+				if (all)
+					all[count++] = token->latency[p][i];
+			}
+			errors += token->errors[p];
+
+			if (token->errors[p])
+				fprintf(stderr, "%s: %s: %s\n", token->tokenInfo.slotName,
+					OpsText[phase->op], msc_error(token->lastError[p]));
+
+			if (Bench.tokenCount > 1)
+				BMPrintResult(phase, token->tokenInfo.slotName,
+					token->latency[p], token->done[p], token->errors[p],
+					busy);
+		}
+
+		if (all)
+			BMPrintResult(phase, "all", all, count, errors,
+				BMElapsed(&phase->start, &phase->end));
+	}
+
+	free(all);
+}
+
+static void BMAddPhase(int op, MSCULong32 size, int count)
+{
+	BenchPhase *phase = &Bench.phases[Bench.phaseCount++];
+
+	phase->op = op;
+	phase->size = size;
+	phase->count = count;
+
+	if (size > Bench.bufferSize)
+		Bench.bufferSize = size;
+}
+
+/*
+ * The tokens known by pcscd, at most maxTokens if not 0
+ */
+static int BMListTokens(int maxTokens)
+{
+	MSCLPTokenInfo tokenList;
+	MSCULong32 tokenSize = 0, i;
+
+	if ((MSCListTokens(MSC_LIST_KNOWN, NULL, &tokenSize) != MSC_SUCCESS)
+		|| (tokenSize == 0))
+		return 0;
+
+	tokenList = malloc(sizeof(MSCTokenInfo) * tokenSize);
+	if (tokenList == NULL)
+		return 0;
+
+	if (MSCListTokens(MSC_LIST_KNOWN, tokenList, &tokenSize) != MSC_SUCCESS)
+		tokenSize = 0;
+
+	if (maxTokens && (tokenSize > (MSCULong32)maxTokens))
+		tokenSize = maxTokens;
+
+	Bench.tokens = calloc(tokenSize, sizeof(BenchToken));
+	if (Bench.tokens == NULL)
+		tokenSize = 0;
+
+	for (i = 0; i < tokenSize; i++)
+		Bench.tokens[i].tokenInfo = tokenList[i];
+
+	free(tokenList);
+
+	return tokenSize;
+}
+
+#ifdef MSC_SIMULATED_TOKENS
+static int BMSimulateTokens(int count, MSCULong32 delay)
+{
+	MSC_RV rv;
+	int i;
+
+	Bench.tokens = calloc(count, sizeof(BenchToken));
+	if (Bench.tokens == NULL)
+	{
+		fprintf(stderr, "Not enough memory\n");
+		return 0;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		rv = STCreateToken(&Bench.tokens[i].tokenInfo, i, Bench.pin,
+			Bench.pinSize, delay);
+		if (rv != MSC_SUCCESS)
+		{
+			fprintf(stderr, "Simulated token %d: %s\n", i, msc_error(rv));
+			break;
+		}
+	}
+
+	return i;
+}
+#endif
+
+static void BMUsage(void)
+{
+	fprintf(stderr, "Usage: muscletest -b [options]\n"
+#ifdef MSC_SIMULATED_TOKENS
+		"  -s             use simulated tokens\n"
+#endif
+		"  -n tokens      number of tokens (all the tokens found, "
+		"or 1 simulated)\n"
+		"  -i iterations  calls of each step (default 100)\n"
+		"  -z sizes       object sizes (default 16,256,1024,4096)\n"
+		"  -p PIN         PIN 0 (default Muscle00)\n"
+		"  -k keyNum      keys keyNum and keyNum + 1 are generated\n"
+		"  -g keygens     key generations (default 3)\n"
+#ifdef MSC_SIMULATED_TOKENS
+		"  -d delay       us used by a simulated command (default 0)\n"
+#endif
+		);
+}
+
+int BMBenchmark(int argc, char **argv)
+{
+	MSCUChar8 AID[] = { 0xA0, 0x00, 0x00, 0x00, 0x01, 0x01 };
+#ifdef MSC_SIMULATED_TOKENS
+	CFDyLibPointers simFunctions;
+#endif
+	MSCULong32 sizes[BM_MAX_SIZES];
+	int sizeCount = 0;
+	char *sizeList = "16,256,1024,4096";
+	const char *pin = "Muscle00";
+	int simulated = 0, maxTokens = 0, iterations = 100, keygens = 3;
+	int keyNum = -1;
+	MSCULong32 delay = 0;
+	pthread_t *threads;
+	MSCObjectACL objACL;
+	MSCChar8 objectID[MSC_MAXSIZE_OBJID];
+	MSC_RV rv;
+	int opt, i, t;
+
+	while ((opt = getopt(argc, argv, "sn:i:z:p:k:g:d:")) != -1)
+	{
+		switch (opt)
+		{
+#ifdef MSC_SIMULATED_TOKENS
+			case 's':
+				simulated = 1;
+				break;
+			case 'd':
+				delay = atol(optarg);
+				break;
+#endif
+			case 'n':
+				maxTokens = atoi(optarg);
+				break;
+			case 'i':
+				iterations = atoi(optarg);
+				break;
+			case 'z':
+				sizeList = optarg;
+				break;
+			case 'p':
+				pin = optarg;
+				break;
+			case 'k':
+				keyNum = atoi(optarg);
+				break;
+			case 'g':
+				keygens = atoi(optarg);
+				break;
+			default:
+				BMUsage();
+				return -1;
+		}
+	}
+
+	while (*sizeList && (sizeCount < BM_MAX_SIZES))
+	{
+		char *end;
+
+		sizes[sizeCount] = strtoul(sizeList, &end, 10);
+		if ((end == sizeList) || (sizes[sizeCount] == 0))
+		{
+			BMUsage();
+			return -1;
+		}
+		sizeCount++;
+		sizeList = (*end == ',') ? end + 1 : end;
+	}
+
+	if ((iterations <= 0) || (keygens < 0) || (maxTokens < 0)
+		|| (keyNum >= MSC_MAX_KEYS - 1)
+		|| (strlen(pin) > BM_MAX_PINSIZE))
+	{
+		BMUsage();
+		return -1;
+	}
+
+	Bench.pinSize = strlen(pin);
+	memcpy(Bench.pin, pin, Bench.pinSize);
+
+	if (!simulated)
+	{
+		Bench.tokenCount = BMListTokens(maxTokens);
+		if (Bench.tokenCount == 0)
+		{
+#ifdef MSC_SIMULATED_TOKENS
+			fprintf(stderr, "No token found, simulated tokens used\n");
+			simulated = 1;
+#else
+			fprintf(stderr, "No token found\n");
+			return -1;
+#endif
+		}
+	}
+
+#ifdef MSC_SIMULATED_TOKENS
+	if (simulated)
+	{
+		Bench.tokenCount = BMSimulateTokens(maxTokens ? maxTokens : 1,
+			delay);
+		if (Bench.tokenCount == 0)
+			return -1;
+		STGetFunctions(&simFunctions);
+
+		/* the simulated keys are free */
+		if (keyNum < 0)
+			keyNum = 0;
+	}
+#endif
+
+	Bench.keyNum = keyNum;
+
+	/* the PIN is verified first, the objects need it */
+	BMAddPhase(BM_PIN, 0, iterations);
+	for (i = 0; i < sizeCount; i++)
+	{
+		BMAddPhase(BM_WRITE, sizes[i], iterations);
+		BMAddPhase(BM_READ, sizes[i], iterations);
+	}
+	if (keyNum >= 0)
+	{
+		BMAddPhase(BM_KEYGEN, 0, keygens);
+		BMAddPhase(BM_CRYPT, 0, iterations);
+	}
+	if (Bench.bufferSize < BM_CRYPT_SIZE)
+		Bench.bufferSize = BM_CRYPT_SIZE;
+
+	objACL.readPermission = MSC_AUT_ALL;
+	objACL.writePermission = MSC_AUT_ALL;
+	objACL.deletePermission = MSC_AUT_ALL;
+
+	for (t = 0; t < Bench.tokenCount; t++)
+	{
+		BenchToken *token = &Bench.tokens[t];
+
+#ifdef MSC_SIMULATED_TOKENS
+		if (simulated)
+			rv = MSCEstablishSimulatedConnection(&token->tokenInfo,
+				&simFunctions, &token->connection);
+		else
+#endif
+			rv = MSCEstablishConnection(&token->tokenInfo,
+				MSC_SHARE_SHARED, AID, sizeof(AID), &token->connection);
+		if (rv != MSC_SUCCESS)
+		{
+			fprintf(stderr, "%s: %s\n", token->tokenInfo.slotName,
+				msc_error(rv));
+			return -1;
+		}
+
+		for (i = 0; i < Bench.phaseCount; i++)
+		{
+			token->latency[i] = malloc(sizeof(long)
+				* (Bench.phases[i].count + 1));
+			if (token->latency[i] == NULL)
+			{
+				fprintf(stderr, "Not enough memory\n");
+				return -1;
+			}
+		}
+
+		/* a wrong PIN would be tried by each iteration of the PIN step
+		 * and block PIN 0 of a real token */
+		rv = MSCVerifyPIN(&token->connection, 0, Bench.pin, Bench.pinSize);
+		if (rv != MSC_SUCCESS)
+		{
+			fprintf(stderr, "%s: VerifyPIN: %s\n",
+				token->tokenInfo.slotName, msc_error(rv));
+			return -1;
+		}
+
+		/* an object of each size, not measured */
+		for (i = 0; i < sizeCount; i++)
+		{
+			BMObjectID(objectID, sizes[i]);
+			(void)MSCDeleteObject(&token->connection, objectID,
+				MSC_ZF_DEFAULT);
+			rv = MSCCreateObject(&token->connection, objectID, sizes[i],
+				&objACL);
+			if (rv != MSC_SUCCESS)
+				fprintf(stderr, "%s: CreateObject %s: %s\n",
+					token->tokenInfo.slotName, objectID, msc_error(rv));
+		}
+	}
+
+	printf("{\"bench\":\"muscletest\",\"simulated\":%s,\"tokens\":%d,"
+		"\"iterations\":%d,\"delay_us\":%lu}\n", simulated ? "true" : "false",
+		Bench.tokenCount, iterations, simulated ? delay : 0);
+
+	pthread_mutex_init(&Bench.mutex, NULL);
+	pthread_cond_init(&Bench.cond, NULL);
+
+	threads = malloc(sizeof(pthread_t) * Bench.tokenCount);
+	if (threads == NULL)
+	{
+		fprintf(stderr, "Not enough memory\n");
+		return -1;
+	}
+
+	for (t = 0; t < Bench.tokenCount; t++)
+		if (pthread_create(&threads[t], NULL, BMWorker, &Bench.tokens[t]))
+		{
+			/* the barriers need all the threads */
+			fprintf(stderr, "Cannot create the threads\n");
+			exit(-1);
+		}
+
+	for (t = 0; t < Bench.tokenCount; t++)
+		pthread_join(threads[t], NULL);
+
+	BMReport();
+
+	for (t = 0; t < Bench.tokenCount; t++)
+	{
+		BenchToken *token = &Bench.tokens[t];
+
+		for (i = 0; i < sizeCount; i++)
+		{
+			BMObjectID(objectID, sizes[i]);
+			(void)MSCDeleteObject(&token->connection, objectID,
+				MSC_ZF_DEFAULT);
+		}
+		(void)MSCLogoutAll(&token->connection);
+		(void)MSCReleaseConnection(&token->connection, MSC_LEAVE_TOKEN);
+
+		for (i = 0; i < Bench.phaseCount; i++)
+			free(token->latency[i]);
+#ifdef MSC_SIMULATED_TOKENS
+		if (simulated)
+			STDestroyToken(&token->tokenInfo);
+#endif
+	}
+
+	pthread_mutex_destroy(&Bench.mutex);
+	pthread_cond_destroy(&Bench.cond);
+	free(threads);
+	free(Bench.tokens);
+
+	return 0;
+}
@@ -0,0 +1,26 @@
+/*
+ * This measures the performance of libmusclecard for muscletest.
+ *
+ * MUSCLE SmartCard Development ( http://www.linuxnet.com )
+ *
+ * Copyright (C) 2009
+ *  Ludovic Rousseau <ludovic.rousseau@free.fr>
+ *
+ * $Id$
+ */
+
+#ifndef __mscbench_h__
+#define __mscbench_h__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+	int BMBenchmark(int, char **);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif							/* __mscbench_h__ */
@@ -0,0 +1,47 @@
+/*
+ * This gives muscletest connections to tokens simulated in memory.
+ *
+ * MUSCLE SmartCard Development ( http://www.linuxnet.com )
+ *
+ * Copyright (C) 2009
+ *  Ludovic Rousseau <ludovic.rousseau@free.fr>
+ *
+ * $Id$
+ */
+
+#ifndef __mscsimulated_h__
+#define __mscsimulated_h__
+
+#include "musclecard.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#ifdef MSC_SIMULATED_TOKENS
+
+#define MSC_TOKEN_TYPE_SIMULATED 16	/* Token served by the application */
+
+	/*
+	 * Connection to a token without reader nor pcscd: the functions of
+	 * libPointers are used instead of a token library. For the tests
+	 * and the benchmarks, only built with configure
+	 * --enable-simulated-tokens. Released with MSCReleaseConnection().
+	 */
+	PCSC_API
+	MSC_RV MSCEstablishSimulatedConnection(MSCLPTokenInfo tokenStruct,
+		LPCFDyLibPointers libPointers, MSCLPTokenConnection pConnection);
+
+#else
+
+/* never set, the tests of this bit are removed by the compiler */
+#define MSC_TOKEN_TYPE_SIMULATED 0
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif							/* __mscsimulated_h__ */
@@ -14,13 +14,19 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/time.h>
 
 #include "misc.h"
 #include <winscard.h>
+#include <reader.h>
 #include "debug.h"
 
 #include "musclecard.h"
 #include "tokenfactory.h"
+#include "objectcache.h"
+#include "mscsimulated.h"
 #include "strlcpycat.h"
 
 #define USE_THREAD_SAFETY
@@ -34,18 +40,31 @@
 #ifdef USE_THREAD_SAFETY
 
 static PCSCLITE_MUTEX PCSC_MCARD_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-static PCSCLITE_THREAD_T callbackThread;
-static ULONG blockingContext = MSC_BLOCKSTATUS_RESUME;
 #endif	/* USE_THREAD_SAFETY */
 
 static SCARDCONTEXT localHContext = 0;
 
+/*
+ * pcscd accepts at most PCSCLITE_MAX_APPLICATION_CONTEXTS (16) contexts
+ * per process. The connections share MSC_MAX_CONNECTION_CONTEXTS of them
+ * and leave the others to localHContext, the event dispatcher and the
+ * application itself. A context is released with its last connection.
+ */
+#define MSC_MAX_CONNECTION_CONTEXTS 8
+
+static struct
+{
+	SCARDCONTEXT hContext;
+	int connections;
+}
+connectionContexts[MSC_MAX_CONNECTION_CONTEXTS];
+
 /*
  * internal function
  */
 MSC_RV pcscToMSC(MSCLong32);
 MSC_RV MSCReEstablishConnection(MSCLPTokenConnection);
+static MSCULong32 mscTokenChunkSize(MSCLPTokenConnection, MSCULong32);
 
 static void mscLockThread(void)
 {
@@ -61,6 +80,161 @@ static void mscUnLockThread(void)
 #endif
 }
 
+/*
+ * Each connection has its own lock so different tokens are used at the
+ * same time. The lock is recursive since some MSC functions call others
+ * on the same connection.
+ * The lock is only held during one MSC call. MSCBeginTransaction()
+ * releases it when it returns: the PC/SC transaction keeps the other
+ * applications away from the token, not the other threads using the
+ * same connection.
+ */
+static MSC_RV mscCreateConnectionLock(MSCLPTokenConnection pConnection)
+{
+#ifdef USE_THREAD_SAFETY
+	PCSCLITE_MUTEX_T mutex;
+	pthread_mutexattr_t attr;
+	int ret;
+
+	mutex = malloc(sizeof(PCSCLITE_MUTEX));
+	if (mutex == NULL)
+		return MSC_INTERNAL_ERROR;
+
+	(void)pthread_mutexattr_init(&attr);
+	(void)pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	ret = pthread_mutex_init(mutex, &attr);
+	(void)pthread_mutexattr_destroy(&attr);
+
+	if (ret != 0)
+	{
+		free(mutex);
+		return MSC_INTERNAL_ERROR;
+	}
+
+	pConnection->connectionLock = mutex;
+#endif
+	return MSC_SUCCESS;
+}
+
+static void mscFreeConnectionLock(MSCLPTokenConnection pConnection)
+{
+#ifdef USE_THREAD_SAFETY
+	if (pConnection->connectionLock)
+	{
+		(void)SYS_MutexDestroy(pConnection->connectionLock);
+		free(pConnection->connectionLock);
+	}
+#endif
+	pConnection->connectionLock = NULL;
+}
+
+static void mscLockConnection(MSCLPTokenConnection pConnection)
+{
+#ifdef USE_THREAD_SAFETY
+	if (pConnection->connectionLock)
+		(void)SYS_MutexLock(pConnection->connectionLock);
+#endif
+}
+
+static void mscUnLockConnection(MSCLPTokenConnection pConnection)
+{
+#ifdef USE_THREAD_SAFETY
+	if (pConnection->connectionLock)
+		(void)SYS_MutexUnLock(pConnection->connectionLock);
+#endif
+}
+
+/*
+ * Gives the connection the least used of the shared contexts.
+ * A new context is established while fewer than
+ * MSC_MAX_CONNECTION_CONTEXTS are in use. If pcscd refuses it, an
+ * existing one is shared.
+ */
+static MSCLong32 mscGetConnectionContext(MSCLPTokenConnection pConnection)
+{
+	MSCLong32 rv = SCARD_S_SUCCESS;
+	int i, unused = -1, least = -1;
+
+	mscLockThread();
+
+	for (i = 0; i < MSC_MAX_CONNECTION_CONTEXTS; i++)
+	{
+		if (connectionContexts[i].connections == 0)
+		{
+			if (unused < 0)
+				unused = i;
+		}
+		else
+			if ((least < 0) || (connectionContexts[i].connections
+				< connectionContexts[least].connections))
+				least = i;
+	}
+
+	/* a context per connection while possible */
+	if (unused >= 0)
+	{
+		rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, 0, 0,
+			&connectionContexts[unused].hContext);
+		if (rv == SCARD_S_SUCCESS)
+			least = unused;
+		else
+		{
+			connectionContexts[unused].hContext = 0;
+#ifndef NO_MSC_DEBUG
+			Log2(PCSC_LOG_DEBUG, "SCardEstablishContext returns %s",
+				pcsc_stringify_error(rv));
+#endif
+		}
+	}
+
+	if (least >= 0)
+	{
+		connectionContexts[least].connections++;
+		pConnection->hContext = connectionContexts[least].hContext;
+		rv = SCARD_S_SUCCESS;
+	}
+
+	mscUnLockThread();
+
+	return rv;
+}
+
+static void mscReleaseConnectionContext(MSCLPTokenConnection pConnection)
+{
+	int i;
+
+	mscLockThread();
+
+	for (i = 0; i < MSC_MAX_CONNECTION_CONTEXTS; i++)
+		if ((connectionContexts[i].connections > 0)
+			&& (connectionContexts[i].hContext == pConnection->hContext))
+		{
+			if (--connectionContexts[i].connections == 0)
+			{
+				(void)SCardReleaseContext(connectionContexts[i].hContext);
+				connectionContexts[i].hContext = 0;
+			}
+			break;
+		}
+
+	mscUnLockThread();
+
+	pConnection->hContext = 0;
+}
+
+/*
+ * The MSC functions need the PC/SC context of the library, except on a
+ * simulated token
+ */
+static int mscNoContext(MSCLPTokenConnection pConnection)
+{
+	if (localHContext != 0)
+		return 0;
+
+	return (pConnection == NULL)
+		|| !(pConnection->tokenInfo.tokenType & MSC_TOKEN_TYPE_SIMULATED);
+}
+
 /* Library constructor and deconstructor function for UNIX */
 #ifndef WIN32
 
@@ -80,6 +254,9 @@ static void DESTRUCTOR musclecard_fini(void)
 		SCardReleaseContext(localHContext);
 
 	localHContext = 0;
+
+	TPReleaseIndex();
+	TPReleasePlugins();
 }
 #endif
 
@@ -279,7 +456,7 @@ MSC_RV MSCListTokens(MSCULong32 listScope, MSCLPTokenInfo tokenArray,
 	return MSC_SUCCESS;
 }
 
-MSC_RV MSCEstablishConnection(MSCLPTokenInfo tokenStruct,
+static MSC_RV mscConnectToken(MSCLPTokenInfo tokenStruct,
 	MSCULong32 sharingMode,
 	MSCPUChar8 applicationName,
 	MSCULong32 nameSize, MSCLPTokenConnection pConnection)
@@ -310,8 +487,6 @@ MSC_RV MSCEstablishConnection(MSCLPTokenInfo tokenStruct,
 	vIdFunction = NULL;
 	vInitFunction = NULL;
 
-	if (pConnection == NULL)
-		return MSC_INVALID_PARAMETER;
 	if (tokenStruct == NULL)
 		return MSC_INVALID_PARAMETER;
 	if (nameSize > MSC_MAXSIZE_AID)
@@ -320,7 +495,13 @@ MSC_RV MSCEstablishConnection(MSCLPTokenInfo tokenStruct,
 	pConnection->tokenLibHandle = 0;
 	pConnection->hContext = 0;
 	pConnection->tokenInfo.tokenIdLength = 0;
+	/* a garbage MSC_TOKEN_TYPE_SIMULATED would skip PC/SC */
+	pConnection->tokenInfo.tokenType = 0;
 	pConnection->shareMode = 0;
+	pConnection->loggedIDs = 0;
+	pConnection->ioChunkSize = 0;
+	pConnection->cryptChunkSize = 0;
+	pConnection->objectCache = NULL;
 
 	/*
 	 * Check the token name strings
@@ -352,14 +533,22 @@ MSC_RV MSCEstablishConnection(MSCLPTokenInfo tokenStruct,
 			mscUnLockThread();
 			return pcscToMSC(rv);
 		}
-
-		pConnection->hContext = localHContext;
 	}
-	else
-		pConnection->hContext = localHContext;
 
 	mscUnLockThread();
 
+	/*
+	 * libpcsclite serializes the calls made with the same context so
+	 * the connections use several of them
+	 */
+	rv = mscGetConnectionContext(pConnection);
+	if (pcscToMSC(rv) != MSC_SUCCESS)
+		return pcscToMSC(rv);
+
+	rv = mscCreateConnectionLock(pConnection);
+	if (rv != MSC_SUCCESS)
+		return rv;
+
 #ifdef WIN32
 	rv = SCardConnect(pConnection->hContext, tokenStruct->slotName,
 		SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1,
@@ -542,6 +731,83 @@ MSC_RV MSCEstablishConnection(MSCLPTokenInfo tokenStruct,
 	return MSC_SUCCESS;
 }
 
+MSC_RV MSCEstablishConnection(MSCLPTokenInfo tokenStruct,
+	MSCULong32 sharingMode,
+	MSCPUChar8 applicationName,
+	MSCULong32 nameSize, MSCLPTokenConnection pConnection)
+{
+	MSC_RV rv;
+
+	if (pConnection == NULL)
+		return MSC_INVALID_PARAMETER;
+
+	/* mscConnectToken() may fail before it initializes them */
+	pConnection->connectionLock = NULL;
+	pConnection->hContext = 0;
+
+	rv = mscConnectToken(tokenStruct, sharingMode, applicationName,
+		nameSize, pConnection);
+
+	if (rv != MSC_SUCCESS)
+	{
+		if (pConnection->hContext != 0)
+			mscReleaseConnectionContext(pConnection);
+		mscFreeConnectionLock(pConnection);
+	}
+
+	return rv;
+}
+
+#ifdef MSC_SIMULATED_TOKENS
+MSC_RV MSCEstablishSimulatedConnection(MSCLPTokenInfo tokenStruct,
+	LPCFDyLibPointers libPointers, MSCLPTokenConnection pConnection)
+{
+	MSC_RV rv;
+
+	MSCLong32(*libPL_MSCInitializePlugin) (MSCLPTokenConnection);
+	MSCLong32(*libPL_MSCIdentifyToken) (MSCLPTokenConnection);
+
+	if ((tokenStruct == NULL) || (libPointers == NULL)
+		|| (pConnection == NULL))
+		return MSC_INVALID_PARAMETER;
+
+	if ((libPointers->pvfInitializePlugin == NULL)
+		|| (libPointers->pvfIdentifyToken == NULL)
+		|| (libPointers->pvfFinalizePlugin == NULL))
+		return MSC_UNSUPPORTED_FEATURE;
+
+	/* no reader, no token library: hCard, hContext and tokenLibHandle
+	 * stay at 0 */
+	memset(pConnection, 0, sizeof(MSCTokenConnection));
+	memcpy(&pConnection->tokenInfo, tokenStruct, sizeof(MSCTokenInfo));
+	pConnection->tokenInfo.tokenType =
+		MSC_TOKEN_TYPE_KNOWN | MSC_TOKEN_TYPE_SIMULATED;
+	pConnection->libPointers = *libPointers;
+	pConnection->shareMode = MSC_SHARE_SHARED;
+
+	rv = mscCreateConnectionLock(pConnection);
+	if (rv != MSC_SUCCESS)
+		return rv;
+
+	libPL_MSCInitializePlugin = (MSCLong32(*)(MSCLPTokenConnection))
+		libPointers->pvfInitializePlugin;
+	libPL_MSCIdentifyToken = (MSCLong32(*)(MSCLPTokenConnection))
+		libPointers->pvfIdentifyToken;
+
+	rv = (*libPL_MSCInitializePlugin) (pConnection);
+	if (rv == MSC_SUCCESS)
+		rv = (*libPL_MSCIdentifyToken) (pConnection);
+
+	if (rv != MSC_SUCCESS)
+	{
+		pConnection->tokenInfo.tokenType = 0;
+		mscFreeConnectionLock(pConnection);
+	}
+
+	return rv;
+}
+#endif
+
 MSC_RV MSCReleaseConnection(MSCLPTokenConnection pConnection,
 	MSCULong32 endAction)
 {
@@ -555,8 +821,9 @@ MSC_RV MSCReleaseConnection(MSCLPTokenConnection pConnection,
 	if (pConnection == NULL)
 		return MSC_INVALID_PARAMETER;
 
-	if (pConnection->tokenLibHandle == 0 ||
-		pConnection->hContext == 0 || pConnection->hCard == 0)
+	if (!(pConnection->tokenInfo.tokenType & MSC_TOKEN_TYPE_SIMULATED) &&
+		(pConnection->tokenLibHandle == 0 ||
+		pConnection->hContext == 0 || pConnection->hCard == 0))
 	{
 		return MSC_INVALID_HANDLE;
 	}
@@ -575,6 +842,10 @@ MSC_RV MSCReleaseConnection(MSCLPTokenConnection pConnection,
 
 	libPL_MSCFinalizePlugin = (MSCLong32(*)(MSCLPTokenConnection)) vFunction;
 
+	mscLockConnection(pConnection);
+
+	OCRelease(pConnection);
+
 	/*
 	 * Stop and clean up the plugin
 	 */
@@ -587,7 +858,10 @@ MSC_RV MSCReleaseConnection(MSCLPTokenConnection pConnection,
 	{
 		rv = SCardDisconnect(pConnection->hCard, endAction);
 		if (pcscToMSC(rv) != MSC_SUCCESS)
+		{
+			mscUnLockConnection(pConnection);
 			return pcscToMSC(rv);
+		}
 	}
 
 	/*
@@ -599,21 +873,76 @@ MSC_RV MSCReleaseConnection(MSCLPTokenConnection pConnection,
 		pConnection->tokenLibHandle = 0;
 	}
 
+	if (pConnection->hContext != 0)
+		mscReleaseConnectionContext(pConnection);
+
 	pConnection->tokenLibHandle = 0;
 	pConnection->hCard = 0;
 	pConnection->hContext = 0;
 	pConnection->shareMode = 0;
+	pConnection->tokenInfo.tokenType &= ~MSC_TOKEN_TYPE_SIMULATED;
+
+	mscUnLockConnection(pConnection);
+	mscFreeConnectionLock(pConnection);
 
 	return MSC_SUCCESS;
 }
 
+/*
+ * Updates a token with the new state of its reader
+ */
+static void mscUpdateToken(MSCLPTokenInfo token,
+	LPSCARD_READERSTATE_A readerState)
+{
+	MSCTokenInfo tokenInfo;
+	MSCLong32 rt;
+
+	token->tokenState = readerState->dwEventState;
+
+	if (!(token->tokenState & MSC_STATE_CHANGED))
+		return;
+
+	/*
+	 * If it is removed, we need to update the names/etc
+	 */
+	if (token->tokenState & MSC_STATE_EMPTY)
+	{
+		memset(token->tokenId, 0x00, MAX_ATR_SIZE);
+		token->tokenIdLength = 0;
+		token->tokenType = MSC_TOKEN_TYPE_REMOVED;
+		strlcpy(token->tokenName, MSC_TOKEN_EMPTY_STR, MSC_MAXSIZE_TOKENAME);
+	}
+	else if (token->tokenState & MSC_STATE_PRESENT)
+	{
+		memcpy(token->tokenId, readerState->rgbAtr, readerState->cbAtr);
+		token->tokenIdLength = readerState->cbAtr;
+
+		rt = TPSearchBundlesForAtr(readerState->rgbAtr, readerState->cbAtr,
+			&tokenInfo);
+		/*
+		 * Successfully found
+		 */
+		if (rt == 0)
+		{
+			token->tokenType = MSC_TOKEN_TYPE_KNOWN;
+			strlcpy(token->tokenName, tokenInfo.tokenName,
+				MSC_MAXSIZE_TOKENAME);
+		}
+		else
+		{
+			token->tokenType = MSC_TOKEN_TYPE_UNKNOWN;
+			strlcpy(token->tokenName, MSC_TOKEN_UNKNOWN_STR,
+				MSC_MAXSIZE_TOKENAME);
+		}
+	}
+}
+
 MSC_RV MSCWaitForTokenEvent(MSCLPTokenInfo tokenArray,
 	MSCULong32 arraySize, MSCULong32 timeoutValue)
 {
-	MSCLong32 rv, rt;
+	MSCLong32 rv;
 	LPSCARD_READERSTATE_A rgReaderStates;
-	MSCTokenInfo tokenInfo;
-	int i;
+	MSCULong32 i;
 
 	rgReaderStates = NULL;
 
@@ -668,13 +997,23 @@ MSC_RV MSCWaitForTokenEvent(MSCLPTokenInfo tokenArray,
 		rgReaderStates[i].dwEventState = 0;
 	}
 
-	rv = SCardGetStatusChange(localHContext, timeoutValue,
-		rgReaderStates, arraySize);
+	/*
+	 * The current state is needed only for the tokens without state
+	 */
+	for (i = 0; i < arraySize; i++)
+		if (tokenArray[i].tokenState == 0)
+			break;
 
-	if (rv != SCARD_S_SUCCESS)
+	if (i < arraySize)
 	{
-		free(rgReaderStates);
-		return pcscToMSC(rv);
+		rv = SCardGetStatusChange(localHContext, timeoutValue,
+			rgReaderStates, arraySize);
+
+		if (rv != SCARD_S_SUCCESS)
+		{
+			free(rgReaderStates);
+			return pcscToMSC(rv);
+		}
 	}
 
 	for (i = 0; i < arraySize; i++)
@@ -694,48 +1033,7 @@ MSC_RV MSCWaitForTokenEvent(MSCLPTokenInfo tokenArray,
 		rgReaderStates, arraySize);
 
 	for (i = 0; i < arraySize; i++)
-	{
-		tokenArray[i].tokenState = rgReaderStates[i].dwEventState;
-
-		if (tokenArray[i].tokenState & MSC_STATE_CHANGED)
-		{
-			/*
-			 * If it is removed, we need to update the names/etc
-			 */
-			if (tokenArray[i].tokenState & MSC_STATE_EMPTY)
-			{
-				memset(tokenArray[i].tokenId, 0x00, MAX_ATR_SIZE);
-				tokenArray[i].tokenIdLength = 0;
-				tokenArray[i].tokenType = MSC_TOKEN_TYPE_REMOVED;
-				strlcpy(tokenArray[i].tokenName, MSC_TOKEN_EMPTY_STR,
-					MSC_MAXSIZE_TOKENAME);
-			}
-			else if (tokenArray[i].tokenState & MSC_STATE_PRESENT)
-			{
-				memcpy(tokenArray[i].tokenId, rgReaderStates[i].rgbAtr,
-					rgReaderStates[i].cbAtr);
-				tokenArray[i].tokenIdLength = rgReaderStates[i].cbAtr;
-
-				rt = TPSearchBundlesForAtr(rgReaderStates[i].rgbAtr,
-					rgReaderStates[i].cbAtr, &tokenInfo);
-				/*
-				 * Successfully found
-				 */
-				if (rt == 0)
-				{
-					tokenArray[i].tokenType = MSC_TOKEN_TYPE_KNOWN;
-					strlcpy(tokenArray[i].tokenName, tokenInfo.tokenName,
-						MSC_MAXSIZE_TOKENAME);
-				}
-				else
-				{
-					tokenArray[i].tokenType = MSC_TOKEN_TYPE_UNKNOWN;
-					strlcpy(tokenArray[i].tokenName, MSC_TOKEN_UNKNOWN_STR,
-						MSC_MAXSIZE_TOKENAME);
-				}
-			}
-		}
-	}
+		mscUpdateToken(&tokenArray[i], &rgReaderStates[i]);
 
 	free(rgReaderStates);
 	return pcscToMSC(rv);
@@ -752,110 +1050,516 @@ MSC_RV MSCCancelEventWait(void)
 
 /************************ Start of Callbacks ****************************/
 #ifdef USE_THREAD_SAFETY
-static void *_MSCEventThread(void *arg)
+/*
+ * One dispatcher thread waits for the events of all the registered
+ * callbacks with a single SCardGetStatusChange() per cycle. Its state
+ * array has one entry per reader and is only rebuilt when a callback is
+ * registered or cancelled. The thread uses its own PC/SC context so
+ * MSCCancelEventWait() and the dispatcher do not cancel each other.
+ * A cancelled registration is only marked, the dispatcher frees it and
+ * stops when no registration is left.
+ */
+typedef struct EventRegistration
 {
-	MSCLong32 rv;
-	MSCLPEventWaitInfo evlist;
-	MSCLong32 curToken;
-
-	if (arg == NULL)
-		SYS_ThreadExit(NULL);
+	struct EventRegistration *next;
+	MSCEventWaitInfo info;
+	int isNew;		/* tokens not yet compared to the readers */
+	int pending;	/* the callback must be called */
+	int cancelled;	/* to be freed, the callback is not called any more */
+}
+EventRegistration;
 
-	evlist = (MSCLPEventWaitInfo) arg;
-	blockingContext = MSC_BLOCKSTATUS_BLOCKING;
+static struct
+{
+	EventRegistration *registrations;
+	int changed;	/* registrations to take into account */
+	int running;	/* the thread is started */
+	int joinPending;	/* the thread exited but was not joined */
+	int waiting;	/* the thread is in SCardGetStatusChange() */
+	PCSCLITE_THREAD_T thread;
+	SCARDCONTEXT hContext;
+	SCARD_READERSTATE_A states[PCSCLITE_MAX_READERS_CONTEXTS];
+	MSCULong32 statesCount;
+}
+Dispatcher;
 
-	while (1)
-	{
-		rv = MSCWaitForTokenEvent(evlist->tokenArray,
-			evlist->arraySize, MSC_NO_TIMEOUT);
+static PCSCLITE_MUTEX DispatcherMutex = PTHREAD_MUTEX_INITIALIZER;
 
-		if (rv == MSC_SUCCESS)
-			(evlist->callBack) (evlist->tokenArray, evlist->arraySize, evlist->appData);
-		else
-			break;
+/* broadcast when the dispatcher has taken the changes into account */
+static pthread_cond_t DispatcherCond = PTHREAD_COND_INITIALIZER;
 
-		if (blockingContext == MSC_BLOCKSTATUS_CANCELLING)
-			break;
-	}
+static void mscFreeRegistration(EventRegistration *registration)
+{
+	MSCULong32 curToken;
 
-	for (curToken = 0; curToken < evlist->arraySize; curToken++)
+	for (curToken = 0; curToken < registration->info.arraySize; curToken++)
 	{
-		if (evlist->tokenArray[curToken].addParams)
-			free(evlist->tokenArray[curToken].addParams);
+		if (registration->info.tokenArray[curToken].addParams)
+			free(registration->info.tokenArray[curToken].addParams);
 	}
 
-	free(evlist->tokenArray);
-	free(evlist);
-	blockingContext = MSC_BLOCKSTATUS_RESUME;
-	SYS_ThreadExit(&rv);
-
-	return NULL;
+	free(registration->info.tokenArray);
+	free(registration);
 }
 
-MSC_RV MSCCallbackForTokenEvent(MSCLPTokenInfo tokenArray,
-	MSCULong32 arraySize, MSCCallBack callBack, MSCPVoid32 appData)
+/*
+ * Number of readers watched by the registrations not cancelled and by
+ * the new one. DispatcherMutex is locked by the caller.
+ */
+static MSCULong32 mscDispatcherReaders(EventRegistration *newRegistration)
 {
-	MSCLPEventWaitInfo evlist;
-	MSCULong32 curToken;
+	const char *readers[PCSCLITE_MAX_READERS_CONTEXTS + 1];
+	EventRegistration *registration = newRegistration;
+	MSCULong32 i, j, count = 0;
 
-	/*
-	 * Create the event wait list
-	 */
-	evlist = (MSCLPEventWaitInfo) malloc(sizeof(MSCEventWaitInfo));
+	while (registration)
+	{
+		for (i = 0; !registration->cancelled
+			&& (i < registration->info.arraySize); i++)
+		{
+			const char *slotName = registration->info.tokenArray[i].slotName;
 
-	if (evlist == NULL)
-		return MSC_INTERNAL_ERROR;
+			for (j = 0; j < count; j++)
+				if (strcmp(readers[j], slotName) == 0)
+					break;
 
-	evlist->arraySize = arraySize;
-	evlist->tokenArray = malloc(sizeof(MSCTokenInfo) * arraySize);
-	evlist->appData = appData;
-	evlist->callBack = callBack;
+			if (j < count)
+				continue;
 
-	if (evlist->tokenArray == NULL)
-	{
-		free(evlist);
-		return MSC_INTERNAL_ERROR;
+			readers[count++] = slotName;
+			if (count > PCSCLITE_MAX_READERS_CONTEXTS)
+				return count;
+		}
+
+		registration = (registration == newRegistration) ?
+			Dispatcher.registrations : registration->next;
 	}
 
-	mscLockThread();
-	memcpy(evlist->tokenArray, tokenArray, sizeof(MSCTokenInfo) * arraySize);
+	return count;
+}
 
-	/*
-	 * Copy the "extra" data
-	 */
-	for (curToken = 0; curToken < arraySize; curToken++)
+/*
+ * Frees the cancelled registrations.
+ * DispatcherMutex is locked by the caller, the dispatcher thread.
+ */
+static void mscDispatcherPurge(void)
+{
+	EventRegistration **prev = &Dispatcher.registrations;
+	EventRegistration *registration;
+
+	while ((registration = *prev) != NULL)
 	{
-		if (tokenArray[curToken].addParams != NULL)
+		if (registration->cancelled)
 		{
-			evlist->tokenArray[curToken].addParams =
-				malloc(evlist->tokenArray[curToken].addParamsSize);
-			memcpy((void *) (evlist->tokenArray[curToken].addParams),
-				&tokenArray[curToken],
-				evlist->tokenArray[curToken].addParamsSize);
+			*prev = registration->next;
+			mscFreeRegistration(registration);
 		}
+		else
+			prev = &registration->next;
 	}
-	mscUnLockThread();
+}
+
+/*
+ * Builds the state array with the readers of the registrations not
+ * cancelled. It must be called before mscDispatcherPurge() since the
+ * reader names of the previous array may belong to a cancelled one.
+ * DispatcherMutex is locked by the caller.
+ */
+static MSCLong32 mscDispatcherRebuild(void)
+{
+	LONG rv;
+	EventRegistration *registration;
+	MSCULong32 i, j, count = 0;
+	SCARD_READERSTATE_A states[PCSCLITE_MAX_READERS_CONTEXTS];
+
+	for (registration = Dispatcher.registrations; registration;
+		registration = registration->next)
+	{
+		for (i = 0; !registration->cancelled
+			&& (i < registration->info.arraySize); i++)
+		{
+			const char *slotName = registration->info.tokenArray[i].slotName;
+
+			for (j = 0; j < count; j++)
+				if (strcmp(states[j].szReader, slotName) == 0)
+					break;
+
+			if (j < count)
+				continue;
+
+			if (count == PCSCLITE_MAX_READERS_CONTEXTS)
+				return SCARD_E_INVALID_PARAMETER;
+
+			/* keep the state and ATR of the readers already known */
+			memset(&states[count], 0, sizeof(SCARD_READERSTATE_A));
+			states[count].dwCurrentState = SCARD_STATE_UNAWARE;
+			for (j = 0; j < Dispatcher.statesCount; j++)
+				if (strcmp(Dispatcher.states[j].szReader, slotName) == 0)
+				{
+					states[count] = Dispatcher.states[j];
+					break;
+				}
+			states[count].szReader = slotName;
+			states[count].dwEventState = 0;
+			count++;
+		}
+	}
+
+	memcpy(Dispatcher.states, states, count * sizeof(SCARD_READERSTATE_A));
+	Dispatcher.statesCount = count;
+
+	/* get the state of the new readers */
+	for (j = 0; j < count; j++)
+		if (states[j].dwCurrentState == SCARD_STATE_UNAWARE)
+			break;
+
+	if (j < count)
+	{
+		rv = SCardGetStatusChange(Dispatcher.hContext, 0, Dispatcher.states,
+			count);
+		if ((rv != SCARD_S_SUCCESS) && (rv != SCARD_E_TIMEOUT))
+			return rv;
+
+		for (j = 0; j < count; j++)
+			if (Dispatcher.states[j].dwCurrentState == SCARD_STATE_UNAWARE)
+				Dispatcher.states[j].dwCurrentState =
+					Dispatcher.states[j].dwEventState & ~SCARD_STATE_CHANGED;
+	}
+
+	/* compare the state given by the application to the reader state */
+	for (registration = Dispatcher.registrations; registration;
+		registration = registration->next)
+	{
+		if (!registration->isNew || registration->cancelled)
+			continue;
+
+		registration->isNew = 0;
+
+		for (i = 0; i < registration->info.arraySize; i++)
+		{
+			MSCLPTokenInfo token = &registration->info.tokenArray[i];
+
+			for (j = 0; j < count; j++)
+				if (strcmp(Dispatcher.states[j].szReader, token->slotName) == 0)
+					break;
+
+			if (token->tokenState == 0)
+				token->tokenState = Dispatcher.states[j].dwCurrentState;
+			else
+				if ((token->tokenState == MSC_STATE_UNAWARE)
+					|| ((token->tokenState & 0xFFFF & ~MSC_STATE_CHANGED)
+						!= (Dispatcher.states[j].dwCurrentState & 0xFFFF)))
+				{
+					Dispatcher.states[j].dwEventState =
+						Dispatcher.states[j].dwCurrentState
+						| SCARD_STATE_CHANGED;
+					mscUpdateToken(token, &Dispatcher.states[j]);
+					registration->pending = 1;
+				}
+		}
+	}
+
+	return SCARD_S_SUCCESS;
+}
+
+static void *mscEventDispatcher(void *arg)
+{
+	LONG rv = SCARD_S_SUCCESS;
+	EventRegistration *registration;
+	MSCULong32 i, j;
+
+	(void)arg;
+
+	(void)SYS_MutexLock(&DispatcherMutex);
+
+	while (1)
+	{
+		if (Dispatcher.changed)
+		{
+			Dispatcher.changed = 0;
+			rv = mscDispatcherRebuild();
+			mscDispatcherPurge();
+			(void)pthread_cond_broadcast(&DispatcherCond);
+
+			/* all the registrations are cancelled */
+			if ((rv != SCARD_S_SUCCESS) || (NULL == Dispatcher.registrations))
+				break;
+		}
+
+		/* call the callbacks without the lock, they may register again or
+		 * cancel. The registrations are only freed by this thread */
+		for (registration = Dispatcher.registrations; registration;
+			registration = registration->next)
+		{
+			if (!registration->pending || registration->cancelled)
+				continue;
+
+			registration->pending = 0;
+			(void)SYS_MutexUnLock(&DispatcherMutex);
+			(registration->info.callBack) (registration->info.tokenArray,
+				registration->info.arraySize, registration->info.appData);
+			(void)SYS_MutexLock(&DispatcherMutex);
+		}
+
+		if (Dispatcher.changed)
+			continue;
+
+		for (j = 0; j < Dispatcher.statesCount; j++)
+			Dispatcher.states[j].dwEventState = 0;
+
+		Dispatcher.waiting = 1;
+		(void)SYS_MutexUnLock(&DispatcherMutex);
+		rv = SCardGetStatusChange(Dispatcher.hContext, INFINITE,
+			Dispatcher.states, Dispatcher.statesCount);
+		(void)SYS_MutexLock(&DispatcherMutex);
+		Dispatcher.waiting = 0;
+
+		/* woken up for a new registration or a cancellation */
+		if (rv == SCARD_E_CANCELLED)
+		{
+			rv = SCARD_S_SUCCESS;
+			continue;
+		}
+
+		if (rv != SCARD_S_SUCCESS)
+			break;
+
+		for (j = 0; j < Dispatcher.statesCount; j++)
+		{
+			LPSCARD_READERSTATE_A state = &Dispatcher.states[j];
+
+			if (!(state->dwEventState & SCARD_STATE_CHANGED))
+				continue;
+
+			for (registration = Dispatcher.registrations; registration;
+				registration = registration->next)
+				for (i = 0; i < registration->info.arraySize; i++)
+				{
+					MSCLPTokenInfo token = &registration->info.tokenArray[i];
+
+					if (strcmp(token->slotName, state->szReader) == 0)
+					{
+						mscUpdateToken(token, state);
+						registration->pending = 1;
+					}
+				}
+
+			state->dwCurrentState = state->dwEventState & ~SCARD_STATE_CHANGED;
+		}
+	}
+
+	if (rv != SCARD_S_SUCCESS)
+		Log2(PCSC_LOG_ERROR, "Token event dispatcher stopped: %s",
+			pcsc_stringify_error(rv));
+
+	while (Dispatcher.registrations)
+	{
+		registration = Dispatcher.registrations;
+		Dispatcher.registrations = registration->next;
+		mscFreeRegistration(registration);
+	}
+
+	Dispatcher.statesCount = 0;
+	(void)SCardReleaseContext(Dispatcher.hContext);
+	Dispatcher.hContext = 0;
+	Dispatcher.running = 0;
+	Dispatcher.joinPending = 1;
+	(void)pthread_cond_broadcast(&DispatcherCond);
+
+	(void)SYS_MutexUnLock(&DispatcherMutex);
 
-	if (SYS_ThreadCreate(&callbackThread, THREAD_ATTR_DEFAULT,
-			_MSCEventThread, (void *) evlist) == 0)
+	SYS_ThreadExit(NULL);
+
+	return NULL;
+}
+
+/*
+ * Makes sure the dispatcher sees a change or a cancellation and waits
+ * until it is taken into account.
+ * DispatcherMutex is locked by the caller.
+ */
+static void mscWakeDispatcher(void)
+{
+	PCSCLITE_THREAD_T self = SYS_ThreadSelf();
+	struct timeval now;
+	struct timespec timeout;
+
+	/* called by a callback, the dispatcher is not waiting */
+	if (SYS_ThreadEqual(&self, &Dispatcher.thread))
+		return;
+
+	while (Dispatcher.running && Dispatcher.changed)
+	{
+		/* the dispatcher checks Dispatcher.changed before it waits for
+		 * an event again */
+		if (!Dispatcher.waiting)
+		{
+			(void)pthread_cond_wait(&DispatcherCond, &DispatcherMutex);
+			continue;
+		}
+
+		(void)SCardCancel(Dispatcher.hContext);
+
+		/* SCardCancel() is lost if the dispatcher has not yet entered
+		 * SCardGetStatusChange(), it is sent again after 10 ms */
+		(void)gettimeofday(&now, NULL);
+		now.tv_usec += 10000;
+		timeout.tv_sec = now.tv_sec + now.tv_usec / 1000000;
+		timeout.tv_nsec = (now.tv_usec % 1000000) * 1000;
+		(void)pthread_cond_timedwait(&DispatcherCond, &DispatcherMutex,
+			&timeout);
+	}
+}
+
+MSC_RV MSCCallbackForTokenEvent(MSCLPTokenInfo tokenArray,
+	MSCULong32 arraySize, MSCCallBack callBack, MSCPVoid32 appData)
+{
+	EventRegistration *registration;
+	MSCULong32 curToken;
+	LONG rv;
+
+	if ((arraySize == 0) || (tokenArray == NULL) || (callBack == NULL))
+		return MSC_INVALID_PARAMETER;
+
+	if (arraySize > MSC_MAXSIZE_TOKENARRAY)
+		return MSC_INSUFFICIENT_BUFFER;
+
+	/*
+	 * Make sure they don't pass an empty structure
+	 */
+	for (curToken = 0; curToken < arraySize; curToken++)
+		if (strlen(tokenArray[curToken].slotName) == 0)
+			return MSC_INVALID_PARAMETER;
+
+	/*
+	 * Create the event wait list
+	 */
+	registration = calloc(1, sizeof(EventRegistration));
+
+	if (registration == NULL)
+		return MSC_INTERNAL_ERROR;
+
+	registration->info.arraySize = arraySize;
+	registration->info.tokenArray = malloc(sizeof(MSCTokenInfo) * arraySize);
+	registration->info.appData = appData;
+	registration->info.callBack = callBack;
+	registration->isNew = 1;
+
+	if (registration->info.tokenArray == NULL)
+	{
+		free(registration);
 		return MSC_INTERNAL_ERROR;
+	}
+
+	memcpy(registration->info.tokenArray, tokenArray,
+		sizeof(MSCTokenInfo) * arraySize);
+
+	/*
+	 * Copy the "extra" data
+	 */
+	for (curToken = 0; curToken < arraySize; curToken++)
+	{
+		MSCLPTokenInfo token = &registration->info.tokenArray[curToken];
+
+		if (token->addParams != NULL)
+		{
+			token->addParams = malloc(token->addParamsSize);
+			if (token->addParams)
+				memcpy(token->addParams, tokenArray[curToken].addParams,
+					token->addParamsSize);
+		}
+	}
+
+	(void)SYS_MutexLock(&DispatcherMutex);
+
+	/* the state array of the dispatcher has one entry per reader */
+	if (mscDispatcherReaders(registration) > PCSCLITE_MAX_READERS_CONTEXTS)
+	{
+		(void)SYS_MutexUnLock(&DispatcherMutex);
+		mscFreeRegistration(registration);
+		return MSC_INSUFFICIENT_BUFFER;
+	}
+
+	if (!Dispatcher.running)
+	{
+		/* the previous dispatcher was stopped by an error */
+		if (Dispatcher.joinPending)
+		{
+			SYS_ThreadJoin(Dispatcher.thread, 0);
+			Dispatcher.joinPending = 0;
+		}
+
+		rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, 0, 0,
+			&Dispatcher.hContext);
+		if (rv != SCARD_S_SUCCESS)
+		{
+			(void)SYS_MutexUnLock(&DispatcherMutex);
+			mscFreeRegistration(registration);
+			return pcscToMSC(rv);
+		}
+
+		Dispatcher.changed = 1;
+		registration->next = NULL;
+		Dispatcher.registrations = registration;
+
+		if (SYS_ThreadCreate(&Dispatcher.thread, THREAD_ATTR_DEFAULT,
+				mscEventDispatcher, NULL) != 0)
+		{
+			Dispatcher.registrations = NULL;
+			(void)SCardReleaseContext(Dispatcher.hContext);
+			Dispatcher.hContext = 0;
+			(void)SYS_MutexUnLock(&DispatcherMutex);
+			mscFreeRegistration(registration);
+			return MSC_INTERNAL_ERROR;
+		}
+
+		Dispatcher.running = 1;
+
+		/* tokens given with a 0 state get the state of the reader at
+		 * the registration */
+		mscWakeDispatcher();
+	}
+	else
+	{
+		registration->next = Dispatcher.registrations;
+		Dispatcher.registrations = registration;
+		Dispatcher.changed = 1;
+		mscWakeDispatcher();
+	}
+
+	(void)SYS_MutexUnLock(&DispatcherMutex);
 
 	return MSC_SUCCESS;
 }
 
 MSC_RV MSCCallbackCancelEvent(void)
 {
-	LONG rv;
+	PCSCLITE_THREAD_T self = SYS_ThreadSelf();
+	EventRegistration *registration;
+
+	(void)SYS_MutexLock(&DispatcherMutex);
 
-	/* Release the thread and stop the GetStatusChange */
-	if (blockingContext == MSC_BLOCKSTATUS_BLOCKING)
+	if (Dispatcher.running)
 	{
-		blockingContext = MSC_BLOCKSTATUS_CANCELLING;
-		rv = MSCCancelEventWait();
+		/* the dispatcher frees them and stops if no callback registers
+		 * again meanwhile */
+		for (registration = Dispatcher.registrations; registration;
+			registration = registration->next)
+			registration->cancelled = 1;
+
+		Dispatcher.changed = 1;
+		mscWakeDispatcher();
+	}
 
-		SYS_ThreadJoin(callbackThread, 0);
+	/* a callback can not wait for its own thread */
+	if (Dispatcher.joinPending && !SYS_ThreadEqual(&self, &Dispatcher.thread))
+	{
+		SYS_ThreadJoin(Dispatcher.thread, 0);
+		Dispatcher.joinPending = 0;
 	}
 
+	(void)SYS_MutexUnLock(&DispatcherMutex);
+
 	return MSC_SUCCESS;
 }
 
@@ -867,12 +1571,17 @@ MSC_RV MSCBeginTransaction(MSCLPTokenConnection pConnection)
 	MSCLong32 rv;
 	MSCLong32 ret;
 
-	if (localHContext == 0)
+	if (mscNoContext(pConnection))
 		return MSC_INTERNAL_ERROR;
 
+	mscLockConnection(pConnection);
+
 	while (1)
 	{
-		rv = SCardBeginTransaction(pConnection->hCard);
+		if (pConnection->tokenInfo.tokenType & MSC_TOKEN_TYPE_SIMULATED)
+			rv = SCARD_S_SUCCESS;
+		else
+			rv = SCardBeginTransaction(pConnection->hCard);
 		ret = pcscToMSC(rv);
 
 		if (ret == MSC_TOKEN_RESET)
@@ -892,6 +1601,11 @@ MSC_RV MSCBeginTransaction(MSCLPTokenConnection pConnection)
 			break;
 	}
 
+	if (ret == MSC_SUCCESS)
+		OCTransaction(pConnection, 1);
+
+	mscUnLockConnection(pConnection);
+
 	return ret;
 }
 
@@ -901,12 +1615,17 @@ MSC_RV MSCEndTransaction(MSCLPTokenConnection pConnection,
 	MSCLong32 rv;
 	MSCLong32 ret;
 
-	if (localHContext == 0)
+	if (mscNoContext(pConnection))
 		return MSC_INTERNAL_ERROR;
 
+	mscLockConnection(pConnection);
+
 	while (1)
 	{
-		rv = SCardEndTransaction(pConnection->hCard, endAction);
+		if (pConnection->tokenInfo.tokenType & MSC_TOKEN_TYPE_SIMULATED)
+			rv = SCARD_S_SUCCESS;
+		else
+			rv = SCardEndTransaction(pConnection->hCard, endAction);
 		ret = pcscToMSC(rv);
 
 		if (ret == MSC_TOKEN_RESET)
@@ -925,6 +1644,10 @@ MSC_RV MSCEndTransaction(MSCLPTokenConnection pConnection,
 			break;
 	}
 
+	OCTransaction(pConnection, 0);
+
+	mscUnLockConnection(pConnection);
+
 	return ret;
 }
 
@@ -939,9 +1662,11 @@ MSC_RV MSCWriteFramework(MSCLPTokenConnection pConnection,
 
 	if (pConnection == NULL)
 		return MSC_INVALID_PARAMETER;
-	if (localHContext == 0)
+	if (mscNoContext(pConnection))
 		return MSC_INTERNAL_ERROR;
 
+	mscLockConnection(pConnection);
+
 	vFunction = pConnection->libPointers.pvfWriteFramework;
 
 	if (vFunction != NULL)
@@ -952,7 +1677,11 @@ MSC_RV MSCWriteFramework(MSCLPTokenConnection pConnection,
 
 	}
 	else
-		return MSC_UNSUPPORTED_FEATURE;
+		rv = MSC_UNSUPPORTED_FEATURE;
+
+	OCFlush(pConnection, OC_FLUSH_ALL);
+
+	mscUnLockConnection(pConnection);
 
 	return rv;
 }
@@ -971,9 +1700,11 @@ MSC_RV MSCGetStatus(MSCLPTokenConnection pConnection,
 
 	if (pConnection == NULL)
 		return MSC_INVALID_PARAMETER;
-	if (localHContext == 0)
+	if (mscNoContext(pConnection))
 		return MSC_INTERNAL_ERROR;
 
+	mscLockConnection(pConnection);
+
 	vFunction = pConnection->libPointers.pvfGetStatus;
 
 	if (vFunction != NULL)
@@ -984,7 +1715,9 @@ MSC_RV MSCGetStatus(MSCLPTokenConnection pConnection,
 
 	}
 	else
-		return MSC_UNSUPPORTED_FEATURE;
+		rv = MSC_UNSUPPORTED_FEATURE;
+
+	mscUnLockConnection(pConnection);
 
 	return rv;
 }
@@ -1000,9 +1733,11 @@ MSC_RV MSCGetCapabilities(MSCLPTokenConnection pConnection, MSCULong32 Tag,
 
 	if (pConnection == NULL)
 		return MSC_INVALID_PARAMETER;
-	if (localHContext == 0)
+	if (mscNoContext(pConnection))
 		return MSC_INTERNAL_ERROR;
 
+	mscLockConnection(pConnection);
+
 	vFunction = pConnection->libPointers.pvfGetCapabilities;
 
 	if (vFunction != NULL)
@@ -1013,7 +1748,9 @@ MSC_RV MSCGetCapabilities(MSCLPTokenConnection pConnection, MSCULong32 Tag,
 		rv = (*libMSCGetCapabilities) (pConnection, Tag, Value, Length);
 	}
 	else
-		return MSC_UNSUPPORTED_FEATURE;
+		rv = MSC_UNSUPPORTED_FEATURE;
+
+	mscUnLockConnection(pConnection);
 
 	return rv;
 }
@@ -1030,9 +1767,11 @@ MSC_RV MSCExtendedFeature(MSCLPTokenConnection pConnection,
 
 	if (pConnection == NULL)
 		return MSC_INVALID_PARAMETER;
-	if (localHContext == 0)
+	if (mscNoContext(pConnection))
 		return MSC_INTERNAL_ERROR;
 
+	mscLockConnection(pConnection);
+
 	vFunction = pConnection->libPointers.pvfExtendedFeature;
 
 	if (vFunction != NULL)
@@ -1044,7 +1783,12 @@ MSC_RV MSCExtendedFeature(MSCLPTokenConnection pConnection,
 			outLength, inData, inLength);
 	}
 	else
-		return MSC_UNSUPPORTED_FEATURE;
+		rv = MSC_UNSUPPORTED_FEATURE;
+
+	/* may change anything */
+	OCFlush(pConnection, OC_FLUSH_ALL);
+
+	mscUnLockConnection(pConnection);
 
 	return rv;
 }
@@ -1060,9 +1804,11 @@ MSC_RV MSCGenerateKeys(MSCLPTokenConnection pConnection,
 
 	if (pConnection == NULL)
 		return MSC_INVALID_PARAMETER;
-	if (localHContext == 0)
+	if (mscNoContext(pConnection))
 		return MSC_INTERNAL_ERROR;
 
+	mscLockConnection(pConnection);
+
 	vFunction = pConnection->libPointers.pvfGenerateKeys;
 
 	if (vFunction != NULL)
@@ -1073,7 +1819,11 @@ MSC_RV MSCGenerateKeys(MSCLPTokenConnection pConnection,
 			pParams);
 	}
 	else
-		return MSC_UNSUPPORTED_FEATURE;
+		rv = MSC_UNSUPPORTED_FEATURE;
+
+	OCFlush(pConnection, OC_FLUSH_KEYS);
+
+	mscUnLockConnection(pConnection);
 
 	return rv;
 }
@@ -1091,9 +1841,11 @@ MSC_RV MSCImportKey(MSCLPTokenConnection pConnection, MSCUChar8 keyNum,
 
 	if (pConnection == NULL)
 		return MSC_INVALID_PARAMETER;
-	if (localHContext == 0)
+	if (mscNoContext(pConnection))
 		return MSC_INTERNAL_ERROR;
 
+	mscLockConnection(pConnection);
+
 	vFunction = pConnection->libPointers.pvfImportKey;
 
 	if (vFunction != NULL)
@@ -1108,7 +1860,11 @@ MSC_RV MSCImportKey(MSCLPTokenConnection pConnection, MSCUChar8 keyNum,
 			keyPolicy, pAddParams, addParamsSize);
 	}
 	else
-		return MSC_UNSUPPORTED_FEATURE;
+		rv = MSC_UNSUPPORTED_FEATURE;
+
+	OCFlush(pConnection, OC_FLUSH_KEYS);
+
+	mscUnLockConnection(pConnection);
 
 	return rv;
 }
@@ -1125,9 +1881,11 @@ MSC_RV MSCExportKey(MSCLPTokenConnection pConnection, MSCUChar8 keyNum,
 
 	if (pConnection == NULL)
 		return MSC_INVALID_PARAMETER;
-	if (localHContext == 0)
+	if (mscNoContext(pConnection))
 		return MSC_INTERNAL_ERROR;
 
+	mscLockConnection(pConnection);
+
 	vFunction = pConnection->libPointers.pvfExportKey;
 
 	if (vFunction != NULL)
@@ -1140,7 +1898,9 @@ MSC_RV MSCExportKey(MSCLPTokenConnection pConnection, MSCUChar8 keyNum,
 			keyBlobSize, pAddParams, addParamsSize);
 	}
 	else
-		return MSC_UNSUPPORTED_FEATURE;
+		rv = MSC_UNSUPPORTED_FEATURE;
+
+	mscUnLockConnection(pConnection);
 
 	return rv;
 }
@@ -1158,21 +1918,330 @@ MSC_RV MSCComputeCrypt(MSCLPTokenConnection pConnection,
 
 	if (pConnection == NULL)
 		return MSC_INVALID_PARAMETER;
-	if (localHContext == 0)
+	if (mscNoContext(pConnection))
 		return MSC_INTERNAL_ERROR;
 
+	mscLockConnection(pConnection);
+
 	vFunction = pConnection->libPointers.pvfComputeCrypt;
 
-	if (vFunction != NULL)
-	{
-		libMSCComputeCrypt =
-			(MSCLong32(*)(MSCLPTokenConnection, MSCLPCryptInit,
-				MSCPUChar8, MSCULong32, MSCPUChar8, MSCPULong32)) vFunction;
-		rv = (*libMSCComputeCrypt) (pConnection, cryptInit, pInputData,
-			inputDataSize, pOutputData, outputDataSize);
+	if (vFunction != NULL)
+	{
+		libMSCComputeCrypt =
+			(MSCLong32(*)(MSCLPTokenConnection, MSCLPCryptInit,
+				MSCPUChar8, MSCULong32, MSCPUChar8, MSCPULong32)) vFunction;
+		rv = (*libMSCComputeCrypt) (pConnection, cryptInit, pInputData,
+			inputDataSize, pOutputData, outputDataSize);
+	}
+	else
+		rv = MSC_UNSUPPORTED_FEATURE;
+
+	mscUnLockConnection(pConnection);
+
+	return rv;
+}
+
+/*
+ * Streaming crypt. The input is sent to the token in chunks with
+ * PL_MSCComputeCryptEx(): one MSC_CIPHER_INIT, then MSC_CIPHER_PROCESS
+ * for each chunk and MSC_CIPHER_FINAL for the last one. When there is
+ * more than one chunk a worker thread talks to the token while the
+ * calling thread gives the output of the previous chunk to the
+ * application, so the output of the token is double buffered.
+ */
+#define MSC_CRYPT_SLOTS		2
+#define MSC_CRYPT_EXTRA		512	/* a padding block or a RSA 4096 result */
+
+typedef MSCLong32(*LPComputeCryptEx) (MSCLPTokenConnection, MSCLPCryptInit,
+	MSCUChar8, MSCPUChar8, MSCULong32, MSCPUChar8, MSCPULong32);
+
+typedef struct
+{
+	MSCLPTokenConnection pConnection;
+	MSCLPCryptInit cryptInit;
+	LPComputeCryptEx libMSCComputeCryptEx;
+	MSCPUChar8 pInputData;
+	MSCULong32 inputDataSize;
+	MSCULong32 chunkSize;
+	MSCPUChar8 output[MSC_CRYPT_SLOTS];
+	MSCULong32 outputLength[MSC_CRYPT_SLOTS];
+	MSCULong32 outputSize;	/* size of each output buffer */
+	int filled;		/* chunks done by the token */
+	int consumed;	/* chunks given to the application */
+	int done;		/* the worker has stopped */
+	int cancelled;	/* stopped by the application */
+	MSC_RV rv;		/* result of the worker */
+	MSC_RV callbackRv;	/* result of the callback which stopped */
+#ifdef USE_THREAD_SAFETY
+	PCSCLITE_MUTEX mutex;
+	pthread_cond_t cond;
+#endif
+}
+CryptStream;
+
+static MSCULong32 mscCryptChunkSize(MSCLPTokenConnection pConnection)
+{
+	MSCULong32 chunkSize;
+
+	if (pConnection->cryptChunkSize)
+		return pConnection->cryptChunkSize;
+
+	chunkSize = mscTokenChunkSize(pConnection, MSC_TAG_CAPABLE_CRYPT_MAXIO);
+
+	/* only whole DES blocks before the final step, unless the token
+	 * accepts less than one */
+	if (chunkSize >= 8)
+		chunkSize -= chunkSize % 8;
+
+#ifndef NO_MSC_DEBUG
+	Log2(PCSC_LOG_DEBUG, "Crypt chunk size: %ld", chunkSize);
+#endif
+
+	pConnection->cryptChunkSize = chunkSize;
+
+	return chunkSize;
+}
+
+/*
+ * Sends the chunk number index to the token. The output goes in the
+ * buffer slot.
+ */
+static MSC_RV mscCryptStep(CryptStream *stream, int index, int slot)
+{
+	MSCULong32 offset, length;
+	MSCUChar8 operation;
+
+	offset = index * stream->chunkSize;
+	length = stream->inputDataSize - offset;
+	if (length > stream->chunkSize)
+		length = stream->chunkSize;
+
+	operation = (offset + length == stream->inputDataSize) ?
+		MSC_CIPHER_FINAL : MSC_CIPHER_PROCESS;
+
+	stream->outputLength[slot] = stream->outputSize;
+
+	return (*stream->libMSCComputeCryptEx) (stream->pConnection,
+		stream->cryptInit, operation, stream->pInputData + offset, length,
+		stream->output[slot], &stream->outputLength[slot]);
+}
+
+static int mscCryptChunks(CryptStream *stream)
+{
+	/* the final step is done even without input */
+	if (stream->inputDataSize == 0)
+		return 1;
+
+	return (stream->inputDataSize + stream->chunkSize - 1) /
+		stream->chunkSize;
+}
+
+#ifdef USE_THREAD_SAFETY
+static void *mscCryptWorker(void *arg)
+{
+	CryptStream *stream = arg;
+	int chunks, index, slot;
+	MSC_RV rv = MSC_SUCCESS;
+
+	chunks = mscCryptChunks(stream);
+
+	for (index = 0; index < chunks; index++)
+	{
+		(void)SYS_MutexLock(&stream->mutex);
+		while (!stream->cancelled
+			&& (stream->filled - stream->consumed == MSC_CRYPT_SLOTS))
+			(void)pthread_cond_wait(&stream->cond, &stream->mutex);
+		if (stream->cancelled)
+		{
+			(void)SYS_MutexUnLock(&stream->mutex);
+			break;
+		}
+		(void)SYS_MutexUnLock(&stream->mutex);
+
+		/* this slot is not used by the application */
+		slot = index % MSC_CRYPT_SLOTS;
+		rv = mscCryptStep(stream, index, slot);
+
+		(void)SYS_MutexLock(&stream->mutex);
+		if (rv == MSC_SUCCESS)
+			stream->filled++;
+		(void)pthread_cond_signal(&stream->cond);
+		(void)SYS_MutexUnLock(&stream->mutex);
+
+		if (rv != MSC_SUCCESS)
+			break;
+	}
+
+	(void)SYS_MutexLock(&stream->mutex);
+	stream->rv = rv;
+	stream->done = 1;
+	(void)pthread_cond_signal(&stream->cond);
+	(void)SYS_MutexUnLock(&stream->mutex);
+
+	return NULL;
+}
+
+static int mscCryptPipeline(CryptStream *stream,
+	LPCryptEventCallback outputCallback, MSCPVoid32 addParams)
+{
+	PCSCLITE_THREAD_T worker;
+	MSC_RV rv;
+	int slot;
+
+	(void)SYS_MutexInit(&stream->mutex);
+	(void)pthread_cond_init(&stream->cond, NULL);
+
+	if (SYS_ThreadCreate(&worker, THREAD_ATTR_DEFAULT, mscCryptWorker,
+			stream) != 0)
+	{
+		(void)pthread_cond_destroy(&stream->cond);
+		(void)SYS_MutexDestroy(&stream->mutex);
+		return 0;
+	}
+
+	(void)SYS_MutexLock(&stream->mutex);
+	while (1)
+	{
+		while (!stream->done && (stream->consumed == stream->filled))
+			(void)pthread_cond_wait(&stream->cond, &stream->mutex);
+		if (stream->consumed == stream->filled)
+			break;
+		(void)SYS_MutexUnLock(&stream->mutex);
+
+		/* the worker uses the other slot meanwhile */
+		slot = stream->consumed % MSC_CRYPT_SLOTS;
+		rv = MSC_SUCCESS;
+		if (stream->outputLength[slot])
+			rv = (*outputCallback) (addParams, stream->output[slot],
+				stream->outputLength[slot]);
+		if (rv != MSC_SUCCESS)
+		{
+			(void)SYS_MutexLock(&stream->mutex);
+			stream->cancelled = 1;
+			stream->callbackRv = rv;
+			(void)pthread_cond_signal(&stream->cond);
+			break;
+		}
+
+		(void)SYS_MutexLock(&stream->mutex);
+		stream->consumed++;
+		(void)pthread_cond_signal(&stream->cond);
+	}
+	(void)SYS_MutexUnLock(&stream->mutex);
+
+	(void)SYS_ThreadJoin(worker, NULL);
+
+	(void)pthread_cond_destroy(&stream->cond);
+	(void)SYS_MutexDestroy(&stream->mutex);
+
+	return 1;
+}
+#endif
+
+MSC_RV MSCComputeCryptStream(MSCLPTokenConnection pConnection,
+	MSCLPCryptInit cryptInit, MSCPUChar8 pInputData,
+	MSCULong32 inputDataSize, LPCryptEventCallback outputCallback,
+	MSCPVoid32 addParams)
+{
+	MSC_RV rv;
+	MSCPVoid32 vFunctionEx;
+	CryptStream stream;
+	int chunks, index, slots;
+
+	if (pConnection == NULL)
+		return MSC_INVALID_PARAMETER;
+	if (outputCallback == NULL)
+		return MSC_INVALID_PARAMETER;
+	if (mscNoContext(pConnection))
+		return MSC_INTERNAL_ERROR;
+
+	mscLockConnection(pConnection);
+
+	vFunctionEx = pConnection->libPointers.pvfComputeCryptEx;
+
+	if (vFunctionEx == NULL)
+	{
+		MSCPUChar8 pOutputData;
+		MSCULong32 outputDataSize;
+
+		/* old token library: the whole input at once */
+		outputDataSize = inputDataSize + MSC_CRYPT_EXTRA;
+		pOutputData = malloc(outputDataSize);
+		if (pOutputData == NULL)
+		{
+			mscUnLockConnection(pConnection);
+			return MSC_INTERNAL_ERROR;
+		}
+
+		rv = MSCComputeCrypt(pConnection, cryptInit, pInputData,
+			inputDataSize, pOutputData, &outputDataSize);
+		if ((rv == MSC_SUCCESS) && outputDataSize)
+			rv = (*outputCallback) (addParams, pOutputData, outputDataSize);
+
+		free(pOutputData);
+		mscUnLockConnection(pConnection);
+
+		return rv;
+	}
+
+	memset(&stream, 0, sizeof(stream));
+	stream.pConnection = pConnection;
+	stream.cryptInit = cryptInit;
+	stream.libMSCComputeCryptEx = (LPComputeCryptEx) vFunctionEx;
+	stream.pInputData = pInputData;
+	stream.inputDataSize = inputDataSize;
+	stream.chunkSize = mscCryptChunkSize(pConnection);
+	stream.outputSize = stream.chunkSize + MSC_CRYPT_EXTRA;
+
+	chunks = mscCryptChunks(&stream);
+	slots = chunks > 1 ? MSC_CRYPT_SLOTS : 1;
+
+	for (index = 0; index < slots; index++)
+	{
+		stream.output[index] = malloc(stream.outputSize);
+		if (stream.output[index] == NULL)
+		{
+			rv = MSC_INTERNAL_ERROR;
+			goto end;
+		}
+	}
+
+	/* no input and no output */
+	stream.outputLength[0] = stream.outputSize;
+	rv = (*stream.libMSCComputeCryptEx) (pConnection, cryptInit,
+		MSC_CIPHER_INIT, NULL, 0, stream.output[0], &stream.outputLength[0]);
+	if (rv != MSC_SUCCESS)
+		goto end;
+
+#ifdef USE_THREAD_SAFETY
+	if ((chunks > 1) && mscCryptPipeline(&stream, outputCallback, addParams))
+	{
+		rv = stream.cancelled ? stream.callbackRv : stream.rv;
+		goto end;
+	}
+#endif
+
+	/* one chunk or no thread available */
+	for (index = 0; index < chunks; index++)
+	{
+		rv = mscCryptStep(&stream, index, 0);
+		if (rv != MSC_SUCCESS)
+			break;
+
+		if (stream.outputLength[0])
+		{
+			rv = (*outputCallback) (addParams, stream.output[0],
+				stream.outputLength[0]);
+			if (rv != MSC_SUCCESS)
+				break;
+		}
 	}
-	else
-		return MSC_UNSUPPORTED_FEATURE;
+
+end:
+	for (index = 0; index < MSC_CRYPT_SLOTS; index++)
+		free(stream.output[index]);
+
+	mscUnLockConnection(pConnection);
 
 	return rv;
 }
@@ -1189,9 +2258,11 @@ MSC_RV MSCExtAuthenticate(MSCLPTokenConnection pConnection,
 
 	if (pConnection == NULL)
 		return MSC_INVALID_PARAMETER;
-	if (localHContext == 0)
+	if (mscNoContext(pConnection))
 		return MSC_INTERNAL_ERROR;
 
+	mscLockConnection(pConnection);
+
 	vFunction = pConnection->libPointers.pvfExtAuthenticate;
 
 	if (vFunction != NULL)
@@ -1203,7 +2274,9 @@ MSC_RV MSCExtAuthenticate(MSCLPTokenConnection pConnection,
 			cipherDirection, pData, dataSize);
 	}
 	else
-		return MSC_UNSUPPORTED_FEATURE;
+		rv = MSC_UNSUPPORTED_FEATURE;
+
+	mscUnLockConnection(pConnection);
 
 	return rv;
 }
@@ -1211,7 +2284,7 @@ MSC_RV MSCExtAuthenticate(MSCLPTokenConnection pConnection,
 MSC_RV MSCListKeys(MSCLPTokenConnection pConnection, MSCUChar8 seqOption,
 	MSCLPKeyInfo pKeyInfo)
 {
-	MSCLong32 rv;
+	MSC_RV rv;
 	MSCPVoid32 vFunction;
 
 	MSCLong32(*libMSCListKeys) (MSCLPTokenConnection, MSCUChar8,
@@ -1219,9 +2292,17 @@ MSC_RV MSCListKeys(MSCLPTokenConnection pConnection, MSCUChar8 seqOption,
 
 	if (pConnection == NULL)
 		return MSC_INVALID_PARAMETER;
-	if (localHContext == 0)
+	if (mscNoContext(pConnection))
 		return MSC_INTERNAL_ERROR;
 
+	mscLockConnection(pConnection);
+
+	if (OCListKeys(pConnection, seqOption, pKeyInfo, &rv))
+	{
+		mscUnLockConnection(pConnection);
+		return rv;
+	}
+
 	vFunction = pConnection->libPointers.pvfListKeys;
 
 	if (vFunction != NULL)
@@ -1231,7 +2312,9 @@ MSC_RV MSCListKeys(MSCLPTokenConnection pConnection, MSCUChar8 seqOption,
 		rv = (*libMSCListKeys) (pConnection, seqOption, pKeyInfo);
 	}
 	else
-		return MSC_UNSUPPORTED_FEATURE;
+		rv = MSC_UNSUPPORTED_FEATURE;
+
+	mscUnLockConnection(pConnection);
 
 	return rv;
 }
@@ -1249,9 +2332,11 @@ MSC_RV MSCCreatePIN(MSCLPTokenConnection pConnection, MSCUChar8 pinNum,
 
 	if (pConnection == NULL)
 		return MSC_INVALID_PARAMETER;
-	if (localHContext == 0)
+	if (mscNoContext(pConnection))
 		return MSC_INTERNAL_ERROR;
 
+	mscLockConnection(pConnection);
+
 	vFunction = pConnection->libPointers.pvfCreatePIN;
 
 	if (vFunction != NULL)
@@ -1263,7 +2348,9 @@ MSC_RV MSCCreatePIN(MSCLPTokenConnection pConnection, MSCUChar8 pinNum,
 			pPinCode, pinCodeSize, pUnblockCode, unblockCodeSize);
 	}
 	else
-		return MSC_UNSUPPORTED_FEATURE;
+		rv = MSC_UNSUPPORTED_FEATURE;
+
+	mscUnLockConnection(pConnection);
 
 	return rv;
 }
@@ -1279,9 +2366,11 @@ MSC_RV MSCVerifyPIN(MSCLPTokenConnection pConnection, MSCUChar8 pinNum,
 
 	if (pConnection == NULL)
 		return MSC_INVALID_PARAMETER;
-	if (localHContext == 0)
+	if (mscNoContext(pConnection))
 		return MSC_INTERNAL_ERROR;
 
+	mscLockConnection(pConnection);
+
 	vFunction = pConnection->libPointers.pvfVerifyPIN;
 
 	if (vFunction != NULL)
@@ -1291,7 +2380,13 @@ MSC_RV MSCVerifyPIN(MSCLPTokenConnection pConnection, MSCUChar8 pinNum,
 		rv = (*libMSCVerifyPIN) (pConnection, pinNum, pPinCode, pinCodeSize);
 	}
 	else
-		return MSC_UNSUPPORTED_FEATURE;
+		rv = MSC_UNSUPPORTED_FEATURE;
+
+	/* some tokens log out after a wrong PIN */
+	if (rv != MSC_SUCCESS)
+		OCFlush(pConnection, OC_FLUSH_CONTENTS);
+
+	mscUnLockConnection(pConnection);
 
 	return rv;
 }
@@ -1308,9 +2403,11 @@ MSC_RV MSCChangePIN(MSCLPTokenConnection pConnection, MSCUChar8 pinNum,
 
 	if (pConnection == NULL)
 		return MSC_INVALID_PARAMETER;
-	if (localHContext == 0)
+	if (mscNoContext(pConnection))
 		return MSC_INTERNAL_ERROR;
 
+	mscLockConnection(pConnection);
+
 	vFunction = pConnection->libPointers.pvfChangePIN;
 
 	if (vFunction != NULL)
@@ -1321,7 +2418,9 @@ MSC_RV MSCChangePIN(MSCLPTokenConnection pConnection, MSCUChar8 pinNum,
 			oldPinCodeSize, pNewPinCode, newPinCodeSize);
 	}
 	else
-		return MSC_UNSUPPORTED_FEATURE;
+		rv = MSC_UNSUPPORTED_FEATURE;
+
+	mscUnLockConnection(pConnection);
 
 	return rv;
 }
@@ -1337,9 +2436,11 @@ MSC_RV MSCUnblockPIN(MSCLPTokenConnection pConnection, MSCUChar8 pinNum,
 
 	if (pConnection == NULL)
 		return MSC_INVALID_PARAMETER;
-	if (localHContext == 0)
+	if (mscNoContext(pConnection))
 		return MSC_INTERNAL_ERROR;
 
+	mscLockConnection(pConnection);
+
 	vFunction = pConnection->libPointers.pvfUnblockPIN;
 
 	if (vFunction != NULL)
@@ -1350,7 +2451,9 @@ MSC_RV MSCUnblockPIN(MSCLPTokenConnection pConnection, MSCUChar8 pinNum,
 			unblockCodeSize);
 	}
 	else
-		return MSC_UNSUPPORTED_FEATURE;
+		rv = MSC_UNSUPPORTED_FEATURE;
+
+	mscUnLockConnection(pConnection);
 
 	return rv;
 }
@@ -1364,9 +2467,11 @@ MSC_RV MSCListPINs(MSCLPTokenConnection pConnection, MSCPUShort16 pPinBitMask)
 
 	if (pConnection == NULL)
 		return MSC_INVALID_PARAMETER;
-	if (localHContext == 0)
+	if (mscNoContext(pConnection))
 		return MSC_INTERNAL_ERROR;
 
+	mscLockConnection(pConnection);
+
 	vFunction = pConnection->libPointers.pvfListPINs;
 
 	if (vFunction != NULL)
@@ -1376,7 +2481,9 @@ MSC_RV MSCListPINs(MSCLPTokenConnection pConnection, MSCPUShort16 pPinBitMask)
 		rv = (*libMSCListPINs) (pConnection, pPinBitMask);
 	}
 	else
-		return MSC_UNSUPPORTED_FEATURE;
+		rv = MSC_UNSUPPORTED_FEATURE;
+
+	mscUnLockConnection(pConnection);
 
 	return rv;
 }
@@ -1392,9 +2499,11 @@ MSC_RV MSCCreateObject(MSCLPTokenConnection pConnection,
 
 	if (pConnection == NULL)
 		return MSC_INVALID_PARAMETER;
-	if (localHContext == 0)
+	if (mscNoContext(pConnection))
 		return MSC_INTERNAL_ERROR;
 
+	mscLockConnection(pConnection);
+
 	vFunction = pConnection->libPointers.pvfCreateObject;
 
 	if (vFunction != NULL)
@@ -1405,7 +2514,11 @@ MSC_RV MSCCreateObject(MSCLPTokenConnection pConnection,
 			pObjectACL);
 	}
 	else
-		return MSC_UNSUPPORTED_FEATURE;
+		rv = MSC_UNSUPPORTED_FEATURE;
+
+	OCFlush(pConnection, OC_FLUSH_OBJECTS);
+
+	mscUnLockConnection(pConnection);
 
 	return rv;
 }
@@ -1421,9 +2534,11 @@ MSC_RV MSCDeleteObject(MSCLPTokenConnection pConnection,
 
 	if (pConnection == NULL)
 		return MSC_INVALID_PARAMETER;
-	if (localHContext == 0)
+	if (mscNoContext(pConnection))
 		return MSC_INTERNAL_ERROR;
 
+	mscLockConnection(pConnection);
+
 	vFunction = pConnection->libPointers.pvfDeleteObject;
 
 	if (vFunction != NULL)
@@ -1433,59 +2548,152 @@ MSC_RV MSCDeleteObject(MSCLPTokenConnection pConnection,
 		rv = (*libMSCDeleteObject) (pConnection, objectID, zeroFlag);
 	}
 	else
-		return MSC_UNSUPPORTED_FEATURE;
+		rv = MSC_UNSUPPORTED_FEATURE;
+
+	OCFlush(pConnection, OC_FLUSH_OBJECTS);
+
+	mscUnLockConnection(pConnection);
 
 	return rv;
 }
 
-MSC_RV MSCWriteObject(MSCLPTokenConnection pConnection,
+/*
+ * Largest data sent to the token by one command: the smallest of the
+ * value of the capability tag and of the extended APDU accepted by the
+ * reader (SCARD_ATTR_MAXINPUT minus the 9 bytes of header, Lc and Le).
+ * The reader limit is at least MSC_SIZEOF_KEYPACKET but the token limit
+ * is never exceeded.
+ */
+static MSCULong32 mscTokenChunkSize(MSCLPTokenConnection pConnection,
+	MSCULong32 tag)
+{
+	MSCULong32 chunkSize, tokenMax, length;
+	MSCUChar8 value[sizeof(MSCULong32)];
+	MSCUChar8 maxInput[4];
+	DWORD maxInputLength = sizeof(maxInput);
+
+	chunkSize = MSC_SIZEOF_KEYPACKET;
+
+	length = sizeof(value);
+	if ((MSCGetCapabilities(pConnection, tag, value,
+		&length) == MSC_SUCCESS) && (length == sizeof(MSCULong32)))
+	{
+		memcpy(&tokenMax, value, sizeof(tokenMax));
+
+		/* short APDUs only if the reader does not tell */
+		if ((pConnection->hCard != 0)
+			&& (SCardGetAttrib(pConnection->hCard, SCARD_ATTR_MAXINPUT,
+				maxInput, &maxInputLength) == SCARD_S_SUCCESS)
+			&& (maxInputLength == sizeof(uint32_t)))
+		{
+			uint32_t readerMax;
+
+			memcpy(&readerMax, maxInput, sizeof(readerMax));
+			chunkSize = readerMax > 9 ? readerMax - 9 : 0;
+		}
+		else
+			chunkSize = MSC_MAXSIZEOF_APDU_DATALEN;
+
+		if (chunkSize < MSC_SIZEOF_KEYPACKET)
+			chunkSize = MSC_SIZEOF_KEYPACKET;
+		if (chunkSize > MSC_MAXSIZEOF_EXT_APDU_DATALEN)
+			chunkSize = MSC_MAXSIZEOF_EXT_APDU_DATALEN;
+
+		/* 0 means no limit given */
+		if ((tokenMax != 0) && (chunkSize > tokenMax))
+			chunkSize = tokenMax;
+	}
+
+	return chunkSize;
+}
+
+/*
+ * Largest object chunk given to the token library in one call.
+ *
+ * Without the Ex function of the token library the length is on 8 bits
+ * and MSC_SIZEOF_KEYPACKET is used. Otherwise the chunk is limited by
+ * MSC_TAG_CAPABLE_OBJ_MAXIO. The result is kept in the connection.
+ */
+static MSCULong32 mscObjectChunkSize(MSCLPTokenConnection pConnection,
+	MSCPVoid32 vFunctionEx)
+{
+	if (vFunctionEx == NULL)
+		return MSC_SIZEOF_KEYPACKET;
+
+	if (pConnection->ioChunkSize)
+		return pConnection->ioChunkSize;
+
+	pConnection->ioChunkSize = mscTokenChunkSize(pConnection,
+		MSC_TAG_CAPABLE_OBJ_MAXIO);
+
+#ifndef NO_MSC_DEBUG
+	Log2(PCSC_LOG_DEBUG, "Object chunk size: %ld", pConnection->ioChunkSize);
+#endif
+
+	return pConnection->ioChunkSize;
+}
+
+static MSC_RV mscWriteObject(MSCLPTokenConnection pConnection,
 	MSCCString objectID, MSCULong32 offSet,
 	MSCPUChar8 pInputData, MSCULong32 dataSize,
 	LPRWEventCallback rwCallback, MSCPVoid32 addParams)
 {
 	MSC_RV rv = MSC_UNSPECIFIED_ERROR;
-	MSCULong32 objectSize;
+	MSCULong32 objectSize, chunkSize, length;
 	int totalSteps, stepInterval;
 
 	MSC_RV(*callBackFunction) (void *, int);
-	MSCPVoid32 vFunction;
+	MSCPVoid32 vFunction, vFunctionEx;
 
 	MSCLong32(*libMSCWriteObject) (MSCLPTokenConnection, MSCCString,
 		MSCULong32, MSCPUChar8, MSCUChar8);
+	MSCLong32(*libMSCWriteObjectEx) (MSCLPTokenConnection, MSCCString,
+		MSCULong32, MSCPUChar8, MSCULong32);
 	int i;
 
-	if (pConnection == NULL)
-		return MSC_INVALID_PARAMETER;
-	if (localHContext == 0)
-		return MSC_INTERNAL_ERROR;
-
 	vFunction = pConnection->libPointers.pvfWriteObject;
+	vFunctionEx = pConnection->libPointers.pvfWriteObjectEx;
 	callBackFunction = (MSC_RV(*)(void *, int)) rwCallback;
 	objectSize = dataSize;
 
-	if (vFunction == NULL)
+	if ((vFunction == NULL) && (vFunctionEx == NULL))
 		return MSC_UNSUPPORTED_FEATURE;
 
 	libMSCWriteObject = (MSCLong32(*)(MSCLPTokenConnection, MSCCString,
 			MSCULong32, MSCPUChar8, MSCUChar8)) vFunction;
+	libMSCWriteObjectEx = (MSCLong32(*)(MSCLPTokenConnection, MSCCString,
+			MSCULong32, MSCPUChar8, MSCULong32)) vFunctionEx;
+
+	chunkSize = mscObjectChunkSize(pConnection, vFunctionEx);
+
+	OCForgetObject(pConnection, objectID);
 
 	/*
 	 * Figure out the number of steps total and present this in a percent
 	 * step basis
 	 */
 
-	totalSteps = objectSize / MSC_SIZEOF_KEYPACKET + 1;
+	totalSteps = objectSize / chunkSize + 1;
 	stepInterval = MSC_PERCENT_STEPSIZE / totalSteps;
 
-	for (i = 0; i < objectSize / MSC_SIZEOF_KEYPACKET; i++)
+	for (i = 0; i * chunkSize < objectSize; i++)
 	{
-		rv = (*libMSCWriteObject) (pConnection, objectID,
-			i * MSC_SIZEOF_KEYPACKET + offSet,
-			&pInputData[i * MSC_SIZEOF_KEYPACKET], MSC_SIZEOF_KEYPACKET);
+		length = objectSize - i * chunkSize;
+		if (length > chunkSize)
+			length = chunkSize;
+
+		if (vFunctionEx)
+			rv = (*libMSCWriteObjectEx) (pConnection, objectID,
+				i * chunkSize + offSet, &pInputData[i * chunkSize], length);
+		else
+			rv = (*libMSCWriteObject) (pConnection, objectID,
+				i * chunkSize + offSet, &pInputData[i * chunkSize],
+				(MSCUChar8)length);
+
 		if (rv != MSC_SUCCESS)
 			return rv;
 
-		if (rwCallback)
+		if (rwCallback && (length == chunkSize))
 		{
 			if ((*callBackFunction) (addParams,
 					stepInterval * i) == MSC_CANCELLED)
@@ -1493,72 +2701,101 @@ MSC_RV MSCWriteObject(MSCLPTokenConnection pConnection,
 		}
 	}
 
-	if (objectSize % MSC_SIZEOF_KEYPACKET)
-	{
-		rv = (*libMSCWriteObject) (pConnection, objectID,
-			i * MSC_SIZEOF_KEYPACKET + offSet,
-			&pInputData[i * MSC_SIZEOF_KEYPACKET],
-			objectSize % MSC_SIZEOF_KEYPACKET);
-
-		if (rv != MSC_SUCCESS)
-			return rv;
-	}
-
 	if (rwCallback)
 		(*callBackFunction) (addParams, MSC_PERCENT_STEPSIZE);
 
 	return rv;
 }
 
-MSC_RV MSCReadObject(MSCLPTokenConnection pConnection,
+MSC_RV MSCWriteObject(MSCLPTokenConnection pConnection,
+	MSCCString objectID, MSCULong32 offSet,
+	MSCPUChar8 pInputData, MSCULong32 dataSize,
+	LPRWEventCallback rwCallback, MSCPVoid32 addParams)
+{
+	MSC_RV rv;
+
+	if (pConnection == NULL)
+		return MSC_INVALID_PARAMETER;
+	if (mscNoContext(pConnection))
+		return MSC_INTERNAL_ERROR;
+
+	/* the object is written in several chunks */
+	mscLockConnection(pConnection);
+	rv = mscWriteObject(pConnection, objectID, offSet,
+		pInputData, dataSize, rwCallback, addParams);
+	mscUnLockConnection(pConnection);
+
+	return rv;
+}
+
+static MSC_RV mscReadObject(MSCLPTokenConnection pConnection,
 	MSCCString objectID, MSCULong32 offSet,
 	MSCPUChar8 pOutputData, MSCULong32 dataSize,
 	LPRWEventCallback rwCallback, MSCPVoid32 addParams)
 {
 	MSC_RV rv = MSC_UNSPECIFIED_ERROR;
-	MSCULong32 objectSize;
+	MSCULong32 objectSize, chunkSize, length;
 	int totalSteps, stepInterval;
 
 	MSC_RV(*callBackFunction) (void *, int);
-	MSCPVoid32 vFunction;
+	MSCPVoid32 vFunction, vFunctionEx;
 
 	MSCLong32(*libMSCReadObject) (MSCLPTokenConnection, MSCCString,
 		MSCULong32, MSCPUChar8, MSCUChar8);
+	MSCLong32(*libMSCReadObjectEx) (MSCLPTokenConnection, MSCCString,
+		MSCULong32, MSCPUChar8, MSCULong32);
 	int i;
 
-	if (pConnection == NULL)
-		return MSC_INVALID_PARAMETER;
-	if (localHContext == 0)
-		return MSC_INTERNAL_ERROR;
-
 	vFunction = pConnection->libPointers.pvfReadObject;
+	vFunctionEx = pConnection->libPointers.pvfReadObjectEx;
 	callBackFunction = (MSC_RV(*)(void *, int)) rwCallback;
 	objectSize = dataSize;
 
-	if (vFunction == NULL)
+	if ((vFunction == NULL) && (vFunctionEx == NULL))
 		return MSC_UNSUPPORTED_FEATURE;
 
 	libMSCReadObject = (MSCLong32(*)(MSCLPTokenConnection,
 			MSCCString, MSCULong32, MSCPUChar8, MSCUChar8)) vFunction;
+	libMSCReadObjectEx = (MSCLong32(*)(MSCLPTokenConnection,
+			MSCCString, MSCULong32, MSCPUChar8, MSCULong32)) vFunctionEx;
+
+	if (dataSize
+		&& OCReadObject(pConnection, objectID, offSet, pOutputData, dataSize))
+	{
+		if (rwCallback)
+			(*callBackFunction) (addParams, MSC_PERCENT_STEPSIZE);
+
+		return MSC_SUCCESS;
+	}
+
+	chunkSize = mscObjectChunkSize(pConnection, vFunctionEx);
 
 	/*
 	 * Figure out the number of steps total and present this in a percent
 	 * step basis
 	 */
 
-	totalSteps = objectSize / MSC_SIZEOF_KEYPACKET + 1;
+	totalSteps = objectSize / chunkSize + 1;
 	stepInterval = MSC_PERCENT_STEPSIZE / totalSteps;
 
-	for (i = 0; i < objectSize / MSC_SIZEOF_KEYPACKET; i++)
+	for (i = 0; i * chunkSize < objectSize; i++)
 	{
-		rv = (*libMSCReadObject) (pConnection, objectID,
-			i * MSC_SIZEOF_KEYPACKET + offSet,
-			&pOutputData[i * MSC_SIZEOF_KEYPACKET], MSC_SIZEOF_KEYPACKET);
+		length = objectSize - i * chunkSize;
+		if (length > chunkSize)
+			length = chunkSize;
+
+		if (vFunctionEx)
+			rv = (*libMSCReadObjectEx) (pConnection, objectID,
+				i * chunkSize + offSet, &pOutputData[i * chunkSize], length);
+		else
+			rv = (*libMSCReadObject) (pConnection, objectID,
+				i * chunkSize + offSet, &pOutputData[i * chunkSize],
+				(MSCUChar8)length);
 
 		if (rv != MSC_SUCCESS)
 			return rv;
 
-		if (rwCallback)
+		if (rwCallback && (length == chunkSize))
 		{
 			if ((*callBackFunction) (addParams,
 					stepInterval * i) == MSC_CANCELLED)
@@ -1566,29 +2803,42 @@ MSC_RV MSCReadObject(MSCLPTokenConnection pConnection,
 		}
 	}
 
-	if (objectSize % MSC_SIZEOF_KEYPACKET)
-	{
-		rv = (*libMSCReadObject) (pConnection, objectID,
-			i * MSC_SIZEOF_KEYPACKET + offSet,
-			&pOutputData[i * MSC_SIZEOF_KEYPACKET],
-			objectSize % MSC_SIZEOF_KEYPACKET);
-
-		if (rv != MSC_SUCCESS)
-			return rv;
-	}
-
 	if (rwCallback)
 	{
 		(*callBackFunction) (addParams, MSC_PERCENT_STEPSIZE);
 	}
 
+	if (rv == MSC_SUCCESS)
+		OCStoreObject(pConnection, objectID, offSet, pOutputData, dataSize);
+
+	return rv;
+}
+
+MSC_RV MSCReadObject(MSCLPTokenConnection pConnection,
+	MSCCString objectID, MSCULong32 offSet,
+	MSCPUChar8 pOutputData, MSCULong32 dataSize,
+	LPRWEventCallback rwCallback, MSCPVoid32 addParams)
+{
+	MSC_RV rv;
+
+	if (pConnection == NULL)
+		return MSC_INVALID_PARAMETER;
+	if (mscNoContext(pConnection))
+		return MSC_INTERNAL_ERROR;
+
+	/* the object is read in several chunks */
+	mscLockConnection(pConnection);
+	rv = mscReadObject(pConnection, objectID, offSet,
+		pOutputData, dataSize, rwCallback, addParams);
+	mscUnLockConnection(pConnection);
+
 	return rv;
 }
 
 MSC_RV MSCListObjects(MSCLPTokenConnection pConnection,
 	MSCUChar8 seqOption, MSCLPObjectInfo pObjectInfo)
 {
-	MSCLong32 rv;
+	MSC_RV rv;
 	MSCPVoid32 vFunction;
 
 	MSCLong32(*libMSCListObjects) (MSCLPTokenConnection, MSCUChar8,
@@ -1596,9 +2846,17 @@ MSC_RV MSCListObjects(MSCLPTokenConnection pConnection,
 
 	if (pConnection == NULL)
 		return MSC_INVALID_PARAMETER;
-	if (localHContext == 0)
+	if (mscNoContext(pConnection))
 		return MSC_INTERNAL_ERROR;
 
+	mscLockConnection(pConnection);
+
+	if (OCListObjects(pConnection, seqOption, pObjectInfo, &rv))
+	{
+		mscUnLockConnection(pConnection);
+		return rv;
+	}
+
 	vFunction = pConnection->libPointers.pvfListObjects;
 
 	if (vFunction != NULL)
@@ -1608,7 +2866,9 @@ MSC_RV MSCListObjects(MSCLPTokenConnection pConnection,
 		rv = (*libMSCListObjects) (pConnection, seqOption, pObjectInfo);
 	}
 	else
-		return MSC_UNSUPPORTED_FEATURE;
+		rv = MSC_UNSUPPORTED_FEATURE;
+
+	mscUnLockConnection(pConnection);
 
 	return rv;
 }
@@ -1622,9 +2882,11 @@ MSC_RV MSCLogoutAll(MSCLPTokenConnection pConnection)
 
 	if (pConnection == NULL)
 		return MSC_INVALID_PARAMETER;
-	if (localHContext == 0)
+	if (mscNoContext(pConnection))
 		return MSC_INTERNAL_ERROR;
 
+	mscLockConnection(pConnection);
+
 	vFunction = pConnection->libPointers.pvfLogoutAll;
 
 	if (vFunction != NULL)
@@ -1633,7 +2895,15 @@ MSC_RV MSCLogoutAll(MSCLPTokenConnection pConnection)
 		rv = (*libMSCLogoutAll) (pConnection);
 	}
 	else
-		return MSC_UNSUPPORTED_FEATURE;
+		rv = MSC_UNSUPPORTED_FEATURE;
+
+	/* the objects read may be protected by a PIN */
+	OCFlush(pConnection, OC_FLUSH_CONTENTS);
+
+	if (rv == MSC_SUCCESS)
+		pConnection->loggedIDs = 0;
+
+	mscUnLockConnection(pConnection);
 
 	return rv;
 }
@@ -1649,9 +2919,11 @@ MSC_RV MSCGetChallenge(MSCLPTokenConnection pConnection, MSCPUChar8 pSeed,
 
 	if (pConnection == NULL)
 		return MSC_INVALID_PARAMETER;
-	if (localHContext == 0)
+	if (mscNoContext(pConnection))
 		return MSC_INTERNAL_ERROR;
 
+	mscLockConnection(pConnection);
+
 	vFunction = pConnection->libPointers.pvfGetChallenge;
 
 	if (vFunction != NULL)
@@ -1662,22 +2934,19 @@ MSC_RV MSCGetChallenge(MSCLPTokenConnection pConnection, MSCPUChar8 pSeed,
 			pRandomData, randomDataSize);
 	}
 	else
-		return MSC_UNSUPPORTED_FEATURE;
+		rv = MSC_UNSUPPORTED_FEATURE;
+
+	mscUnLockConnection(pConnection);
 
 	return rv;
 }
 
-MSC_RV MSCGetKeyAttributes(MSCLPTokenConnection pConnection,
+static MSC_RV mscGetKeyAttributes(MSCLPTokenConnection pConnection,
 	MSCUChar8 keyNumber, MSCLPKeyInfo pKeyInfo)
 {
 	MSC_RV rv;
 	MSCKeyInfo keyInfo;
 
-	if (pConnection == NULL)
-		return MSC_INVALID_PARAMETER;
-	if (localHContext == 0)
-		return MSC_INTERNAL_ERROR;
-
 	rv = MSCListKeys(pConnection, MSC_SEQUENCE_RESET, &keyInfo);
 
 	if (rv != MSC_SEQUENCE_END && rv != MSC_SUCCESS)
@@ -1731,17 +3000,30 @@ MSC_RV MSCGetKeyAttributes(MSCLPTokenConnection pConnection,
 	return MSC_SUCCESS;
 }
 
-MSC_RV MSCGetObjectAttributes(MSCLPTokenConnection pConnection,
-	MSCCString objectID, MSCLPObjectInfo pObjectInfo)
+MSC_RV MSCGetKeyAttributes(MSCLPTokenConnection pConnection,
+	MSCUChar8 keyNumber, MSCLPKeyInfo pKeyInfo)
 {
 	MSC_RV rv;
-	MSCObjectInfo objInfo;
 
 	if (pConnection == NULL)
 		return MSC_INVALID_PARAMETER;
-	if (localHContext == 0)
+	if (mscNoContext(pConnection))
 		return MSC_INTERNAL_ERROR;
 
+	/* the key list is walked from the start */
+	mscLockConnection(pConnection);
+	rv = mscGetKeyAttributes(pConnection, keyNumber, pKeyInfo);
+	mscUnLockConnection(pConnection);
+
+	return rv;
+}
+
+static MSC_RV mscGetObjectAttributes(MSCLPTokenConnection pConnection,
+	MSCCString objectID, MSCLPObjectInfo pObjectInfo)
+{
+	MSC_RV rv;
+	MSCObjectInfo objInfo;
+
 	rv = MSCListObjects(pConnection, MSC_SEQUENCE_RESET, &objInfo);
 
 	if (rv != MSC_SEQUENCE_END && rv != MSC_SUCCESS)
@@ -1788,6 +3070,24 @@ MSC_RV MSCGetObjectAttributes(MSCLPTokenConnection pConnection,
 	return MSC_SUCCESS;
 }
 
+MSC_RV MSCGetObjectAttributes(MSCLPTokenConnection pConnection,
+	MSCCString objectID, MSCLPObjectInfo pObjectInfo)
+{
+	MSC_RV rv;
+
+	if (pConnection == NULL)
+		return MSC_INVALID_PARAMETER;
+	if (mscNoContext(pConnection))
+		return MSC_INTERNAL_ERROR;
+
+	/* the object list is walked from the start */
+	mscLockConnection(pConnection);
+	rv = mscGetObjectAttributes(pConnection, objectID, pObjectInfo);
+	mscUnLockConnection(pConnection);
+
+	return rv;
+}
+
 MSC_RV MSCReadAllocateObject(MSCLPTokenConnection pConnection,
 	MSCCString objectID, MSCPUChar8 * pOutputData,
 	MSCPULong32 dataSize, LPRWEventCallback rwCallback, MSCPVoid32 addParams)
@@ -1799,7 +3099,7 @@ MSC_RV MSCReadAllocateObject(MSCLPTokenConnection pConnection,
 
     if (pConnection == NULL)
         return MSC_INVALID_PARAMETER;
-     if (localHContext == 0)
+     if (mscNoContext(pConnection))
          return MSC_INTERNAL_ERROR;
 
     if (pOutputData == 0)
@@ -1810,6 +3110,9 @@ MSC_RV MSCReadAllocateObject(MSCLPTokenConnection pConnection,
     *dataSize = 0;
     *pOutputData = 0;
 
+    /* the object may change between the two calls */
+    mscLockConnection(pConnection);
+
     rv = MSCGetObjectAttributes(pConnection, objectID, &objInfo);
     if (rv == MSC_SUCCESS)
     {
@@ -1833,9 +3136,26 @@ MSC_RV MSCReadAllocateObject(MSCLPTokenConnection pConnection,
         }
     }
 
+    mscUnLockConnection(pConnection);
+
     return rv;
 }
 
+/*
+ * Clears a secret before its buffer is freed. The compiler may remove a
+ * memset() there since the buffer is not read any more.
+ */
+INTERNAL void mscWipe(void *buffer, size_t size)
+{
+#ifdef HAVE_EXPLICIT_BZERO
+	explicit_bzero(buffer, size);
+#else
+	volatile MSCUChar8 *p = buffer;
+
+	while (size--)
+		*p++ = 0;
+#endif
+}
 
 MSC_RV pcscToMSC(MSCLong32 pcscCode)
 {
@@ -2039,6 +3359,12 @@ MSC_RV MSCReEstablishConnection(MSCLPTokenConnection pConnection)
 	if (rv != SCARD_S_SUCCESS)
 		return pcscToMSC(rv);
 
+	/* the card may have been replaced */
+	pConnection->ioChunkSize = 0;
+	pConnection->cryptChunkSize = 0;
+	pConnection->loggedIDs = 0;
+	OCFlush(pConnection, OC_FLUSH_ALL);
+
 	/*
 	 * Stop the plugin and start it up again
 	 */
@@ -2068,6 +3394,9 @@ MSCUChar8 MSCIsTokenReset(MSCLPTokenConnection pConnection)
 	MSCUChar8 tokenId[MAX_ATR_SIZE];
 	MSCULong32 tokenIdLength;
 
+	if (pConnection->tokenInfo.tokenType & MSC_TOKEN_TYPE_SIMULATED)
+		return 0;
+
 	slotNameSize = sizeof(slotName);
 	tokenIdLength = sizeof(tokenId);
 
@@ -2100,6 +3429,9 @@ MSCUChar8 MSCIsTokenMoved(MSCLPTokenConnection pConnection)
 	if (pConnection->tokenInfo.tokenType & MSC_TOKEN_TYPE_REMOVED)
 		return 1;
 
+	if (pConnection->tokenInfo.tokenType & MSC_TOKEN_TYPE_SIMULATED)
+		return 0;
+
 	rv = SCardStatus(pConnection->hCard, slotName,
 		&slotNameSize, &slotState, &slotProtocol, tokenId, &tokenIdLength);
 
@@ -2109,15 +3441,35 @@ MSCUChar8 MSCIsTokenMoved(MSCLPTokenConnection pConnection)
 	return 0;
 }
 
+/*
+ * Same as MSCIsTokenMoved() || MSCIsTokenReset() with only one
+ * SCardStatus()
+ */
 MSCUChar8 MSCIsTokenChanged(MSCLPTokenConnection pConnection)
 {
-	if (MSCIsTokenMoved(pConnection))
+	MSCULong32 rv;
+	char slotName[MAX_READERNAME];
+	MSCULong32 slotNameSize = MAX_READERNAME, slotState, slotProtocol;
+	MSCUChar8 tokenId[MAX_ATR_SIZE];
+	MSCULong32 tokenIdLength = MAX_ATR_SIZE;
+
+	if (pConnection->tokenInfo.tokenType & MSC_TOKEN_TYPE_REMOVED)
 		return 1;
-	else
-		if (MSCIsTokenReset(pConnection))
-			return 1;
-		else
-			return 0;
+
+	if (pConnection->tokenInfo.tokenType & MSC_TOKEN_TYPE_SIMULATED)
+		return 0;
+
+	/* SCARD_W_RESET_CARD included */
+	rv = SCardStatus(pConnection->hCard, slotName,
+		&slotNameSize, &slotState, &slotProtocol, tokenId, &tokenIdLength);
+
+	if (rv != SCARD_S_SUCCESS || (slotState & SCARD_ABSENT))
+		return 1;
+
+	if (pConnection->tokenInfo.tokenType & MSC_TOKEN_TYPE_RESET)
+		return 1;
+
+	return 0;
 }
 
 MSCUChar8 MSCIsTokenKnown(MSCLPTokenConnection pConnection)
@@ -16,6 +16,7 @@
 #include "winscard.h"
 #include "musclecard.h"
 #include "strlcpycat.h"
+#include "mscbench.h"
 
 #define MY_OBJECT_ID    "c1"
 #define MY_OBJECT_SIZE  50
@@ -42,6 +43,9 @@ int main(int argc, char **argv)
 	int reader_to_use;
 	int i, j;
 
+	if ((argc > 1) && (strcmp(argv[1], "-b") == 0))
+		return BMBenchmark(argc - 1, argv + 1);
+
 	printf("********************************************************\n");
 	printf("\n");
 
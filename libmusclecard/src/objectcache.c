@@ -0,0 +1,491 @@
+/*
+ * This keeps the objects and keys of a token in memory.
+ *
+ * MUSCLE SmartCard Development ( http://www.linuxnet.com )
+ *
+ * Copyright (C) 2009
+ *  Ludovic Rousseau <ludovic.rousseau@free.fr>
+ *
+ * $Id$
+ */
+
+/*
+ * The object list, the key list and the objects read completely are
+ * kept for each connection so MSCListObjects(), MSCGetObjectAttributes()
+ * and MSCReadAllocateObject() do not go to the token again.
+ *
+ * Another application may change the token between two of our
+ * commands so the cache is only used with an exclusive connection or
+ * during a transaction. It is emptied when the event counter of the
+ * reader changes (the token was removed or inserted), when the
+ * connection is established again after a reset and for the parts
+ * changed by our own commands.
+ */
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include "misc.h"
+#include <winscard.h>
+#include "debug.h"
+
+#include "musclecard.h"
+#include "objectcache.h"
+#include "strlcpycat.h"
+
+/* largest size of the object contents kept for a connection */
+#define OC_MAX_CONTENTS 65536
+
+typedef struct CachedObject
+{
+	struct CachedObject *next;
+	MSCChar8 objectID[MSC_MAXSIZE_OBJID];
+	MSCULong32 size;
+	MSCPUChar8 data;
+}
+CachedObject;
+
+typedef struct
+{
+	MSCULong32 eventCounter;	/* of the reader when the cache was filled */
+	int transaction;		/* a transaction is in progress */
+
+	MSCLPObjectInfo objects;
+	MSCULong32 objectCount;
+	MSCULong32 objectNext;	/* for MSC_SEQUENCE_NEXT */
+	int objectsKnown;
+
+	MSCLPKeyInfo keys;
+	MSCULong32 keyCount;
+	MSCULong32 keyNext;
+	int keysKnown;
+
+	CachedObject *contents;
+	MSCULong32 contentsSize;
+}
+ObjectCache;
+
+static ObjectCache *OCGetCache(MSCLPTokenConnection);
+static MSC_RV OCFillObjects(MSCLPTokenConnection, ObjectCache *);
+static MSC_RV OCFillKeys(MSCLPTokenConnection, ObjectCache *);
+static void OCFreeContents(ObjectCache *, MSCCString);
+
+/*
+ * Gives the next object of the list. The list is read completely from
+ * the token the first time.
+ *
+ * Returns 0 if the cache can not be used and the token library must be
+ * called instead, 1 if *pRv is the result.
+ */
+int OCListObjects(MSCLPTokenConnection pConnection, MSCUChar8 seqOption,
+	MSCLPObjectInfo pObjectInfo, MSC_RV *pRv)
+{
+	ObjectCache *cache;
+
+	cache = OCGetCache(pConnection);
+	if (cache == NULL)
+		return 0;
+
+	if (seqOption == MSC_SEQUENCE_RESET)
+	{
+		if (!cache->objectsKnown)
+		{
+			*pRv = OCFillObjects(pConnection, cache);
+			if (*pRv != MSC_SUCCESS)
+				return 1;
+		}
+
+		cache->objectNext = 0;
+	}
+	else
+		/* the list was started with the token library */
+		if (!cache->objectsKnown)
+			return 0;
+
+	if (cache->objectNext >= cache->objectCount)
+	{
+		*pRv = MSC_SEQUENCE_END;
+		return 1;
+	}
+
+	memcpy(pObjectInfo, &cache->objects[cache->objectNext++],
+		sizeof(MSCObjectInfo));
+	*pRv = MSC_SUCCESS;
+
+	return 1;
+}
+
+/*
+ * Same as OCListObjects() for the keys
+ */
+int OCListKeys(MSCLPTokenConnection pConnection, MSCUChar8 seqOption,
+	MSCLPKeyInfo pKeyInfo, MSC_RV *pRv)
+{
+	ObjectCache *cache;
+
+	cache = OCGetCache(pConnection);
+	if (cache == NULL)
+		return 0;
+
+	if (seqOption == MSC_SEQUENCE_RESET)
+	{
+		if (!cache->keysKnown)
+		{
+			*pRv = OCFillKeys(pConnection, cache);
+			if (*pRv != MSC_SUCCESS)
+				return 1;
+		}
+
+		cache->keyNext = 0;
+	}
+	else
+		if (!cache->keysKnown)
+			return 0;
+
+	if (cache->keyNext >= cache->keyCount)
+	{
+		*pRv = MSC_SEQUENCE_END;
+		return 1;
+	}
+
+	memcpy(pKeyInfo, &cache->keys[cache->keyNext++], sizeof(MSCKeyInfo));
+	*pRv = MSC_SUCCESS;
+
+	return 1;
+}
+
+/*
+ * Copies a part of an object if its content is known.
+ *
+ * Returns 1 if the data was copied, 0 otherwise.
+ */
+int OCReadObject(MSCLPTokenConnection pConnection, MSCCString objectID,
+	MSCULong32 offSet, MSCPUChar8 pOutputData, MSCULong32 dataSize)
+{
+	ObjectCache *cache;
+	CachedObject *object;
+
+	cache = OCGetCache(pConnection);
+	if (cache == NULL)
+		return 0;
+
+	for (object = cache->contents; object; object = object->next)
+		if (strncmp(objectID, object->objectID, MSC_MAXSIZE_OBJID) == 0)
+			break;
+
+	if ((object == NULL) || (offSet > object->size)
+		|| (dataSize > object->size - offSet))
+		return 0;
+
+	memcpy(pOutputData, object->data + offSet, dataSize);
+
+	return 1;
+}
+
+/*
+ * Keeps an object just read from the token. Only complete objects of
+ * the known object list are kept.
+ */
+void OCStoreObject(MSCLPTokenConnection pConnection, MSCCString objectID,
+	MSCULong32 offSet, MSCPUChar8 pData, MSCULong32 dataSize)
+{
+	ObjectCache *cache;
+	CachedObject *object;
+	MSCULong32 i;
+
+	cache = OCGetCache(pConnection);
+	if ((cache == NULL) || !cache->objectsKnown || (offSet != 0))
+		return;
+
+	for (i = 0; i < cache->objectCount; i++)
+		if (strncmp(objectID, cache->objects[i].objectID,
+			MSC_MAXSIZE_OBJID) == 0)
+			break;
+
+	if ((i == cache->objectCount) || (cache->objects[i].objectSize != dataSize))
+		return;
+
+	if (cache->contentsSize + dataSize > OC_MAX_CONTENTS)
+		return;
+
+	OCFreeContents(cache, objectID);
+
+	object = malloc(sizeof(CachedObject));
+	if (object == NULL)
+		return;
+
+	object->data = malloc(dataSize ? dataSize : 1);
+	if (object->data == NULL)
+	{
+		free(object);
+		return;
+	}
+
+	strlcpy(object->objectID, objectID, sizeof(object->objectID));
+	object->size = dataSize;
+	memcpy(object->data, pData, dataSize);
+
+	object->next = cache->contents;
+	cache->contents = object;
+	cache->contentsSize += dataSize;
+}
+
+/*
+ * The object was written by us
+ */
+void OCForgetObject(MSCLPTokenConnection pConnection, MSCCString objectID)
+{
+	ObjectCache *cache = pConnection->objectCache;
+
+	if (cache)
+		OCFreeContents(cache, objectID);
+}
+
+/*
+ * A transaction starts (1) or ends (0)
+ */
+void OCTransaction(MSCLPTokenConnection pConnection, int start)
+{
+	ObjectCache *cache = pConnection->objectCache;
+
+	if (start && (cache == NULL))
+	{
+		cache = calloc(1, sizeof(ObjectCache));
+		pConnection->objectCache = cache;
+	}
+
+	if (cache == NULL)
+		return;
+
+	/* the token may have been changed since our last transaction */
+	if (start && (pConnection->shareMode != SCARD_SHARE_EXCLUSIVE))
+		OCFlush(pConnection, OC_FLUSH_ALL);
+
+	cache->transaction = start;
+}
+
+/*
+ * Empties parts of the cache. See OC_FLUSH_*
+ */
+void OCFlush(MSCLPTokenConnection pConnection, int what)
+{
+	ObjectCache *cache = pConnection->objectCache;
+
+	if (cache == NULL)
+		return;
+
+	if (what & (OC_FLUSH_OBJECTS | OC_FLUSH_CONTENTS))
+		OCFreeContents(cache, NULL);
+
+	if (what & OC_FLUSH_OBJECTS)
+	{
+		free(cache->objects);
+		cache->objects = NULL;
+		cache->objectCount = 0;
+		cache->objectsKnown = 0;
+	}
+
+	if (what & OC_FLUSH_KEYS)
+	{
+		free(cache->keys);
+		cache->keys = NULL;
+		cache->keyCount = 0;
+		cache->keysKnown = 0;
+	}
+}
+
+/*
+ * The connection is released
+ */
+void OCRelease(MSCLPTokenConnection pConnection)
+{
+	OCFlush(pConnection, OC_FLUSH_ALL);
+	free(pConnection->objectCache);
+	pConnection->objectCache = NULL;
+}
+
+/*
+ * Gives the cache of the connection if it can be used now
+ */
+static ObjectCache *OCGetCache(MSCLPTokenConnection pConnection)
+{
+	ObjectCache *cache = pConnection->objectCache;
+	SCARD_READERSTATE_A readerState;
+	MSCLong32 rv;
+
+	/* another application may change the token between our commands */
+	if ((pConnection->shareMode != SCARD_SHARE_EXCLUSIVE)
+		&& ((cache == NULL) || !cache->transaction))
+		return NULL;
+
+	if (pConnection->tokenInfo.tokenType & MSC_TOKEN_TYPE_REMOVED)
+		return NULL;
+
+	if (cache == NULL)
+	{
+		cache = calloc(1, sizeof(ObjectCache));
+		if (cache == NULL)
+			return NULL;
+		pConnection->objectCache = cache;
+	}
+
+	/*
+	 * The event counter of the reader is in the upper word of
+	 * dwEventState. An impossible counter in dwCurrentState makes
+	 * SCardGetStatusChange() return immediately.
+	 */
+	memset(&readerState, 0, sizeof(readerState));
+	readerState.szReader = pConnection->tokenInfo.slotName;
+	readerState.dwCurrentState = 0xFFFF0000;
+
+	rv = SCardGetStatusChange(pConnection->hContext, 0, &readerState, 1);
+	if ((rv != SCARD_S_SUCCESS) && (rv != SCARD_E_TIMEOUT))
+		return NULL;
+
+	if (!(readerState.dwEventState & SCARD_STATE_PRESENT))
+	{
+		OCFlush(pConnection, OC_FLUSH_ALL);
+		return NULL;
+	}
+
+	if ((readerState.dwEventState >> 16) != cache->eventCounter)
+	{
+#ifndef NO_MSC_DEBUG
+		Log2(PCSC_LOG_DEBUG, "Token changed in %s, cache emptied",
+			pConnection->tokenInfo.slotName);
+#endif
+		OCFlush(pConnection, OC_FLUSH_ALL);
+		cache->eventCounter = readerState.dwEventState >> 16;
+	}
+
+	return cache;
+}
+
+static MSC_RV OCFillObjects(MSCLPTokenConnection pConnection,
+	ObjectCache *cache)
+{
+	MSCLong32(*libMSCListObjects) (MSCLPTokenConnection, MSCUChar8,
+		MSCLPObjectInfo);
+	MSCObjectInfo objectInfo;
+	MSCUChar8 seqOption = MSC_SEQUENCE_RESET;
+	MSCULong32 size = 0;
+	MSC_RV rv;
+
+	if (pConnection->libPointers.pvfListObjects == NULL)
+		return MSC_UNSUPPORTED_FEATURE;
+
+	libMSCListObjects = (MSCLong32(*)(MSCLPTokenConnection, MSCUChar8,
+			MSCLPObjectInfo)) pConnection->libPointers.pvfListObjects;
+
+	OCFlush(pConnection, OC_FLUSH_OBJECTS);
+
+	while ((rv = (*libMSCListObjects) (pConnection, seqOption,
+		&objectInfo)) == MSC_SUCCESS)
+	{
+		if (cache->objectCount == size)
+		{
+			MSCLPObjectInfo objects;
+
+			size = size ? size * 2 : 16;
+			objects = realloc(cache->objects, size * sizeof(MSCObjectInfo));
+			if (objects == NULL)
+			{
+				OCFlush(pConnection, OC_FLUSH_OBJECTS);
+				return MSC_INTERNAL_ERROR;
+			}
+			cache->objects = objects;
+		}
+
+		memcpy(&cache->objects[cache->objectCount++], &objectInfo,
+			sizeof(MSCObjectInfo));
+		seqOption = MSC_SEQUENCE_NEXT;
+	}
+
+	if (rv != MSC_SEQUENCE_END)
+	{
+		OCFlush(pConnection, OC_FLUSH_OBJECTS);
+		return rv;
+	}
+
+	cache->objectsKnown = 1;
+
+	return MSC_SUCCESS;
+}
+
+static MSC_RV OCFillKeys(MSCLPTokenConnection pConnection,
+	ObjectCache *cache)
+{
+	MSCLong32(*libMSCListKeys) (MSCLPTokenConnection, MSCUChar8,
+		MSCLPKeyInfo);
+	MSCKeyInfo keyInfo;
+	MSCUChar8 seqOption = MSC_SEQUENCE_RESET;
+	MSCULong32 size = 0;
+	MSC_RV rv;
+
+	if (pConnection->libPointers.pvfListKeys == NULL)
+		return MSC_UNSUPPORTED_FEATURE;
+
+	libMSCListKeys = (MSCLong32(*)(MSCLPTokenConnection, MSCUChar8,
+			MSCLPKeyInfo)) pConnection->libPointers.pvfListKeys;
+
+	OCFlush(pConnection, OC_FLUSH_KEYS);
+
+	while ((rv = (*libMSCListKeys) (pConnection, seqOption,
+		&keyInfo)) == MSC_SUCCESS)
+	{
+		if (cache->keyCount == size)
+		{
+			MSCLPKeyInfo keys;
+
+			size = size ? size * 2 : 16;
+			keys = realloc(cache->keys, size * sizeof(MSCKeyInfo));
+			if (keys == NULL)
+			{
+				OCFlush(pConnection, OC_FLUSH_KEYS);
+				return MSC_INTERNAL_ERROR;
+			}
+			cache->keys = keys;
+		}
+
+		memcpy(&cache->keys[cache->keyCount++], &keyInfo,
+			sizeof(MSCKeyInfo));
+		seqOption = MSC_SEQUENCE_NEXT;
+	}
+
+	if (rv != MSC_SEQUENCE_END)
+	{
+		OCFlush(pConnection, OC_FLUSH_KEYS);
+		return rv;
+	}
+
+	cache->keysKnown = 1;
+
+	return MSC_SUCCESS;
+}
+
+/*
+ * Frees the content of an object or of all the objects if objectID is
+ * NULL
+ */
+static void OCFreeContents(ObjectCache *cache, MSCCString objectID)
+{
+	CachedObject **p = &cache->contents;
+
+	while (*p)
+	{
+		CachedObject *object = *p;
+
+		if (objectID && strncmp(objectID, object->objectID,
+			MSC_MAXSIZE_OBJID))
+		{
+			p = &object->next;
+			continue;
+		}
+
+		*p = object->next;
+		cache->contentsSize -= object->size;
+		free(object->data);
+		free(object);
+	}
+}
@@ -0,0 +1,45 @@
+/*
+ * This keeps the objects and keys of a token in memory.
+ *
+ * MUSCLE SmartCard Development ( http://www.linuxnet.com )
+ *
+ * Copyright (C) 2009
+ *  Ludovic Rousseau <ludovic.rousseau@free.fr>
+ *
+ * $Id$
+ */
+
+#ifndef __objectcache_h__
+#define __objectcache_h__
+
+#include "mscdefines.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* parts of the cache for OCFlush() */
+#define OC_FLUSH_OBJECTS	0x01	/* object list and contents */
+#define OC_FLUSH_KEYS		0x02	/* key list */
+#define OC_FLUSH_CONTENTS	0x04	/* object contents only */
+#define OC_FLUSH_ALL		(OC_FLUSH_OBJECTS | OC_FLUSH_KEYS)
+
+	int OCListObjects(MSCLPTokenConnection, MSCUChar8, MSCLPObjectInfo,
+		MSC_RV *);
+	int OCListKeys(MSCLPTokenConnection, MSCUChar8, MSCLPKeyInfo,
+		MSC_RV *);
+	int OCReadObject(MSCLPTokenConnection, MSCCString, MSCULong32,
+		MSCPUChar8, MSCULong32);
+	void OCStoreObject(MSCLPTokenConnection, MSCCString, MSCULong32,
+		MSCPUChar8, MSCULong32);
+	void OCForgetObject(MSCLPTokenConnection, MSCCString);
+	void OCTransaction(MSCLPTokenConnection, int);
+	void OCFlush(MSCLPTokenConnection, int);
+	void OCRelease(MSCLPTokenConnection);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif							/* __objectcache_h__ */
@@ -0,0 +1,452 @@
+/*
+ * This simulates a MUSCLE token in memory for muscletest.
+ *
+ * MUSCLE SmartCard Development ( http://www.linuxnet.com )
+ *
+ * Copyright (C) 2009
+ *  Ludovic Rousseau <ludovic.rousseau@free.fr>
+ *
+ * $Id$
+ */
+
+/*
+ * The functions of a token library working on objects, keys and PINs
+ * kept in memory. They are given to MSCEstablishSimulatedConnection()
+ * so the benchmark of muscletest runs without reader nor token. The
+ * state of a token is in tokenInfo.addParams of the connection.
+ *
+ * Each command waits for the delay given to STCreateToken() to look
+ * like a real token. With no delay only the time used by libmusclecard
+ * is measured. The ACLs are kept but not checked and the "crypt" only
+ * mixes the data with the key number.
+ */
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "musclecard.h"
+#include "mscsimulated.h"
+#include "simtoken.h"
+
+#define ST_MAX_OBJECTS	32
+#define ST_MAX_PINSIZE	16
+#define ST_MEMORY		(1024 * 1024)
+#define ST_MAXIO		1024	/* MSC_TAG_CAPABLE_*_MAXIO */
+
+typedef struct
+{
+	MSCChar8 objectID[MSC_MAXSIZE_OBJID];
+	MSCULong32 size;
+	MSCPUChar8 data;
+	MSCObjectACL acl;
+}
+STObject;
+
+typedef struct
+{
+	STObject objects[ST_MAX_OBJECTS];
+	MSCULong32 usedMemory;
+	MSCULong32 objectNext;	/* for MSC_SEQUENCE_NEXT */
+
+	MSCKeyInfo keys[MSC_MAX_KEYS];
+	int keyPresent[MSC_MAX_KEYS];
+	MSCULong32 keyNext;
+
+	MSCUChar8 pin[ST_MAX_PINSIZE];
+	MSCULong32 pinSize;
+	MSCUShort16 loggedID;
+
+	MSCULong32 delay;		/* us used by each command */
+}
+SimToken;
+
+static SimToken *STGetToken(MSCLPTokenConnection pConnection)
+{
+	SimToken *token = pConnection->tokenInfo.addParams;
+
+	if (token->delay)
+		(void)usleep(token->delay);
+
+	return token;
+}
+
+static STObject *STFindObject(SimToken *token, MSCCString objectID)
+{
+	int i;
+
+	for (i = 0; i < ST_MAX_OBJECTS; i++)
+		if (token->objects[i].data && (strncmp(token->objects[i].objectID,
+			objectID, MSC_MAXSIZE_OBJID) == 0))
+			return &token->objects[i];
+
+	return NULL;
+}
+
+/*
+ * Token identification: one simulated reader per token, the PIN 0 is
+ * pinCode
+ */
+MSC_RV STCreateToken(MSCLPTokenInfo tokenInfo, int index,
+	MSCPUChar8 pinCode, MSCULong32 pinSize, MSCULong32 delay)
+{
+	SimToken *token;
+
+	if (pinSize > ST_MAX_PINSIZE)
+		return MSC_INVALID_PARAMETER;
+
+	token = calloc(1, sizeof(SimToken));
+	if (token == NULL)
+		return MSC_INTERNAL_ERROR;
+
+	memcpy(token->pin, pinCode, pinSize);
+	token->pinSize = pinSize;
+	token->delay = delay;
+
+	memset(tokenInfo, 0, sizeof(MSCTokenInfo));
+	strncpy(tokenInfo->tokenName, "Simulated MUSCLE Token",
+		MSC_MAXSIZE_TOKENAME - 1);
+	snprintf(tokenInfo->slotName, sizeof(tokenInfo->slotName),
+		"Simulated Reader %d", index);
+	tokenInfo->tokenState = MSC_STATE_PRESENT;
+	tokenInfo->addParams = token;
+	tokenInfo->addParamsSize = sizeof(SimToken);
+
+	return MSC_SUCCESS;
+}
+
+void STDestroyToken(MSCLPTokenInfo tokenInfo)
+{
+	SimToken *token = tokenInfo->addParams;
+	int i;
+
+	if (token == NULL)
+		return;
+
+	for (i = 0; i < ST_MAX_OBJECTS; i++)
+		free(token->objects[i].data);
+
+	free(token);
+	tokenInfo->addParams = NULL;
+}
+
+static MSCLong32 STInitializePlugin(MSCLPTokenConnection pConnection)
+{
+	return pConnection->tokenInfo.addParams ? MSC_SUCCESS
+		: MSC_UNRECOGNIZED_TOKEN;
+}
+
+static MSCLong32 STIdentifyToken(MSCLPTokenConnection pConnection)
+{
+	(void)STGetToken(pConnection);
+
+	return MSC_SUCCESS;
+}
+
+static MSCLong32 STFinalizePlugin(MSCLPTokenConnection pConnection)
+{
+	(void)pConnection;
+
+	return MSC_SUCCESS;
+}
+
+static MSCLong32 STGetStatus(MSCLPTokenConnection pConnection,
+	MSCLPStatusInfo pStatusInfo)
+{
+	SimToken *token = STGetToken(pConnection);
+	int i;
+
+	memset(pStatusInfo, 0, sizeof(MSCStatusInfo));
+	pStatusInfo->appVersion = 0x0100;
+	pStatusInfo->swVersion = 0x0100;
+	pStatusInfo->totalMemory = ST_MEMORY;
+	pStatusInfo->freeMemory = ST_MEMORY - token->usedMemory;
+	pStatusInfo->usedPINs = 1;
+	for (i = 0; i < MSC_MAX_KEYS; i++)
+		if (token->keyPresent[i])
+			pStatusInfo->usedKeys++;
+	pStatusInfo->loggedID = token->loggedID;
+
+	return MSC_SUCCESS;
+}
+
+static MSCLong32 STGetCapabilities(MSCLPTokenConnection pConnection,
+	MSCULong32 tag, MSCPUChar8 value, MSCPULong32 length)
+{
+	MSCULong32 maxIO = ST_MAXIO;
+
+	(void)STGetToken(pConnection);
+
+	switch (tag)
+	{
+		case MSC_TAG_CAPABLE_OBJ_MAXIO:
+		case MSC_TAG_CAPABLE_CRYPT_MAXIO:
+			if (*length < sizeof(maxIO))
+				return MSC_INSUFFICIENT_BUFFER;
+			memcpy(value, &maxIO, sizeof(maxIO));
+			*length = sizeof(maxIO);
+			return MSC_SUCCESS;
+
+		default:
+			return MSC_UNSUPPORTED_FEATURE;
+	}
+}
+
+static MSCLong32 STGenerateKeys(MSCLPTokenConnection pConnection,
+	MSCUChar8 prvKeyNum, MSCUChar8 pubKeyNum, MSCLPGenKeyParams pParams)
+{
+	SimToken *token = STGetToken(pConnection);
+	MSCLPKeyInfo key;
+
+	if ((prvKeyNum >= MSC_MAX_KEYS) || (pubKeyNum >= MSC_MAX_KEYS))
+		return MSC_INCORRECT_P1;
+
+	key = &token->keys[prvKeyNum];
+	memset(key, 0, sizeof(MSCKeyInfo));
+	key->keyNum = prvKeyNum;
+	key->keyType = MSC_KEY_RSA_PRIVATE;
+	key->keySize = pParams->keySize;
+	key->keyPolicy = pParams->privateKeyPolicy;
+	key->keyACL = pParams->privateKeyACL;
+	token->keyPresent[prvKeyNum] = 1;
+
+	key = &token->keys[pubKeyNum];
+	memset(key, 0, sizeof(MSCKeyInfo));
+	key->keyNum = pubKeyNum;
+	key->keyType = MSC_KEY_RSA_PUBLIC;
+	key->keySize = pParams->keySize;
+	key->keyPolicy = pParams->publicKeyPolicy;
+	key->keyACL = pParams->publicKeyACL;
+	token->keyPresent[pubKeyNum] = 1;
+
+	return MSC_SUCCESS;
+}
+
+static MSCLong32 STComputeCrypt(MSCLPTokenConnection pConnection,
+	MSCLPCryptInit cryptInit, MSCPUChar8 pInputData,
+	MSCULong32 inputDataSize, MSCPUChar8 pOutputData,
+	MSCPULong32 outputDataSize)
+{
+	SimToken *token = STGetToken(pConnection);
+	MSCULong32 i;
+
+	if ((cryptInit->keyNum >= MSC_MAX_KEYS)
+		|| !token->keyPresent[cryptInit->keyNum])
+		return MSC_INCORRECT_P1;
+
+	if (*outputDataSize < inputDataSize)
+		return MSC_INSUFFICIENT_BUFFER;
+
+	for (i = 0; i < inputDataSize; i++)
+		pOutputData[i] = pInputData[i] ^ cryptInit->keyNum;
+	*outputDataSize = inputDataSize;
+
+	return MSC_SUCCESS;
+}
+
+static MSCLong32 STListKeys(MSCLPTokenConnection pConnection,
+	MSCUChar8 seqOption, MSCLPKeyInfo pKeyInfo)
+{
+	SimToken *token = STGetToken(pConnection);
+
+	if (seqOption == MSC_SEQUENCE_RESET)
+		token->keyNext = 0;
+
+	while ((token->keyNext < MSC_MAX_KEYS)
+		&& !token->keyPresent[token->keyNext])
+		token->keyNext++;
+
+	if (token->keyNext >= MSC_MAX_KEYS)
+		return MSC_SEQUENCE_END;
+
+	*pKeyInfo = token->keys[token->keyNext++];
+
+	return MSC_SUCCESS;
+}
+
+static MSCLong32 STVerifyPIN(MSCLPTokenConnection pConnection,
+	MSCUChar8 pinNum, MSCPUChar8 pPinCode, MSCULong32 pinCodeSize)
+{
+	SimToken *token = STGetToken(pConnection);
+
+	if (pinNum != 0)
+		return MSC_INCORRECT_P1;
+
+	if ((pinCodeSize != token->pinSize)
+		|| (memcmp(pPinCode, token->pin, pinCodeSize) != 0))
+	{
+		token->loggedID &= ~1;
+		return MSC_AUTH_FAILED;
+	}
+
+	token->loggedID |= 1;
+
+	return MSC_SUCCESS;
+}
+
+static MSCLong32 STLogoutAll(MSCLPTokenConnection pConnection)
+{
+	SimToken *token = STGetToken(pConnection);
+
+	token->loggedID = 0;
+
+	return MSC_SUCCESS;
+}
+
+static MSCLong32 STCreateObject(MSCLPTokenConnection pConnection,
+	MSCCString objectID, MSCULong32 objectSize, MSCLPObjectACL pObjectACL)
+{
+	SimToken *token = STGetToken(pConnection);
+	STObject *object;
+	int i;
+
+	if (STFindObject(token, objectID))
+		return MSC_OBJECT_EXISTS;
+
+	if ((objectSize == 0) || (objectSize > ST_MEMORY - token->usedMemory))
+		return MSC_NO_MEMORY_LEFT;
+
+	for (i = 0; (i < ST_MAX_OBJECTS) && token->objects[i].data; i++)
+		;
+	if (i == ST_MAX_OBJECTS)
+		return MSC_NO_MEMORY_LEFT;
+
+	object = &token->objects[i];
+	object->data = calloc(1, objectSize);
+	if (object->data == NULL)
+		return MSC_NO_MEMORY_LEFT;
+
+	strncpy(object->objectID, objectID, MSC_MAXSIZE_OBJID);
+	object->size = objectSize;
+	object->acl = *pObjectACL;
+	token->usedMemory += objectSize;
+
+	return MSC_SUCCESS;
+}
+
+static MSCLong32 STDeleteObject(MSCLPTokenConnection pConnection,
+	MSCCString objectID, MSCUChar8 zeroFlag)
+{
+	SimToken *token = STGetToken(pConnection);
+	STObject *object;
+
+	(void)zeroFlag;
+
+	object = STFindObject(token, objectID);
+	if (object == NULL)
+		return MSC_OBJECT_NOT_FOUND;
+
+	token->usedMemory -= object->size;
+	free(object->data);
+	memset(object, 0, sizeof(STObject));
+
+	return MSC_SUCCESS;
+}
+
+static MSCLong32 STWriteObjectEx(MSCLPTokenConnection pConnection,
+	MSCCString objectID, MSCULong32 offset, MSCPUChar8 pInputData,
+	MSCULong32 dataSize)
+{
+	SimToken *token = STGetToken(pConnection);
+	STObject *object;
+
+	object = STFindObject(token, objectID);
+	if (object == NULL)
+		return MSC_OBJECT_NOT_FOUND;
+
+	if ((dataSize > ST_MAXIO) || (offset > object->size)
+		|| (dataSize > object->size - offset))
+		return MSC_INVALID_PARAMETER;
+
+	memcpy(object->data + offset, pInputData, dataSize);
+
+	return MSC_SUCCESS;
+}
+
+static MSCLong32 STWriteObject(MSCLPTokenConnection pConnection,
+	MSCCString objectID, MSCULong32 offset, MSCPUChar8 pInputData,
+	MSCUChar8 dataSize)
+{
+	return STWriteObjectEx(pConnection, objectID, offset, pInputData,
+		dataSize);
+}
+
+static MSCLong32 STReadObjectEx(MSCLPTokenConnection pConnection,
+	MSCCString objectID, MSCULong32 offset, MSCPUChar8 pOutputData,
+	MSCULong32 dataSize)
+{
+	SimToken *token = STGetToken(pConnection);
+	STObject *object;
+
+	object = STFindObject(token, objectID);
+	if (object == NULL)
+		return MSC_OBJECT_NOT_FOUND;
+
+	if ((dataSize > ST_MAXIO) || (offset > object->size)
+		|| (dataSize > object->size - offset))
+		return MSC_INVALID_PARAMETER;
+
+	memcpy(pOutputData, object->data + offset, dataSize);
+
+	return MSC_SUCCESS;
+}
+
+static MSCLong32 STReadObject(MSCLPTokenConnection pConnection,
+	MSCCString objectID, MSCULong32 offset, MSCPUChar8 pOutputData,
+	MSCUChar8 dataSize)
+{
+	return STReadObjectEx(pConnection, objectID, offset, pOutputData,
+		dataSize);
+}
+
+static MSCLong32 STListObjects(MSCLPTokenConnection pConnection,
+	MSCUChar8 seqOption, MSCLPObjectInfo pObjectInfo)
+{
+	SimToken *token = STGetToken(pConnection);
+	STObject *object;
+
+	if (seqOption == MSC_SEQUENCE_RESET)
+		token->objectNext = 0;
+
+	while ((token->objectNext < ST_MAX_OBJECTS)
+		&& (token->objects[token->objectNext].data == NULL))
+		token->objectNext++;
+
+	if (token->objectNext >= ST_MAX_OBJECTS)
+		return MSC_SEQUENCE_END;
+
+	object = &token->objects[token->objectNext++];
+	memcpy(pObjectInfo->objectID, object->objectID, MSC_MAXSIZE_OBJID);
+	pObjectInfo->objectSize = object->size;
+	pObjectInfo->objectACL = object->acl;
+
+	return MSC_SUCCESS;
+}
+
+/*
+ * The functions not given are MSC_UNSUPPORTED_FEATURE for libmusclecard
+ */
+void STGetFunctions(LPCFDyLibPointers libPointers)
+{
+	memset(libPointers, 0, sizeof(CFDyLibPointers));
+
+	libPointers->pvfInitializePlugin = (MSCPVoid32) STInitializePlugin;
+	libPointers->pvfIdentifyToken = (MSCPVoid32) STIdentifyToken;
+	libPointers->pvfFinalizePlugin = (MSCPVoid32) STFinalizePlugin;
+	libPointers->pvfGetStatus = (MSCPVoid32) STGetStatus;
+	libPointers->pvfGetCapabilities = (MSCPVoid32) STGetCapabilities;
+	libPointers->pvfGenerateKeys = (MSCPVoid32) STGenerateKeys;
+	libPointers->pvfComputeCrypt = (MSCPVoid32) STComputeCrypt;
+	libPointers->pvfListKeys = (MSCPVoid32) STListKeys;
+	libPointers->pvfVerifyPIN = (MSCPVoid32) STVerifyPIN;
+	libPointers->pvfLogoutAll = (MSCPVoid32) STLogoutAll;
+	libPointers->pvfCreateObject = (MSCPVoid32) STCreateObject;
+	libPointers->pvfDeleteObject = (MSCPVoid32) STDeleteObject;
+	libPointers->pvfWriteObject = (MSCPVoid32) STWriteObject;
+	libPointers->pvfReadObject = (MSCPVoid32) STReadObject;
+	libPointers->pvfListObjects = (MSCPVoid32) STListObjects;
+	libPointers->pvfWriteObjectEx = (MSCPVoid32) STWriteObjectEx;
+	libPointers->pvfReadObjectEx = (MSCPVoid32) STReadObjectEx;
+}
@@ -0,0 +1,31 @@
+/*
+ * This simulates a MUSCLE token in memory for muscletest.
+ *
+ * MUSCLE SmartCard Development ( http://www.linuxnet.com )
+ *
+ * Copyright (C) 2009
+ *  Ludovic Rousseau <ludovic.rousseau@free.fr>
+ *
+ * $Id$
+ */
+
+#ifndef __simtoken_h__
+#define __simtoken_h__
+
+#include "musclecard.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+	MSC_RV STCreateToken(MSCLPTokenInfo, int, MSCPUChar8, MSCULong32,
+		MSCULong32);
+	void STDestroyToken(MSCLPTokenInfo);
+	void STGetFunctions(LPCFDyLibPointers);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif							/* __simtoken_h__ */
@@ -15,15 +15,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #ifdef HAVE_DIRENT_H
 #include <dirent.h>
 #endif
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 
 #include "misc.h"
 #include "debug.h"
 #include <parser.h>
 #include <dyn_generic.h>
+#include <thread_generic.h>
 
 #include "tokenfactory.h"
 #include "strlcpycat.h"
@@ -39,91 +47,318 @@
 #define MSC_MANUMSC_KEY_NAME                "spVendorName"
 #define MSC_PRODMSC_KEY_NAME                "spProductName"
 #define MSC_ATRMSC_KEY_NAME                 "spAtrValue"
+#define MSC_ATRMASK_KEY_NAME                "spAtrMask"
 #define MSC_LIBRMSC_KEY_NAME                "CFBundleExecutable"
 #define MSC_DEFAULTAPP_NAME                 "spDefaultApplication"
 
-static int atrToString(MSCPUChar8 Atr, MSCULong32 Length, char *outAtr)
+/*
+ * The ATR of all the bundles are read once and kept in memory. The ATR
+ * without mask are in a trie, one level per ATR byte. The ATR with a
+ * mask (spAtrMask) are compared one by one if the trie has no match.
+ *
+ * The index is read again when the drop directory changes (inotify, or
+ * its modification time if inotify is not available). Only the drop
+ * directory is watched: a bundle is installed or removed, not edited.
+ */
+typedef struct TokenEntry
+{
+	struct TokenEntry *next;	/* all the entries, in bundle order */
+	MSCUChar8 atr[MAX_ATR_SIZE];
+	MSCUChar8 mask[MAX_ATR_SIZE];
+	MSCULong32 atrLength;
+	int masked;
+	MSCChar8 tokenName[MSC_MAXSIZE_TOKENAME];
+	MSCChar8 svProvider[MSC_MAXSIZE_SVCPROV];
+	MSCUChar8 tokenApp[MSC_MAXSIZE_AID];
+	MSCULong32 tokenAppLen;
+}
+TokenEntry;
+
+typedef struct AtrNode
+{
+	MSCUChar8 value;		/* ATR byte of this level */
+	struct AtrNode *child;	/* next ATR byte */
+	struct AtrNode *sibling;	/* other values of this ATR byte */
+	TokenEntry *entry;	/* ATR ending here */
+}
+AtrNode;
+
+static PCSCLITE_MUTEX IndexMutex = PTHREAD_MUTEX_INITIALIZER;
+static int IndexBuilt = 0;
+static TokenEntry *IndexEntries = NULL;
+static AtrNode *IndexTrie = NULL;	/* first value of the first ATR byte */
+static time_t IndexMtime = 0;
+#ifdef HAVE_SYS_INOTIFY_H
+static int IndexNotify = -1;
+#endif
+
+/*
+ * The token libraries are loaded and bound once and shared by the
+ * connections using them. A library is kept loaded when its last
+ * connection is released so the next connection finds it ready.
+ */
+typedef struct TokenPlugin
+{
+	struct TokenPlugin *next;
+	MSCChar8 svProvider[MSC_MAXSIZE_SVCPROV];
+	MSCPVoid32 libHandle;
+	CFDyLibPointers libPointers;
+	int refCount;	/* connections using the library */
+}
+TokenPlugin;
+
+static PCSCLITE_MUTEX PluginsMutex = PTHREAD_MUTEX_INITIALIZER;
+static TokenPlugin *Plugins = NULL;
+
+static int stringToBytes(const char *inStr, MSCPUChar8 Buffer,
+	MSCULong32 size, MSCPULong32 Length)
 {
 	MSCULong32 i;
 	MSCULong32 j;
+	MSCULong32 inLen;
 
 	j = 0;
 
-	for (i = 0; i < Length; i++)
+	inLen = strlen(inStr);
+
+	if ((inLen % 2) || (inLen > 2 * size))
 	{
-		if ((Atr[i] / 16) > 9)
-		{
-			outAtr[j] = ((Atr[i] / 16) - 10) + 'A';
-		} else
+		return -1;
+	}
+
+	for (i = 0; i < inLen; i++)
+	{
+		int nibble;
+
+		if (inStr[i] <= '9' && inStr[i] >= '0')
+			nibble = inStr[i] - '0';
+		else if (inStr[i] <= 'F' && inStr[i] >= 'A')
+			nibble = inStr[i] - 'A' + 10;
+		else if (inStr[i] <= 'f' && inStr[i] >= 'a')
+			nibble = inStr[i] - 'a' + 10;
+		else
+			return -1;
+
+		if (i % 2)
 		{
-			outAtr[j] = (Atr[i] / 16) + '0';
+			Buffer[j] += nibble;
+			j += 1;
 		}
+		else
+			Buffer[j] = nibble * 16;
+	}
 
-		j += 1;
+	*Length = j;
 
-		if ((Atr[i] % 16) > 9)
-		{
-			outAtr[j] = ((Atr[i] % 16) - 10) + 'A';
-		} else
+	return 0;
+}
+
+static void TPFreeIndex(void)
+{
+	while (IndexEntries)
+	{
+		TokenEntry *entry = IndexEntries;
+
+		IndexEntries = entry->next;
+		free(entry);
+	}
+
+	/* the trie is freed level by level using the child links */
+	while (IndexTrie)
+	{
+		AtrNode *node = IndexTrie;
+
+		if (node->child)
 		{
-			outAtr[j] = (Atr[i] % 16) + '0';
+			/* move the children in the list of siblings */
+			AtrNode *last = node->child;
+
+			while (last->sibling)
+				last = last->sibling;
+			last->sibling = node->sibling;
+			IndexTrie = node->child;
 		}
+		else
+			IndexTrie = node->sibling;
+
+		free(node);
+	}
+
+	IndexBuilt = 0;
+}
+
+static int TPAddToTrie(TokenEntry *newEntry)
+{
+	AtrNode **level = &IndexTrie;
+	AtrNode *node = NULL;
+	MSCULong32 i;
+
+	for (i = 0; i < newEntry->atrLength; i++)
+	{
+		for (node = *level; node; node = node->sibling)
+			if (node->value == newEntry->atr[i])
+				break;
 
-		j += 1;
+		if (node == NULL)
+		{
+			node = calloc(1, sizeof(AtrNode));
+			if (node == NULL)
+				return -1;
+
+			node->value = newEntry->atr[i];
+			node->sibling = *level;
+			*level = node;
+		}
 
+		level = &node->child;
 	}
 
-	outAtr[j] = 0;	/* Add the NULL */
+	/* the first bundle declaring an ATR is used */
+	if (node && (node->entry == NULL))
+		node->entry = newEntry;
 
 	return 0;
 }
 
-static int stringToBytes(char *inStr, MSCPUChar8 Buffer, MSCPULong32 Length)
+/*
+ * Reads the ATR aliases of a bundle and adds them to the index
+ */
+static void TPAddBundle(const char *bundleName, TokenEntry ***last)
 {
-	int i;
-	int j;
-	int inLen;
-
-	j = 0;
-	inLen = 0;
+	char fullPath[200];
+	char keyValue[TOKEN_MAX_VALUE_SIZE];
+	int atrIndex;
+	int rv;
 
-	inLen = strlen(inStr);
+#ifndef WIN32
+	snprintf(fullPath, sizeof(fullPath), "%s/%s/Contents/Info.plist",
+		MSC_SVC_DROPDIR, bundleName);
+#else
+	snprintf(fullPath, sizeof(fullPath), "%s\\%s\\Contents\\Info.plist",
+		MSC_SVC_DROPDIR, bundleName);
+#endif
 
-	if (inLen > MSC_MAXSIZE_AID)
+	for (atrIndex = 0; ; atrIndex++)
 	{
-		return -1;
-	}
+		TokenEntry *entry;
+		MSCULong32 length;
 
-	for (i = 0; i < inLen; i += 2)
-	{
-		if (inStr[i] <= '9' && inStr[i] >= '0')
+		rv = LTPBundleFindValueWithKey(fullPath,
+			MSC_ATRMSC_KEY_NAME, keyValue, atrIndex);
+		if (rv != 0)
+			break;	/* No more aliases */
+
+		entry = calloc(1, sizeof(TokenEntry));
+		if (entry == NULL)
+			return;
+
+		if (stringToBytes(keyValue, entry->atr, sizeof(entry->atr),
+			&entry->atrLength) != 0)
 		{
-			Buffer[j] = (inStr[i] - '0') * 16;
-		} else if (inStr[i] <= 'F' && inStr[i] >= 'A')
+			Log3(PCSC_LOG_ERROR, "Malformed ATR %s in %s", keyValue,
+				fullPath);
+			free(entry);
+			continue;
+		}
+
+		/* optional mask of the ATR */
+		rv = LTPBundleFindOptionalValueWithKey(fullPath,
+			MSC_ATRMASK_KEY_NAME, keyValue, atrIndex);
+		if (rv == 0)
 		{
-			Buffer[j] = (inStr[i] - 'A' + 10) * 16;
+			if ((stringToBytes(keyValue, entry->mask, sizeof(entry->mask),
+				&length) != 0) || (length != entry->atrLength))
+			{
+				Log3(PCSC_LOG_ERROR, "Malformed ATR mask %s in %s",
+					keyValue, fullPath);
+				free(entry);
+				continue;
+			}
+			entry->masked = 1;
 		}
 
-		if (inStr[i + 1] <= '9' && inStr[i + 1] >= '0')
+		/*
+		 * See if this bundle has a special name for this ATR
+		 */
+		rv = LTPBundleFindValueWithKey(fullPath,
+			MSC_PRODMSC_KEY_NAME, keyValue, atrIndex);
+		if (rv != 0)
+			rv = LTPBundleFindValueWithKey(fullPath,
+				MSC_PRODMSC_KEY_NAME, keyValue, 0);
+		if (rv != 0)
 		{
-			Buffer[j] += inStr[i + 1] - '0';
-		} else if (inStr[i + 1] <= 'F' && inStr[i + 1] >= 'A')
+			Log2(PCSC_LOG_ERROR, "No product name in %s", fullPath);
+			free(entry);
+			continue;
+		}
+		strlcpy(entry->tokenName, keyValue, sizeof(entry->tokenName));
+
+		/*
+		 * See if this bundle has a special driver for this card
+		 */
+		rv = LTPBundleFindValueWithKey(fullPath,
+			MSC_LIBRMSC_KEY_NAME, keyValue, atrIndex);
+		if (rv != 0)
+			rv = LTPBundleFindValueWithKey(fullPath,
+				MSC_LIBRMSC_KEY_NAME, keyValue, 0);
+		if (rv != 0)
 		{
-			Buffer[j] += inStr[i + 1] - 'A' + 10;
+			Log2(PCSC_LOG_ERROR, "No library path in %s", fullPath);
+			free(entry);
+			continue;
 		}
+#if defined(WIN32)
+		snprintf(entry->svProvider, sizeof(entry->svProvider),
+			"%s\\%s\\Contents\\Win32\\%s", MSC_SVC_DROPDIR, bundleName,
+			keyValue);
+#elif defined(__APPLE__)
+		snprintf(entry->svProvider, sizeof(entry->svProvider), "%s/%s",
+			MSC_SVC_DROPDIR, bundleName);
+#else
+		snprintf(entry->svProvider, sizeof(entry->svProvider),
+			"%s/%s/Contents/%s/%s", MSC_SVC_DROPDIR, bundleName, MSC_ARCH,
+			keyValue);
+#endif
 
-		j += 1;
-	}
+		/*
+		 * See if this bundle has a default AID
+		 */
+		rv = LTPBundleFindValueWithKey(fullPath,
+			MSC_DEFAULTAPP_NAME, keyValue, atrIndex);
+		if (rv != 0)
+			rv = LTPBundleFindValueWithKey(fullPath,
+				MSC_DEFAULTAPP_NAME, keyValue, 0);
+		if (rv == 0)
+		{
+			if (stringToBytes(keyValue, entry->tokenApp,
+				sizeof(entry->tokenApp), &entry->tokenAppLen) != 0)
+			{
+				Log2(PCSC_LOG_ERROR, "Malformed AID string in %s", fullPath);
+				free(entry);
+				continue;
+			}
+		}
+		else
+		{
+			Log2(PCSC_LOG_ERROR, "No AID specified in %s", fullPath);
+			entry->tokenAppLen = 0;
+		}
 
-	*Length = j;
+		if (!entry->masked && (TPAddToTrie(entry) != 0))
+		{
+			free(entry);
+			return;
+		}
 
-	return 0;
+		**last = entry;
+		*last = &entry->next;
+	}
 }
 
-MSCLong32 TPSearchBundlesForAtr(MSCPUChar8 Atr, MSCULong32 Length,
-	MSCLPTokenInfo tokenInfo)
+static void TPBuildIndex(void)
 {
-	MSCLong32 rv;
+	TokenEntry **last = &IndexEntries;
+	struct stat dirStat;
 
 #ifndef WIN32
 	DIR *hpDir = 0;
@@ -134,16 +369,31 @@ MSCLong32 TPSearchBundlesForAtr(MSCPUChar8 Atr, MSCULong32 Length,
 	char findPath[200];
 #endif
 
-	char atrString[MAX_ATR_SIZE*2 +1]; /* ATR in ASCII */
-	char fullPath[200];
-	char fullLibPath[250];
-	char keyValue[TOKEN_MAX_VALUE_SIZE];
-	int atrIndex;
+	TPFreeIndex();
+	IndexBuilt = 1;
+
+	/* read before the scan so a change during the scan is seen later */
+	IndexMtime = (stat(MSC_SVC_DROPDIR, &dirStat) == 0) ? dirStat.st_mtime : 0;
 
-	rv = 0;
-	atrIndex = 0;
+#ifdef HAVE_SYS_INOTIFY_H
+	if (IndexNotify < 0)
+	{
+		IndexNotify = inotify_init();
+		if (IndexNotify >= 0)
+		{
+			(void)fcntl(IndexNotify, F_SETFL, O_NONBLOCK);
+			(void)fcntl(IndexNotify, F_SETFD, FD_CLOEXEC);
 
-	atrToString(Atr, Length, atrString);
+			if (inotify_add_watch(IndexNotify, MSC_SVC_DROPDIR,
+				IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+				| IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF) < 0)
+			{
+				(void)close(IndexNotify);
+				IndexNotify = -1;
+			}
+		}
+	}
+#endif
 
 #ifndef WIN32
 	hpDir = opendir(MSC_SVC_DROPDIR);
@@ -152,8 +402,16 @@ MSCLong32 TPSearchBundlesForAtr(MSCPUChar8 Atr, MSCULong32 Length,
 	{
 		Log2(PCSC_LOG_ERROR, "Cannot open PC/SC token drivers directory: %s",
 			MSC_SVC_DROPDIR);
-		return -1;
+		return;
+	}
+
+	while ((currFP = readdir(hpDir)) != 0)
+	{
+		if (strstr(currFP->d_name, ".bundle") != 0)
+			TPAddBundle(currFP->d_name, &last);
 	}
+
+	closedir(hpDir);
 #else
 	sprintf(findPath, "%s\\*.bundle", MSC_SVC_DROPDIR);
 	hFind = FindFirstFile(findPath, &findData);
@@ -162,187 +420,159 @@ MSCLong32 TPSearchBundlesForAtr(MSCPUChar8 Atr, MSCULong32 Length,
 	{
 		Log2(PCSC_LOG_ERROR, "Cannot open PC/SC token drivers directory: %s",
 			findPath);
-		return -1;
+		return;
 	}
-#endif
 
-#ifndef WIN32
-	while ((currFP = readdir(hpDir)) != 0)
-	{
-		if (strstr(currFP->d_name, ".bundle") != 0)
-#else
 	do
 	{
 		if (strstr(findData.cFileName, ".bundle") != 0)
-#endif
-		{
+			TPAddBundle(findData.cFileName, &last);
+	}
+	while (FindNextFile(hFind, &findData) != 0);
 
-			/*
-			 * The bundle exists - let's form a full path name and get the
-			 * vendor and product ID's for this particular bundle 
-			 */
-#ifndef WIN32
-			sprintf(fullPath, "%s/%s/Contents/Info.plist", MSC_SVC_DROPDIR,
-				currFP->d_name);
-#else
-			sprintf(fullPath, "%s\\%s\\Contents\\Info.plist", MSC_SVC_DROPDIR,
-				findData.cFileName);
+	FindClose(hFind);
 #endif
+}
 
-			atrIndex = 0;
+/*
+ * Has the drop directory changed since the index was built?
+ */
+static int TPIndexChanged(void)
+{
+	struct stat dirStat;
+	time_t mtime;
 
-#ifndef NO_MSC_DEBUG
-			Log2(PCSC_LOG_DEBUG, "ATR comparison: FILE: %s", fullPath);
-			Log2(PCSC_LOG_DEBUG, "ATR comparison: Target Match: %s", atrString);
-#endif
+#ifdef HAVE_SYS_INOTIFY_H
+	if (IndexNotify >= 0)
+	{
+		char buffer[4096]
+			__attribute__ ((aligned(__alignof__(struct inotify_event))));
+		int changed = 0;
+		ssize_t ret;
+
+		/* empty the event queue */
+		while ((ret = read(IndexNotify, buffer, sizeof(buffer))) > 0)
+		{
+			ssize_t i;
+
+			changed = 1;
 
-			while (1)
+			for (i = 0; i < ret;
+				i += sizeof(struct inotify_event)
+					+ ((struct inotify_event *)(buffer + i))->len)
 			{
-				rv = LTPBundleFindValueWithKey(fullPath,
-					MSC_ATRMSC_KEY_NAME, keyValue, atrIndex);
-				if (rv != 0)
-				{
-					break;	/* No aliases found, break out of search
-							 * aliases loop */
-				}
-#ifndef NO_MSC_DEBUG
-				Log2(PCSC_LOG_DEBUG, "ATR comparison: Source: %s", keyValue);
-#endif
+				struct inotify_event *event =
+					(struct inotify_event *)(buffer + i);
 
-				if (strcmp(keyValue, atrString) != 0)
+				/* the directory itself is gone, watch it again later */
+				if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
 				{
-					/*
-					 * Go back and see if there are any aliases 
-					 */
-					atrIndex += 1;
-					continue;
+					(void)close(IndexNotify);
+					IndexNotify = -1;
+					return 1;
 				}
-#ifndef NO_MSC_DEBUG
-				Log2(PCSC_LOG_DEBUG, "Match found at ATR alias %d", atrIndex);
-#endif
+			}
+		}
 
-				/*
-				 * See if this bundle has a special name for this ATR 
-				 */
-				rv = LTPBundleFindValueWithKey(fullPath,
-					MSC_PRODMSC_KEY_NAME, keyValue, atrIndex);
-				if (rv != 0)
-				{
-					rv = LTPBundleFindValueWithKey(fullPath,
-						MSC_PRODMSC_KEY_NAME, keyValue, 0);
-					if (rv != 0)
-					{
-						Log1(PCSC_LOG_ERROR,
-							"Match found, failed due to no product name.");
-#ifndef WIN32
-						closedir(hpDir);
-#endif
-						return -1;
-					}
-				}
-#ifndef NO_MSC_DEBUG
-				Log2(PCSC_LOG_DEBUG, "Product name: %s", keyValue);
-#endif
-				strlcpy(tokenInfo->tokenName, keyValue,
-					sizeof(tokenInfo->tokenName));
-
-				/*
-				 * See if this bundle has a special driver for this card 
-				 */
-				rv = LTPBundleFindValueWithKey(fullPath,
-					MSC_LIBRMSC_KEY_NAME, keyValue, atrIndex);
-				if (rv != 0)
-				{
-					rv = LTPBundleFindValueWithKey(fullPath,
-						MSC_LIBRMSC_KEY_NAME, keyValue, 0);
-					if (rv != 0)
-					{
-						Log1(PCSC_LOG_ERROR,
-							"Match found, failed due to no library path.");
-#ifndef WIN32
-						closedir(hpDir);
-#endif
-						return -1;
-					}
-				}
-#if defined(WIN32)
-				sprintf(fullLibPath, "%s\\%s\\Contents\\Win32\\%s",
-					MSC_SVC_DROPDIR, findData.cFileName, keyValue);
-#elif defined(__APPLE__)
-				sprintf(fullLibPath, "%s/%s", MSC_SVC_DROPDIR,
-					currFP->d_name);
-#else
-				sprintf(fullLibPath, "%s/%s/Contents/%s/%s", MSC_SVC_DROPDIR,
-					currFP->d_name, MSC_ARCH, keyValue);
+		return changed;
+	}
 #endif
 
-				if (fullLibPath == NULL)
-				{
-					Log1(PCSC_LOG_ERROR, "No path to bundle library found !");
-					return -1;
-				}
+	mtime = (stat(MSC_SVC_DROPDIR, &dirStat) == 0) ? dirStat.st_mtime : 0;
 
-				/*
-				 * Copy the library path and return successfully 
-				 */
-				strlcpy(tokenInfo->svProvider, fullLibPath,
-					sizeof(tokenInfo->svProvider));
-
-				/*
-				 * See if this bundle has a default AID 
-				 */
-				rv = LTPBundleFindValueWithKey(fullPath,
-					MSC_DEFAULTAPP_NAME, keyValue, atrIndex);
-				if (rv != 0)
-				{
-					rv = LTPBundleFindValueWithKey(fullPath,
-						MSC_DEFAULTAPP_NAME, keyValue, 0);
-				}
+	return mtime != IndexMtime;
+}
 
-				if (rv == 0)
-				{
-#ifndef NO_MSC_DEBUG
-					Log2(PCSC_LOG_DEBUG, "Default AID name: %s", keyValue);
-#endif
-					rv = stringToBytes(keyValue, tokenInfo->tokenApp,
-						&tokenInfo->tokenAppLen);
-					if (rv != 0)
-					{
-						Log1(PCSC_LOG_ERROR,
-							"Match found, failed due to malformed aid string.");
-#ifndef WIN32
-						closedir(hpDir);
-#endif
-						return -1;
-					}
+static TokenEntry *TPFindEntry(MSCPUChar8 Atr, MSCULong32 Length)
+{
+	AtrNode *level = IndexTrie;
+	AtrNode *node = NULL;
+	TokenEntry *entry;
+	MSCULong32 i;
 
-				} else
-				{
-					Log1(PCSC_LOG_ERROR, "No AID specified in bundle");
-					tokenInfo->tokenAppLen = 0;
-				}
+	for (i = 0; (i < Length) && level; i++)
+	{
+		for (node = level; node; node = node->sibling)
+			if (node->value == Atr[i])
+				break;
 
-#ifndef WIN32
-				closedir(hpDir);
-#endif
-				return 0;
+		if (node == NULL)
+			break;
 
-			}	/* do ... while */
-		}	/* if .bundle */
-	}	/* while readdir */
-#ifdef WIN32
-	/* This is part of a Do..While loop (see above) */
-	while (FindNextFile(hFind, &findData) != 0);
+		level = node->child;
+	}
+
+	if ((i == Length) && node && node->entry)
+		return node->entry;
+
+	for (entry = IndexEntries; entry; entry = entry->next)
+	{
+		if (!entry->masked || (entry->atrLength != Length))
+			continue;
+
+		for (i = 0; i < Length; i++)
+			if ((Atr[i] & entry->mask[i]) != (entry->atr[i] & entry->mask[i]))
+				break;
+
+		if (i == Length)
+			return entry;
+	}
+
+	return NULL;
+}
+
+MSCLong32 TPSearchBundlesForAtr(MSCPUChar8 Atr, MSCULong32 Length,
+	MSCLPTokenInfo tokenInfo)
+{
+	TokenEntry *entry;
+	MSCLong32 rv = -1;
+
+	(void)SYS_MutexLock(&IndexMutex);
+
+	if (!IndexBuilt || TPIndexChanged())
+		TPBuildIndex();
+
+	entry = TPFindEntry(Atr, Length);
+	if (entry)
+	{
+#ifndef NO_MSC_DEBUG
+		Log3(PCSC_LOG_DEBUG, "ATR match: %s, %s", entry->tokenName,
+			entry->svProvider);
 #endif
+		strlcpy(tokenInfo->tokenName, entry->tokenName,
+			sizeof(tokenInfo->tokenName));
+		strlcpy(tokenInfo->svProvider, entry->svProvider,
+			sizeof(tokenInfo->svProvider));
+		memcpy(tokenInfo->tokenApp, entry->tokenApp, entry->tokenAppLen);
+		tokenInfo->tokenAppLen = entry->tokenAppLen;
+		rv = 0;
+	}
 
-#ifndef WIN32
-	closedir(hpDir);
+	(void)SYS_MutexUnLock(&IndexMutex);
+
+	return rv;
+}
+
+/*
+ * Frees the ATR index when the library is unloaded
+ */
+void TPReleaseIndex(void)
+{
+	(void)SYS_MutexLock(&IndexMutex);
+	TPFreeIndex();
+#ifdef HAVE_SYS_INOTIFY_H
+	if (IndexNotify >= 0)
+	{
+		(void)close(IndexNotify);
+		IndexNotify = -1;
+	}
 #endif
-	return -1;
+	(void)SYS_MutexUnLock(&IndexMutex);
 }
 
 MSCLong32 TPLoadToken(MSCLPTokenConnection pConnection)
 {
+	TokenPlugin *plugin;
 	MSCLong32 rv;
 
 	pConnection->libPointers.pvfWriteFramework = 0;
@@ -369,6 +599,9 @@ MSCLong32 TPLoadToken(MSCLPTokenConnection pConnection)
 	pConnection->libPointers.pvfListObjects = 0;
 	pConnection->libPointers.pvfLogoutAll = 0;
 	pConnection->libPointers.pvfGetChallenge = 0;
+	pConnection->libPointers.pvfWriteObjectEx = 0;
+	pConnection->libPointers.pvfReadObjectEx = 0;
+	pConnection->libPointers.pvfComputeCryptEx = 0;
 
 	/*
 	 * Find the Card's Library 
@@ -386,6 +619,26 @@ MSCLong32 TPLoadToken(MSCLPTokenConnection pConnection)
 		return SCARD_E_CARD_UNSUPPORTED;
 	}
 
+	/*
+	 * The library may be already loaded and bound for another connection
+	 */
+	(void)SYS_MutexLock(&PluginsMutex);
+
+	for (plugin = Plugins; plugin; plugin = plugin->next)
+		if (strcmp(plugin->svProvider, pConnection->tokenInfo.svProvider) == 0)
+			break;
+
+	if (plugin)
+	{
+		plugin->refCount++;
+		pConnection->tokenLibHandle = plugin->libHandle;
+		memcpy(&pConnection->libPointers, &plugin->libPointers,
+			sizeof(CFDyLibPointers));
+		(void)SYS_MutexUnLock(&PluginsMutex);
+
+		return SCARD_S_SUCCESS;
+	}
+
 	/*
 	 * Load that library and store the handle in the SCARDCHANNEL
 	 * structure 
@@ -398,6 +651,7 @@ MSCLong32 TPLoadToken(MSCLPTokenConnection pConnection)
 	{
 		Log2(PCSC_LOG_ERROR, "Error: Could not load service library %s",
 			pConnection->tokenInfo.svProvider);
+		(void)SYS_MutexUnLock(&PluginsMutex);
 		return SCARD_E_INVALID_TARGET;
 	} else
 	{
@@ -407,11 +661,36 @@ MSCLong32 TPLoadToken(MSCLPTokenConnection pConnection)
 
 	rv = TPBindFunctions(pConnection);
 
+	if (rv != SCARD_S_SUCCESS)
+	{
+		(void)DYN_CloseLibrary(&pConnection->tokenLibHandle);
+		pConnection->tokenLibHandle = 0;
+		(void)SYS_MutexUnLock(&PluginsMutex);
+		return rv;
+	}
+
+	/* not an error if no memory, the library is just not shared */
+	plugin = calloc(1, sizeof(TokenPlugin));
+	if (plugin)
+	{
+		strlcpy(plugin->svProvider, pConnection->tokenInfo.svProvider,
+			sizeof(plugin->svProvider));
+		plugin->libHandle = pConnection->tokenLibHandle;
+		memcpy(&plugin->libPointers, &pConnection->libPointers,
+			sizeof(CFDyLibPointers));
+		plugin->refCount = 1;
+		plugin->next = Plugins;
+		Plugins = plugin;
+	}
+
+	(void)SYS_MutexUnLock(&PluginsMutex);
+
 	return rv;
 }
 
 MSCLong32 TPUnloadToken(MSCLPTokenConnection pConnection)
 {
+	TokenPlugin *plugin;
 	MSCLong32 rv;
 
 	if (pConnection->tokenLibHandle == 0)
@@ -419,6 +698,24 @@ MSCLong32 TPUnloadToken(MSCLPTokenConnection pConnection)
 		return SCARD_E_INVALID_VALUE;
 	}
 
+	(void)SYS_MutexLock(&PluginsMutex);
+
+	for (plugin = Plugins; plugin; plugin = plugin->next)
+		if (plugin->libHandle == pConnection->tokenLibHandle)
+			break;
+
+	if (plugin)
+	{
+		/* kept loaded for the next connection, see TPReleasePlugins() */
+		plugin->refCount--;
+		(void)SYS_MutexUnLock(&PluginsMutex);
+
+		pConnection->tokenLibHandle = 0;
+		return TPUnbindFunctions(pConnection);
+	}
+
+	(void)SYS_MutexUnLock(&PluginsMutex);
+
 	rv = DYN_CloseLibrary(&pConnection->tokenLibHandle);
 
 	if (rv != SCARD_S_SUCCESS)
@@ -430,6 +727,34 @@ MSCLong32 TPUnloadToken(MSCLPTokenConnection pConnection)
 	return TPUnbindFunctions(pConnection);
 }
 
+/*
+ * Unloads the token libraries no more used when the library is unloaded
+ */
+void TPReleasePlugins(void)
+{
+	TokenPlugin **p;
+
+	(void)SYS_MutexLock(&PluginsMutex);
+
+	p = &Plugins;
+	while (*p)
+	{
+		TokenPlugin *plugin = *p;
+
+		if (plugin->refCount > 0)
+		{
+			p = &plugin->next;
+			continue;
+		}
+
+		*p = plugin->next;
+		(void)DYN_CloseLibrary(&plugin->libHandle);
+		free(plugin);
+	}
+
+	(void)SYS_MutexUnLock(&PluginsMutex);
+}
+
 MSCLong32 TPBindFunctions(MSCLPTokenConnection pConnection)
 {
 	MSCLong32 rv;
@@ -699,6 +1024,28 @@ MSCLong32 TPBindFunctions(MSCLPTokenConnection pConnection)
 		return SCARD_F_INTERNAL_ERROR;
 	}
 
+	/*
+	 * Object I/O with a 32 bits length. Only in recent token libraries,
+	 * MSCReadObject() and MSCWriteObject() use small chunks without them
+	 */
+	rv = DYN_GetAddress(pConnection->tokenLibHandle,
+		&pConnection->libPointers.pvfWriteObjectEx, "PL_MSCWriteObjectEx");
+
+	if (rv != SCARD_S_SUCCESS)
+		pConnection->libPointers.pvfWriteObjectEx = 0;
+
+	rv = DYN_GetAddress(pConnection->tokenLibHandle,
+		&pConnection->libPointers.pvfReadObjectEx, "PL_MSCReadObjectEx");
+
+	if (rv != SCARD_S_SUCCESS)
+		pConnection->libPointers.pvfReadObjectEx = 0;
+
+	rv = DYN_GetAddress(pConnection->tokenLibHandle,
+		&pConnection->libPointers.pvfComputeCryptEx, "PL_MSCComputeCryptEx");
+
+	if (rv != SCARD_S_SUCCESS)
+		pConnection->libPointers.pvfComputeCryptEx = 0;
+
 	return SCARD_S_SUCCESS;
 }
 
@@ -728,6 +1075,9 @@ MSCLong32 TPUnbindFunctions(MSCLPTokenConnection pConnection)
 	pConnection->libPointers.pvfListObjects = 0;
 	pConnection->libPointers.pvfLogoutAll = 0;
 	pConnection->libPointers.pvfGetChallenge = 0;
+	pConnection->libPointers.pvfWriteObjectEx = 0;
+	pConnection->libPointers.pvfReadObjectEx = 0;
+	pConnection->libPointers.pvfComputeCryptEx = 0;
 
 	return SCARD_S_SUCCESS;
 }
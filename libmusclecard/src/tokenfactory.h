@@ -25,6 +25,8 @@ extern "C"
 	MSCLong32 TPUnbindFunctions(MSCLPTokenConnection);
 	MSCLong32 TPSearchBundlesForAtr(MSCPUChar8 Atr, MSCULong32 Length,
 		MSCLPTokenInfo tokenInfo);
+	void TPReleaseIndex(void);
+	void TPReleasePlugins(void);
 
 #ifdef __cplusplus
 }